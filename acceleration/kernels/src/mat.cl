@@ -1,20 +1,52 @@
-// TODO: Kernels should use stride instead of width for indexing. Can be done in include.
 #include <opencl-c-base.h>
 #include <opencl-c.h>
 
-void sumArray(__local double **tmp, int bsize, int li);
+// The kernels are a template over their element type. `matInit` builds the source once
+// per `MatrixDtype`, defining these first, with a suffix making the kernel names unique.
+// NOTE: Must match the headers in mat.c.
+#ifndef REAL
+#define REAL double
+#define REAL4 double4
+#define KERNEL(name) name
+#endif
 
-void sumArray(__local double **tmp, int bsize, int li) {
+// Reduction operations of `reduce` and `matreduce`.
+// NOTE: Must match the enum in mat.c.
+#define REDUCE_SUM 0
+#define REDUCE_MAX 1
+
+// Activation functions of `matactivation` and `matactivationderive`.
+// NOTE: Must match `MatrixActivation` in mat.h.
+#define ACTIVATION_RELU 0
+#define ACTIVATION_SIGMOID 1
+#define ACTIVATION_TANH 2
+#define ACTIVATION_NONE 3
+
+// Storage only dtypes of `matwiden` and `matnarrow`.
+// NOTE: Must match `MatrixDtype` in mat.h.
+#define DTYPE_FLOAT16 2
+#define DTYPE_BFLOAT16 3
+
+REAL reduceOp(REAL a, REAL b, int op);
+void reduceArray(__local REAL *temp, int bsize, int li, int op);
+REAL activation(REAL x, int op);
+REAL activationDerivative(REAL y, int op);
+
+REAL reduceOp(REAL a, REAL b, int op) {
+    return (op == REDUCE_MAX)? fmax(a, b) : a + b;
+}
+
+// Reduce the `bsize` elements of temp into temp[0].
+void reduceArray(__local REAL *temp, int bsize, int li, int op) {
     // Ensure input is ready before function runs
     barrier(CLK_LOCAL_MEM_FENCE);
-    __local double *temp = *tmp;
     
     int halfbsize = (int) bsize / 2;
     while (halfbsize > 0) {
         if (li < halfbsize) {
-            temp[li] += temp[li + halfbsize];
+            temp[li] = reduceOp(temp[li], temp[li + halfbsize], op);
             if (bsize % 2 == 1 && li == 0)
-                temp[li] += temp[li + bsize - 1];
+                temp[li] = reduceOp(temp[li], temp[li + bsize - 1], op);
         }
         
         // Proceed to next half
@@ -27,10 +59,27 @@ void sumArray(__local double **tmp, int bsize, int li) {
     barrier(CLK_LOCAL_MEM_FENCE);
 }
 
-__kernel void sum(__global double *src, int src_size, __local double *temp, __global double *res) {
-    int li = get_global_id(0);
-    sumArray(&temp, src_size, li);
-    if (li == 0) res[0] = temp[0];
+// One pass of a reduction, writing a partial result per work-group to res.
+// Every work item first reduces a strided part of src, four elements at a time,
+// so any size is covered by a grid of a few groups. A second pass over the
+// partial results, with a single group, gives the final result.
+__kernel void KERNEL(reduce)(__global REAL *src, int n, int op, __local REAL *temp, __global REAL *res) {
+    int li = get_local_id(0);
+    int gi = get_global_id(0);
+    int gsize = get_global_size(0);
+
+    REAL acc = (op == REDUCE_MAX)? -INFINITY : 0;
+    int n4 = n / 4;
+    for (int i = gi; i < n4; i += gsize) {
+        REAL4 v = vload4(i, src);
+        acc = reduceOp(acc, reduceOp(reduceOp(v.x, v.y, op), reduceOp(v.z, v.w, op), op), op);
+    }
+    for (int i = n4 * 4 + gi; i < n; i += gsize)
+        acc = reduceOp(acc, src[i], op);
+
+    temp[li] = acc;
+    reduceArray(temp, get_local_size(0), li, op);
+    if (li == 0) res[get_group_id(0)] = temp[0];
 }
 
 unsigned remapLinearIndexSpace(int literal, __global unsigned *source_mapping, __global unsigned *target_mapping, int mapping_size);
@@ -51,8 +100,27 @@ unsigned remapLinearIndexSpace(int literal, __global unsigned *source_mapping, _
     return sum;
 }
 
+int stridedIndex(int gi, int ndims, __global unsigned *dimsz, __global unsigned *stride);
+
+// Offset of element `gi` of a Tensor shaped `dimsz`, in a buffer strided by `stride`.
+int stridedIndex(int gi, int ndims, __global unsigned *dimsz, __global unsigned *stride) {
+    int ind = 0;
+    for (int i = 0; i < ndims; i++) {
+        ind += (gi % dimsz[i]) * stride[i];
+        gi /= dimsz[i];
+    }
+
+    return ind;
+}
+
+// Copy a strided view to the contiguous r.
+__kernel void KERNEL(matgather)(__global REAL *a, int aoffset, __global unsigned *astride, __global REAL *r, int ndims, __global unsigned *rdimsz) {
+    int gi = get_global_id(0);
+    r[gi] = a[aoffset + stridedIndex(gi, ndims, rdimsz, astride)];
+}
+
 // adimsz = adimsz[0], bdimsz = bdimsz[0]
-__kernel void matprod(__global double *a, __global double *b, __global unsigned *adimsz, __global unsigned *bdimsz, __global double *r, __global unsigned *rdimsz, int ndims) {
+__kernel void KERNEL(matprod)(__global REAL *a, __global REAL *b, __global unsigned *adimsz, __global unsigned *bdimsz, __global REAL *r, __global unsigned *rdimsz, int ndims) {
     int gi = get_global_id(0);
 
     unsigned a_stride = 1;
@@ -78,7 +146,67 @@ __kernel void matprod(__global double *a, __global double *b, __global unsigned
     }
 }
 
-__kernel void matdot(__global double *a, __global double *b, unsigned andims, __global unsigned *adimsz, unsigned bndims, __global unsigned *bdimsz, __global double *r, unsigned rndims, __global unsigned *rdimsz) {
+// Tile size of `matgemm`, and the number of outputs each work item computes.
+// NOTE: Must match GEMM_TS and GEMM_WPT in mat.c.
+#define GEMM_TS 16
+#define GEMM_WPT 4
+#define GEMM_RTS (GEMM_TS / GEMM_WPT)
+
+// r = a * b, for a (M x K) and b (K x N). The operands may be strided views, so
+// a[row, k] = a[aoffset + row * ars + k * acs], which is a[row * K + k] if contiguous.
+// Run with a local size of (GEMM_TS, GEMM_RTS), and a global size of N and M / GEMM_WPT,
+// both rounded up to whole tiles.
+__kernel void KERNEL(matgemm)(__global REAL *a, __global REAL *b, __global REAL *r, int M, int N, int K,
+                              int aoffset, int ars, int acs, int boffset, int brs, int bcs) {
+    const int lcol = get_local_id(0);
+    const int lrow = get_local_id(1);
+    const int tile_col = get_group_id(0) * GEMM_TS;
+    const int tile_row = get_group_id(1) * GEMM_TS;
+    const int col = tile_col + lcol;
+
+    __local REAL atile[GEMM_TS][GEMM_TS];
+    __local REAL btile[GEMM_TS][GEMM_TS];
+
+    // Each work item accumulates GEMM_WPT rows of a single column.
+    REAL acc[GEMM_WPT];
+    for (int w = 0; w < GEMM_WPT; w++) acc[w] = 0;
+
+    const int tiles = (K + GEMM_TS - 1) / GEMM_TS;
+    for (int t = 0; t < tiles; t++) {
+        const int tile_k = t * GEMM_TS;
+
+        // Load both tiles, padding out of bounds elements with zeros.
+        for (int w = 0; w < GEMM_WPT; w++) {
+            const int trow = lrow + w * GEMM_RTS;
+            const int arow = tile_row + trow;
+            const int acol = tile_k + lcol;
+            const int brow = tile_k + trow;
+
+            atile[trow][lcol] = (arow < M && acol < K)? a[aoffset + arow * ars + acol * acs] : 0;
+            btile[trow][lcol] = (brow < K && col < N)? b[boffset + brow * brs + col * bcs] : 0;
+        }
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for (int k = 0; k < GEMM_TS; k++) {
+            const REAL bval = btile[k][lcol];
+            for (int w = 0; w < GEMM_WPT; w++)
+                acc[w] += atile[lrow + w * GEMM_RTS][k] * bval;
+        }
+
+        // Don't overwrite the tiles before everyone is done with them.
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (col < N) {
+        for (int w = 0; w < GEMM_WPT; w++) {
+            const int row = tile_row + lrow + w * GEMM_RTS;
+            if (row < M) r[row * N + col] = acc[w];
+        }
+    }
+}
+
+__kernel void KERNEL(matdot)(__global REAL *a, __global REAL *b, unsigned andims, __global unsigned *adimsz, unsigned bndims, __global unsigned *bdimsz, __global REAL *r, unsigned rndims, __global unsigned *rdimsz) {
     int gi = get_global_id(0);
 
     unsigned a_stride = 1;
@@ -98,17 +226,188 @@ __kernel void matdot(__global double *a, __global double *b, unsigned andims, __
         r[gi] += a[a_ind + a_stride * i] * b[b_ind + b_stride * i];
 }
 
-__kernel void matadd(__global double *a, __global double *b, __global double *r) {
+__kernel void KERNEL(matadd)(__global REAL *a, __global REAL *b, __global REAL *r) {
     int gi = get_global_id(0);
     r[gi] = a[gi] + b[gi];
 }
 
-__kernel void matsub(__global double *a, __global double *b, __global double *r) {
+__kernel void KERNEL(matsub)(__global REAL *a, __global REAL *b, __global REAL *r) {
     int gi = get_global_id(0);
     r[gi] = a[gi] - b[gi];
 }
 
-__kernel void matmul(__global double *a, __global double *b, __global double *r) {
+__kernel void KERNEL(matmul)(__global REAL *a, __global REAL *b, __global REAL *r) {
     int gi = get_global_id(0);
     r[gi] = a[gi] * b[gi];
 }
+
+// y += alpha * x, in place.
+__kernel void KERNEL(mataxpy)(REAL alpha, __global REAL *x, __global REAL *y) {
+    int gi = get_global_id(0);
+    y[gi] += alpha * x[gi];
+}
+
+REAL activation(REAL x, int op) {
+    if (op == ACTIVATION_SIGMOID) return 1 / (1 + exp(-x));
+    if (op == ACTIVATION_TANH) return tanh(x);
+    if (op == ACTIVATION_NONE) return x;
+    return fmax(x, (REAL) 0);
+}
+
+// Derivative of the activation, from its output `y`.
+REAL activationDerivative(REAL y, int op) {
+    if (op == ACTIVATION_SIGMOID) return y * (1 - y);
+    if (op == ACTIVATION_TANH) return 1 - y * y;
+    if (op == ACTIVATION_NONE) return 1;
+    return (y > 0)? 1 : 0;
+}
+
+__kernel void KERNEL(matactivation)(__global REAL *a, int op, __global REAL *r) {
+    int gi = get_global_id(0);
+    r[gi] = activation(a[gi], op);
+}
+
+// r = u * f'(a), the upstream derivative `u` through the activation at its input `a`.
+__kernel void KERNEL(matactivationderive)(__global REAL *a, __global REAL *u, int op, __global REAL *r) {
+    int gi = get_global_id(0);
+    r[gi] = u[gi] * activationDerivative(activation(a[gi], op), op);
+}
+
+// Fused dense layer, r = f(w * [x; 1]) for `n` inputs x of `in` elements, with the bias as
+// the last column of w {in + 1, out}. One work item per output, of global size {out, n}.
+__kernel void KERNEL(matdense)(__global REAL *w, __global REAL *x, __global REAL *r, int in, int out, int op) {
+    int o = get_global_id(0);
+    int b = get_global_id(1);
+
+    __global REAL *wrow = w + o * (in + 1);
+    REAL acc = wrow[in];
+    for (int k = 0; k < in; k++) acc += wrow[k] * x[b * in + k];
+
+    r[b * out + o] = activation(acc, op);
+}
+
+// Derivative of `matdense` by its weights, from the upstream derivative `u` and the output `y`,
+// summed over the `n` inputs. Global size {in + 1, out}.
+__kernel void KERNEL(matdenseweights)(__global REAL *u, __global REAL *y, __global REAL *x, __global REAL *dw,
+                                      int in, int out, int n, int op) {
+    int k = get_global_id(0);
+    int o = get_global_id(1);
+
+    REAL acc = 0;
+    for (int b = 0; b < n; b++) {
+        REAL d = u[b * out + o] * activationDerivative(y[b * out + o], op);
+        acc += (k < in)? d * x[b * in + k] : d;
+    }
+
+    dw[o * (in + 1) + k] = acc;
+}
+
+// Derivative of `matdense` by its inputs. Global size {in, n}.
+__kernel void KERNEL(matdenseinput)(__global REAL *u, __global REAL *y, __global REAL *w, __global REAL *dx,
+                                    int in, int out, int op) {
+    int k = get_global_id(0);
+    int b = get_global_id(1);
+
+    REAL acc = 0;
+    for (int o = 0; o < out; o++)
+        acc += u[b * out + o] * activationDerivative(y[b * out + o], op) * w[o * (in + 1) + k];
+
+    dx[b * in + k] = acc;
+}
+
+// Optimizer updates of the weights `w` by their gradient `g`, in place, with their state.
+// v = momentum * v + g, w -= learning_rate * v.
+__kernel void KERNEL(matmomentum)(REAL learning_rate, REAL momentum, __global REAL *g, __global REAL *v, __global REAL *w) {
+    int gi = get_global_id(0);
+    REAL vi = momentum * v[gi] + g[gi];
+    v[gi] = vi;
+    w[gi] -= learning_rate * vi;
+}
+
+// s = decay * s + (1 - decay) * g^2, w -= learning_rate * g / (sqrt(s) + epsilon).
+__kernel void KERNEL(matrmsprop)(REAL learning_rate, REAL decay, REAL epsilon, __global REAL *g, __global REAL *s, __global REAL *w) {
+    int gi = get_global_id(0);
+    REAL gv = g[gi];
+    REAL si = decay * s[gi] + (1 - decay) * gv * gv;
+    s[gi] = si;
+    w[gi] -= learning_rate * gv / (sqrt(si) + epsilon);
+}
+
+// m and v are the moving averages of g and g^2, `c1` and `c2` their bias corrections.
+__kernel void KERNEL(matadam)(REAL learning_rate, REAL beta1, REAL beta2, REAL epsilon, REAL c1, REAL c2,
+                              __global REAL *g, __global REAL *m, __global REAL *v, __global REAL *w) {
+    int gi = get_global_id(0);
+    REAL gv = g[gi];
+    REAL mi = beta1 * m[gi] + (1 - beta1) * gv;
+    REAL vi = beta2 * v[gi] + (1 - beta2) * gv * gv;
+    m[gi] = mi;
+    v[gi] = vi;
+    w[gi] -= learning_rate * (mi * c1) / (sqrt(vi * c2) + epsilon);
+}
+
+// Element-wise operations of strided operands, shaped as the result.
+__kernel void KERNEL(mataddv)(__global REAL *a, int aoffset, __global unsigned *astride, __global REAL *b, int boffset, __global unsigned *bstride,
+                              __global REAL *r, int ndims, __global unsigned *rdimsz) {
+    int gi = get_global_id(0);
+    r[gi] = a[aoffset + stridedIndex(gi, ndims, rdimsz, astride)] + b[boffset + stridedIndex(gi, ndims, rdimsz, bstride)];
+}
+
+__kernel void KERNEL(matsubv)(__global REAL *a, int aoffset, __global unsigned *astride, __global REAL *b, int boffset, __global unsigned *bstride,
+                              __global REAL *r, int ndims, __global unsigned *rdimsz) {
+    int gi = get_global_id(0);
+    r[gi] = a[aoffset + stridedIndex(gi, ndims, rdimsz, astride)] - b[boffset + stridedIndex(gi, ndims, rdimsz, bstride)];
+}
+
+__kernel void KERNEL(matmulv)(__global REAL *a, int aoffset, __global unsigned *astride, __global REAL *b, int boffset, __global unsigned *bstride,
+                              __global REAL *r, int ndims, __global unsigned *rdimsz) {
+    int gi = get_global_id(0);
+    r[gi] = a[aoffset + stridedIndex(gi, ndims, rdimsz, astride)] * b[boffset + stridedIndex(gi, ndims, rdimsz, bstride)];
+}
+
+// Reduce a dimension of a strided Tensor, one output per work item.
+// astride - strides of the other dimensions, the reduced one is `n` elements `axis_stride` apart.
+__kernel void KERNEL(matreduce)(__global REAL *a, int aoffset, __global unsigned *astride, int n, int axis_stride, int op, REAL scale,
+                                __global REAL *r, int ndims, __global unsigned *rdimsz) {
+    int gi = get_global_id(0);
+    int ind = aoffset + stridedIndex(gi, ndims, rdimsz, astride);
+
+    REAL acc = a[ind];
+    for (int i = 1; i < n; i++)
+        acc = reduceOp(acc, a[ind + i * axis_stride], op);
+    r[gi] = acc * scale;
+}
+
+// Convert 16-bit storage to REAL: IEEE half, or bfloat16 (the top half of a float).
+__kernel void KERNEL(matwiden)(__global ushort *a, int dtype, __global REAL *r) {
+    int gi = get_global_id(0);
+    if (dtype == DTYPE_FLOAT16) r[gi] = vload_half(gi, (__global half *) a);
+    else r[gi] = as_float((uint) a[gi] << 16);
+}
+
+// Convert REAL to 16-bit storage, rounding to nearest, ties to even.
+__kernel void KERNEL(matnarrow)(__global REAL *a, int dtype, __global ushort *r) {
+    int gi = get_global_id(0);
+    float v = a[gi];
+    if (dtype == DTYPE_FLOAT16) vstore_half_rte(v, gi, (__global half *) r);
+    else {
+        uint bits = as_uint(v);
+        r[gi] = isnan(v)? (ushort) ((bits >> 16) | 0x40) : (ushort) ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+    }
+}
+
+// Product of the int8 weights `q` {in, out}, with a scale per row, and the inputs quantized
+// to int8 by `x_scale`, summed in int. Global size {out, n}.
+__kernel void KERNEL(matqprod)(__global char *q, __global float *scale, __global REAL *x, float x_scale,
+                               __global REAL *r, int in, int out) {
+    int o = get_global_id(0);
+    int b = get_global_id(1);
+
+    __global char *qrow = q + o * in;
+    __global REAL *xb = x + b * in;
+    float inv = 1 / x_scale;
+
+    int acc = 0;
+    for (int k = 0; k < in; k++) acc += qrow[k] * clamp(convert_int_sat_rte((float) xb[k] * inv), -127, 127);
+
+    r[b * out + o] = acc * (scale[o] * x_scale);
+}
@@ -1,12 +1,18 @@
 /*
 Register functions by passing their source code, and name.
 
-Call the function using its name and passing its parameters.
+Call the function using its name and passing its parameters, or
+using a handle from claGetKernel to skip the name lookup.
 
 Automatic clean-up.
 
+Device memory is drawn from a pool of reusable buffers, instead of
+being allocated and freed on every call.
+
+Preallocated device memory can be made with claMakeBuffer and passed to
+claRunKernel with the OCLRESIDENT flag. It will not be copied or freed by the call.
+
 TODO: Maybe also safe calls to run_kernel? (type checking, variable count checks, NULL ptr)
-TODO: Add the ability to use preallocated memory, that wont be freed after the call.
 */
 
 #include <stdlib.h>
@@ -17,20 +23,38 @@ TODO: Add the ability to use preallocated memory, that wont be freed after the c
 
 #include "oclapi.h"
 
+#ifdef _WIN32
+#include <direct.h>
+#define MKDIR(path) _mkdir(path)
+#else
+#include <sys/stat.h>
+#define MKDIR(path) mkdir(path, 0755)
+#endif
+
+// Identifies program cache files, and their layout version.
+#define PROGRAM_CACHE_MAGIC "OCLAPIC1"
+
+// Argument base types, decoded once at registration.
+enum _OCLAPI_ARG_TYPE { _OCLCHAR, _OCLSHORT, _OCLINT, _OCLFLOAT, _OCLDOUBLE };
+
 // Internal structures to keep track of kernel registrations
 // and kernel argument structure.
 typedef struct {
     char rettype[RETTYPE_SIZE];
     int isptr;
+    int type;
     size_t asize;
     // Temporary variable used during execution
     int _dsize;
     int _islocal;
     int _flags;
+    int _resident;
     void *_host_data;
     cl_mem _device_data;
 } _oclapi_Karg;
 
+// Kernels are kept in a hash table by name. `next` chains kernels
+// that hash to the same bucket.
 typedef struct _oclapi_klist {
     cl_kernel kernel;
     char *name;
@@ -42,6 +66,28 @@ typedef struct _oclapi_klist {
     struct _oclapi_klist *next;
 } _oclapi_Klist;
 
+// Argument metadata stored in the program cache, after the binary.
+typedef struct {
+    int islocal;
+    char rettype[RETTYPE_SIZE];
+} _oclapi_CachedArg;
+
+typedef struct {
+    int argc;
+    _oclapi_CachedArg *argv;
+} _oclapi_CachedKernel;
+
+// Free buffers of the pool, one list per power of two size.
+typedef struct _oclapi_poolnode {
+    cl_mem buffer;
+    struct _oclapi_poolnode *next;
+} _oclapi_PoolNode;
+
+typedef struct {
+    _oclapi_PoolNode *free[POOL_BUCKETS];
+    OCLAPIPoolStats stats;
+} _oclapi_Pool;
+
 cl_platform_id cpPlatform;
 cl_device_id device_id;
 cl_context context;
@@ -52,7 +98,139 @@ cl_int clerr = CL_SUCCESS;
 
 bool oclinit = false;
 
-_oclapi_Klist *kernels = NULL;
+_oclapi_Klist *kernels[KERNEL_TABLE_SIZE] = { NULL };
+
+// FNV-1a hash of a kernel name, as a bucket of `kernels`.
+static unsigned _claKernelBucket(const char *name) {
+    unsigned hash = 2166136261u;
+    while (*name) {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+    
+    return hash & (KERNEL_TABLE_SIZE - 1);
+}
+
+// Find a registered kernel by name, or NULL.
+static _oclapi_Klist* _claFindKernel(const char *name) {
+    _oclapi_Klist *k = kernels[_claKernelBucket(name)];
+    
+    while (k != NULL) {
+        if (strcmp(k->name, name) == 0) break;
+        k = k->next;
+    }
+    
+    return k;
+}
+
+// Unlink and release registered kernels by name, leaving their program alone.
+static void _claUnlinkKernels(char **names, int n) {
+    for (int i = 0; i < n; i++) {
+        _oclapi_Klist **link = &kernels[_claKernelBucket(names[i])];
+        while (*link != NULL && strcmp((*link)->name, names[i]) != 0) link = &(*link)->next;
+        if (*link == NULL) continue;
+        
+        _oclapi_Klist *k = *link;
+        *link = k->next;
+        clReleaseKernel(k->kernel);
+        free(k->argv);
+        free(k);
+    }
+}
+
+// Directory compiled programs are cached in, or NULL if caching is disabled.
+char *cache_dir = NULL;
+
+// Buffers in the pool belong to `context`, and are released with it.
+_oclapi_Pool pool = { 0 };
+
+// Smallest bucket that fits `size` bytes
+static int _claPoolBucket(size_t size) {
+    int bucket = POOL_MIN_BUCKET;
+    while (bucket < POOL_BUCKETS && ((size_t) 1 << bucket) < size) bucket++;
+    
+    return bucket;
+}
+
+// Release free buffers until at most `max_cached` bytes are cached.
+// Largest buffers are released first.
+static void _claPoolTrim(size_t max_cached) {
+    for (int bucket = POOL_BUCKETS - 1; bucket >= 0 && pool.stats.bytes_cached > max_cached; bucket--) {
+        while (pool.free[bucket] != NULL && pool.stats.bytes_cached > max_cached) {
+            _oclapi_PoolNode *node = pool.free[bucket];
+            pool.free[bucket] = node->next;
+            
+            clReleaseMemObject(node->buffer);
+            pool.stats.bytes_cached -= (size_t) 1 << bucket;
+            free(node);
+        }
+    }
+}
+
+// Get a device buffer of at least `size` bytes from the pool
+/*
+ * returns an OpenCL error
+ * */
+static cl_int _claPoolAcquire(size_t size, cl_mem *buffer) {
+    int bucket = _claPoolBucket(size);
+    if (bucket >= POOL_BUCKETS) return CL_INVALID_BUFFER_SIZE;
+    size_t bucket_size = (size_t) 1 << bucket;
+    
+    _oclapi_PoolNode *node = pool.free[bucket];
+    if (node != NULL) {
+        pool.free[bucket] = node->next;
+        *buffer = node->buffer;
+        free(node);
+        
+        pool.stats.hits++;
+        pool.stats.bytes_cached -= bucket_size;
+    } else {
+        cl_int err;
+        *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bucket_size, NULL, &err);
+        // Cached buffers may be what is taking up the device memory.
+        if (err == CL_MEM_OBJECT_ALLOCATION_FAILURE || err == CL_OUT_OF_RESOURCES) {
+            _claPoolTrim(0);
+            *buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bucket_size, NULL, &err);
+        }
+        if (err) {
+            *buffer = NULL;
+            return err;
+        }
+        
+        pool.stats.misses++;
+    }
+    
+    pool.stats.bytes_in_use += bucket_size;
+    if (pool.stats.bytes_in_use > pool.stats.high_water_mark)
+        pool.stats.high_water_mark = pool.stats.bytes_in_use;
+    
+    return CL_SUCCESS;
+}
+
+// Return a buffer taken by `_claPoolAcquire` to the pool
+/*
+ * returns an OpenCL error
+ * */
+static cl_int _claPoolRelease(cl_mem buffer) {
+    size_t size;
+    cl_int err = clGetMemObjectInfo(buffer, CL_MEM_SIZE, sizeof(size_t), &size, NULL);
+    if (err) return err;
+    
+    int bucket = _claPoolBucket(size);
+    // Not a pool buffer.
+    if (bucket >= POOL_BUCKETS || ((size_t) 1 << bucket) != size) return clReleaseMemObject(buffer);
+    
+    pool.stats.bytes_in_use -= size;
+    _oclapi_PoolNode *node = (_oclapi_PoolNode *) malloc(sizeof(_oclapi_PoolNode));
+    // Out of host memory to cache it, release it instead.
+    if (!node) return clReleaseMemObject(buffer);
+    node->buffer = buffer;
+    node->next = pool.free[bucket];
+    pool.free[bucket] = node;
+    pool.stats.bytes_cached += size;
+    
+    return CL_SUCCESS;
+}
 
 // Get the last error
 /*
@@ -97,6 +275,9 @@ OCLAPIErr claInit() {
     queue = clCreateCommandQueue(context, device_id, 0, &err);
     if (err) goto ExitErrorCL;
     
+    if (cache_dir == NULL && getenv("OCLAPI_PROGRAM_CACHE") != NULL)
+        claSetProgramCache(getenv("OCLAPI_PROGRAM_CACHE"));
+    
     fputs("Initialized OpenCL API successfuly.\n", stderr);
     
     oclinit = true;
@@ -124,37 +305,221 @@ OCLAPIErr claInit() {
 OCLAPIErr claCln() {
     if (!oclinit) return OCL_UNINITIALIZED;
     
-    _oclapi_Klist *k = kernels;
-    
-    while (k != NULL) {
-        // TODO: Programs will repeat if multiple kernels are added at once.
-        // This will cause clReleaseProgram to return an error. This is not
-        // problematic per say but bad practice and should be avoided.
-        cl_program prog;
-        clGetKernelInfo(k->kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &prog, NULL);
-        clReleaseProgram(prog);
-        clReleaseKernel(k->kernel);
+    for (int bucket = 0; bucket < KERNEL_TABLE_SIZE; bucket++) {
+        _oclapi_Klist *k = kernels[bucket];
         
-        _oclapi_Klist *oldk = k;
-        free(k->argv);
-        k = k->next;
-        free(oldk);
+        while (k != NULL) {
+            // TODO: Programs will repeat if multiple kernels are added at once.
+            // This will cause clReleaseProgram to return an error. This is not
+            // problematic per say but bad practice and should be avoided.
+            cl_program prog;
+            clGetKernelInfo(k->kernel, CL_KERNEL_PROGRAM, sizeof(cl_program), &prog, NULL);
+            clReleaseProgram(prog);
+            clReleaseKernel(k->kernel);
+            
+            _oclapi_Klist *oldk = k;
+            free(k->argv);
+            k = k->next;
+            free(oldk);
+        }
+        
+        kernels[bucket] = NULL;
     }
     
+    _claPoolTrim(0);
+    
     clReleaseCommandQueue(queue);
     clReleaseContext(context);
+    
+    oclinit = false;
 
     puts("Cleaned OpenCL API successfuly.");
     
     return OCL_NO_ERR;
 }
 
+// Build a program from source
+/*
+ * returns an OpenCL error
+ * */
+static cl_int _claBuildFromSrc(const char **src, cl_program *prog) {
+    cl_int err;
+    
+    *prog = clCreateProgramWithSource(context, 1, src, NULL, &err);
+    if (err) return err;
+    // Build with kernel arg info flag to retrive it later. This solution thankfully
+    // allows for building programs and having access to some of the information form
+    // the compilation process, allowing for this whole library to feasably exist.
+    err = clBuildProgram(*prog, 0, NULL, BUILD_OPTIONS, NULL, NULL);
+    if (err == CL_BUILD_PROGRAM_FAILURE) {
+        char buildlog[BUILD_LOG_SIZE];
+        clGetProgramBuildInfo(*prog, device_id, CL_PROGRAM_BUILD_LOG, (size_t) BUILD_LOG_SIZE, buildlog, NULL);
+        printf("Build error: \n%s\n", buildlog);
+    }
+    
+    return err;
+}
+
+// Path of the cache file for a program
+/*
+ * The file name is a hash of everything that affects the compiled binary: source,
+ * build options and device, as well as the registered kernel names, since their
+ * argument metadata is stored along with the binary.
+ * NOTE: Files included by the source are not hashed.
+ * */
+static void _claProgramCachePath(const char *src, char **names, int kerneln, char *path) {
+    unsigned long long hash = 14695981039346656037ull;
+#define HASH_STRING(str) \
+    for (const char *c = (str); ; c++) { \
+        hash ^= (unsigned char) *c; \
+        hash *= 1099511628211ull; \
+        if (*c == '\0') break; \
+    }
+    
+    HASH_STRING(src);
+    HASH_STRING(BUILD_OPTIONS);
+    
+    cl_device_info device_infos[] = { CL_DEVICE_NAME, CL_DEVICE_VENDOR, CL_DEVICE_VERSION, CL_DRIVER_VERSION };
+    for (int i = 0; i < sizeof(device_infos) / sizeof(cl_device_info); i++) {
+        char info[RETTYPE_SIZE * 4] = { 0 };
+        clGetDeviceInfo(device_id, device_infos[i], sizeof(info) - 1, info, NULL);
+        HASH_STRING(info);
+    }
+    
+    for (int i = 0; i < kerneln; i++) HASH_STRING(names[i]);
+#undef HASH_STRING
+    
+    snprintf(path, PROGRAM_CACHE_PATH_SIZE, "%s/%016llx.clbin", cache_dir, hash);
+}
+
+// Load a cached program binary and the argument metadata of its kernels
+/*
+ * OpenCL only provides argument metadata for programs built from source, so it is
+ * read from the cache as well, one `_oclapi_CachedKernel` per kernel name.
+ * returns the built program, or NULL if there is no valid cache file
+ * */
+static cl_program _claLoadCachedProgram(const char *path, int kerneln, _oclapi_CachedKernel *cached) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    
+    cl_program prog = NULL;
+    unsigned char *binary = NULL;
+    size_t binary_size = 0;
+    int loaded_kernels = 0;
+    char magic[sizeof(PROGRAM_CACHE_MAGIC)];
+    cl_int err;
+    
+    // Sizes read from the file are checked against what is left of it, so a
+    // truncated or corrupt file is never trusted with an allocation.
+    long file_size;
+    if (fseek(f, 0, SEEK_END) || (file_size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET)) goto Fail;
+    size_t remaining = (size_t) file_size;
+    
+    if (remaining < sizeof(magic) + sizeof(size_t)) goto Fail;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic))) goto Fail;
+    if (fread(&binary_size, sizeof(size_t), 1, f) != 1 || binary_size == 0) goto Fail;
+    remaining -= sizeof(magic) + sizeof(size_t);
+    if (binary_size > remaining) goto Fail;
+    remaining -= binary_size;
+    
+    binary = (unsigned char *) malloc(binary_size);
+    if (binary == NULL || fread(binary, binary_size, 1, f) != 1) goto Fail;
+    
+    for (; loaded_kernels < kerneln; loaded_kernels++) {
+        _oclapi_CachedKernel *ck = &cached[loaded_kernels];
+        if (remaining < sizeof(int) || fread(&ck->argc, sizeof(int), 1, f) != 1 || ck->argc < 0) goto Fail;
+        remaining -= sizeof(int);
+        if ((size_t) ck->argc > remaining / sizeof(_oclapi_CachedArg)) goto Fail;
+        remaining -= sizeof(_oclapi_CachedArg) * ck->argc;
+        
+        ck->argv = (_oclapi_CachedArg *) malloc(sizeof(_oclapi_CachedArg) * (ck->argc? ck->argc : 1));
+        if (ck->argv == NULL || (ck->argc && fread(ck->argv, sizeof(_oclapi_CachedArg), ck->argc, f) != ck->argc)) {
+            loaded_kernels++;
+            goto Fail;
+        }
+    }
+    
+    const unsigned char *binaries[] = { binary };
+    cl_int binary_status;
+    prog = clCreateProgramWithBinary(context, 1, &device_id, &binary_size, binaries, &binary_status, &err);
+    if (err || binary_status) goto Fail;
+    if ((err = clBuildProgram(prog, 0, NULL, BUILD_OPTIONS, NULL, NULL))) goto Fail;
+    
+    free(binary);
+    fclose(f);
+    
+    return prog;
+    
+    Fail:
+    // A stale or broken cache file is a miss, rebuilt from source.
+    if (prog != NULL) clReleaseProgram(prog);
+    for (int i = 0; i < loaded_kernels; i++) {
+        free(cached[i].argv);
+        cached[i].argv = NULL;
+    }
+    free(binary);
+    fclose(f);
+    
+    return NULL;
+}
+
+// Save a program binary, and the argument metadata of its registered kernels
+/*
+ * Failing to save is not an error, the program will simply be built again next time.
+ * */
+static void _claSaveCachedProgram(const char *path, cl_program prog, char **names, int kerneln) {
+    size_t binary_size = 0;
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_size, NULL) || binary_size == 0) return;
+    
+    unsigned char *binary = (unsigned char *) malloc(binary_size);
+    unsigned char *binaries[] = { binary };
+    if (clGetProgramInfo(prog, CL_PROGRAM_BINARIES, sizeof(binaries), binaries, NULL)) {
+        free(binary);
+        return;
+    }
+    
+    MKDIR(cache_dir);
+    
+    // Write to a temporary file first, so a concurrent process never sees half a file.
+    char tmp_path[PROGRAM_CACHE_PATH_SIZE + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *f = fopen(tmp_path, "wb");
+    if (f == NULL) {
+        free(binary);
+        return;
+    }
+    
+    int ok = fwrite(PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC), 1, f) == 1;
+    ok = ok && fwrite(&binary_size, sizeof(size_t), 1, f) == 1;
+    ok = ok && fwrite(binary, binary_size, 1, f) == 1;
+    
+    for (int i = 0; ok && i < kerneln; i++) {
+        _oclapi_Klist *k = _claFindKernel(names[i]);
+        ok = fwrite(&k->argc, sizeof(int), 1, f) == 1;
+        
+        for (int argument = 0; ok && argument < k->argc; argument++) {
+            _oclapi_CachedArg arg = { 0 };
+            memcpy(arg.rettype, k->argv[argument].rettype, RETTYPE_SIZE);
+            arg.islocal = k->argv[argument]._islocal;
+            ok = fwrite(&arg, sizeof(arg), 1, f) == 1;
+        }
+    }
+    
+    ok = fclose(f) == 0 && ok;
+    free(binary);
+    
+    if (!ok || rename(tmp_path, path)) remove(tmp_path);
+}
+
 // Register a kerenel so it can be run
 /*
  * Before a function is ran using the ocl api, it must first be
  * registered. The user needs to supply a source program and any
  * number of kernels in that program. All names must be unique.
  * 
+ * If a program cache is set (see `claSetProgramCache`), the compiled program
+ * is loaded from it when possible, and saved to it otherwise.
+ * 
  * `src` - source code string.
  * `kerneln` - number of kernels in source code.
  * `...` - string names of the kernels in source code.
@@ -163,84 +528,144 @@ OCLAPIErr claCln() {
 OCLAPIErr claRegisterFromSrc(const char **src, int kerneln, ...) {
     int err;
     if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; };
+    if (src == NULL || kerneln <= 0) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
     
-    cl_program prog = clCreateProgramWithSource(context, 1, src, NULL, &err);
-    if (err) goto ExitErrorCL;
-    // Build with kernel arg info flag to retrive it later. This solution thankfully
-    // allows for building programs and having access to some of the information form
-    // the compilation process, allowing for this whole library to feasably exist.
-    err = clBuildProgram(prog, 0, NULL, "-cl-kernel-arg-info -I acceleration/kernels/src", NULL, NULL);
-    if (err == CL_BUILD_PROGRAM_FAILURE) {
-        char buildlog[BUILD_LOG_SIZE];
-        clGetProgramBuildInfo(prog, device_id, CL_PROGRAM_BUILD_LOG, (size_t) BUILD_LOG_SIZE, buildlog, NULL);
-        printf("Build error: \n%s\n", buildlog);
-    } if (err) goto ExitErrorCL;
+    // Names are needed for the cache before the kernels are made.
+    char **names = (char **) malloc(sizeof(char *) * kerneln);
+    if (names == NULL) { err = CL_OUT_OF_HOST_MEMORY; goto ExitErrorCL; }
     
     va_list valist;
     va_start(valist, kerneln);
+    for (int kernel = 0; kernel < kerneln; kernel++) names[kernel] = va_arg(valist, char *);
+    va_end(valist);
     
     for (int kernel = 0; kernel < kerneln; kernel++) {
-        char *name = va_arg(valist, char *);
+        if (_claFindKernel(names[kernel]) != NULL) {
+            free(names);
+            err = OCL_INVALID_NAME;
+            goto ExitErrorOCL;
+        }
+    }
+    
+    char cache_path[PROGRAM_CACHE_PATH_SIZE];
+    _oclapi_CachedKernel *cached = NULL;
+    cl_program prog = NULL;
+    
+    if (cache_dir != NULL) {
+        _claProgramCachePath(src[0], names, kerneln, cache_path);
+        cached = (_oclapi_CachedKernel *) calloc(kerneln, sizeof(_oclapi_CachedKernel));
+        if (cached != NULL) prog = _claLoadCachedProgram(cache_path, kerneln, cached);
+        if (prog == NULL) {
+            free(cached);
+            cached = NULL;
+        }
+    }
+    
+    Build:
+    if (prog == NULL && (err = _claBuildFromSrc(src, &prog))) {
+        free(names);
+        goto ExitErrorCL;
+    }
+    
+    int registered = 0;
+    for (int kernel = 0; kernel < kerneln; kernel++) {
+        char *name = names[kernel];
         
-        _oclapi_Klist *k = kernels;
+        cl_kernel clkernel = clCreateKernel(prog, name, &err);
+        if (err) break;
         
-        if (k == NULL) {
-            kernels = (_oclapi_Klist *) malloc(sizeof(_oclapi_Klist));
-            k = kernels;
-            k->next = NULL;
-        } else {
-            while (k->next != NULL) {
-                if (strcmp(k->name, name) == 0) { 
-                    va_end(valist);
-                    return OCL_INVALID_NAME;
-                }
-                
-                k = k->next;
-            }
-            
-            k->next = (_oclapi_Klist *) malloc(sizeof(_oclapi_Klist));
-            k->next->next = NULL;
-            k = k->next;
+        int argc = 0;
+        clGetKernelInfo(clkernel, CL_KERNEL_NUM_ARGS, sizeof(int), &argc, NULL);
+        
+        _oclapi_Klist *k = (_oclapi_Klist *) malloc(sizeof(_oclapi_Klist));
+        _oclapi_Karg *argv = (_oclapi_Karg *) malloc(sizeof(_oclapi_Karg) * (argc? argc : 1));
+        if (k == NULL || argv == NULL || (cached != NULL && cached[kernel].argc != argc)) {
+            if (k == NULL || argv == NULL) err = CL_OUT_OF_HOST_MEMORY;
+            else err = OCL_INVALID_ARG;
+            clReleaseKernel(clkernel);
+            free(argv);
+            free(k);
+            break;
         }
         
-        k->kernel = clCreateKernel(prog, name, &err);
-        if (err) goto ExitErrorCL;
+        unsigned bucket = _claKernelBucket(name);
+        k->next = kernels[bucket];
+        kernels[bucket] = k;
+        registered++;
+        
+        k->kernel = clkernel;
         k->name = name;
-        clGetKernelInfo(k->kernel, CL_KERNEL_NUM_ARGS, sizeof(int), &(k->argc), NULL);
-        k->argv = (_oclapi_Karg *) malloc(sizeof(_oclapi_Karg) * k->argc);
+        k->argc = argc;
+        k->argv = argv;
         
         // Fill out arguments
         for (int argument = 0; argument < k->argc; argument++) {
-            clGetKernelArgInfo(k->kernel, argument, CL_KERNEL_ARG_TYPE_NAME, RETTYPE_SIZE, k->argv[argument].rettype, NULL);
+            if (cached != NULL) {
+                memcpy(k->argv[argument].rettype, cached[kernel].argv[argument].rettype, RETTYPE_SIZE);
+                k->argv[argument].rettype[RETTYPE_SIZE - 1] = '\0';
+                k->argv[argument]._islocal = cached[kernel].argv[argument].islocal;
+            } else {
+                clGetKernelArgInfo(k->kernel, argument, CL_KERNEL_ARG_TYPE_NAME, RETTYPE_SIZE, k->argv[argument].rettype, NULL);
+                
+                cl_kernel_arg_address_qualifier addressq = CL_KERNEL_ARG_ADDRESS_PRIVATE;
+                clGetKernelArgInfo(k->kernel, argument, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(addressq), &addressq, NULL);
+                k->argv[argument]._islocal = addressq == CL_KERNEL_ARG_ADDRESS_LOCAL;
+            }
+            
             k->argv[argument].isptr = strchr(k->argv[argument].rettype, '*') != 0;
             
             if (strstr(k->argv[argument].rettype, "char")) {
+                k->argv[argument].type = _OCLCHAR;
                 k->argv[argument].asize = sizeof(char);
+            } else if (strstr(k->argv[argument].rettype, "short")) {
+                k->argv[argument].type = _OCLSHORT;
+                k->argv[argument].asize = sizeof(short);
             } else if (strstr(k->argv[argument].rettype, "int")) {
+                k->argv[argument].type = _OCLINT;
                 k->argv[argument].asize = sizeof(int);
             } else if (strstr(k->argv[argument].rettype, "float")) {
+                k->argv[argument].type = _OCLFLOAT;
                 k->argv[argument].asize = sizeof(float);
             } else if (strstr(k->argv[argument].rettype, "double")) {
+                k->argv[argument].type = _OCLDOUBLE;
                 k->argv[argument].asize = sizeof(double);
             } else {
-                va_end(valist);
                 puts("INVALID ARG");
                 err = OCL_INVALID_ARG;
-                goto ExitErrorOCL;
+                break;
             }
             
-            cl_kernel_arg_address_qualifier addressq = CL_KERNEL_ARG_ADDRESS_PRIVATE;
-            clGetKernelArgInfo(k->kernel, argument, CL_KERNEL_ARG_ADDRESS_QUALIFIER, sizeof(addressq), &addressq, NULL);
-            k->argv[argument]._islocal = addressq == CL_KERNEL_ARG_ADDRESS_LOCAL;
-            
             // Initilize values reset
             k->argv[argument]._dsize = 0;
             k->argv[argument]._flags = 0;
+            k->argv[argument]._resident = 0;
             k->argv[argument]._host_data = NULL;
         }
+        
+        if (err) break;
     }
     
-    va_end(valist);
+    if (!err && cached == NULL && cache_dir != NULL) _claSaveCachedProgram(cache_path, prog, names, kerneln);
+    
+    // Nothing of a failed call stays registered, so it can be retried.
+    if (err) {
+        _claUnlinkKernels(names, registered);
+        clReleaseProgram(prog);
+        prog = NULL;
+    }
+    
+    if (cached != NULL) {
+        for (int kernel = 0; kernel < kerneln; kernel++) free(cached[kernel].argv);
+        free(cached);
+        cached = NULL;
+        
+        // A stale or broken cache file is rebuilt from source, which replaces it.
+        if (err) goto Build;
+    }
+    free(names);
+    
+    if (err == OCL_INVALID_ARG) goto ExitErrorOCL;
+    if (err) goto ExitErrorCL;
     
     return OCL_NO_ERR;
     
@@ -256,51 +681,69 @@ OCLAPIErr claRegisterFromSrc(const char **src, int kerneln, ...) {
     return oclerr;
 }
 
-// Run registered kernel
+// Set the directory compiled programs are cached in
 /*
- * For output variables, the user must allocate the correct amount of memory.
- * `name` - name of the kernel.
- * `wdim` - number of dimensions to run the kerenl in the GPU (typically between 1 to 3, see OpenCL docs).
- * `gsz` - array of sizes for the global run size. Array length should be dim (see OpenCL docs).
- * `lsz` - array of sizes for the local run size. Array length should be dim (see OpenCL docs).
- * `...` - parameters for the function. After every pointer there must follow: the size of the pointer, operation flags.
+ * Programs registered afterwards are loaded from the cache when possible,
+ * skipping the build from source. The directory is made if it doesn't exist.
+ * If unset, the `OCLAPI_PROGRAM_CACHE` environment variable is used by `claInit`.
+ * `dir` - cache directory, or NULL to disable caching.
  * returns 0 on success
  * */
-OCLAPIErr claRunKernel(const char *name, int wdim, size_t *gsz, size_t *lsz, ...) {
-    int err;
+OCLAPIErr claSetProgramCache(const char *dir) {
+    free(cache_dir);
+    cache_dir = NULL;
     
-    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (dir == NULL) return OCL_NO_ERR;
     
-    _oclapi_Klist *k = kernels;
-    
-    while (k != NULL) {
-        if (strcmp(k->name, name) == 0) break;
-        k = k->next;
+    // Leave room for the file name.
+    if (strlen(dir) > PROGRAM_CACHE_PATH_SIZE - 32) {
+        oclerr = OCL_INVALID_ARG;
+        return oclerr;
     }
     
-    if (k == NULL) { err = OCL_INVALID_NAME; goto ExitErrorOCL; }
+    cache_dir = (char *) malloc(strlen(dir) + 1);
+    strcpy(cache_dir, dir);
     
-    va_list valist;
-    va_start(valist, lsz);
+    return OCL_NO_ERR;
+}
+
+// Free the host copy of an argument once its asynchronous write is done.
+static void CL_CALLBACK _claFreeStaging(cl_event event, cl_int status, void *staging) {
+    free(staging);
+}
+
+// Return the pooled buffers of arguments `from` to `to` (exclusive) of a failed run
+static void _claReleaseArgs(_oclapi_Klist *k, int from, int to) {
+    for (int i = from; i < to; i++)
+        if (k->argv[i].isptr && !k->argv[i]._resident && !k->argv[i]._islocal) _claPoolRelease(k->argv[i]._device_data);
+}
+
+// Shared implementation of `claRunKernel` and `claRunKernelAsync`
+/*
+ * When not `blocking`, host arguments are copied to a staging buffer before the write
+ * is enqueued, and `OCLOUT` reads are not waited for. The command queue is in-order,
+ * so pooled buffers can be returned as soon as the commands using them are enqueued.
+ * */
+static OCLAPIErr _claRunKernel(_oclapi_Klist *k, int wdim, size_t *gsz, size_t *lsz, int blocking,
+                               int waitn, const cl_event *waitlist, cl_event *event, va_list valist) {
+    int err;
+    // Pool buffers are held by the arguments from `released` up to `acquired`,
+    // and returned if the run fails.
+    int acquired = 0;
+    int released = 0;
+    
+    if (event != NULL) *event = NULL;
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (k == NULL) { err = OCL_INVALID_NAME; goto ExitErrorOCL; }
+    if (waitn < 0 || (waitn > 0 && waitlist == NULL)) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
     
     for (int i = 0; i < k->argc; i++) {
         void *data;
         size_t device_dsize = k->argv[i].asize;
         
         if (k->argv[i].isptr) {
-            if (strstr(k->argv[i].rettype, "char")) 
-                k->argv[i]._host_data = (char *) (va_arg(valist, int *));
-            else if (strstr(k->argv[i].rettype, "int"))
-                k->argv[i]._host_data = (int *) va_arg(valist, int *);
-            else if (strstr(k->argv[i].rettype, "float"))
-                k->argv[i]._host_data = (float *) (va_arg(valist, double *));
-            else if (strstr(k->argv[i].rettype, "double"))
-                k->argv[i]._host_data = (double *) va_arg(valist, double *);
-            else {
-                va_end(valist);
-                err = OCL_INVALID_ARG;
-                goto ExitErrorOCL;
-            }
+            // All pointer types are passed the same way.
+            k->argv[i]._host_data = va_arg(valist, void *);
             
             // Store the data size to know how much data to return
             int dsize = va_arg(valist, int);
@@ -309,92 +752,482 @@ OCLAPIErr claRunKernel(const char *name, int wdim, size_t *gsz, size_t *lsz, ...
             // Store the flags in-case this argument needs to be copied out
             int flags = va_arg(valist, int);
             k->argv[i]._flags = flags;
+            k->argv[i]._resident = (flags & OCLRESIDENT) != 0;
             
-            cl_mem_flags clflags;
-            switch ((flags & ~OCLCPY) & ~OCLOUT) {
+            // Pooled buffers are always read-write, but the access flags are
+            // still validated.
+            switch (flags & ~(OCLCPY | OCLOUT | OCLRESIDENT)) {
                 case OCLREAD:
-                clflags = CL_MEM_READ_ONLY;
-                break;
-                
                 case OCLWRITE:
-                clflags = CL_MEM_WRITE_ONLY;
-                break;
-                
                 case OCLREAD | OCLWRITE:
-                clflags = CL_MEM_READ_WRITE;
                 break;
                 
                 default:
-                va_end(valist);
                 err = OCL_INVALID_ARG;
                 goto ExitErrorOCL;
             }
             
-            // This will be freed later
-            // TODO: Maybe the void *host_ptr argument can be used to save the copy?
-            k->argv[i]._device_data = clCreateBuffer(context, clflags, k->argv[i].asize * dsize, NULL, &err);
-            if (err) goto ExitErrorCL;
-            
-            if (!k->argv[i]._islocal) {
-                data = &(k->argv[i]._device_data);
-                device_dsize = sizeof(cl_mem);
-            } else {
+            if (k->argv[i]._islocal) {
+                // Local memory is only sized, never allocated or copied.
+                k->argv[i]._device_data = NULL;
                 data = NULL;
                 // This took a bit too much to figure out... OpenCL docs are not the clearest...
                 // Moreover, NVIDIA GPUs seem to be very lax when it comes to out of bounds access
                 device_dsize = k->argv[i]._dsize * k->argv[i].asize;
+            } else {
+                if (k->argv[i]._resident) {
+                    // Already on the device, owned by the caller.
+                    k->argv[i]._device_data = (cl_mem) k->argv[i]._host_data;
+                    k->argv[i]._host_data = NULL;
+                } else {
+                    // This will be returned to the pool later
+                    if ((err = _claPoolAcquire(k->argv[i].asize * dsize, &k->argv[i]._device_data))) goto ExitErrorCL;
+                    acquired = i + 1;
+                }
+                
+                data = &(k->argv[i]._device_data);
+                device_dsize = sizeof(cl_mem);
             }
             
             // Copy data from given pointer to buffer pointed to by data
-            if (flags & OCLCPY)
-                if ((err = clEnqueueWriteBuffer(queue, *(cl_mem *) data, CL_TRUE, 0, k->argv[i].asize * dsize, k->argv[i]._host_data, 0, NULL, NULL))) goto ExitErrorCL;
+            if ((flags & OCLCPY) && !k->argv[i]._resident && !k->argv[i]._islocal) {
+                size_t bytes = k->argv[i].asize * dsize;
+                
+                // Without room for a staging copy the write falls back to blocking.
+                void *staging = blocking? NULL : malloc(bytes);
+                
+                if (staging == NULL) {
+                    if ((err = clEnqueueWriteBuffer(queue, k->argv[i]._device_data, CL_TRUE, 0, bytes, k->argv[i]._host_data, 0, NULL, NULL))) goto ExitErrorCL;
+                } else {
+                    // The caller may reuse its memory as soon as this call returns.
+                    memcpy(staging, k->argv[i]._host_data, bytes);
+                    
+                    cl_event write_event;
+                    if ((err = clEnqueueWriteBuffer(queue, k->argv[i]._device_data, CL_FALSE, 0, bytes, staging, 0, NULL, &write_event))) {
+                        free(staging);
+                        goto ExitErrorCL;
+                    }
+                    
+                    err = clSetEventCallback(write_event, CL_COMPLETE, _claFreeStaging, staging);
+                    clReleaseEvent(write_event);
+                    if (err) goto ExitErrorCL;
+                }
+            }
         } else {
-            if (strstr(k->argv[i].rettype, "char")) 
-                data = &(char) { va_arg(valist, int) };
-            else if (strstr(k->argv[i].rettype, "int")) 
-                data = &(int) { va_arg(valist, int) };
-            else if (strstr(k->argv[i].rettype, "float"))
-                data = &(float) { va_arg(valist, double) };
-            else if (strstr(k->argv[i].rettype, "double")) 
-                data = &(double) { va_arg(valist, double) };
-            else {
-                va_end(valist);
-                return OCL_INVALID_ARG;
+            // Promoted types are read, then narrowed to the kernel's type.
+            switch (k->argv[i].type) {
+                case _OCLCHAR: data = &(char) { va_arg(valist, int) }; break;
+                case _OCLSHORT: data = &(short) { va_arg(valist, int) }; break;
+                case _OCLINT: data = &(int) { va_arg(valist, int) }; break;
+                case _OCLFLOAT: data = &(float) { va_arg(valist, double) }; break;
+                case _OCLDOUBLE: data = &(double) { va_arg(valist, double) }; break;
+                
+                default:
+                err = OCL_INVALID_ARG;
+                goto ExitErrorOCL;
             }
         }
         
         if ((err = clSetKernelArg(k->kernel, i, device_dsize, data))) goto ExitErrorCL;
     }
     
-    va_end(valist);
-    
     // Run the kernel
-    if ((err = clEnqueueNDRangeKernel(queue, k->kernel, wdim, NULL, gsz, lsz, 0, NULL, NULL))) goto ExitErrorCL;
-    clFinish(queue);
+    cl_event last_event = NULL;
+    if ((err = clEnqueueNDRangeKernel(queue, k->kernel, wdim, NULL, gsz, lsz, waitn, waitlist, (event != NULL)? &last_event : NULL))) goto ExitErrorCL;
     
     // Copy out the data and free it
     for (int i = 0; i < k->argc; i++) {
-        if (k->argv[i].isptr) {
+        if (k->argv[i].isptr && !k->argv[i]._resident && !k->argv[i]._islocal) {
             if (k->argv[i]._flags & OCLOUT) {
-                if ((err = clEnqueueReadBuffer(queue, k->argv[i]._device_data, CL_TRUE, 0, k->argv[i].asize * k->argv[i]._dsize, k->argv[i]._host_data, 0, NULL, NULL))) goto ExitErrorCL;
+                // The queue is in-order, so the last read completing means
+                // everything before it has too.
+                cl_event read_event = NULL;
+                if ((err = clEnqueueReadBuffer(queue, k->argv[i]._device_data, blocking? CL_TRUE : CL_FALSE, 0, k->argv[i].asize * k->argv[i]._dsize, k->argv[i]._host_data, 0, NULL, (event != NULL)? &read_event : NULL))) goto ExitErrorCL;
+                
+                if (read_event != NULL) {
+                    clReleaseEvent(last_event);
+                    last_event = read_event;
+                }
             }
             
-            if ((err = clReleaseMemObject(k->argv[i]._device_data))) goto ExitErrorCL;
+            released = i + 1;
+            if ((err = _claPoolRelease(k->argv[i]._device_data))) goto ExitErrorCL;
         }
     }
     
-    clFinish(queue);
+    if (blocking) clFinish(queue);
+    else clFlush(queue);
+    
+    if (event != NULL) *event = last_event;
     
     return OCL_NO_ERR;
     
     ExitErrorOCL:
+    _claReleaseArgs(k, released, acquired);
     oclerr = err;
     
     return oclerr;
     
     ExitErrorCL:
+    _claReleaseArgs(k, released, acquired);
     oclerr = OCL_INTERNAL_OPENCL_ERROR;
     clerr = err;
     
     return oclerr;
 }
+
+// Run registered kernel
+/*
+ * For output variables, the user must allocate the correct amount of memory.
+ * `name` - name of the kernel.
+ * `wdim` - number of dimensions to run the kerenl in the GPU (typically between 1 to 3, see OpenCL docs).
+ * `gsz` - array of sizes for the global run size. Array length should be dim (see OpenCL docs).
+ * `lsz` - array of sizes for the local run size. Array length should be dim (see OpenCL docs).
+ * `...` - parameters for the function. After every pointer there must follow: the size of the pointer, operation flags.
+ * If the flags contain `OCLRESIDENT`, the pointer must be a `cl_mem` made by `claMakeBuffer`.
+ * returns 0 on success
+ * */
+OCLAPIErr claRunKernel(const char *name, int wdim, size_t *gsz, size_t *lsz, ...) {
+    va_list valist;
+    va_start(valist, lsz);
+    OCLAPIErr err = _claRunKernel(_claFindKernel(name), wdim, gsz, lsz, 1, 0, NULL, NULL, valist);
+    va_end(valist);
+    
+    return err;
+}
+
+// Run registered kernel without waiting for it
+/*
+ * Same as `claRunKernel`, but returns as soon as the work is enqueued.
+ * Host memory passed with `OCLCPY` may be reused once the call returns, but memory passed with
+ * `OCLOUT` must not be read until `event` has completed (see `claWaitForEvents`).
+ * `waitn` - number of events in `waitlist`.
+ * `waitlist` - events that must complete before the kernel runs. May be NULL if `waitn` is 0.
+ * `event` - if not NULL, set to an event that completes once the kernel and its `OCLOUT` copies
+ * are done. Must be released with `claReleaseEvent`.
+ * returns 0 on success
+ * */
+OCLAPIErr claRunKernelAsync(const char *name, int wdim, size_t *gsz, size_t *lsz, int waitn, const cl_event *waitlist, cl_event *event, ...) {
+    va_list valist;
+    va_start(valist, event);
+    OCLAPIErr err = _claRunKernel(_claFindKernel(name), wdim, gsz, lsz, 0, waitn, waitlist, event, valist);
+    va_end(valist);
+    
+    return err;
+}
+
+// Get a handle to a registered kernel
+/*
+ * Running a kernel by handle skips looking it up by name. Handles stay
+ * valid until `claCln`.
+ * `name` - name of the kernel.
+ * returns the handle, or NULL if no such kernel is registered.
+ * */
+OCLAPIKernel claGetKernel(const char *name) {
+    if (name == NULL) return NULL;
+    
+    _oclapi_Klist *k = _claFindKernel(name);
+    if (k == NULL) oclerr = OCL_INVALID_NAME;
+    
+    return k;
+}
+
+// Run registered kernel by handle
+/*
+ * Same as `claRunKernel`, with `kernel` from `claGetKernel`.
+ * returns 0 on success
+ * */
+OCLAPIErr claRunKernelHandle(OCLAPIKernel kernel, int wdim, size_t *gsz, size_t *lsz, ...) {
+    va_list valist;
+    va_start(valist, lsz);
+    OCLAPIErr err = _claRunKernel(kernel, wdim, gsz, lsz, 1, 0, NULL, NULL, valist);
+    va_end(valist);
+    
+    return err;
+}
+
+// Run registered kernel by handle without waiting for it
+/*
+ * Same as `claRunKernelAsync`, with `kernel` from `claGetKernel`.
+ * returns 0 on success
+ * */
+OCLAPIErr claRunKernelHandleAsync(OCLAPIKernel kernel, int wdim, size_t *gsz, size_t *lsz, int waitn, const cl_event *waitlist, cl_event *event, ...) {
+    va_list valist;
+    va_start(valist, event);
+    OCLAPIErr err = _claRunKernel(kernel, wdim, gsz, lsz, 0, waitn, waitlist, event, valist);
+    va_end(valist);
+    
+    return err;
+}
+
+// Block until the events have completed
+/*
+ * returns 0 on success
+ * */
+OCLAPIErr claWaitForEvents(int eventn, const cl_event *events) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (eventn <= 0) return OCL_NO_ERR;
+    if (events == NULL) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    if ((err = clWaitForEvents(eventn, events))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Release an event returned by `claRunKernelAsync`
+/*
+ * returns 0 on success
+ * */
+OCLAPIErr claReleaseEvent(cl_event event) {
+    int err;
+    
+    if (event == NULL) return OCL_NO_ERR;
+    if ((err = clReleaseEvent(event))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Block until all enqueued work has completed
+/*
+ * returns 0 on success
+ * */
+OCLAPIErr claFinish() {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if ((err = clFinish(queue))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Get the name of the device in use
+/*
+ * `name` - filled with the name, truncated to `size` bytes including the terminator.
+ * returns 0 on success
+ * */
+OCLAPIErr claGetDeviceName(char *name, size_t size) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (name == NULL || size == 0) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    name[0] = '\0';
+    if ((err = clGetDeviceInfo(device_id, CL_DEVICE_NAME, size - 1, name, NULL))) goto ExitErrorCL;
+    name[size - 1] = '\0';
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Make a device buffer that persists between kernel calls
+/*
+ * The buffer is taken from the pool, and may be larger than `size`.
+ * The buffer can be passed to `claRunKernel` using the `OCLRESIDENT` flag.
+ * `size` - size of the buffer in bytes.
+ * `buffer` - the resulting buffer. Must be freed using `claFreeBuffer`.
+ * returns 0 on success
+ * */
+OCLAPIErr claMakeBuffer(size_t size, cl_mem *buffer) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (buffer == NULL) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    if ((err = _claPoolAcquire(size, buffer))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    *buffer = NULL;
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Free a buffer made by `claMakeBuffer`
+/*
+ * returns 0 on success
+ * */
+OCLAPIErr claFreeBuffer(cl_mem buffer) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (buffer == NULL) return OCL_NO_ERR;
+    
+    if ((err = _claPoolRelease(buffer))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Copy host memory into a device buffer
+/*
+ * `size` - number of bytes to copy.
+ * returns 0 on success
+ * */
+OCLAPIErr claWriteBuffer(cl_mem buffer, void *src, size_t size) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (buffer == NULL || src == NULL) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    if ((err = clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, size, src, 0, NULL, NULL))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Copy a device buffer into host memory
+/*
+ * `size` - number of bytes to copy.
+ * returns 0 on success
+ * */
+OCLAPIErr claReadBuffer(cl_mem buffer, void *dst, size_t size) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (buffer == NULL || dst == NULL) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    if ((err = clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, size, dst, 0, NULL, NULL))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Copy between two device buffers without passing through the host
+/*
+ * `size` - number of bytes to copy.
+ * returns 0 on success
+ * */
+OCLAPIErr claCopyBuffer(cl_mem src, cl_mem dst, size_t size) {
+    int err;
+    
+    if (!oclinit) { err = OCL_UNINITIALIZED; goto ExitErrorOCL; }
+    if (src == NULL || dst == NULL) { err = OCL_INVALID_ARG; goto ExitErrorOCL; }
+    
+    if ((err = clEnqueueCopyBuffer(queue, src, dst, 0, 0, size, 0, NULL, NULL))) goto ExitErrorCL;
+    
+    return OCL_NO_ERR;
+    
+    ExitErrorOCL:
+    oclerr = err;
+    
+    return oclerr;
+    
+    ExitErrorCL:
+    oclerr = OCL_INTERNAL_OPENCL_ERROR;
+    clerr = err;
+    
+    return oclerr;
+}
+
+// Get the device buffer pool statistics
+/*
+ * `stats` - filled with the current statistics.
+ * `perserve` - if zero, the hit and miss counters are reset, and the high-water mark is
+ * lowered to the bytes currently in use.
+ * returns 0 on success
+ * */
+OCLAPIErr claGetPoolStats(OCLAPIPoolStats *stats, int perserve) {
+    if (stats == NULL) { oclerr = OCL_INVALID_ARG; return oclerr; }
+    
+    *stats = pool.stats;
+    
+    if (!perserve) {
+        pool.stats.hits = 0;
+        pool.stats.misses = 0;
+        pool.stats.high_water_mark = pool.stats.bytes_in_use;
+    }
+    
+    return OCL_NO_ERR;
+}
+
+// Release cached device buffers
+/*
+ * Buffers in use are unaffected.
+ * `max_cached` - number of bytes the pool may keep cached. 0 empties the pool.
+ * returns 0 on success
+ * */
+OCLAPIErr claTrimPool(size_t max_cached) {
+    if (!oclinit) { oclerr = OCL_UNINITIALIZED; return oclerr; }
+    
+    _claPoolTrim(max_cached);
+    
+    return OCL_NO_ERR;
+}
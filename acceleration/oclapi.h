@@ -20,13 +20,29 @@
 
 #define BUILD_LOG_SIZE 32768
 
-enum _OCLAPI_MEM_OP { _OCLCPY, _OCLREAD, _OCLWRITE, _OCLOUT };
+#define BUILD_OPTIONS "-cl-kernel-arg-info -I acceleration/kernels/src"
+
+// Longest path of a program cache file.
+#define PROGRAM_CACHE_PATH_SIZE 4096
+
+// Number of buckets in the kernel registry. Must be a power of two.
+#define KERNEL_TABLE_SIZE 64
+
+// Device buffers are pooled in power of two sized buckets, the smallest
+// being 2^POOL_MIN_BUCKET bytes.
+#define POOL_MIN_BUCKET 8
+#define POOL_BUCKETS 48
+
+enum _OCLAPI_MEM_OP { _OCLCPY, _OCLREAD, _OCLWRITE, _OCLOUT, _OCLRESIDENT };
 
 typedef enum {
     OCLCPY=1 << _OCLCPY, 
     OCLREAD=1 << _OCLREAD, 
     OCLWRITE=1 << _OCLWRITE, 
-    OCLOUT=1 << _OCLOUT 
+    OCLOUT=1 << _OCLOUT,
+    // The pointer argument is a `cl_mem` made by `claMakeBuffer`. It is
+    // used as is, never copied, and never released by `claRunKernel`.
+    OCLRESIDENT=1 << _OCLRESIDENT
 } OCLAPIMem;
 
 typedef enum {
@@ -38,10 +54,43 @@ typedef enum {
     OCL_INTERNAL_OPENCL_ERROR
 } OCLAPIErr;
 
+// Opaque handle to a registered kernel, see `claGetKernel`.
+typedef struct _oclapi_klist *OCLAPIKernel;
+
+// Device buffer pool statistics, see `claGetPoolStats`.
+typedef struct {
+    // Buffer requests served from the pool.
+    size_t hits;
+    // Buffer requests that had to allocate a new buffer.
+    size_t misses;
+    // Bytes handed out and not yet returned to the pool.
+    size_t bytes_in_use;
+    // Highest `bytes_in_use` seen.
+    size_t high_water_mark;
+    // Bytes held by free buffers, waiting to be reused.
+    size_t bytes_cached;
+} OCLAPIPoolStats;
+
 OCLAPIErr claInit();
 OCLAPIErr claCln();
 OCLAPIErr claRegisterFromSrc(const char **src, int kerneln, ...);
+OCLAPIErr claSetProgramCache(const char *dir);
 OCLAPIErr claRunKernel(const char *name, int wdim, size_t *gsz, size_t *lsz, ...);
+OCLAPIErr claRunKernelAsync(const char *name, int wdim, size_t *gsz, size_t *lsz, int waitn, const cl_event *waitlist, cl_event *event, ...);
+OCLAPIKernel claGetKernel(const char *name);
+OCLAPIErr claRunKernelHandle(OCLAPIKernel kernel, int wdim, size_t *gsz, size_t *lsz, ...);
+OCLAPIErr claRunKernelHandleAsync(OCLAPIKernel kernel, int wdim, size_t *gsz, size_t *lsz, int waitn, const cl_event *waitlist, cl_event *event, ...);
+OCLAPIErr claWaitForEvents(int eventn, const cl_event *events);
+OCLAPIErr claReleaseEvent(cl_event event);
+OCLAPIErr claFinish();
+OCLAPIErr claGetDeviceName(char *name, size_t size);
+OCLAPIErr claMakeBuffer(size_t size, cl_mem *buffer);
+OCLAPIErr claFreeBuffer(cl_mem buffer);
+OCLAPIErr claWriteBuffer(cl_mem buffer, void *src, size_t size);
+OCLAPIErr claReadBuffer(cl_mem buffer, void *dst, size_t size);
+OCLAPIErr claCopyBuffer(cl_mem src, cl_mem dst, size_t size);
+OCLAPIErr claGetPoolStats(OCLAPIPoolStats *stats, int perserve);
+OCLAPIErr claTrimPool(size_t max_cached);
 OCLAPIErr claGetError(int perserve);
 cl_int claGetExtendedError(int perserve);
 
@@ -0,0 +1,32 @@
+/* date = October 16th 2026 10:12 am */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+// Shared helpers for the benchmark executables.
+// NOTE: Must be included before any other header, for `clock_gettime`.
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <time.h>
+#endif
+
+// Wall clock time in seconds, from an arbitrary starting point.
+static double benchNow() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+#endif //BENCH_H
@@ -0,0 +1,92 @@
+// Throughput of the tiled `matgemm` kernel against the naive `matprod` kernel,
+// for square matrices. Operands are kept on the device, so only the kernels
+// are measured.
+//
+// Usage: aml-bench-gemm [repetitions]
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <mat.h>
+
+// Must match mat.c.
+#define GEMM_TS 16
+#define GEMM_WPT 4
+
+int main(int argc, char **argv) {
+    int reps = (argc > 1)? atoi(argv[1]) : 10;
+    if (reps < 1) reps = 1;
+    
+    claInit();
+    if (matInit() != MAT_NO_ERROR) {
+        puts("Failed to initialize mat.h");
+        return 1;
+    }
+    
+    unsigned sizes[] = { 16, 64, 128, 256, 512, 1024, 2048 };
+    
+    printf("%6s %14s %14s %8s\n", "size", "matprod GF/s", "matgemm GF/s", "speedup");
+    
+    for (int s = 0; s < sizeof(sizes) / sizeof(unsigned); s++) {
+        unsigned n = sizes[s];
+        size_t bytes = sizeof(double) * n * n;
+        
+        double *host = (double *) malloc(bytes);
+        for (size_t i = 0; i < (size_t) n * n; i++) host[i] = (double) rand() / RAND_MAX;
+        
+        cl_mem a, b, r;
+        claMakeBuffer(bytes, &a);
+        claMakeBuffer(bytes, &b);
+        claMakeBuffer(bytes, &r);
+        claWriteBuffer(a, host, bytes);
+        claWriteBuffer(b, host, bytes);
+        
+        unsigned dimsz[] = { n, n };
+        double flops = 2.0 * n * n * n;
+        
+        // Naive kernel, one output per work item.
+        size_t prod_gz[] = { (size_t) n * n };
+        double start = benchNow();
+        for (int i = 0; i < reps; i++)
+            claRunKernel("matprod", 1, prod_gz, NULL,
+                         a, n * n, OCLREAD | OCLRESIDENT,
+                         b, n * n, OCLREAD | OCLRESIDENT,
+                         dimsz, 2, OCLREAD | OCLCPY,
+                         dimsz, 2, OCLREAD | OCLCPY,
+                         r, n * n, OCLWRITE | OCLRESIDENT,
+                         dimsz, 2, OCLREAD | OCLCPY,
+                         2);
+        double prod_time = (benchNow() - start) / reps;
+        
+        // Tiled kernel.
+        size_t gemm_gz[] = { (n + GEMM_TS - 1) / GEMM_TS * GEMM_TS, (n + GEMM_TS - 1) / GEMM_TS * (GEMM_TS / GEMM_WPT) };
+        size_t gemm_lz[] = { GEMM_TS, GEMM_TS / GEMM_WPT };
+        start = benchNow();
+        for (int i = 0; i < reps; i++)
+            claRunKernel("matgemm", 2, gemm_gz, gemm_lz,
+                         a, n * n, OCLREAD | OCLRESIDENT,
+                         b, n * n, OCLREAD | OCLRESIDENT,
+                         r, n * n, OCLWRITE | OCLRESIDENT,
+                         n, n, n,
+                         0, n, 1, 0, n, 1);
+        double gemm_time = (benchNow() - start) / reps;
+        
+        if (claGetError(0)) {
+            printf("Kernel failed: %s\n", clGetErrorString(claGetExtendedError(0)));
+            return 1;
+        }
+        
+        printf("%6u %14.2f %14.2f %7.2fx\n", n, flops / prod_time * 1e-9, flops / gemm_time * 1e-9, prod_time / gemm_time);
+        
+        claFreeBuffer(a);
+        claFreeBuffer(b);
+        claFreeBuffer(r);
+        free(host);
+    }
+    
+    claCln();
+    
+    return 0;
+}
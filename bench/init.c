@@ -0,0 +1,69 @@
+// Startup time of the mat.h kernels, built from source (cold) vs. loaded
+// from the program cache (warm).
+//
+// Usage: aml-bench-init [cache directory] [repetitions]
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <oclapi.h>
+#include <matkernels.h>
+#include <acceleration/kernels/static_kernels_src.h>
+
+static void checkRegistration(const char *dtype) {
+    if (claGetError(0)) {
+        printf("Registration of the %s kernels failed: %s\n", dtype, clGetErrorString(claGetExtendedError(0)));
+        exit(1);
+    }
+}
+
+// Same registrations `matInit` does, float64 and float32, on a fresh OpenCL API instance.
+static double timeRegistration(const char *cache) {
+    const char *src_kernel = KERNEL_STATIC_SOURCE_MAT_CL;
+    const char *src_kernel32 = _matKernelSource(MAT_FLOAT32_HEADER, src_kernel);
+    
+    claInit();
+    claSetProgramCache(cache);
+    
+    double start = benchNow();
+    claRegisterFromSrc(&src_kernel, MAT_KERNEL_COUNT, MAT_KERNEL_NAMES(""));
+    double mid = benchNow();
+    checkRegistration("float64");
+    
+    double start32 = benchNow();
+    claRegisterFromSrc(&src_kernel32, MAT_KERNEL_COUNT, MAT_KERNEL_NAMES("_f32"));
+    double end = benchNow();
+    checkRegistration("float32");
+    free((void *) src_kernel32);
+    
+    claCln();
+    
+    return (mid - start) + (end - start32);
+}
+
+int main(int argc, char **argv) {
+    const char *cache = (argc > 1)? argv[1] : "aml_bench_cache";
+    int reps = (argc > 2)? atoi(argv[2]) : 5;
+    if (reps < 1) reps = 1;
+    
+    double cold = 0;
+    for (int i = 0; i < reps; i++) cold += timeRegistration(NULL);
+    cold /= reps;
+    
+    // Populates the cache, unless a previous run already did.
+    double first = timeRegistration(cache);
+    
+    double warm = 0;
+    for (int i = 0; i < reps; i++) warm += timeRegistration(cache);
+    warm /= reps;
+    
+    printf("cache directory: %s\n", cache);
+    printf("cold (source build):  %10.3f ms\n", cold * 1e3);
+    printf("first cached run:     %10.3f ms\n", first * 1e3);
+    printf("warm (cached binary): %10.3f ms\n", warm * 1e3);
+    printf("speedup:              %10.2fx\n", cold / warm);
+    
+    return 0;
+}
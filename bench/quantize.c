@@ -0,0 +1,176 @@
+// Latency and accuracy of a `Machine` quantized to int8 (see `mlMachineQuantize`),
+// against the same machine in float64 and float32, on the CPU. Accuracy, of
+// both float32 and int8, is the error of the outputs relative to float64, and
+// how often their largest output (the predicted class) is the same.
+//
+// Usage: aml-bench-quantize [repetitions] [width]
+
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ml.h>
+
+#define LAYERS 3
+#define INPUTS 16
+#define OUTPUTS 10
+#define CALIBRATION 64
+#define TESTS 256
+
+static Tensor* randomTensor(unsigned ndims, unsigned *dims, double range) {
+    Tensor *t = matMakeTensor(ndims, dims, NULL);
+    t->data = (double *) matTensorAlloc(t, sizeof(double) * t->literal_size);
+    for (size_t i = 0; i < t->literal_size; i++) t->data[i] = range * (2.0 * rand() / RAND_MAX - 1);
+
+    return t;
+}
+
+// FullyConnected, Bias and ReLu layers, with a linear last one, the same for a same `seed`.
+static Machine makeMachine(unsigned width, unsigned seed) {
+    srand(seed);
+
+    Layer **layers = (Layer **) malloc(sizeof(Layer *) * 3 * LAYERS);
+    int n = 0;
+    unsigned in = INPUTS;
+    for (int i = 0; i < LAYERS; i++) {
+        unsigned out = (i == LAYERS - 1)? OUTPUTS : width;
+        layers[n++] = mlMakeLayer(FullyConnected, NULL, randomTensor(2, (unsigned []) { in, out }, sqrt(6.0 / (in + out))));
+        layers[n++] = mlMakeLayer(Bias, NULL, randomTensor(1, &out, 0.1));
+        if (i < LAYERS - 1) layers[n++] = mlMakeLayer(ReLu, NULL, NULL);
+        in = out;
+    }
+
+    return mlMakeMachine(n, layers);
+}
+
+static void freeMachine(Machine machine) {
+    mlFreeMachineD(machine);
+    free(machine.layers);
+}
+
+// Seconds per feed forward of `input`.
+static double timeMachine(Machine machine, Tensor *input, int reps) {
+    Tensor *output = NULL;
+    // Warm up.
+    mlMachineFeedForward(machine, input, &output);
+    matFreeTensor(&output);
+
+    double start = benchNow();
+    for (int i = 0; i < reps; i++) {
+        mlMachineFeedForward(machine, input, &output);
+        matFreeTensor(&output);
+    }
+
+    return (benchNow() - start) / reps;
+}
+
+// The `i`th element of an output, in either compute dtype.
+static double outputAt(Tensor *t, size_t i) {
+    return (t->dtype == MAT_FLOAT32)? t->data32[i] : t->data[i];
+}
+
+static int argmax(Tensor *t) {
+    int best = 0;
+    for (int i = 1; i < t->literal_size; i++) best = (outputAt(t, i) > outputAt(t, best))? i : best;
+
+    return best;
+}
+
+// Errors of outputs against the float64 ones, over the test inputs.
+typedef struct {
+    double max_error, sum_error;
+    int agree;
+} Accuracy;
+
+static void accumulate(Accuracy *acc, Tensor *y, Tensor *output) {
+    for (int j = 0; j < y->literal_size; j++) {
+        double e = fabs(outputAt(output, j) - y->data[j]);
+        acc->max_error = fmax(acc->max_error, e);
+        acc->sum_error += e;
+    }
+    acc->agree += argmax(y) == argmax(output);
+}
+
+static void printAccuracy(const char *name, Accuracy acc, double max_output) {
+    printf("%s vs float64: max error %.3g (%.3g%% of the largest output), mean error %.3g, same class %.1f%%\n",
+           name, acc.max_error, 100 * acc.max_error / max_output, acc.sum_error / (TESTS * OUTPUTS), 100.0 * acc.agree / TESTS);
+}
+
+int main(int argc, char **argv) {
+    int reps = (argc > 1)? atoi(argv[1]) : 20;
+    if (reps < 1) reps = 1;
+    unsigned width = (argc > 2)? atoi(argv[2]) : 1024;
+    if (width < 1) width = 1024;
+
+    claInit();
+    matInit();
+    // CPU only nodes.
+    matSetBackend(MAT_BACKEND_CPU);
+
+    Machine f64 = makeMachine(width, 1);
+    Machine f32 = makeMachine(width, 1);
+    Machine q8 = makeMachine(width, 1);
+    mlMachineCast(f32, MAT_FLOAT32);
+
+    srand(2);
+    Tensor calibration[CALIBRATION];
+    for (int i = 0; i < CALIBRATION; i++) {
+        Tensor *t = randomTensor(1, (unsigned []) { INPUTS }, 1);
+        calibration[i] = *t;
+        free(t);
+    }
+
+    double start = benchNow();
+    MLErr error = mlMachineQuantize(q8, CALIBRATION, calibration);
+    double quantize_time = benchNow() - start;
+    if (error != ML_NO_ERR) {
+        printf("Quantization failed: %s\n", mlGetErrorString(error));
+        return 1;
+    }
+
+    // Accuracy on inputs not calibrated on.
+    Accuracy acc32 = { 0 }, acc8 = { 0 };
+    double max_output = 0;
+    for (int i = 0; i < TESTS; i++) {
+        Tensor *x = randomTensor(1, (unsigned []) { INPUTS }, 1);
+        Tensor *y = NULL, *y32 = NULL, *yq = NULL;
+        mlMachineFeedForward(f64, x, &y);
+        mlMachineFeedForward(f32, x, &y32);
+        mlMachineFeedForward(q8, x, &yq);
+
+        for (int j = 0; j < y->literal_size; j++) max_output = fmax(max_output, fabs(y->data[j]));
+        accumulate(&acc32, y, y32);
+        accumulate(&acc8, y, yq);
+
+        matFreeTensor(&x);
+        matFreeTensor(&y);
+        matFreeTensor(&y32);
+        matFreeTensor(&yq);
+    }
+
+    printf("%u x %u hidden layers, CPU ISA %d, quantized in %.3f ms\n", width, width, matGetCpuIsa(), quantize_time * 1e3);
+    printAccuracy("float32", acc32, max_output);
+    printAccuracy("int8", acc8, max_output);
+
+    printf("%6s %12s %12s %12s %10s %10s\n", "batch", "float64 ms", "float32 ms", "int8 ms", "vs f64", "vs f32");
+    unsigned batches[] = { 1, 8, 64 };
+    for (int b = 0; b < sizeof(batches) / sizeof(unsigned); b++) {
+        Tensor *input = randomTensor(batches[b] == 1? 1 : 2, (unsigned []) { INPUTS, batches[b] }, 1);
+
+        double t64 = timeMachine(f64, input, reps);
+        double t32 = timeMachine(f32, input, reps);
+        double tq = timeMachine(q8, input, reps);
+        printf("%6u %12.3f %12.3f %12.3f %9.2fx %9.2fx\n", batches[b], t64 * 1e3, t32 * 1e3, tq * 1e3, t64 / tq, t32 / tq);
+
+        matFreeTensor(&input);
+    }
+
+    for (int i = 0; i < CALIBRATION; i++) matFreeTensorD(calibration[i]);
+    freeMachine(f64);
+    freeMachine(f32);
+    freeMachine(q8);
+
+    return 0;
+}
@@ -1,8 +1,12 @@
 #include "mat.h"
+#include "matcpu.h"
+#include "matkernels.h"
+#include "matprofile.h"
 #include "../acceleration/oclapi.h"
 
 #include <acceleration/kernels/static_kernels_src.h>
 
+#include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,42 +14,245 @@
 #define MAX(a, b) (((a) > (b))? (a) : (b))
 #define MIN(a, b) (((a) < (b))? (a) : (b))
 
-bool matinit = false;
+// Expands to the three `claRunKernel` parameters of a Tensor's data. Resident
+// Tensors pass their device buffer, which is neither copied in nor out.
+// Views pass all the data of their base, kernels index it through strides.
+#define MAT_KERNEL_DATA(t, flags) \
+    (matIsTensorResident(t)? (void *) matTensorStorage(t)->_device_data : (void *) (t)->data), \
+    (int) matTensorStorage(t)->literal_size, \
+    (matIsTensorResident(t)? (((flags) & ~(OCLCPY | OCLOUT)) | OCLRESIDENT) : (flags))
+
+// Runs a kernel. Kernels writing to a resident result are not waited for, since the
+// result is only read back through `matTensorToHost`, which the in-order queue
+// orders after them.
+#define MAT_RUN_KERNEL(resident, kernel, wdim, gz, lz, ...) \
+    ((resident)? claRunKernelHandleAsync(kernel, wdim, gz, lz, 0, NULL, NULL, __VA_ARGS__) : \
+                 claRunKernelHandle(kernel, wdim, gz, lz, __VA_ARGS__))
+
+// Tile size of the `matgemm` kernel, and the number of outputs per work item.
+// NOTE: Must match the defines in mat.cl.
+#define GEMM_TS 16
+#define GEMM_WPT 4
+
+// Work-group size of the `reduce` kernel, and the elements each work item reduces per step.
+#define REDUCE_WG 256
+#define REDUCE_WIDTH 4
+
+// Reduction operations of the `reduce` and `matreduce` kernels.
+// NOTE: Must match the defines in mat.cl.
+enum { MAT_REDUCE_SUM, MAT_REDUCE_MAX };
+
+// Element-wise operations of `_matSTDLinearCall`, indexing its CPU functions.
+enum { MAT_BINARY_ADD, MAT_BINARY_SUB, MAT_BINARY_MULT };
 
+bool matinit = false;
+// Were the kernels registered, the CPU backend is always available.
+static bool matdevice = false;
+// Global backend, see `matSetBackend`.
+static MatrixBackend matbackend = MAT_BACKEND_AUTO;
+// Used until calibrated. Small operations are faster on the host, since the
+// device pays for the launch and both transfers.
+static MatrixCrossover matcrossover = {
+    .elementwise = 1 << 20,
+    .prod = 1 << 21,
+    .dot = 1 << 21,
+    .sum = 1 << 20
+};
+
+// Kernel handles of a dtype, looked up once in `matInit`.
+typedef struct {
+    // Did the program of the dtype build, e.g. a device without fp64 only has float32 kernels.
+    bool built;
+    OCLAPIKernel matmul;
+    OCLAPIKernel matadd;
+    OCLAPIKernel matsub;
+    OCLAPIKernel matprod;
+    OCLAPIKernel matdot;
+    OCLAPIKernel matgemm;
+    OCLAPIKernel matgather;
+    OCLAPIKernel mataddv;
+    OCLAPIKernel matsubv;
+    OCLAPIKernel matmulv;
+    OCLAPIKernel matreduce;
+    OCLAPIKernel reduce;
+    OCLAPIKernel mataxpy;
+    OCLAPIKernel matmomentum;
+    OCLAPIKernel matrmsprop;
+    OCLAPIKernel matadam;
+    OCLAPIKernel matactivation;
+    OCLAPIKernel matactivationderive;
+    OCLAPIKernel matdense;
+    OCLAPIKernel matdenseweights;
+    OCLAPIKernel matdenseinput;
+    OCLAPIKernel matwiden;
+    OCLAPIKernel matnarrow;
+    OCLAPIKernel matqprod;
+} _MatKernels;
+
+// Indexed by `MatrixDtype`, storage only dtypes have no kernels of their own.
+static _MatKernels kernels[MAT_COMPUTE_DTYPES];
+
+
+#define MAT_GET_KERNELS(k, suffix) \
+    do { \
+        (k).matmul = claGetKernel("matmul" suffix); \
+        (k).matadd = claGetKernel("matadd" suffix); \
+        (k).matsub = claGetKernel("matsub" suffix); \
+        (k).matprod = claGetKernel("matprod" suffix); \
+        (k).matdot = claGetKernel("matdot" suffix); \
+        (k).matgemm = claGetKernel("matgemm" suffix); \
+        (k).matgather = claGetKernel("matgather" suffix); \
+        (k).mataddv = claGetKernel("mataddv" suffix); \
+        (k).matsubv = claGetKernel("matsubv" suffix); \
+        (k).matmulv = claGetKernel("matmulv" suffix); \
+        (k).matreduce = claGetKernel("matreduce" suffix); \
+        (k).reduce = claGetKernel("reduce" suffix); \
+        (k).mataxpy = claGetKernel("mataxpy" suffix); \
+        (k).matmomentum = claGetKernel("matmomentum" suffix); \
+        (k).matrmsprop = claGetKernel("matrmsprop" suffix); \
+        (k).matadam = claGetKernel("matadam" suffix); \
+        (k).matactivation = claGetKernel("matactivation" suffix); \
+        (k).matactivationderive = claGetKernel("matactivationderive" suffix); \
+        (k).matdense = claGetKernel("matdense" suffix); \
+        (k).matdenseweights = claGetKernel("matdenseweights" suffix); \
+        (k).matdenseinput = claGetKernel("matdenseinput" suffix); \
+        (k).matwiden = claGetKernel("matwiden" suffix); \
+        (k).matnarrow = claGetKernel("matnarrow" suffix); \
+        (k).matqprod = claGetKernel("matqprod" suffix); \
+        (k).built = !claGetError(1); \
+    } while (0)
+
+// Initialize the CPU backend, and the device backend if `oclapi` is initialized.
+/*
+ * Builds the kernels once per dtype. Without a device, or for a dtype whose
+ * kernels failed to build, operations run on the CPU.
+ * */
 MatrixErr matInit() {
     if (matinit) return MAT_NO_ERROR;
 
+    _matCpuInit();
+
     // Source code defined in "acceleration/kernels/static_kernels_src.h"
     const char *src_kernel = KERNEL_STATIC_SOURCE_MAT_CL;
     
-    claRegisterFromSrc(&src_kernel, 6, "matmul", "matadd", "matsub", "matprod", "matdot", "sum");
-    if (claGetError(1)) return MAT_INITIALIZATION_FAILED;
+    claRegisterFromSrc(&src_kernel, MAT_KERNEL_COUNT, MAT_KERNEL_NAMES(""));
+    if (!claGetError(1)) MAT_GET_KERNELS(kernels[MAT_FLOAT64], "");
+    // The float32 kernels are checked on their own.
+    claGetError(0);
+
+    const char *src_kernel32 = _matKernelSource(MAT_FLOAT32_HEADER, KERNEL_STATIC_SOURCE_MAT_CL);
+    claRegisterFromSrc(&src_kernel32, MAT_KERNEL_COUNT, MAT_KERNEL_NAMES("_f32"));
+    if (!claGetError(1)) MAT_GET_KERNELS(kernels[MAT_FLOAT32], "_f32");
+    free((void *) src_kernel32);
+
+    matdevice = kernels[MAT_FLOAT64].built || kernels[MAT_FLOAT32].built;
+    if (!matdevice) fputs("Failed to initialize the mat.h device backend, running on the CPU.\n", stderr);
+    else if (!kernels[MAT_FLOAT64].built) fputs("No float64 mat.h kernels, running float64 on the CPU.\n", stderr);
     
     matinit = true;
+
+    // Load or make the calibration profile, if one is set.
+    if (_matHasDevice()) _matProfileInit();
     
     return MAT_NO_ERROR;
 }
 
-Tensor* matMakeTensor(unsigned ndims, unsigned *dims, MatrixErr *e) {
-    Tensor *t = (Tensor *) malloc(sizeof(Tensor));
-    
-    t->ndims = ndims;
+// Can float64 operations, which the calibration measures, run on the device.
+int _matHasDevice() {
+    return matinit && kernels[MAT_FLOAT64].built;
+}
 
-    unsigned *dimsz = ndims? (unsigned *) malloc(sizeof(unsigned) * ndims) :\
-                      (unsigned *) malloc(sizeof(unsigned));
-    if (ndims == 0) dimsz[0] = 1;
+// Set the backend operations run on, unless given one explicitly.
+/*
+ * returns MAT_UNINITIALIZED if the device is requested, but not available.
+ * */
+MatrixErr matSetBackend(MatrixBackend backend) {
+    if (backend == MAT_BACKEND_DEVICE && !matdevice) return MAT_UNINITIALIZED;
+    matbackend = backend;
 
-    int literal_size = 1;
+    return MAT_NO_ERROR;
+}
+
+MatrixBackend matGetBackend() {
+    return matbackend;
+}
+
+MatrixCrossover matGetCrossover() {
+    return matcrossover;
+}
+
+// Override the crossover sizes, e.g. with ones from `matCalibrate` on another run.
+void matSetCrossover(MatrixCrossover crossover) {
+    matcrossover = crossover;
+}
+
+// Is the device copy the only up to date one.
+static inline int _matIsDeviceDirty(Tensor *t) {
+    return matIsTensorResident(t) && matTensorStorage(t)->_sync == MAT_DEVICE_DIRTY;
+}
+
+// Should an operation of `work` size run on the device, when not told otherwise.
+/*
+ * Operands only valid on the device keep the operation there, anything else
+ * would have to read them back first.
+ * */
+static inline int _matPreferDevice(size_t work, size_t crossover, Tensor *t1, Tensor *t2) {
+    if (_matIsDeviceDirty(t1) || _matIsDeviceDirty(t2)) return 1;
+    return work >= crossover;
+}
+
+MatrixCpuIsa matGetCpuIsa() {
+    return _matCpuGetIsa();
+}
+
+// Force the CPU backend to a narrower instruction set, e.g. for validation.
+/*
+ * returns MAT_INITIALIZATION_FAILED if the CPU doesn't support it.
+ * */
+MatrixErr matSetCpuIsa(MatrixCpuIsa isa) {
+    return _matCpuSetIsa(isa)? MAT_INITIALIZATION_FAILED : MAT_NO_ERROR;
+}
+
+// Pick the backend of a single operation on Tensors of `dtype`.
+/*
+ * `prefer_device` decides when neither the call nor the global backend do.
+ * */
+static MatrixErr _matResolveBackend(MatrixBackend requested, int prefer_device, MatrixDtype dtype, MatrixBackend *on) {
+    if (matIsDtypeStorage(dtype)) return MAT_DTYPE_UNSUPPORTED;
+    bool device = matdevice && kernels[dtype].built;
+
+    if (requested == MAT_BACKEND_AUTO) requested = matbackend;
+    if (requested == MAT_BACKEND_AUTO)
+        requested = (device && prefer_device)? MAT_BACKEND_DEVICE : MAT_BACKEND_CPU;
+    if (requested == MAT_BACKEND_DEVICE && !device) return MAT_UNINITIALIZED;
+
+    *on = requested;
+
+    return MAT_NO_ERROR;
+}
+
+// Make a Tensor without data, from the current arena if one is set (see `matSetArena`).
+Tensor* matMakeTensor(unsigned ndims, unsigned *dims, MatrixErr *e) {
     for (int i = 0; i < ndims; i++) {
         if (dims[i] == 0) {
-            free(t);
-            free(dimsz);
-
             if (e != NULL) *e = MAT_DIMENSION_ZERO;
             
             return NULL;
         }
+    }
+
+    MatrixArena *arena = matGetArena();
+    Tensor *t = arena? (Tensor *) matArenaAlloc(arena, sizeof(Tensor)) : (Tensor *) malloc(sizeof(Tensor));
+    
+    t->ndims = ndims;
+    t->_arena = arena;
+
+    unsigned *dimsz = ndims? (unsigned *) matTensorAlloc(t, sizeof(unsigned) * ndims) :\
+                      (unsigned *) matTensorAlloc(t, sizeof(unsigned));
+    if (ndims == 0) dimsz[0] = 1;
 
+    int literal_size = 1;
+    for (int i = 0; i < ndims; i++) {
         dimsz[i] = dims[i];
         literal_size *= dims[i];
     }
@@ -53,12 +260,60 @@ Tensor* matMakeTensor(unsigned ndims, unsigned *dims, MatrixErr *e) {
     t->dimsz = dimsz;
     t->literal_size = literal_size;
     t->data = NULL;
+    t->dtype = MAT_FLOAT64;
+    t->stride = NULL;
+    t->offset = 0;
+    t->_base = NULL;
+    t->_device_data = NULL;
+    t->_sync = MAT_SYNCED;
 
     if (e != NULL) *e = MAT_NO_ERROR;
 
     return t;
 }
 
+// Give a Tensor without data its own data, of `dtype`.
+static inline void _matAllocData(Tensor *t, MatrixDtype dtype) {
+    t->dtype = dtype;
+    t->data = (double *) matTensorAlloc(t, matDtypeSize(dtype) * t->literal_size);
+}
+
+// Address of element `i` of the host data.
+static inline void* _matElementAt(Tensor *t, size_t i) {
+    return (char *) t->data + i * matDtypeSize(t->dtype);
+}
+
+// Element `i` of the host data, whatever the dtype.
+static inline double _matGetElement(Tensor *t, size_t i) {
+    if (t->dtype == MAT_FLOAT64) return t->data[i];
+    if (t->dtype == MAT_FLOAT32) return t->data32[i];
+
+    float v;
+    _matCpuWiden(_matElementAt(t, i), t->dtype, &v, 1);
+    return v;
+}
+
+static inline void _matSetElement(Tensor *t, size_t i, double v) {
+    if (t->dtype == MAT_FLOAT64) t->data[i] = v;
+    else _matCpuNarrow(&(float) { (float) v }, _matElementAt(t, i), t->dtype, 1);
+}
+
+// A scalar of `dtype`, see `matMakeScalar`.
+static Tensor* _matMakeScalarOf(double s, MatrixDtype dtype, MatrixErr *e) {
+    Tensor *t = matMakeTensor(0, NULL, e);
+    if (t != NULL) {
+        _matAllocData(t, dtype);
+        _matSetElement(t, 0, s);
+    }
+
+    return t;
+}
+
+// Do the Tensors given share the dtype of `t`.
+static inline int _matSameDtype(Tensor *t, Tensor *t2, Tensor *t3) {
+    return (t2 == NULL || t2->dtype == t->dtype) && (t3 == NULL || t3->dtype == t->dtype);
+}
+
 void matTensorPrint(Tensor *t) {
     {
         MatrixErr err;
@@ -67,6 +322,8 @@ void matTensorPrint(Tensor *t) {
             return;
         }
     }
+
+    matTensorToHost(t);
     
     unsigned *ind = calloc(t->ndims, sizeof(unsigned));
     // For any even dimension, print linearly. Including 0.
@@ -88,7 +345,7 @@ void matTensorPrint(Tensor *t) {
         }
 
         for (int even = 0; even < even_iter; even++) {
-            printed_even += printf("%#.6g%s", *matTensorAtI(t, ind, NULL), (ind[0] == t->dimsz[0] - 1)? "" : ", ");
+            printed_even += printf("%#.6g%s", matTensorGetI(t, ind, NULL), (ind[0] == t->dimsz[0] - 1)? "" : ", ");
             
             // Increment and carry index.
             ind[0]++;
@@ -122,6 +379,161 @@ void matTensorPrint(Tensor *t) {
     }
 }
 
+// Give an operation result a device buffer, to be written by the kernel.
+static MatrixErr _matMakeResidentResult(Tensor *res) {
+    if (claMakeBuffer(matDtypeSize(res->dtype) * res->literal_size, &res->_device_data)) return MAT_KERNEL_FAILURE;
+    res->_sync = MAT_DEVICE_DIRTY;
+
+    return MAT_NO_ERROR;
+}
+
+// The result of an operation shaped `dims`: `into` if given, otherwise a new Tensor of `dtype`.
+/*
+ * `into` must be contiguous with the same number of elements, and keeps its own
+ * shape. It must have the dtype of the result, unless it has no data yet.
+ * A resident `into` is written on the device, see `_matWroteResult`.
+ * */
+static MatrixErr _matMakeResult(Tensor *into, unsigned ndims, unsigned *dims, MatrixDtype dtype, Tensor **res) {
+    if (into == NULL) {
+        MatrixErr e;
+        if ((*res = matMakeTensor(ndims, dims, &e)) == NULL) return e;
+        _matAllocData(*res, dtype);
+
+        return MAT_NO_ERROR;
+    }
+
+    size_t size = 1;
+    for (int i = 0; i < ndims; i++) size *= dims[i];
+    if (!matIsTensorContiguous(into) || into->literal_size != size) return MAT_DIMENSION_MISTMATCH;
+    if (into->data == NULL) _matAllocData(into, dtype);
+    else if (into->dtype != dtype) return MAT_DTYPE_MISMATCH;
+
+    *res = into;
+
+    return MAT_NO_ERROR;
+}
+
+// Mark which copy of a resident `into` result was written.
+static inline void _matWroteResult(Tensor *into, MatrixBackend on) {
+    if (into == NULL || !matIsTensorResident(into)) return;
+    matTensorStorage(into)->_sync = (on == MAT_BACKEND_CPU)? MAT_HOST_DIRTY : MAT_DEVICE_DIRTY;
+}
+
+// Upload pending host changes of a resident operand.
+static inline MatrixErr _matSyncOperand(Tensor *t) {
+    return matIsTensorResident(t)? matTensorToDevice(t) : MAT_NO_ERROR;
+}
+
+// Strides of a Tensor, the contiguous ones if it has none.
+/*
+ * `stride` must have room for MAX(ndims, 1) elements. Scalars get a stride of 0.
+ * */
+static void _matTensorStrides(Tensor *t, unsigned *stride) {
+    stride[0] = 0;
+
+    unsigned acc = 1;
+    for (int i = 0; i < t->ndims; i++) {
+        stride[i] = (t->stride != NULL)? t->stride[i] : acc;
+        acc *= t->dimsz[i];
+    }
+}
+
+// A view of `t` shaped `dims`, reading its data through `stride` from `offset`.
+/*
+ * Canonical strides from offset 0 make a contiguous view.
+ * */
+static Tensor* _matMakeView(Tensor *t, unsigned ndims, unsigned *dims, unsigned *stride, size_t offset, MatrixErr *e) {
+    Tensor *v = matMakeTensor(ndims, dims, e);
+    if (v == NULL) return NULL;
+
+    Tensor *storage = matTensorStorage(t);
+    v->data = storage->data;
+    v->dtype = storage->dtype;
+    v->_base = storage;
+    v->offset = offset;
+
+    int contiguous = offset == 0;
+    unsigned acc = 1;
+    for (int i = 0; contiguous && i < ndims; i++) {
+        contiguous = stride[i] == acc || dims[i] == 1;
+        acc *= dims[i];
+    }
+
+    if (!contiguous) {
+        v->stride = (unsigned *) matTensorAlloc(v, sizeof(unsigned) * (ndims? ndims : 1));
+        memcpy(v->stride, stride, sizeof(unsigned) * (ndims? ndims : 1));
+    }
+
+    return v;
+}
+
+// Copy the (possibly strided) host data of `t`, shaped `dimsz` and read through `stride`, to `r`.
+static void _matGatherHost(Tensor *t, const unsigned *stride, unsigned ndims, const unsigned *dimsz, void *r) {
+    if (t->dtype == MAT_FLOAT64) _matCpuGather(t->data + t->offset, stride, ndims, dimsz, (double *) r);
+    else if (t->dtype == MAT_FLOAT32) _matCpuGather32(t->data32 + t->offset, stride, ndims, dimsz, (float *) r);
+    else _matCpuGatherBytes((char *) t->data8 + t->offset * matDtypeSize(t->dtype), matDtypeSize(t->dtype), stride, ndims, dimsz, r);
+}
+
+// Contiguous copy of a (possibly strided) Tensor.
+/*
+ * On the device, the copy is resident. Storage only dtypes are copied on the host.
+ * `into` - the copy, or NULL to make a new one, see `_matMakeResult`. It must not
+ * share data with `t`.
+ * */
+static Tensor* _matGatherInto(Tensor *t, Tensor *into, MatrixBackend on, MatrixErr *e) {
+    Tensor *r;
+    {
+        MatrixErr err = _matMakeResult(into, t->ndims, t->dimsz, t->dtype, &r);
+        if (err != MAT_NO_ERROR) {
+            if (e != NULL) *e = err;
+
+            return NULL;
+        }
+    }
+
+    unsigned nd = t->ndims? t->ndims : 1;
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * nd);
+    _matTensorStrides(t, stride);
+
+    if (matIsDtypeStorage(t->dtype)) on = MAT_BACKEND_CPU;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(t);
+        if (!kernel_error) _matGatherHost(t, stride, t->ndims, t->dimsz, r->data);
+    } else {
+        kernel_error = _matSyncOperand(t);
+        if (!kernel_error && into == NULL && matIsTensorResident(t)) kernel_error = _matMakeResidentResult(r);
+
+        // Indexed by the shape of `t`, whatever the shape of `into`.
+        size_t gz[] = { r->literal_size };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(r), kernels[t->dtype].matgather, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t, OCLREAD | OCLCPY),
+                                          (int) t->offset, stride, nd, OCLREAD | OCLCPY,
+                                          MAT_KERNEL_DATA(r, OCLWRITE | OCLOUT),
+                                          (int) t->ndims, t->dimsz, nd, OCLREAD | OCLCPY);
+        kernel_error = kernel_error || claGetError(1);
+    }
+    free(stride);
+
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(&r);
+        if (e != NULL) *e = MAT_KERNEL_FAILURE;
+
+        return NULL;
+    }
+
+    _matWroteResult(into, on);
+    if (e != NULL) *e = MAT_NO_ERROR;
+
+    return r;
+}
+
+static inline Tensor* _matGather(Tensor *t, MatrixBackend on, MatrixErr *e) {
+    return _matGatherInto(t, NULL, on, e);
+}
+
 Tensor* matTensorDeepCopy(Tensor *t, MatrixErr *e) {
     if (t == NULL) {
         if (e != NULL) *e = MAT_NULL_PTR;
@@ -129,13 +541,42 @@ Tensor* matTensorDeepCopy(Tensor *t, MatrixErr *e) {
         return NULL;
     }
 
+    // Views are gathered into a contiguous copy, wherever their data is up to date.
+    if (!matIsTensorContiguous(t))
+        return _matGather(t, _matIsDeviceDirty(t)? MAT_BACKEND_DEVICE : MAT_BACKEND_CPU, e);
+
     Tensor *r;
-    if (matIsTensorScalar(t))
-        r = matMakeScalar(t->data[0], e);
+    size_t bytes = matDtypeSize(t->dtype) * t->literal_size;
+    if (matIsTensorResident(t)) {
+        Tensor *storage = matTensorStorage(t);
+        r = matMakeTensor(t->ndims, t->dimsz, e);
+        _matAllocData(r, t->dtype);
+        if (claMakeBuffer(bytes, &r->_device_data)) {
+            matFreeTensor(&r);
+            if (e != NULL) *e = MAT_KERNEL_FAILURE;
+
+            return NULL;
+        }
+
+        // Copy whichever side holds the latest data.
+        if (storage->_sync == MAT_DEVICE_DIRTY) {
+            if (claCopyBuffer(storage->_device_data, r->_device_data, bytes)) {
+                matFreeTensor(&r);
+                if (e != NULL) *e = MAT_KERNEL_FAILURE;
+
+                return NULL;
+            }
+            r->_sync = MAT_DEVICE_DIRTY;
+        } else {
+            memcpy((void *) r->data, (void *) t->data, bytes);
+            r->_sync = MAT_HOST_DIRTY;
+        }
+    } else if (matIsTensorScalar(t))
+        r = _matMakeScalarOf(_matGetElement(t, 0), t->dtype, e);
     else {
         r = matMakeTensor(t->ndims, t->dimsz, e);
-        r->data = (double *) malloc(sizeof(double) * r->literal_size);
-        memcpy((void *) r->data, (void *) t->data, t->literal_size * sizeof(double));
+        _matAllocData(r, t->dtype);
+        memcpy((void *) r->data, (void *) t->data, bytes);
     }
 
     if (e != NULL) *e = MAT_NO_ERROR;
@@ -143,6 +584,143 @@ Tensor* matTensorDeepCopy(Tensor *t, MatrixErr *e) {
     return r;
 }
 
+// Convert `n` elements of host data between dtypes.
+/*
+ * Any conversion but float64 to float32 and back goes through float32, in chunks.
+ * */
+static void _matConvertData(const void *src, MatrixDtype from, void *dst, MatrixDtype to, size_t n) {
+    if (from == to) memcpy(dst, src, matDtypeSize(to) * n);
+    else if (from == MAT_FLOAT32) _matCpuNarrow((const float *) src, dst, to, n);
+    else if (to == MAT_FLOAT32) _matCpuWiden(src, from, (float *) dst, n);
+    else {
+        float chunk[256];
+        for (size_t i = 0; i < n; i += 256) {
+            size_t m = MIN(256, n - i);
+            _matCpuWiden((const char *) src + i * matDtypeSize(from), from, chunk, m);
+            _matCpuNarrow(chunk, (char *) dst + i * matDtypeSize(to), to, m);
+        }
+    }
+}
+
+// Convert the contiguous `src` to `dst`, with as many elements and another dtype.
+/*
+ * Runs on the device when `src` is resident and one of the dtypes is a 16-bit one,
+ * with the `matwiden` or `matnarrow` kernel of the other. Otherwise on the host.
+ * `resident` - make `dst` resident if it isn't, otherwise a resident `dst` is
+ * written where the conversion runs, see `_matWroteResult`.
+ * */
+static MatrixErr _matConvertTensor(Tensor *src, Tensor *dst, int resident) {
+    int widen = matIsDtypeStorage(src->dtype);
+    MatrixDtype storage = widen? src->dtype : dst->dtype;
+    MatrixDtype real = widen? dst->dtype : src->dtype;
+
+    MatrixBackend on = MAT_BACKEND_CPU;
+    if ((storage == MAT_FLOAT16 || storage == MAT_BFLOAT16) && !matIsDtypeStorage(real) &&
+        _matResolveBackend(MAT_BACKEND_AUTO, matIsTensorResident(src), real, &on) != MAT_NO_ERROR)
+        on = MAT_BACKEND_CPU;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(src);
+        if (!kernel_error) {
+            _matConvertData(src->data, src->dtype, dst->data, dst->dtype, dst->literal_size);
+            if (resident && !matIsTensorResident(dst)) kernel_error = matTensorToDevice(dst);
+            else _matWroteResult(dst, on);
+        }
+    } else {
+        kernel_error = _matSyncOperand(src);
+        if (!kernel_error && resident && !matIsTensorResident(dst)) kernel_error = _matMakeResidentResult(dst);
+
+        size_t gz[] = { dst->literal_size };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(dst), widen? kernels[real].matwiden : kernels[real].matnarrow,
+                                          1, gz, NULL,
+                                          MAT_KERNEL_DATA(src, OCLREAD | OCLCPY), (int) storage,
+                                          MAT_KERNEL_DATA(dst, OCLWRITE | OCLOUT));
+        kernel_error = kernel_error || claGetError(1);
+        if (!kernel_error) _matWroteResult(dst, on);
+    }
+
+    return kernel_error? MAT_KERNEL_FAILURE : MAT_NO_ERROR;
+}
+
+// A contiguous copy of the Tensor in another dtype.
+/*
+ * The copy is resident if `t` is (see `matTensorToDevice`). Conversions to and from
+ * the storage only dtypes of a resident Tensor run on the device, others on the host.
+ * Narrower dtypes round to nearest, ties to even.
+ * */
+Tensor* matTensorCast(Tensor *t, MatrixDtype dtype, MatrixErr *e) {
+    if (matCheckTensor(t, e) != MAT_NO_ERROR) return NULL;
+    if (t->dtype == dtype) return matTensorDeepCopy(t, e);
+
+    Tensor *src = t;
+    if (!matIsTensorContiguous(t) && (src = matTensorDeepCopy(t, e)) == NULL) return NULL;
+
+    MatrixErr err;
+    Tensor *r = matMakeTensor(t->ndims, t->dimsz, &err);
+    if (r != NULL) {
+        _matAllocData(r, dtype);
+        if ((err = _matConvertTensor(src, r, matIsTensorResident(t))) != MAT_NO_ERROR) matFreeTensor(&r);
+    }
+    if (src != t) matFreeTensor(&src);
+
+    if (e != NULL) *e = err;
+
+    return r;
+}
+
+// Convert the data of a Tensor to another dtype, in place.
+/*
+ * Only for Tensors owning their data. Views of it must not be used afterwards.
+ * The data is reallocated with `matTensorAlloc`, and a resident Tensor gets a new
+ * device copy.
+ * */
+MatrixErr matTensorSetDtype(Tensor *t, MatrixDtype dtype) {
+    {
+        MatrixErr err;
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
+    }
+    if (t->dtype == dtype) return MAT_NO_ERROR;
+    if (t->_base != NULL || !matIsTensorContiguous(t)) return MAT_DIMENSION_MISTMATCH;
+
+    int resident = matIsTensorResident(t);
+    if (matTensorReleaseDevice(t) != MAT_NO_ERROR) return MAT_KERNEL_FAILURE;
+
+    void *data = matTensorAlloc(t, matDtypeSize(dtype) * t->literal_size);
+    _matConvertData(t->data, t->dtype, data, dtype, t->literal_size);
+    matTensorRelease(t, t->data);
+    t->data = (double *) data;
+    t->dtype = dtype;
+
+    return resident? matTensorToDevice(t) : MAT_NO_ERROR;
+}
+
+// Shape two Tensors broadcast to, and the strides of each at that shape.
+/*
+ * Dimensions of size 1, and those past a Tensor's rank, get a stride of 0, so their
+ * single element is repeated. `dimsz`, `stride1` and `stride2` must have room for
+ * MAX(t1->ndims, t2->ndims, 1) elements.
+ * returns MAT_UNFIT_TENSORS if the shapes don't broadcast.
+ * */
+static MatrixErr _matBroadcast(Tensor *t1, Tensor *t2, unsigned *dimsz, unsigned *stride1, unsigned *stride2) {
+    _matTensorStrides(t1, stride1);
+    _matTensorStrides(t2, stride2);
+
+    dimsz[0] = 1;
+    for (int i = 0; i < MAX(t1->ndims, t2->ndims); i++) {
+        unsigned d1 = (i < t1->ndims)? t1->dimsz[i] : 1;
+        unsigned d2 = (i < t2->ndims)? t2->dimsz[i] : 1;
+        if (d1 != d2 && d1 != 1 && d2 != 1) return MAT_UNFIT_TENSORS;
+
+        dimsz[i] = MAX(d1, d2);
+        if (d1 == 1) stride1[i] = 0;
+        if (d2 == 1) stride2[i] = 0;
+    }
+
+    return MAT_NO_ERROR;
+}
+
 MatrixErr matTensorFit(Tensor *t1, Tensor *t2, Tensor **t1r, Tensor **t2r) {
     if (t1r == NULL || t2r == NULL) return MAT_NULL_PTR;
     *t1r = NULL;
@@ -152,113 +730,92 @@ MatrixErr matTensorFit(Tensor *t1, Tensor *t2, Tensor **t1r, Tensor **t2r) {
         if (matCheckTensor(t1, &err) != MAT_NO_ERROR) return err;
         if (matCheckTensor(t2, &err) != MAT_NO_ERROR) return err;
     }
-    
-    Tensor *biggest = (t1->ndims > t2->ndims)? t1 : t2;
-    unsigned *t1_dims = (unsigned *) malloc(sizeof(unsigned) * biggest->ndims);
-    unsigned *t2_dims = (unsigned *) malloc(sizeof(unsigned) * biggest->ndims);
-    
-    for (int i = 0; i < biggest->ndims; i++) {
-        if (i < t1->ndims)
-            if (t1->dimsz[i] != 1)
-                t1_dims[i] = t1->dimsz[i];
-            else
-                t1_dims[i] = t2->dimsz[i];
-        else t1_dims[i] = t2->dimsz[i];
-    }
-
-    for (int i = 0; i < biggest->ndims; i++) {
-        if (i < t2->ndims)
-            if (t2->dimsz[i] != 1)
-                t2_dims[i] = t2->dimsz[i];
-            else 
-                t2_dims[i] = t1->dimsz[i];
-        else t2_dims[i] = t1->dimsz[i];
-    }
-
-    for (int i = 0; i < biggest->ndims; i++) {
-        if (t1_dims[i] != t2_dims[i] && t1_dims[i] != 1 && t2_dims[i] != 1) {
-            free(t1_dims);
-            free(t2_dims);
-
-            return MAT_UNFIT_TENSORS;
-        }
-    }
 
-    Tensor *t1_res = matMakeTensor(biggest->ndims, t1_dims, NULL);
-    free(t1_dims);
-    t1_res->data = (double *) malloc(sizeof(double) * t1_res->literal_size);
+    if (t1->dtype != t2->dtype) return MAT_DTYPE_MISMATCH;
+    if (matTensorToHost(t1) || matTensorToHost(t2)) return MAT_KERNEL_FAILURE;
 
-    for (int i = 0; i < t1_res->literal_size; i++) {
-        unsigned *ind = matTensorIAt(t1_res, i, NULL);
-        unsigned *ind_org = (unsigned *) malloc(sizeof(unsigned) * t1->ndims);
-        
-        memcpy(ind_org, ind, t1->ndims * sizeof(unsigned));
-        
-        for (int sind = 0; sind < t1->ndims; sind++) 
-            if (ind[sind] >= t1->dimsz[sind])
-                ind_org[sind] %= t1->dimsz[sind];
-        
-        *matTensorAtI(t1_res, ind, NULL) = *matTensorAtI(t1, ind_org, NULL);
+    unsigned ndims = MAX(t1->ndims, t2->ndims);
+    unsigned nd = ndims? ndims : 1;
+    unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *stride1 = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *stride2 = (unsigned *) malloc(sizeof(unsigned) * nd);
 
-        free(ind);
-        free(ind_org);
-    }
-    
-    Tensor *t2_res = matMakeTensor(biggest->ndims, t2_dims, NULL);
-    free(t2_dims);
-    t2_res->data = (double *) malloc(sizeof(double) * t2_res->literal_size);
-
-    for (int i = 0; i < t2_res->literal_size; i++) {
-        unsigned *ind = matTensorIAt(t2_res, i, NULL);
-        unsigned *ind_org = (unsigned *) malloc(sizeof(unsigned) * t2->ndims);
-        memcpy(ind_org, ind, sizeof(unsigned) * t2->ndims);
-        
-        for (int sind = 0; sind < t2->ndims; sind++) 
-            if (ind[sind] >= t2->dimsz[sind])
-                ind_org[sind] = ind[sind] % t2->dimsz[sind];
- 
-        *matTensorAtI(t2_res, ind, NULL) = *matTensorAtI(t2, ind_org, NULL);
+    MatrixErr err = _matBroadcast(t1, t2, dimsz, stride1, stride2);
+    if (err == MAT_NO_ERROR) {
+        // Both are expanded by reading them with the broadcast strides.
+        Tensor *t1_res = matMakeTensor(ndims, dimsz, NULL);
+        Tensor *t2_res = matMakeTensor(ndims, dimsz, NULL);
+        _matAllocData(t1_res, t1->dtype);
+        _matAllocData(t2_res, t2->dtype);
 
-        free(ind);
-        free(ind_org);
+        _matGatherHost(t1, stride1, ndims, dimsz, t1_res->data);
+        _matGatherHost(t2, stride2, ndims, dimsz, t2_res->data);
+
+        *t1r = t1_res;
+        *t2r = t2_res;
     }
 
-    *t1r = t1_res;
-    *t2r = t2_res;
+    free(dimsz);
+    free(stride1);
+    free(stride2);
 
-    return MAT_NO_ERROR;
+    return err;
 }
 
-// Get a refrance to the value of a matrix at a given index.
-double* matTensorAtI(Tensor *t, unsigned *ind, MatrixErr *e) {
+// Offset in the host data of the element at a given index, bringing the data up to date.
+static MatrixErr _matTensorOffsetI(Tensor *t, unsigned *ind, size_t *at) {
     {
         MatrixErr err;
-        if (matCheckTensor(t, &err) != MAT_NO_ERROR) {
-            if (e != NULL) *e = err;
-            return NULL;
-        }
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
     }
 
-    if (matIsTensorScalar(t)) {
-        if (e != NULL) *e = MAT_NO_ERROR;
-        return t->data;
-    }
+    // The caller is about to read the host data.
+    if (matTensorToHost(t)) return MAT_KERNEL_FAILURE;
+
+    *at = t->offset;
+    if (matIsTensorScalar(t)) return MAT_NO_ERROR;
 
     int r = 0;
     int mult = 1;
 
     for (int i = 0; i < t->ndims; i++) {
         r += ind[i] * mult;
+        *at += ind[i] * ((t->stride != NULL)? t->stride[i] : mult);
         mult *= t->dimsz[i];
     }
 
-    if (r > t->literal_size) {
-        if (e != NULL) *e = MAT_DIMENSION_OUT_OF_RANGE;
-        return NULL;
-    }
+    if (r >= t->literal_size) return MAT_DIMENSION_OUT_OF_RANGE;
 
-    if (e != NULL) *e = MAT_NO_ERROR;
-    return (double *) (t->data + r);
+    return MAT_NO_ERROR;
+}
+
+// Get a refrance to the value of a matrix at a given index.
+/*
+ * Only for float64 Tensors, see `matTensorGetI` for any dtype.
+ * */
+double* matTensorAtI(Tensor *t, unsigned *ind, MatrixErr *e) {
+    size_t at;
+    MatrixErr err = _matTensorOffsetI(t, ind, &at);
+    if (err == MAT_NO_ERROR && t->dtype != MAT_FLOAT64) err = MAT_DTYPE_MISMATCH;
+
+    if (e != NULL) *e = err;
+    if (err != MAT_NO_ERROR) return NULL;
+
+    return (double *) (t->data + at);
+}
+
+// The value of a Tensor of any dtype at a given index.
+/*
+ * returns 0 on error.
+ * */
+double matTensorGetI(Tensor *t, unsigned *ind, MatrixErr *e) {
+    size_t at;
+    MatrixErr err = _matTensorOffsetI(t, ind, &at);
+
+    if (e != NULL) *e = err;
+    if (err != MAT_NO_ERROR) return 0;
+
+    return _matGetElement(t, at);
 }
 
 unsigned* matTensorIAt(Tensor *t, int literal, MatrixErr *e) {
@@ -282,109 +839,663 @@ unsigned* matTensorIAt(Tensor *t, int literal, MatrixErr *e) {
     return ind;
 }
 
-MatrixErr matSum(double *src, int size, double *res) {
-    if (src == NULL) return MAT_NULL_PTR;
-    if (res == NULL) return MAT_NULL_PTR;
+// A view of the Tensor with its last dimension moved to the front.
+/*
+ * The same as `matTTensor`, without copying the data. Only strides are swapped.
+ * */
+Tensor* matTTensorView(Tensor *t, MatrixErr *e) {
+    if (matCheckTensor(t, e) != MAT_NO_ERROR) return NULL;
+
+    unsigned nd = t->ndims? t->ndims : 1;
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *vstride = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * nd);
+    _matTensorStrides(t, stride);
+
+    dimsz[0] = t->dimsz[t->ndims? t->ndims - 1 : 0];
+    vstride[0] = stride[t->ndims? t->ndims - 1 : 0];
+    for (int i = 1; i < t->ndims; i++) {
+        dimsz[i] = t->dimsz[i - 1];
+        vstride[i] = stride[i - 1];
+    }
 
-    size_t gz[] = { size };
-    claRunKernel("sum", 1, gz, NULL,
-                 src, size, OCLREAD | OCLCPY,
-                 size,
-                 NULL, size, OCLWRITE | OCLREAD,
-                 res, 1, OCLWRITE | OCLOUT);
-    if (claGetError(1)) return MAT_KERNEL_FAILURE;
+    Tensor *v = _matMakeView(t, t->ndims, dimsz, vstride, t->offset, e);
+    free(stride);
+    free(vstride);
+    free(dimsz);
 
-    return MAT_NO_ERROR;
+    return v;
 }
 
-MatrixErr matProd(Tensor *t1, Tensor *t2, Tensor **r) {
-    if (r == NULL) return MAT_NULL_PTR;
-    *r = NULL;
-    {
-        MatrixErr err;
-        if (matCheckTensor(t1, &err) != MAT_NO_ERROR) return err;
-        if (matCheckTensor(t2, &err) != MAT_NO_ERROR) return err;
+// The Tensor with other dimensions of the same literal size.
+/*
+ * A view for contiguous Tensors, otherwise a contiguous copy.
+ * */
+Tensor* matTensorReshape(Tensor *t, unsigned ndims, unsigned *dims, MatrixErr *e) {
+    if (matCheckTensor(t, e) != MAT_NO_ERROR) return NULL;
+
+    size_t size = 1;
+    for (int i = 0; i < ndims; i++) size *= dims[i];
+    if (size != t->literal_size) {
+        if (e != NULL) *e = MAT_DIMENSION_MISTMATCH;
+        return NULL;
     }
 
-    if (t1->ndims == 0 || t2->ndims == 0) return MAT_DIMENSION_MISTMATCH;
-    if (t1->ndims != 1 && t2->ndims != 1 && t1->ndims != t2->ndims) return MAT_DIMENSION_MISTMATCH;
-    
-    int t1_vector = 0;
-    unsigned *odimsz1 = t1->dimsz;
-    if (t1->ndims == 1) {
-        t1->ndims = MAX(2, t2->ndims);
-        odimsz1 = t1->dimsz;
-        t1->dimsz = (unsigned *) malloc(sizeof(unsigned) * t1->ndims);
-        t1->dimsz[0] = odimsz1[0];
-        for (int i = 1; i < t1->ndims; i++) t1->dimsz[i] = 1;
-        
-        t1_vector = 1;
-    }
-    
-    int t2_vector = 0;
-    unsigned *odimsz2 = t2->dimsz;
-    if (t2->ndims == 1) {
-        t2->ndims = MAX(2, t1->ndims);
-        odimsz2 = t2->dimsz;
-        t2->dimsz = (unsigned *) malloc(sizeof(unsigned) * t2->ndims);
-        t2->dimsz[0] = 1;
-        t2->dimsz[1] = odimsz2[0];
-        for (int i = 2; i < t2->ndims; i++) t2->dimsz[i] = 1;
-        
-        t2_vector = 1;
+    if (!matIsTensorContiguous(t)) {
+        Tensor *r = matTensorDeepCopy(t, e);
+        if (r == NULL) return NULL;
+
+        matTensorRelease(r, r->dimsz);
+        r->dimsz = (unsigned *) matTensorAlloc(r, sizeof(unsigned) * (ndims? ndims : 1));
+        r->dimsz[0] = 1;
+        memcpy(r->dimsz, dims, sizeof(unsigned) * ndims);
+        r->ndims = ndims;
+
+        return r;
     }
-    
-    if (t1->dimsz[0] != ((t2->ndims > 1)? t2->dimsz[1] : t2->dimsz[0])) return MAT_UNFIT_TENSORS;
 
-    Tensor *biggest = (t1->ndims > t2->ndims)? t1 : t2;
-    int rndims = biggest->ndims;
-    unsigned *rdimsz = (unsigned *) malloc(sizeof(unsigned) * rndims);
-    for (int i = 2; i < rndims; i++) {
-        if (t1->dimsz[i] != t2->dimsz[i] && t1->dimsz[i] != 1 && t2->dimsz[i] != 1)
-            return MAT_UNFIT_TENSORS;
-        
-        rdimsz[i] = biggest->dimsz[i];
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * (ndims? ndims : 1));
+    unsigned acc = 1;
+    for (int i = 0; i < ndims; i++) {
+        stride[i] = acc;
+        acc *= dims[i];
     }
-    rdimsz[0] = t2->dimsz[0];
-    rdimsz[1] = (t1->ndims > 1)? t1->dimsz[1] : t1->dimsz[0];
 
-    // Standard kernel call in OCLAPI.
-    *r = matMakeTensor(rndims, rdimsz, NULL);
-    free(rdimsz);
-    Tensor *res = *r;
-    res->data = (double *) malloc(sizeof(double) * res->literal_size);
-
-    size_t gz[] = { res->literal_size };
-    claRunKernel("matprod", 1, gz, NULL,
-                 t1->data, t1->literal_size, OCLREAD | OCLCPY,
-                 t2->data, t2->literal_size, OCLREAD | OCLCPY,
-                 t1->dimsz, t1->ndims, OCLREAD | OCLCPY,
-                 t2->dimsz, t2->ndims, OCLREAD | OCLCPY,
-                 res->data, res->literal_size, OCLWRITE | OCLOUT,
-                 res->dimsz, res->ndims, OCLREAD | OCLCPY,
-                 res->ndims);
+    Tensor *v = _matMakeView(t, ndims, dims, stride, 0, e);
+    free(stride);
 
-    if (t1_vector) {
-        t1->ndims = 1;
-        free(t1->dimsz);
-        t1->dimsz = odimsz1;
-    }
-    
-    if (t2_vector) {
-        t2->ndims = 1;
-        free(t2->dimsz);
-        t2->dimsz = odimsz2;
-    }
+    return v;
+}
 
-    if (claGetError(1)) {
-        matFreeTensor(r);
-        return MAT_KERNEL_FAILURE;
+// A view of indices [start, end) of dimension `dim`.
+Tensor* matTensorSlice(Tensor *t, unsigned dim, unsigned start, unsigned end, MatrixErr *e) {
+    if (matCheckTensor(t, e) != MAT_NO_ERROR) return NULL;
+    if (dim >= t->ndims || start >= end || end > t->dimsz[dim]) {
+        if (e != NULL) *e = MAT_DIMENSION_OUT_OF_RANGE;
+        return NULL;
+    }
+
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * t->ndims);
+    unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * t->ndims);
+    _matTensorStrides(t, stride);
+    memcpy(dimsz, t->dimsz, sizeof(unsigned) * t->ndims);
+    dimsz[dim] = end - start;
+
+    Tensor *v = _matMakeView(t, t->ndims, dimsz, stride, t->offset + (size_t) start * stride[dim], e);
+    free(stride);
+    free(dimsz);
+
+    return v;
+}
+
+// Stack the flattened Tensors as the rows of a new matrix, {literal size, n}.
+/*
+ * Used to batch samples. All the Tensors must have the same literal size and dtype.
+ * `tensors` - an array of `n` Tensors.
+ * */
+Tensor* matTensorStack(Tensor *tensors, unsigned n, MatrixErr *e) {
+    if (tensors == NULL) {
+        if (e != NULL) *e = MAT_NULL_PTR;
+        return NULL;
+    }
+    if (n == 0) {
+        if (e != NULL) *e = MAT_DIMENSION_ZERO;
+        return NULL;
+    }
+
+    size_t size = tensors[0].literal_size;
+    for (int i = 0; i < n; i++) {
+        if (matCheckTensor(&tensors[i], e) != MAT_NO_ERROR) return NULL;
+        if (tensors[i].literal_size != size) {
+            if (e != NULL) *e = MAT_DIMENSION_MISTMATCH;
+            return NULL;
+        }
+        if (tensors[i].dtype != tensors[0].dtype) {
+            if (e != NULL) *e = MAT_DTYPE_MISMATCH;
+            return NULL;
+        }
+        if (matTensorToHost(&tensors[i])) {
+            if (e != NULL) *e = MAT_KERNEL_FAILURE;
+            return NULL;
+        }
+    }
+
+    Tensor *r = matMakeTensor(2, (unsigned []) { size, n }, e);
+    if (r == NULL) return NULL;
+    _matAllocData(r, tensors[0].dtype);
+
+    for (int i = 0; i < n; i++) {
+        Tensor *t = &tensors[i];
+        if (matIsTensorContiguous(t)) {
+            memcpy(_matElementAt(r, (size_t) i * size), t->data, matDtypeSize(t->dtype) * size);
+            continue;
+        }
+
+        unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * (t->ndims? t->ndims : 1));
+        _matTensorStrides(t, stride);
+        _matGatherHost(t, stride, t->ndims, t->dimsz, _matElementAt(r, (size_t) i * size));
+        free(stride);
+    }
+
+    if (e != NULL) *e = MAT_NO_ERROR;
+
+    return r;
+}
+
+// Split the rows of a matrix into new vectors, undoing `matTensorStack`.
+/*
+ * `r` - an array with room for a Tensor per row (t->dimsz[1]).
+ * */
+MatrixErr matTensorUnstack(Tensor *t, Tensor **r) {
+    if (r == NULL) return MAT_NULL_PTR;
+    {
+        MatrixErr err;
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
+    }
+    if (t->ndims != 2) return MAT_DIMENSION_MISTMATCH;
+
+    Tensor *src = t;
+    if (!matIsTensorContiguous(t)) {
+        MatrixErr err;
+        if ((src = matTensorDeepCopy(t, &err)) == NULL) return err;
+    }
+    if (matTensorToHost(src)) {
+        if (src != t) matFreeTensor(&src);
+        return MAT_KERNEL_FAILURE;
+    }
+
+    unsigned size = t->dimsz[0];
+    for (int i = 0; i < t->dimsz[1]; i++) {
+        r[i] = matMakeTensor(1, &size, NULL);
+        _matAllocData(r[i], t->dtype);
+        memcpy(r[i]->data, _matElementAt(src, (size_t) i * size), matDtypeSize(t->dtype) * size);
+    }
+
+    if (src != t) matFreeTensor(&src);
+
+    return MAT_NO_ERROR;
+}
+
+// Give the Tensor a persistent device copy of its data.
+/*
+ * Operations on a resident Tensor pass its device buffer to the kernel directly,
+ * and their results are resident as well. The host data is only updated when
+ * read through mat.h, or explicitly with `matTensorToHost`.
+ * If the Tensor is already resident, uploads any host side changes.
+ * Does nothing without a device, or when running on the CPU backend.
+ * */
+MatrixErr matTensorToDevice(Tensor *t) {
+    {
+        MatrixErr err;
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
+    }
+    if (!matdevice || matbackend == MAT_BACKEND_CPU) return MAT_NO_ERROR;
+    // Views share the device copy of their base.
+    t = matTensorStorage(t);
+
+    if (!matIsTensorResident(t)) {
+        if (claMakeBuffer(matDtypeSize(t->dtype) * t->literal_size, &t->_device_data)) return MAT_KERNEL_FAILURE;
+        t->_sync = MAT_HOST_DIRTY;
+    }
+
+    if (t->_sync == MAT_HOST_DIRTY) {
+        if (claWriteBuffer(t->_device_data, t->data, matDtypeSize(t->dtype) * t->literal_size)) return MAT_KERNEL_FAILURE;
+        t->_sync = MAT_SYNCED;
+    }
+
+    return MAT_NO_ERROR;
+}
+
+// Bring the host data of a resident Tensor up to date.
+/*
+ * Does nothing for host only Tensors.
+ * */
+MatrixErr matTensorToHost(Tensor *t) {
+    if (t == NULL) return MAT_NULL_PTR;
+    t = matTensorStorage(t);
+    if (!matIsTensorResident(t) || t->_sync != MAT_DEVICE_DIRTY) return MAT_NO_ERROR;
+    if (t->data == NULL) return MAT_TENSOR_NO_DATA;
+
+    if (claReadBuffer(t->_device_data, t->data, matDtypeSize(t->dtype) * t->literal_size)) return MAT_KERNEL_FAILURE;
+    t->_sync = MAT_SYNCED;
+
+    return MAT_NO_ERROR;
+}
+
+// Synchronize the host data and free the device copy.
+MatrixErr matTensorReleaseDevice(Tensor *t) {
+    MatrixErr err = matTensorToHost(t);
+    if (err != MAT_NO_ERROR) return err;
+    t = matTensorStorage(t);
+
+    claFreeBuffer(t->_device_data);
+    t->_device_data = NULL;
+    t->_sync = MAT_SYNCED;
+
+    return MAT_NO_ERROR;
+}
+
+MatrixErr matSum(double *src, int size, double *res) {
+    return matSumOn(src, size, res, MAT_BACKEND_AUTO);
+}
+
+// Reduce `n` elements of `dtype` on the device, with the `reduce` kernel.
+/*
+ * The first pass leaves one partial result per work-group on the device, and
+ * a single group reduces those. There are at most REDUCE_WG groups, every work
+ * item looping over the input as needed.
+ * `src`, `src_size`, `src_flags` - the kernel argument of the input.
+ * `res` - a single element of `dtype`.
+ * returns non zero on failure.
+ * */
+static int _matReduceDevice(void *src, int src_size, int src_flags, size_t n, int op, MatrixDtype dtype, void *res) {
+    size_t groups = (n + REDUCE_WG * REDUCE_WIDTH - 1) / (REDUCE_WG * REDUCE_WIDTH);
+    groups = MIN(MAX(groups, 1), REDUCE_WG);
+
+    cl_mem partial;
+    if (claMakeBuffer(matDtypeSize(dtype) * groups, &partial)) return 1;
+
+    size_t gz[] = { groups * REDUCE_WG };
+    size_t lz[] = { REDUCE_WG };
+    int error = claRunKernelHandle(kernels[dtype].reduce, 1, gz, lz,
+                                   src, src_size, src_flags,
+                                   (int) n, op,
+                                   NULL, REDUCE_WG, OCLREAD | OCLWRITE,
+                                   (void *) partial, (int) groups, OCLWRITE | OCLRESIDENT);
+
+    gz[0] = REDUCE_WG;
+    error = error || claRunKernelHandle(kernels[dtype].reduce, 1, gz, lz,
+                                        (void *) partial, (int) groups, OCLREAD | OCLRESIDENT,
+                                        (int) groups, op,
+                                        NULL, REDUCE_WG, OCLREAD | OCLWRITE,
+                                        res, 1, OCLWRITE | OCLOUT);
+    claFreeBuffer(partial);
+
+    return error || claGetError(1);
+}
+
+MatrixErr matSumOn(double *src, int size, double *res, MatrixBackend backend) {
+    if (src == NULL) return MAT_NULL_PTR;
+    if (res == NULL) return MAT_NULL_PTR;
+
+    MatrixBackend on;
+    {
+        MatrixErr err = _matResolveBackend(backend, _matPreferDevice(size, matcrossover.sum, NULL, NULL), MAT_FLOAT64, &on);
+        if (err != MAT_NO_ERROR) return err;
+    }
+
+    if (on == MAT_BACKEND_CPU) {
+        *res = _matCpuSum(src, size);
+        return MAT_NO_ERROR;
+    }
+
+    if (_matReduceDevice(src, size, OCLREAD | OCLCPY, size, MAT_REDUCE_SUM, MAT_FLOAT64, res)) return MAT_KERNEL_FAILURE;
+
+    return MAT_NO_ERROR;
+}
+
+// Reduce dimension `dim` of a Tensor, which is removed from the result.
+/*
+ * `mean` - divide the sums by the size of the dimension.
+ * */
+static MatrixErr _matReduceAxis(Tensor *t, unsigned dim, int op, int mean, Tensor **r) {
+    if (r == NULL) return MAT_NULL_PTR;
+    *r = NULL;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
+        if (matIsTensorScalar(t)) {
+            *r = matTensorDeepCopy(t, &err);
+            return err;
+        }
+        if (dim >= t->ndims) return MAT_DIMENSION_OUT_OF_RANGE;
+
+        int prefer_device = _matPreferDevice(t->literal_size, matcrossover.sum, t, NULL);
+        if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, t->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * t->ndims);
+    _matTensorStrides(t, stride);
+    unsigned n = t->dimsz[dim];
+    unsigned axis_stride = stride[dim];
+
+    // The other dimensions, and their strides in the source.
+    unsigned rndims = t->ndims - 1;
+    unsigned nd = rndims? rndims : 1;
+    unsigned *rdimsz = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *rstride = (unsigned *) malloc(sizeof(unsigned) * nd);
+    rdimsz[0] = 1;
+    rstride[0] = 0;
+    for (int i = 0, j = 0; i < t->ndims; i++) {
+        if (i == dim) continue;
+        rdimsz[j] = t->dimsz[i];
+        rstride[j++] = stride[i];
+    }
+    free(stride);
+
+    Tensor *res = matMakeTensor(rndims, rdimsz, NULL);
+    free(rdimsz);
+    _matAllocData(res, t->dtype);
+    double scale = mean? 1.0 / n : 1.0;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(t);
+        if (!kernel_error && t->dtype == MAT_FLOAT32)
+            _matCpuReduce32(t->data32 + t->offset, rstride, rndims, res->dimsz, n, axis_stride, op == MAT_REDUCE_MAX, res->data32);
+        else if (!kernel_error)
+            _matCpuReduce(t->data + t->offset, rstride, rndims, res->dimsz, n, axis_stride, op == MAT_REDUCE_MAX, res->data);
+        if (!kernel_error && mean)
+            for (size_t i = 0; i < res->literal_size; i++) _matSetElement(res, i, _matGetElement(res, i) * scale);
+    } else if (rndims == 0 && matIsTensorContiguous(t)) {
+        // A single output, reduced by all work items.
+        kernel_error = _matSyncOperand(t) ||
+                       _matReduceDevice(MAT_KERNEL_DATA(t, OCLREAD | OCLCPY), t->literal_size, op, t->dtype, res->data);
+        _matSetElement(res, 0, _matGetElement(res, 0) * scale);
+    } else {
+        kernel_error = _matSyncOperand(t);
+        if (!kernel_error && matIsTensorResident(t)) kernel_error = _matMakeResidentResult(res);
+
+        size_t gz[] = { res->literal_size };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(res), kernels[t->dtype].matreduce, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t, OCLREAD | OCLCPY),
+                                          (int) t->offset, rstride, nd, OCLREAD | OCLCPY,
+                                          (int) n, (int) axis_stride, op, scale,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          (int) rndims, res->dimsz, nd, OCLREAD | OCLCPY);
+        kernel_error = kernel_error || claGetError(1);
+    }
+    free(rstride);
+
+    if (kernel_error) {
+        matFreeTensor(&res);
+        return MAT_KERNEL_FAILURE;
+    }
+
+    *r = res;
+
+    return MAT_NO_ERROR;
+}
+
+// Sum of dimension `dim` of a Tensor, which is removed from the result.
+/*
+ * Reducing the only dimension gives a scalar. Reduce a flattened view
+ * (see `matTensorFlatten`) for the sum of all elements.
+ * */
+MatrixErr matSumAxis(Tensor *t, unsigned dim, Tensor **r) {
+    return _matReduceAxis(t, dim, MAT_REDUCE_SUM, 0, r);
+}
+
+// Mean of dimension `dim` of a Tensor, see `matSumAxis`.
+MatrixErr matMeanAxis(Tensor *t, unsigned dim, Tensor **r) {
+    return _matReduceAxis(t, dim, MAT_REDUCE_SUM, 1, r);
+}
+
+// Maximum of dimension `dim` of a Tensor, see `matSumAxis`.
+MatrixErr matMaxAxis(Tensor *t, unsigned dim, Tensor **r) {
+    return _matReduceAxis(t, dim, MAT_REDUCE_MAX, 0, r);
+}
+
+static MatrixErr _matProdOn(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend);
+static MatrixErr _matSTDLinearCall(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, int op, MatrixBackend backend);
+
+MatrixErr matProd(Tensor *t1, Tensor *t2, Tensor **r) {
+    return matProdOn(t1, t2, r, MAT_BACKEND_AUTO);
+}
+
+MatrixErr matProdOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    return _matProdOn(t1, t2, NULL, r, backend);
+}
+
+// `matProd` writing to the existing Tensor `r` instead of a new one.
+/*
+ * `r` must be contiguous, with as many elements as the product, and not be one
+ * of the operands. Its shape is left as is.
+ * */
+MatrixErr matProdInto(Tensor *t1, Tensor *t2, Tensor *r) {
+    Tensor *res;
+    return _matProdOn(t1, t2, r, &res, MAT_BACKEND_AUTO);
+}
+
+typedef MatrixErr (*_matProductFn)(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend);
+
+// Does a product involve a storage only dtype, see `_matMixedOn`.
+static inline int _matIsMixed(Tensor *t1, Tensor *t2, Tensor *into) {
+    return matIsDtypeStorage(t1->dtype) || matIsDtypeStorage(t2->dtype) ||
+           (into != NULL && into->data != NULL && matIsDtypeStorage(into->dtype));
+}
+
+// A float32 copy of an operand of `_matMixedOn`, or the operand itself if it is float32.
+/*
+ * A view widens its whole base instead, and views the copy the same way, so the
+ * base (e.g. transposed weights) is converted in one pass, where it is up to date.
+ * `base` - set to the widened base, to free after the view.
+ * */
+static Tensor* _matWidenOperand(Tensor *t, Tensor **base, MatrixErr *e) {
+    *base = NULL;
+    if (t->dtype == MAT_FLOAT32) return t;
+    if (t->_base == NULL) return matTensorCast(t, MAT_FLOAT32, e);
+
+    if ((*base = matTensorCast(t->_base, MAT_FLOAT32, e)) == NULL) return NULL;
+    unsigned *stride = (unsigned *) malloc(sizeof(unsigned) * (t->ndims? t->ndims : 1));
+    _matTensorStrides(t, stride);
+    Tensor *view = _matMakeView(*base, t->ndims, t->dimsz, stride, t->offset, e);
+    free(stride);
+
+    return view;
+}
+
+// A product `fn` with operands or result of a storage only dtype, in float32.
+/*
+ * The 16-bit operands are widened to float32 copies (on the device when resident,
+ * see `matTensorCast`), so the product accumulates in float32. The other operand
+ * must be float32 or 16-bit too. The result is float32, or rounded to the dtype of
+ * `into` if it is a storage only one.
+ * */
+static MatrixErr _matMixedOn(_matProductFn fn, Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend) {
+    if (t1->dtype == MAT_FLOAT64 || t2->dtype == MAT_FLOAT64) return MAT_DTYPE_MISMATCH;
+    int narrow = into != NULL && into->data != NULL && matIsDtypeStorage(into->dtype);
+    if (into != NULL && into->data != NULL && into->dtype == MAT_FLOAT64) return MAT_DTYPE_MISMATCH;
+
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *b1 = NULL;
+    Tensor *b2 = NULL;
+    Tensor *w1 = _matWidenOperand(t1, &b1, &error);
+    Tensor *w2 = (w1 == NULL)? t2 : _matWidenOperand(t2, &b2, &error);
+    if (w1 == NULL || w2 == NULL) goto Cleanup;
+
+    if ((error = fn(w1, w2, narrow? NULL : into, r, backend)) != MAT_NO_ERROR || !narrow) goto Cleanup;
+
+    Tensor *res = *r;
+    *r = NULL;
+    if (res->literal_size != into->literal_size || !matIsTensorContiguous(into)) error = MAT_DIMENSION_MISTMATCH;
+    else if ((error = _matConvertTensor(res, into, 0)) == MAT_NO_ERROR) *r = into;
+    matFreeTensor(&res);
+
+    Cleanup:
+    if (w1 != t1) matFreeTensor(&w1);
+    if (w2 != t2) matFreeTensor(&w2);
+    matFreeTensor(&b1);
+    matFreeTensor(&b2);
+
+    return error;
+}
+
+// `into` - the result, or NULL to make a new one.
+static MatrixErr _matProdOn(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend) {
+    if (r == NULL) return MAT_NULL_PTR;
+    *r = NULL;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if (matCheckTensor(t1, &err) != MAT_NO_ERROR) return err;
+        if (matCheckTensor(t2, &err) != MAT_NO_ERROR) return err;
+        if (_matIsMixed(t1, t2, into)) return _matMixedOn(_matProdOn, t1, t2, into, r, backend);
+        if (t1->dtype != t2->dtype) return MAT_DTYPE_MISMATCH;
+
+        // M * N * K for matrices.
+        size_t work = t1->literal_size * (t2->literal_size / t1->dimsz[0]);
+        int prefer_device = _matPreferDevice(work, matcrossover.prod, t1, t2);
+        if ((err = _matResolveBackend(backend, prefer_device, t1->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    if (t1->ndims == 0 || t2->ndims == 0) return MAT_DIMENSION_MISTMATCH;
+    if (t1->ndims != 1 && t2->ndims != 1 && t1->ndims != t2->ndims) return MAT_DIMENSION_MISTMATCH;
+
+    // Only the matrix kernels read strided operands, anything else is gathered first.
+    Tensor *ot1 = t1;
+    Tensor *ot2 = t2;
+    if (!matIsTensorContiguous(t1) && t1->ndims != 2) t1 = matTensorDeepCopy(t1, NULL);
+    if (!matIsTensorContiguous(t2) && t2->ndims != 2) t2 = matTensorDeepCopy(t2, NULL);
+    if (t1 == NULL || t2 == NULL) {
+        if (t1 != ot1) matFreeTensor(&t1);
+        if (t2 != ot2) matFreeTensor(&t2);
+        return MAT_KERNEL_FAILURE;
+    }
+
+    MatrixErr error = MAT_NO_ERROR;
+    int kernel_error = 0;
+    Tensor *res = NULL;
+    // Shape of the result, which indexes it whatever the shape of `into`.
+    unsigned *rdimsz = NULL;
+    
+    int t1_vector = 0;
+    unsigned *odimsz1 = t1->dimsz;
+    if (t1->ndims == 1) {
+        t1->ndims = MAX(2, t2->ndims);
+        odimsz1 = t1->dimsz;
+        t1->dimsz = (unsigned *) malloc(sizeof(unsigned) * t1->ndims);
+        t1->dimsz[0] = odimsz1[0];
+        for (int i = 1; i < t1->ndims; i++) t1->dimsz[i] = 1;
+        
+        t1_vector = 1;
+    }
+    
+    int t2_vector = 0;
+    unsigned *odimsz2 = t2->dimsz;
+    if (t2->ndims == 1) {
+        t2->ndims = MAX(2, t1->ndims);
+        odimsz2 = t2->dimsz;
+        t2->dimsz = (unsigned *) malloc(sizeof(unsigned) * t2->ndims);
+        t2->dimsz[0] = 1;
+        t2->dimsz[1] = odimsz2[0];
+        for (int i = 2; i < t2->ndims; i++) t2->dimsz[i] = 1;
+        
+        t2_vector = 1;
+    }
+    
+    if (t1->dimsz[0] != ((t2->ndims > 1)? t2->dimsz[1] : t2->dimsz[0])) {
+        error = MAT_UNFIT_TENSORS;
+        goto Cleanup;
+    }
+
+    Tensor *biggest = (t1->ndims > t2->ndims)? t1 : t2;
+    int rndims = biggest->ndims;
+    rdimsz = (unsigned *) malloc(sizeof(unsigned) * rndims);
+    for (int i = 2; i < rndims; i++) {
+        if (t1->dimsz[i] != t2->dimsz[i] && t1->dimsz[i] != 1 && t2->dimsz[i] != 1) {
+            error = MAT_UNFIT_TENSORS;
+            goto Cleanup;
+        }
+        
+        rdimsz[i] = biggest->dimsz[i];
+    }
+    rdimsz[0] = t2->dimsz[0];
+    rdimsz[1] = (t1->ndims > 1)? t1->dimsz[1] : t1->dimsz[0];
+
+    // Standard kernel call in OCLAPI.
+    error = _matMakeResult(into, rndims, rdimsz, t1->dtype, r);
+    if (error != MAT_NO_ERROR) goto Cleanup;
+    res = *r;
+
+    // Strides of the matrices, read as a[row, k] = a[row * ars + k * acs].
+    unsigned s1[2], s2[2];
+    if (rndims == 2) {
+        _matTensorStrides(t1, s1);
+        _matTensorStrides(t2, s2);
+    }
+    int M = t1->dimsz[1], N = t2->dimsz[0], K = t1->dimsz[0];
+
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(t1) || matTensorToHost(t2);
+
+        if (!kernel_error && rndims == 2 && res->dtype == MAT_FLOAT32)
+            kernel_error = _matCpuGemm32(t1->data32 + t1->offset, s1[1], s1[0], t2->data32 + t2->offset, s2[1], s2[0],
+                                         res->data32, M, N, K);
+        else if (!kernel_error && rndims == 2)
+            kernel_error = _matCpuGemm(t1->data + t1->offset, s1[1], s1[0], t2->data + t2->offset, s2[1], s2[0],
+                                       res->data, M, N, K);
+        else if (!kernel_error && res->dtype == MAT_FLOAT32)
+            _matCpuProd32(t1->data32, t1->dimsz, t2->data32, t2->dimsz, res->data32, rdimsz, rndims, res->literal_size);
+        else if (!kernel_error)
+            _matCpuProd(t1->data, t1->dimsz, t2->data, t2->dimsz, res->data, rdimsz, rndims, res->literal_size);
+    } else {
+        kernel_error = _matSyncOperand(t1) || _matSyncOperand(t2);
+        if (!kernel_error && into == NULL && (matIsTensorResident(t1) || matIsTensorResident(t2)))
+            kernel_error = _matMakeResidentResult(res);
+
+        if (!kernel_error && rndims == 2) {
+            // Plain matrices use the tiled kernel.
+            size_t gz[] = { (N + GEMM_TS - 1) / GEMM_TS * GEMM_TS, (M + GEMM_TS - 1) / GEMM_TS * (GEMM_TS / GEMM_WPT) };
+            size_t lz[] = { GEMM_TS, GEMM_TS / GEMM_WPT };
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(res), kernels[res->dtype].matgemm, 2, gz, lz,
+                                          MAT_KERNEL_DATA(t1, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(t2, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          M, N, K,
+                                          (int) t1->offset, (int) s1[1], (int) s1[0],
+                                          (int) t2->offset, (int) s2[1], (int) s2[0]);
+        } else if (!kernel_error) {
+            size_t gz[] = { res->literal_size };
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(res), kernels[res->dtype].matprod, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t1, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(t2, OCLREAD | OCLCPY),
+                                          t1->dimsz, t1->ndims, OCLREAD | OCLCPY,
+                                          t2->dimsz, t2->ndims, OCLREAD | OCLCPY,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          rdimsz, rndims, OCLREAD | OCLCPY,
+                                          rndims);
+        }
+        kernel_error = kernel_error || claGetError(1);
+    }
+
+    Cleanup:
+    free(rdimsz);
+
+    if (t1_vector) {
+        t1->ndims = 1;
+        free(t1->dimsz);
+        t1->dimsz = odimsz1;
+    }
+    
+    if (t2_vector) {
+        t2->ndims = 1;
+        free(t2->dimsz);
+        t2->dimsz = odimsz2;
+    }
+
+    if (t1 != ot1) matFreeTensor(&t1);
+    if (t2 != ot2) matFreeTensor(&t2);
+
+    if (error != MAT_NO_ERROR) return error;
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(r);
+        return MAT_KERNEL_FAILURE;
+    }
+
+    if (into != NULL) {
+        _matWroteResult(into, on);
+        return MAT_NO_ERROR;
     }
 
     if (matIsTensorScalar(res)) {
-        double res_s = res->data[0];
+        matTensorToHost(res);
+        double res_s = _matGetElement(res, 0);
+        MatrixDtype dtype = res->dtype;
         matFreeTensor(r);
-        *r = matMakeScalar(res_s, NULL);
+        *r = _matMakeScalarOf(res_s, dtype, NULL);
     }
 
     matTensorReduce(*r);
@@ -392,22 +1503,61 @@ MatrixErr matProd(Tensor *t1, Tensor *t2, Tensor **r) {
     return MAT_NO_ERROR;
 }
 
+static MatrixErr _matDotOn(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend);
+
 MatrixErr matDot(Tensor *t1, Tensor *t2, Tensor **r) {
+    return matDotOn(t1, t2, r, MAT_BACKEND_AUTO);
+}
+
+MatrixErr matDotOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    return _matDotOn(t1, t2, NULL, r, backend);
+}
+
+// `matDot` writing to the existing Tensor `r`, see `matProdInto`.
+MatrixErr matDotInto(Tensor *t1, Tensor *t2, Tensor *r) {
+    Tensor *res;
+    return _matDotOn(t1, t2, r, &res, MAT_BACKEND_AUTO);
+}
+
+// `into` - the result, or NULL to make a new one.
+static MatrixErr _matDotOn(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, MatrixBackend backend) {
     if (r == NULL) return MAT_NULL_PTR;
     *r = NULL;
+    MatrixBackend on;
     {
         MatrixErr err;
         if (matCheckTensor(t1, &err) != MAT_NO_ERROR) return err;
         if (matCheckTensor(t2, &err) != MAT_NO_ERROR) return err;
     }
+    if (_matIsMixed(t1, t2, into)) return _matMixedOn(_matDotOn, t1, t2, into, r, backend);
     
-    if (matIsTensorScalar(t1) || matIsTensorScalar(t2)) return matMult(t1, t2, r);
-    if (t1->ndims <= 2 && t2->ndims <= 2) return matProd(t1, t2, r);
+    if (matIsTensorScalar(t1) || matIsTensorScalar(t2))
+        return _matSTDLinearCall(t1, t2, into, r, MAT_BINARY_MULT, backend);
+    if (t1->ndims <= 2 && t2->ndims <= 2) return _matProdOn(t1, t2, into, r, backend);
+    if (t1->dtype != t2->dtype) return MAT_DTYPE_MISMATCH;
+
+    {
+        size_t work = t1->literal_size * (t2->literal_size / t1->dimsz[0]);
+        int prefer_device = _matPreferDevice(work, matcrossover.dot, t1, t2);
+        MatrixErr err = _matResolveBackend(backend, prefer_device, t1->dtype, &on);
+        if (err != MAT_NO_ERROR) return err;
+    }
     
     // a Tensors is nD, n > 2.
     // Check if first dimension of t1 equals the second dimension of t2.
     if (t1->dimsz[0] != t2->dimsz[MIN(1, t2->ndims - 1)]) return MAT_DIMENSION_MISTMATCH;
 
+    // The nD kernel reads contiguous operands, views are gathered first.
+    Tensor *ot1 = t1;
+    Tensor *ot2 = t2;
+    if (!matIsTensorContiguous(t1)) t1 = matTensorDeepCopy(t1, NULL);
+    if (!matIsTensorContiguous(t2)) t2 = matTensorDeepCopy(t2, NULL);
+    if (t1 == NULL || t2 == NULL) {
+        if (t1 != ot1) matFreeTensor(&t1);
+        if (t2 != ot2) matFreeTensor(&t2);
+        return MAT_KERNEL_FAILURE;
+    }
+
     unsigned ndims = MAX(0, t1->ndims + t2->ndims - 2);
     unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * (ndims? ndims : 1));
     // For scalar result. If nonscalar - this would be overwritten.
@@ -418,111 +1568,918 @@ MatrixErr matDot(Tensor *t1, Tensor *t2, Tensor **r) {
         else dimsz[i] = t2->dimsz[MAX(i - t1->ndims + 2, t2->ndims - 1)];
     }
 
-    *r = matMakeTensor(ndims, dimsz, NULL);
-    free(dimsz);
+    // The result is indexed by `dimsz`, whatever the shape of `into`.
+    MatrixErr error = _matMakeResult(into, ndims, dimsz, t1->dtype, r);
+    if (error != MAT_NO_ERROR) {
+        free(dimsz);
+        if (t1 != ot1) matFreeTensor(&t1);
+        if (t2 != ot2) matFreeTensor(&t2);
+        return error;
+    }
     Tensor *res = *r;
-    res->data = (double *) malloc(sizeof(double) * res->literal_size);
-
-    size_t gz[] = { res->literal_size };
-    claRunKernel("matdot", 1, gz, NULL,
-                 t1->data, t1->literal_size, OCLREAD | OCLCPY,
-                 t2->data, t2->literal_size, OCLREAD | OCLCPY,
-                 t1->ndims, t1->dimsz, t1->ndims, OCLREAD | OCLCPY,
-                 t2->ndims, t2->dimsz, t2->ndims, OCLREAD | OCLCPY,
-                 res->data, res->literal_size, OCLWRITE | OCLOUT,
-                 res->ndims, res->dimsz, res->ndims, OCLREAD | OCLCPY);
-    if (claGetError(1)) {
-        matFreeTensor(r);
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(t1) || matTensorToHost(t2);
+        if (!kernel_error && res->dtype == MAT_FLOAT32)
+            _matCpuDot32(t1->data32, t1->ndims, t1->dimsz, t2->data32, t2->ndims, t2->dimsz,
+                         res->data32, dimsz, res->literal_size);
+        else if (!kernel_error)
+            _matCpuDot(t1->data, t1->ndims, t1->dimsz, t2->data, t2->ndims, t2->dimsz,
+                       res->data, dimsz, res->literal_size);
+    } else {
+        kernel_error = _matSyncOperand(t1) || _matSyncOperand(t2);
+        if (!kernel_error && into == NULL && (matIsTensorResident(t1) || matIsTensorResident(t2)))
+            kernel_error = _matMakeResidentResult(res);
+
+        size_t gz[] = { res->literal_size };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(matIsTensorResident(res), kernels[res->dtype].matdot, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t1, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(t2, OCLREAD | OCLCPY),
+                                          t1->ndims, t1->dimsz, t1->ndims, OCLREAD | OCLCPY,
+                                          t2->ndims, t2->dimsz, t2->ndims, OCLREAD | OCLCPY,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          ndims, dimsz, ndims, OCLREAD | OCLCPY);
+    }
+    kernel_error = kernel_error || (on == MAT_BACKEND_DEVICE && claGetError(1));
+
+    free(dimsz);
+    if (t1 != ot1) matFreeTensor(&t1);
+    if (t2 != ot2) matFreeTensor(&t2);
+
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(r);
         return MAT_KERNEL_FAILURE;
     }
 
-    matTensorReduce(*r);
+    if (into != NULL) _matWroteResult(into, on);
+    else matTensorReduce(*r);
 
     return MAT_NO_ERROR;
 }
 
-MatrixErr _matSTDLinearCall(Tensor *t1, Tensor *t2, Tensor **r, const char *kname);
+// A scalar operand of another dtype, converted to the dtype of the other operand.
+/*
+ * Lets scalars (e.g. from `matMakeScalar`) combine with Tensors of any dtype.
+ * `*conv` - the converted scalar, which replaces its operand, or NULL if the dtypes match.
+ * returns MAT_DTYPE_MISMATCH if neither operand of another dtype is a scalar.
+ * */
+static MatrixErr _matMatchScalar(Tensor **t1, Tensor **t2, Tensor **conv) {
+    *conv = NULL;
+    if ((*t1)->dtype == (*t2)->dtype) return MAT_NO_ERROR;
+
+    Tensor **s = matIsTensorScalar(*t2)? t2 : matIsTensorScalar(*t1)? t1 : NULL;
+    if (s == NULL) return MAT_DTYPE_MISMATCH;
+    if (matTensorToHost(*s)) return MAT_KERNEL_FAILURE;
+
+    MatrixErr err;
+    // Keeps the shape of the scalar, which may broadcast to more dimensions.
+    if ((*conv = matMakeTensor((*s)->ndims, (*s)->dimsz, &err)) == NULL) return err;
+    _matAllocData(*conv, ((s == t1)? *t2 : *t1)->dtype);
+    _matSetElement(*conv, 0, _matGetElement(*s, (*s)->offset));
+    *s = *conv;
 
-MatrixErr _matSTDLinearCall(Tensor *t1, Tensor *t2, Tensor **r, const char *kname) {
+    return MAT_NO_ERROR;
+}
+
+// `into` - the result, or NULL to make a new one. It may be one of the operands, if
+// it has the shape of the result.
+// `op` - the operation, MAT_BINARY_*.
+static MatrixErr _matSTDLinearCall(Tensor *t1, Tensor *t2, Tensor *into, Tensor **r, int op, MatrixBackend backend) {
     if (r == NULL) return MAT_NULL_PTR;
     *r = NULL;
+    MatrixBackend on;
+    Tensor *conv;
     {
         MatrixErr err;
         if (matCheckTensor(t1, &err) != MAT_NO_ERROR) return err;
         if (matCheckTensor(t2, &err) != MAT_NO_ERROR) return err;
+        if ((err = _matMatchScalar(&t1, &t2, &conv)) != MAT_NO_ERROR) return err;
+
+        size_t work = MAX(t1->literal_size, t2->literal_size);
+        int prefer_device = _matPreferDevice(work, matcrossover.elementwise, t1, t2);
+        if ((err = _matResolveBackend(backend, prefer_device, t1->dtype, &on)) != MAT_NO_ERROR) {
+            matFreeTensor(&conv);
+            return err;
+        }
     }
 
-    Tensor *new_t1;
-    Tensor *new_t2;
-    if (matTensorFit(t1, t2, &new_t1, &new_t2)) return MAT_UNFIT_TENSORS;
+    int resident = on == MAT_BACKEND_DEVICE &&
+                   ((into == NULL)? matIsTensorResident(t1) || matIsTensorResident(t2) : matIsTensorResident(into));
+
+    unsigned ndims = MAX(t1->ndims, t2->ndims);
+    unsigned nd = ndims? ndims : 1;
+    unsigned *rdimsz = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *stride1 = (unsigned *) malloc(sizeof(unsigned) * nd);
+    unsigned *stride2 = (unsigned *) malloc(sizeof(unsigned) * nd);
+    if (_matBroadcast(t1, t2, rdimsz, stride1, stride2) != MAT_NO_ERROR) {
+        free(rdimsz);
+        free(stride1);
+        free(stride2);
+        matFreeTensor(&conv);
+
+        return MAT_UNFIT_TENSORS;
+    }
+
+    // Contiguous Tensors of the same shape are read linearly. Otherwise the operands
+    // are read through their strides, broadcast ones with a stride of 0, so they
+    // are never expanded.
+    int strided = !matIsTensorContiguous(t1) || !matIsTensorContiguous(t2) || t1->ndims != t2->ndims;
+    for (int i = 0; !strided && i < t1->ndims; i++) strided = t1->dimsz[i] != t2->dimsz[i];
 
     // Standard kernel call in OCLAPI.
-    unsigned *rdimsz = (unsigned *) malloc(sizeof(unsigned) * new_t1->ndims);
-    for (int i = 0; i < new_t2->ndims; i++) 
-        rdimsz[i] = new_t2->dimsz[i];
-    rdimsz[0] = new_t1->dimsz[0];
+    // The result is indexed by `rdimsz`, whatever the shape of `into`.
+    MatrixErr error = _matMakeResult(into, ndims, rdimsz, t1->dtype, r);
+    if (error != MAT_NO_ERROR) {
+        free(rdimsz);
+        free(stride1);
+        free(stride2);
+        matFreeTensor(&conv);
+
+        return error;
+    }
+    Tensor *res = *r;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(t1) || matTensorToHost(t2);
+        if (!kernel_error && res->dtype == MAT_FLOAT32) {
+            static const _matCpuBinaryFn32 fns[] = { _matCpuAdd32, _matCpuSub32, _matCpuMult32 };
+            if (strided)
+                _matCpuBinaryStrided32(fns[op], ndims, rdimsz, t1->data32 + t1->offset, stride1,
+                                       t2->data32 + t2->offset, stride2, res->data32);
+            else fns[op](t1->data32, t2->data32, res->data32, res->literal_size);
+        } else if (!kernel_error) {
+            static const _matCpuBinaryFn fns[] = { _matCpuAdd, _matCpuSub, _matCpuMult };
+            if (strided)
+                _matCpuBinaryStrided(fns[op], ndims, rdimsz, t1->data + t1->offset, stride1,
+                                     t2->data + t2->offset, stride2, res->data);
+            else fns[op](t1->data, t2->data, res->data, res->literal_size);
+        }
+    } else {
+        kernel_error = _matSyncOperand(t1) || _matSyncOperand(t2);
+        if (!kernel_error && resident && into == NULL) kernel_error = _matMakeResidentResult(res);
+
+        _MatKernels *k = &kernels[res->dtype];
+        OCLAPIKernel kernel = (op == MAT_BINARY_ADD)? k->matadd : (op == MAT_BINARY_SUB)? k->matsub : k->matmul;
+        OCLAPIKernel strided_kernel = (op == MAT_BINARY_ADD)? k->mataddv : (op == MAT_BINARY_SUB)? k->matsubv : k->matmulv;
+
+        size_t gz[] = { res->literal_size };
+        if (!kernel_error && strided)
+            kernel_error = MAT_RUN_KERNEL(resident, strided_kernel, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t1, OCLREAD | OCLCPY),
+                                          (int) t1->offset, stride1, nd, OCLREAD | OCLCPY,
+                                          MAT_KERNEL_DATA(t2, OCLREAD | OCLCPY),
+                                          (int) t2->offset, stride2, nd, OCLREAD | OCLCPY,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          (int) ndims, rdimsz, nd, OCLREAD | OCLCPY);
+        else if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernel, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(t1, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(t2, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT));
+    }
 
-    *r = matMakeTensor(new_t1->ndims, rdimsz, NULL);
     free(rdimsz);
-    Tensor *res = *r;
-    res->data = (double *) malloc(sizeof(double) * res->literal_size);
-
-    size_t gz[] = { res->literal_size };
-    claRunKernel(kname, 1, gz, NULL,
-                 new_t1->data, new_t1->literal_size, OCLREAD | OCLCPY,
-                 new_t2->data, new_t2->literal_size, OCLREAD | OCLCPY,
-                 res->data, res->literal_size, OCLWRITE | OCLOUT);
-    if (claGetError(1)) { 
-        matFreeTensor(r);
+    free(stride1);
+    free(stride2);
+    matFreeTensor(&conv);
+
+    if (kernel_error || (on == MAT_BACKEND_DEVICE && claGetError(1))) { 
+        if (into == NULL) matFreeTensor(r);
         return MAT_KERNEL_FAILURE;
     }
 
+    _matWroteResult(into, on);
+
     return MAT_NO_ERROR;
 }
 
 inline MatrixErr matAdd(Tensor *t1, Tensor *t2, Tensor **r) {
-    return _matSTDLinearCall(t1, t2, r, "matadd");
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_ADD, MAT_BACKEND_AUTO);
 }
 
 inline MatrixErr matSub(Tensor *t1, Tensor *t2, Tensor **r) {
-    return _matSTDLinearCall(t1, t2, r, "matsub");
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_SUB, MAT_BACKEND_AUTO);
 }
 
 inline MatrixErr matMult(Tensor *t1, Tensor *t2, Tensor **r) {
-    return _matSTDLinearCall(t1, t2, r, "matmul");
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_MULT, MAT_BACKEND_AUTO);
+}
+
+MatrixErr matAddOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_ADD, backend);
+}
+
+MatrixErr matSubOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_SUB, backend);
+}
+
+MatrixErr matMultOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    return _matSTDLinearCall(t1, t2, NULL, r, MAT_BINARY_MULT, backend);
+}
+
+// `matAdd` writing to the existing Tensor `r`, which may be one of the operands.
+/*
+ * `r` must be contiguous, with as many elements as the result. Its shape is left as is.
+ * */
+MatrixErr matAddInto(Tensor *t1, Tensor *t2, Tensor *r) {
+    Tensor *res;
+    return _matSTDLinearCall(t1, t2, r, &res, MAT_BINARY_ADD, MAT_BACKEND_AUTO);
+}
+
+// `matSub` writing to the existing Tensor `r`, see `matAddInto`.
+MatrixErr matSubInto(Tensor *t1, Tensor *t2, Tensor *r) {
+    Tensor *res;
+    return _matSTDLinearCall(t1, t2, r, &res, MAT_BINARY_SUB, MAT_BACKEND_AUTO);
+}
+
+// `matMult` writing to the existing Tensor `r`, see `matAddInto`.
+MatrixErr matMultInto(Tensor *t1, Tensor *t2, Tensor *r) {
+    Tensor *res;
+    return _matSTDLinearCall(t1, t2, r, &res, MAT_BINARY_MULT, MAT_BACKEND_AUTO);
+}
+
+// t -= s, in place. `s` may broadcast to the shape of `t`.
+MatrixErr matSubInPlace(Tensor *t, Tensor *s) {
+    return matSubInto(t, s, t);
+}
+
+// Check the Tensors of an update of `w` in place, and bring them to where it runs.
+/*
+ * `w`, and the state Tensors `s1` and `s2` (if not NULL), must be contiguous with as
+ * many elements, and all the Tensors share a dtype. `g` is read only, and gathered to
+ * `*gc` if strided. Runs where the Tensors are up to date, or by size, unless the
+ * backend is set.
+ * */
+static MatrixErr _matBeginUpdate(Tensor *w, Tensor *g, Tensor *s1, Tensor *s2, MatrixBackend *on, Tensor **gc) {
+    MatrixErr err;
+    if (matCheckTensor(w, &err) != MAT_NO_ERROR) return err;
+    if (matCheckTensor(g, &err) != MAT_NO_ERROR) return err;
+    if (!matIsTensorContiguous(w) || g->literal_size != w->literal_size) return MAT_DIMENSION_MISTMATCH;
+
+    Tensor *state[] = { s1, s2 };
+    for (int i = 0; i < 2; i++) {
+        if (state[i] == NULL) continue;
+        if (matCheckTensor(state[i], &err) != MAT_NO_ERROR) return err;
+        if (!matIsTensorContiguous(state[i]) || state[i]->literal_size != w->literal_size) return MAT_DIMENSION_MISTMATCH;
+    }
+    if (!_matSameDtype(w, g, s1) || !_matSameDtype(w, s2, NULL)) return MAT_DTYPE_MISMATCH;
+
+    int prefer_device = _matPreferDevice(w->literal_size, matcrossover.elementwise, w, g) ||
+                        _matIsDeviceDirty(s1) || _matIsDeviceDirty(s2);
+    if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, w->dtype, on)) != MAT_NO_ERROR) return err;
+
+    *gc = g;
+    if (!matIsTensorContiguous(g) && (*gc = _matGather(g, *on, &err)) == NULL) return err;
+
+    int sync_error;
+    if (*on == MAT_BACKEND_CPU)
+        sync_error = matTensorToHost(*gc) || matTensorToHost(w) ||
+                     (s1 != NULL && matTensorToHost(s1)) || (s2 != NULL && matTensorToHost(s2));
+    else
+        sync_error = _matSyncOperand(*gc) || _matSyncOperand(w) ||
+                     (s1 != NULL && _matSyncOperand(s1)) || (s2 != NULL && _matSyncOperand(s2));
+
+    if (sync_error) {
+        if (*gc != g) matFreeTensor(gc);
+        return MAT_KERNEL_FAILURE;
+    }
+
+    return MAT_NO_ERROR;
+}
+
+// Are all the Tensors written by an update resident, so its kernel isn't waited for.
+static inline int _matUpdateResident(Tensor *w, Tensor *s1, Tensor *s2) {
+    return matIsTensorResident(w) && (s1 == NULL || matIsTensorResident(s1)) && (s2 == NULL || matIsTensorResident(s2));
+}
+
+// Finish an update begun with `_matBeginUpdate`.
+static MatrixErr _matEndUpdate(Tensor *w, Tensor *g, Tensor *gc, Tensor *s1, Tensor *s2, MatrixBackend on, int kernel_error) {
+    kernel_error = kernel_error || (on == MAT_BACKEND_DEVICE && claGetError(1));
+
+    if (gc != g) matFreeTensor(&gc);
+    if (kernel_error) return MAT_KERNEL_FAILURE;
+
+    _matWroteResult(w, on);
+    _matWroteResult(s1, on);
+    _matWroteResult(s2, on);
+
+    return MAT_NO_ERROR;
+}
+
+// y += alpha * x, in place.
+/*
+ * `y` must be contiguous, and `x` have as many elements. A strided `x` is gathered first.
+ * */
+MatrixErr matAxpy(double alpha, Tensor *x, Tensor *y) {
+    MatrixBackend on;
+    Tensor *xc;
+    MatrixErr err = _matBeginUpdate(y, x, NULL, NULL, &on, &xc);
+    if (err != MAT_NO_ERROR) return err;
+
+    int kernel_error = 0;
+    size_t gz[] = { y->literal_size };
+    if (on == MAT_BACKEND_CPU && y->dtype == MAT_FLOAT32)
+        _matCpuAxpy32(alpha, xc->data32, y->data32, y->literal_size);
+    else if (on == MAT_BACKEND_CPU)
+        _matCpuAxpy(alpha, xc->data, y->data, y->literal_size);
+    else
+        kernel_error = MAT_RUN_KERNEL(_matUpdateResident(y, NULL, NULL), kernels[y->dtype].mataxpy, 1, gz, NULL, alpha,
+                                      MAT_KERNEL_DATA(xc, OCLREAD | OCLCPY),
+                                      MAT_KERNEL_DATA(y, OCLREAD | OCLWRITE | OCLCPY | OCLOUT));
+
+    return _matEndUpdate(y, x, xc, NULL, NULL, on, kernel_error);
+}
+
+// Momentum update of the weights `w` by their gradient `g`, in place, in one pass.
+/*
+ * v = momentum * v + g, w -= learning_rate * v.
+ * `v` - the velocity, contiguous with as many elements as `w`, starting as zeros.
+ * Optimizer state is best kept resident (see `matTensorToDevice`), so it stays on the device.
+ * */
+MatrixErr matMomentumUpdate(Tensor *w, Tensor *g, Tensor *v, double learning_rate, double momentum) {
+    if (v == NULL) return MAT_NULL_PTR;
+
+    MatrixBackend on;
+    Tensor *gc;
+    MatrixErr err = _matBeginUpdate(w, g, v, NULL, &on, &gc);
+    if (err != MAT_NO_ERROR) return err;
+
+    int kernel_error = 0;
+    size_t gz[] = { w->literal_size };
+    if (on == MAT_BACKEND_CPU && w->dtype == MAT_FLOAT32)
+        _matCpuMomentum32(learning_rate, momentum, gc->data32, v->data32, w->data32, w->literal_size);
+    else if (on == MAT_BACKEND_CPU)
+        _matCpuMomentum(learning_rate, momentum, gc->data, v->data, w->data, w->literal_size);
+    else
+        kernel_error = MAT_RUN_KERNEL(_matUpdateResident(w, v, NULL), kernels[w->dtype].matmomentum, 1, gz, NULL,
+                                      learning_rate, momentum,
+                                      MAT_KERNEL_DATA(gc, OCLREAD | OCLCPY),
+                                      MAT_KERNEL_DATA(v, OCLREAD | OCLWRITE | OCLCPY | OCLOUT),
+                                      MAT_KERNEL_DATA(w, OCLREAD | OCLWRITE | OCLCPY | OCLOUT));
+
+    return _matEndUpdate(w, g, gc, v, NULL, on, kernel_error);
+}
+
+// RMSProp update, see `matMomentumUpdate`.
+/*
+ * s = decay * s + (1 - decay) * g^2, w -= learning_rate * g / (sqrt(s) + epsilon).
+ * */
+MatrixErr matRMSPropUpdate(Tensor *w, Tensor *g, Tensor *s, double learning_rate, double decay, double epsilon) {
+    if (s == NULL) return MAT_NULL_PTR;
+
+    MatrixBackend on;
+    Tensor *gc;
+    MatrixErr err = _matBeginUpdate(w, g, s, NULL, &on, &gc);
+    if (err != MAT_NO_ERROR) return err;
+
+    int kernel_error = 0;
+    size_t gz[] = { w->literal_size };
+    if (on == MAT_BACKEND_CPU && w->dtype == MAT_FLOAT32)
+        _matCpuRMSProp32(learning_rate, decay, epsilon, gc->data32, s->data32, w->data32, w->literal_size);
+    else if (on == MAT_BACKEND_CPU)
+        _matCpuRMSProp(learning_rate, decay, epsilon, gc->data, s->data, w->data, w->literal_size);
+    else
+        kernel_error = MAT_RUN_KERNEL(_matUpdateResident(w, s, NULL), kernels[w->dtype].matrmsprop, 1, gz, NULL,
+                                      learning_rate, decay, epsilon,
+                                      MAT_KERNEL_DATA(gc, OCLREAD | OCLCPY),
+                                      MAT_KERNEL_DATA(s, OCLREAD | OCLWRITE | OCLCPY | OCLOUT),
+                                      MAT_KERNEL_DATA(w, OCLREAD | OCLWRITE | OCLCPY | OCLOUT));
+
+    return _matEndUpdate(w, g, gc, s, NULL, on, kernel_error);
+}
+
+// Adam update, see `matMomentumUpdate`. m and v are the moving averages of g and g^2.
+/*
+ * m = beta1 * m + (1 - beta1) * g, v = beta2 * v + (1 - beta2) * g^2,
+ * w -= learning_rate * m' / (sqrt(v') + epsilon), with m' and v' bias corrected for `step`.
+ * `step` - number of this update, from 1.
+ * */
+MatrixErr matAdamUpdate(Tensor *w, Tensor *g, Tensor *m, Tensor *v, double learning_rate,
+                        double beta1, double beta2, double epsilon, int step) {
+    if (m == NULL || v == NULL) return MAT_NULL_PTR;
+    if (step < 1) return MAT_DIMENSION_MISTMATCH;
+
+    MatrixBackend on;
+    Tensor *gc;
+    MatrixErr err = _matBeginUpdate(w, g, m, v, &on, &gc);
+    if (err != MAT_NO_ERROR) return err;
+
+    double c1 = 1 / (1 - pow(beta1, step));
+    double c2 = 1 / (1 - pow(beta2, step));
+
+    int kernel_error = 0;
+    size_t gz[] = { w->literal_size };
+    if (on == MAT_BACKEND_CPU && w->dtype == MAT_FLOAT32)
+        _matCpuAdam32(learning_rate, beta1, beta2, epsilon, c1, c2, gc->data32, m->data32, v->data32, w->data32, w->literal_size);
+    else if (on == MAT_BACKEND_CPU)
+        _matCpuAdam(learning_rate, beta1, beta2, epsilon, c1, c2, gc->data, m->data, v->data, w->data, w->literal_size);
+    else
+        kernel_error = MAT_RUN_KERNEL(_matUpdateResident(w, m, v), kernels[w->dtype].matadam, 1, gz, NULL,
+                                      learning_rate, beta1, beta2, epsilon, c1, c2,
+                                      MAT_KERNEL_DATA(gc, OCLREAD | OCLCPY),
+                                      MAT_KERNEL_DATA(m, OCLREAD | OCLWRITE | OCLCPY | OCLOUT),
+                                      MAT_KERNEL_DATA(v, OCLREAD | OCLWRITE | OCLCPY | OCLOUT),
+                                      MAT_KERNEL_DATA(w, OCLREAD | OCLWRITE | OCLCPY | OCLOUT));
+
+    return _matEndUpdate(w, g, gc, m, v, on, kernel_error);
+}
+
+// f(t), or u * f'(t) if `u` is given, into `into` or a new Tensor shaped as `t`.
+static MatrixErr _matActivationOn(Tensor *t, Tensor *u, MatrixActivation f, Tensor *into, Tensor **r) {
+    if (r == NULL) return MAT_NULL_PTR;
+    *r = NULL;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if (matCheckTensor(t, &err) != MAT_NO_ERROR) return err;
+        if (u != NULL && matCheckTensor(u, &err) != MAT_NO_ERROR) return err;
+        if (u != NULL && u->literal_size != t->literal_size) return MAT_DIMENSION_MISTMATCH;
+        if (!_matSameDtype(t, u, NULL)) return MAT_DTYPE_MISMATCH;
+
+        int prefer_device = _matPreferDevice(t->literal_size, matcrossover.elementwise, t, u);
+        if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, t->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    int resident = on == MAT_BACKEND_DEVICE &&
+                   ((into == NULL)? matIsTensorResident(t) || (u != NULL && matIsTensorResident(u)) : matIsTensorResident(into));
+
+    // Strided operands are gathered, the kernels read linearly.
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *tc = t;
+    Tensor *uc = u;
+    if (!matIsTensorContiguous(t)) tc = _matGather(t, on, &error);
+    if (tc != NULL && u != NULL && !matIsTensorContiguous(u)) uc = _matGather(u, on, &error);
+    if (tc == NULL || (u != NULL && uc == NULL)) goto Cleanup;
+
+    if ((error = _matMakeResult(into, t->ndims, t->dimsz, t->dtype, r)) != MAT_NO_ERROR) goto Cleanup;
+    Tensor *res = *r;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(tc) || (uc != NULL && matTensorToHost(uc));
+        if (kernel_error);
+        else if (t->dtype == MAT_FLOAT32 && uc == NULL) _matCpuActivation32(tc->data32, f, res->data32, res->literal_size);
+        else if (t->dtype == MAT_FLOAT32) _matCpuActivationDerive32(tc->data32, uc->data32, f, res->data32, res->literal_size);
+        else if (uc == NULL) _matCpuActivation(tc->data, f, res->data, res->literal_size);
+        else _matCpuActivationDerive(tc->data, uc->data, f, res->data, res->literal_size);
+    } else {
+        kernel_error = _matSyncOperand(tc) || (uc != NULL && _matSyncOperand(uc));
+        if (!kernel_error && resident && into == NULL) kernel_error = _matMakeResidentResult(res);
+
+        size_t gz[] = { res->literal_size };
+        if (!kernel_error && uc == NULL)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[t->dtype].matactivation, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(tc, OCLREAD | OCLCPY), (int) f,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT));
+        else if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[t->dtype].matactivationderive, 1, gz, NULL,
+                                          MAT_KERNEL_DATA(tc, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(uc, OCLREAD | OCLCPY), (int) f,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT));
+        kernel_error = kernel_error || claGetError(1);
+    }
+
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(r);
+        *r = NULL;
+        error = MAT_KERNEL_FAILURE;
+    } else _matWroteResult(into, on);
+
+    Cleanup:
+    if (tc != t) matFreeTensor(&tc);
+    if (uc != u) matFreeTensor(&uc);
+
+    return error;
+}
+
+// Element-wise activation function, f(t).
+MatrixErr matActivation(Tensor *t, MatrixActivation f, Tensor **r) {
+    return _matActivationOn(t, NULL, f, NULL, r);
+}
+
+// `matActivation` writing to the existing Tensor `r`, see `matAddInto`.
+MatrixErr matActivationInto(Tensor *t, MatrixActivation f, Tensor *r) {
+    Tensor *res;
+    return _matActivationOn(t, NULL, f, r, &res);
+}
+
+// The derivative `u` of f(t) through the activation function, u * f'(t), in one pass.
+/*
+ * `u` must have as many elements as `t`. The result is shaped as `t`.
+ * */
+MatrixErr matActivationDerive(Tensor *t, Tensor *u, MatrixActivation f, Tensor **r) {
+    if (u == NULL) return MAT_NULL_PTR;
+    return _matActivationOn(t, u, f, NULL, r);
 }
 
-// PERF: LONG TERM : making a "numpy view"-like implementation, just like previus commits.
+// Sizes of a dense layer, for weights `w` {in + 1, out} and inputs `x`.
+/*
+ * `x` is a single input of `in` elements, or a batch {in, n}.
+ * */
+static MatrixErr _matDenseSizes(Tensor *w, Tensor *x, unsigned *in, unsigned *out, unsigned *n, int *batch) {
+    MatrixErr err;
+    if (matCheckTensor(w, &err) != MAT_NO_ERROR) return err;
+    if (matCheckTensor(x, &err) != MAT_NO_ERROR) return err;
+    if (w->ndims != 2 || w->dimsz[0] < 2 || !matIsTensorContiguous(w)) return MAT_DIMENSION_MISTMATCH;
+    if (x->dtype != w->dtype) return MAT_DTYPE_MISMATCH;
+
+    *in = w->dimsz[0] - 1;
+    *out = w->dimsz[1];
+    *batch = x->ndims == 2 && x->dimsz[0] == *in;
+    *n = *batch? x->dimsz[1] : 1;
+    if (!*batch && x->literal_size != *in) return MAT_DIMENSION_MISTMATCH;
+
+    return MAT_NO_ERROR;
+}
+
+static MatrixErr _matDenseOn(Tensor *w, Tensor *x, MatrixActivation f, Tensor *into, Tensor **r) {
+    if (r == NULL) return MAT_NULL_PTR;
+    *r = NULL;
+    unsigned in, out, n;
+    int batch;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if ((err = _matDenseSizes(w, x, &in, &out, &n, &batch)) != MAT_NO_ERROR) return err;
+
+        int prefer_device = _matPreferDevice((size_t) in * out * n, matcrossover.prod, w, x);
+        if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, w->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    int resident = on == MAT_BACKEND_DEVICE &&
+                   ((into == NULL)? matIsTensorResident(w) || matIsTensorResident(x) : matIsTensorResident(into));
+
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *xc = matIsTensorContiguous(x)? x : _matGather(x, on, &error);
+    if (xc == NULL) return error;
+
+    if ((error = _matMakeResult(into, batch? 2 : 1, (unsigned []) { out, n }, w->dtype, r)) != MAT_NO_ERROR) goto Cleanup;
+    Tensor *res = *r;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(w) || matTensorToHost(xc);
+        if (!kernel_error && w->dtype == MAT_FLOAT32) _matCpuDense32(w->data32, xc->data32, res->data32, in, out, n, f);
+        else if (!kernel_error) _matCpuDense(w->data, xc->data, res->data, in, out, n, f);
+    } else {
+        kernel_error = _matSyncOperand(w) || _matSyncOperand(xc);
+        if (!kernel_error && resident && into == NULL) kernel_error = _matMakeResidentResult(res);
+
+        size_t gz[] = { out, n };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[w->dtype].matdense, 2, gz, NULL,
+                                          MAT_KERNEL_DATA(w, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(xc, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          (int) in, (int) out, (int) f);
+        kernel_error = kernel_error || claGetError(1);
+    }
+
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(r);
+        *r = NULL;
+        error = MAT_KERNEL_FAILURE;
+    } else _matWroteResult(into, on);
+
+    Cleanup:
+    if (xc != x) matFreeTensor(&xc);
+
+    return error;
+}
+
+// Fused dense layer, f(w * [x; 1]), a product, bias and activation in one pass.
+/*
+ * `w` - contiguous weights {in + 1, out}, with the bias as the last column.
+ * `x` - a single input of `in` elements, or a batch {in, n} (see `matTensorStack`).
+ * `f` - the activation, or MAT_ACTIVATION_NONE.
+ * `r` - the output, {out} or {out, n}.
+ * */
+MatrixErr matDense(Tensor *w, Tensor *x, MatrixActivation f, Tensor **r) {
+    return _matDenseOn(w, x, f, NULL, r);
+}
+
+// `matDense` writing to the existing Tensor `r`, see `matProdInto`.
+MatrixErr matDenseInto(Tensor *w, Tensor *x, MatrixActivation f, Tensor *r) {
+    Tensor *res;
+    return _matDenseOn(w, x, f, r, &res);
+}
+
+// Derivatives of `matDense` by its weights and inputs, from its output.
+/*
+ * `y` - the output of `matDense(w, x, f)`.
+ * `u` - the upstream derivative, with as many elements as `y`.
+ * `dw` - the derivative by `w`, summed over a batch, shaped as `w`.
+ * `dx` - the derivative by `x`, shaped as `x`.
+ * */
+MatrixErr matDenseDerive(Tensor *w, Tensor *x, Tensor *y, Tensor *u, MatrixActivation f, Tensor **dw, Tensor **dx) {
+    if (dw == NULL || dx == NULL) return MAT_NULL_PTR;
+    *dw = *dx = NULL;
+    unsigned in, out, n;
+    int batch;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if ((err = _matDenseSizes(w, x, &in, &out, &n, &batch)) != MAT_NO_ERROR) return err;
+        if (matCheckTensor(y, &err) != MAT_NO_ERROR) return err;
+        if (matCheckTensor(u, &err) != MAT_NO_ERROR) return err;
+        if (y->literal_size != (size_t) out * n || u->literal_size != y->literal_size) return MAT_DIMENSION_MISTMATCH;
+        if (!_matSameDtype(w, y, u)) return MAT_DTYPE_MISMATCH;
+
+        int prefer_device = _matPreferDevice((size_t) 2 * in * out * n, matcrossover.prod, w, u) || _matIsDeviceDirty(y);
+        if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, w->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    int resident = on == MAT_BACKEND_DEVICE && (matIsTensorResident(w) || matIsTensorResident(u));
+
+    // x, y and u, gathered if strided.
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *src[] = { x, y, u };
+    Tensor *c[] = { NULL, NULL, NULL };
+    for (int i = 0; i < 3; i++) {
+        c[i] = matIsTensorContiguous(src[i])? src[i] : _matGather(src[i], on, &error);
+        if (c[i] == NULL) goto Cleanup;
+    }
+
+    if ((error = _matMakeResult(NULL, 2, w->dimsz, w->dtype, dw)) != MAT_NO_ERROR) goto Cleanup;
+    if ((error = _matMakeResult(NULL, x->ndims, x->dimsz, w->dtype, dx)) != MAT_NO_ERROR) goto Cleanup;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(w) || matTensorToHost(c[0]) || matTensorToHost(c[1]) || matTensorToHost(c[2]);
+        if (!kernel_error && w->dtype == MAT_FLOAT32)
+            _matCpuDenseDerive32(w->data32, c[0]->data32, c[1]->data32, c[2]->data32, (*dw)->data32, (*dx)->data32,
+                                 in, out, n, f);
+        else if (!kernel_error)
+            _matCpuDenseDerive(w->data, c[0]->data, c[1]->data, c[2]->data, (*dw)->data, (*dx)->data, in, out, n, f);
+    } else {
+        kernel_error = _matSyncOperand(w) || _matSyncOperand(c[0]) || _matSyncOperand(c[1]) || _matSyncOperand(c[2]);
+        if (!kernel_error && resident) kernel_error = _matMakeResidentResult(*dw) || _matMakeResidentResult(*dx);
+
+        size_t wgz[] = { in + 1, out };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[w->dtype].matdenseweights, 2, wgz, NULL,
+                                          MAT_KERNEL_DATA(c[2], OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(c[1], OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(c[0], OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(*dw, OCLWRITE | OCLOUT),
+                                          (int) in, (int) out, (int) n, (int) f);
+
+        size_t xgz[] = { in, n };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[w->dtype].matdenseinput, 2, xgz, NULL,
+                                          MAT_KERNEL_DATA(c[2], OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(c[1], OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(w, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(*dx, OCLWRITE | OCLOUT),
+                                          (int) in, (int) out, (int) f);
+        kernel_error = kernel_error || claGetError(1);
+    }
+
+    if (kernel_error) error = MAT_KERNEL_FAILURE;
+
+    Cleanup:
+    for (int i = 0; i < 3; i++)
+        if (c[i] != src[i]) matFreeTensor(&c[i]);
+
+    if (error != MAT_NO_ERROR) {
+        matFreeTensor(dw);
+        matFreeTensor(dx);
+    }
+
+    return error;
+}
+
+// int8 weights for `matQuantizedProd`, symmetric with a scale per row (output channel).
+/*
+ * `w` - weights {in, out}, a row of `in` elements per output, as in `matDot(w, x)`.
+ * `q` - round(w / scale) of each row, MAT_INT8 shaped as `w`.
+ * `scale` - MAT_FLOAT32 {out}, max |w| / 127 of each row, so each row spans [-127, 127].
+ * Runs on the host, the results aren't resident.
+ * */
+MatrixErr matQuantize(Tensor *w, Tensor **q, Tensor **scale) {
+    if (q == NULL || scale == NULL) return MAT_NULL_PTR;
+    *q = *scale = NULL;
+    {
+        MatrixErr err;
+        if (matCheckTensor(w, &err) != MAT_NO_ERROR) return err;
+        if (w->ndims != 2) return MAT_DIMENSION_MISTMATCH;
+    }
+
+    unsigned in = w->dimsz[0];
+    unsigned out = w->dimsz[1];
+
+    // A contiguous float32 copy, scaled in place.
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *wf = matTensorCast(w, MAT_FLOAT32, &error);
+    if (wf == NULL) return error;
+    if (matTensorToHost(wf)) {
+        error = MAT_KERNEL_FAILURE;
+        goto Cleanup;
+    }
+
+    if ((error = _matMakeResult(NULL, 2, w->dimsz, MAT_INT8, q)) != MAT_NO_ERROR) goto Cleanup;
+    if ((error = _matMakeResult(NULL, 1, &out, MAT_FLOAT32, scale)) != MAT_NO_ERROR) goto Cleanup;
+
+    for (unsigned o = 0; o < out; o++) {
+        float *row = wf->data32 + (size_t) o * in;
+
+        float max = 0;
+        for (unsigned k = 0; k < in; k++) max = MAX(max, fabsf(row[k]));
+        // A row of zeros stays zeros.
+        float s = (max > 0)? max / 127 : 1;
+
+        for (unsigned k = 0; k < in; k++) row[k] /= s;
+        (*scale)->data32[o] = s;
+    }
+    _matCpuNarrow(wf->data32, (*q)->data8, MAT_INT8, wf->literal_size);
+
+    Cleanup:
+    matFreeTensor(&wf);
+    if (error != MAT_NO_ERROR) {
+        matFreeTensor(q);
+        matFreeTensor(scale);
+    }
+
+    return error;
+}
+
+static MatrixErr _matQuantizedProdOn(Tensor *q, Tensor *scale, Tensor *x, double x_scale, Tensor *into, Tensor **r) {
+    if (r == NULL) return MAT_NULL_PTR;
+    *r = NULL;
+    unsigned in, out, n;
+    int batch;
+    MatrixBackend on;
+    {
+        MatrixErr err;
+        if (matCheckTensor(q, &err) != MAT_NO_ERROR) return err;
+        if (matCheckTensor(scale, &err) != MAT_NO_ERROR) return err;
+        if (matCheckTensor(x, &err) != MAT_NO_ERROR) return err;
+        if (q->dtype != MAT_INT8 || scale->dtype != MAT_FLOAT32) return MAT_DTYPE_MISMATCH;
+        if (matIsDtypeStorage(x->dtype)) return MAT_DTYPE_UNSUPPORTED;
+        if (q->ndims != 2 || !matIsTensorContiguous(q)) return MAT_DIMENSION_MISTMATCH;
+        if (!matIsTensorContiguous(scale) || scale->literal_size != q->dimsz[1]) return MAT_DIMENSION_MISTMATCH;
+
+        in = q->dimsz[0];
+        out = q->dimsz[1];
+        batch = x->ndims == 2 && x->dimsz[0] == in;
+        n = batch? x->dimsz[1] : 1;
+        if (!batch && x->literal_size != in) return MAT_DIMENSION_MISTMATCH;
+
+        int prefer_device = _matPreferDevice((size_t) in * out * n, matcrossover.prod, q, x);
+        if ((err = _matResolveBackend(MAT_BACKEND_AUTO, prefer_device, x->dtype, &on)) != MAT_NO_ERROR) return err;
+    }
+
+    int resident = on == MAT_BACKEND_DEVICE &&
+                   ((into == NULL)? matIsTensorResident(q) || matIsTensorResident(x) : matIsTensorResident(into));
+
+    MatrixErr error = MAT_NO_ERROR;
+    Tensor *xc = matIsTensorContiguous(x)? x : _matGather(x, on, &error);
+    if (xc == NULL) return error;
+
+    // Dynamic quantization, from the range of this input.
+    if (x_scale <= 0) {
+        if (matTensorToHost(xc)) {
+            error = MAT_KERNEL_FAILURE;
+            goto Cleanup;
+        }
+
+        double max = 0;
+        for (size_t i = 0; i < xc->literal_size; i++) max = MAX(max, fabs(_matGetElement(xc, i)));
+        x_scale = (max > 0)? max / 127 : 1;
+    }
+
+    if ((error = _matMakeResult(into, batch? 2 : 1, (unsigned []) { out, n }, x->dtype, r)) != MAT_NO_ERROR) goto Cleanup;
+    Tensor *res = *r;
+
+    int kernel_error = 0;
+    if (on == MAT_BACKEND_CPU) {
+        kernel_error = matTensorToHost(q) || matTensorToHost(scale) || matTensorToHost(xc);
+        if (!kernel_error && x->dtype == MAT_FLOAT32)
+            _matCpuQuantizedProd32(q->data8, scale->data32, xc->data32, x_scale, res->data32, in, out, n);
+        else if (!kernel_error)
+            _matCpuQuantizedProd(q->data8, scale->data32, xc->data, x_scale, res->data, in, out, n);
+    } else {
+        kernel_error = _matSyncOperand(q) || _matSyncOperand(scale) || _matSyncOperand(xc);
+        if (!kernel_error && resident && into == NULL) kernel_error = _matMakeResidentResult(res);
+
+        size_t gz[] = { out, n };
+        if (!kernel_error)
+            kernel_error = MAT_RUN_KERNEL(resident, kernels[x->dtype].matqprod, 2, gz, NULL,
+                                          MAT_KERNEL_DATA(q, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(scale, OCLREAD | OCLCPY),
+                                          MAT_KERNEL_DATA(xc, OCLREAD | OCLCPY),
+                                          x_scale,
+                                          MAT_KERNEL_DATA(res, OCLWRITE | OCLOUT),
+                                          (int) in, (int) out);
+        kernel_error = kernel_error || claGetError(1);
+    }
+
+    if (kernel_error) {
+        if (into == NULL) matFreeTensor(r);
+        *r = NULL;
+        error = MAT_KERNEL_FAILURE;
+    } else _matWroteResult(into, on);
+
+    Cleanup:
+    if (xc != x) matFreeTensor(&xc);
+
+    return error;
+}
+
+// Product of int8 weights and inputs quantized to int8, (q * round(x / x_scale)) * scale * x_scale.
+/*
+ * The products are summed in int32, on the CPU with AVX2 (pmaddubsw) or AVX-512 VNNI
+ * (vpdpbusd) when supported.
+ * `q`, `scale` - int8 weights {in, out} and the float32 scale of each row, see `matQuantize`.
+ * `x` - a single input of `in` elements, or a batch {in, n} (see `matTensorStack`), of
+ * a compute dtype, which the result has.
+ * `x_scale` - the step of the quantized inputs, e.g. max |x| / 127 over calibration
+ * inputs. Inputs past 127 steps saturate. 0 takes max |x| / 127 of `x` itself.
+ * `r` - the output, {out} or {out, n}, as `matDot(w, x)` of the weights `w` quantized.
+ * */
+MatrixErr matQuantizedProd(Tensor *q, Tensor *scale, Tensor *x, double x_scale, Tensor **r) {
+    return _matQuantizedProdOn(q, scale, x, x_scale, NULL, r);
+}
+
+// `matQuantizedProd` writing to the existing Tensor `r`, see `matProdInto`.
+MatrixErr matQuantizedProdInto(Tensor *q, Tensor *scale, Tensor *x, double x_scale, Tensor *r) {
+    Tensor *res;
+    return _matQuantizedProdOn(q, scale, x, x_scale, r, &res);
+}
+
+static MatrixErr _matTTensorOn(Tensor *t, Tensor *into, Tensor **r, MatrixBackend backend);
+
+// A transposed copy, see `matTTensorView` for a transposed view of the same data.
 MatrixErr matTTensor(Tensor *t, Tensor **r) {
+    return matTTensorOn(t, r, MAT_BACKEND_AUTO);
+}
+
+// Moves the last dimension to the front.
+/*
+ * The transposed view of the source, gathered into a new contiguous Tensor.
+ * Without an explicit backend, only runs on the device if the data is only there.
+ * */
+MatrixErr matTTensorOn(Tensor *t, Tensor **r, MatrixBackend backend) {
+    return _matTTensorOn(t, NULL, r, backend);
+}
+
+// `matTTensor` writing to the existing Tensor `r`, see `matProdInto`.
+/*
+ * `r` must not share data with `t`.
+ * */
+MatrixErr matTTensorInto(Tensor *t, Tensor *r) {
+    Tensor *res;
+    return _matTTensorOn(t, r, &res, MAT_BACKEND_AUTO);
+}
+
+static MatrixErr _matTTensorOn(Tensor *t, Tensor *into, Tensor **r, MatrixBackend backend) {
+    MatrixBackend on;
     {
         MatrixErr err;
         if (matCheckTensor(t, &err)) return err;
+        // Storage only dtypes are gathered on the host.
+        if (matIsDtypeStorage(t->dtype)) on = MAT_BACKEND_CPU;
+        else if ((err = _matResolveBackend(backend, _matIsDeviceDirty(t), t->dtype, &on)) != MAT_NO_ERROR) return err;
     }
     if (r == NULL) return MAT_NULL_PTR;
     *r = NULL;
 
-    unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * t->ndims);
-    dimsz[0] = t->dimsz[t->ndims - 1];
-    for (int i = 1; i < t->ndims; i++) dimsz[i] = t->dimsz[i - 1];
+    MatrixErr err;
+    if (t->ndims == 0 && into == NULL) {
+        *r = matTensorDeepCopy(t, &err);
+        return err;
+    }
 
-    Tensor *res = matMakeTensor(t->ndims, dimsz, NULL);
-    res->data = (double *) malloc(sizeof(double) * res->literal_size);
-    free(dimsz);
+    if (t->ndims == 0 || (on == MAT_BACKEND_CPU && matIsTensorContiguous(t) && !matIsDtypeStorage(t->dtype))) {
+        // A plain 2D transpose of the last dimension by all the others, in cache blocks.
+        if ((err = matTensorToHost(t)) != MAT_NO_ERROR) return err;
 
-    // Copy the data, offset.
-    for (int i = 0; i < t->literal_size; i++) {
-        unsigned *ind = matTensorIAt(t, i, NULL);
+        unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned) * (t->ndims? t->ndims : 1));
+        if (t->ndims) dimsz[0] = t->dimsz[t->ndims - 1];
+        for (int i = 1; i < t->ndims; i++) dimsz[i] = t->dimsz[i - 1];
 
-        unsigned last = ind[t->ndims - 1];
-        for (int j = t->ndims; j --> 0;) ind[j] = ind[j - 1];
-        ind[0] = last;
-        
-        *matTensorAtI(res, ind, NULL) = t->data[i];
+        Tensor *res;
+        err = _matMakeResult(into, t->ndims, dimsz, t->dtype, &res);
+        free(dimsz);
+        if (err != MAT_NO_ERROR) return err;
 
-        free(ind);
+        int D = t->ndims? t->dimsz[t->ndims - 1] : 1;
+        if (t->ndims == 0) _matSetElement(res, 0, _matGetElement(t, t->offset));
+        else if (t->dtype == MAT_FLOAT32) _matCpuTranspose32(t->data32, res->data32, t->literal_size / D, D);
+        else _matCpuTranspose(t->data, res->data, t->literal_size / D, D);
+        _matWroteResult(into, MAT_BACKEND_CPU);
+        *r = res;
+
+        return MAT_NO_ERROR;
     }
 
-    *r = res;
+    Tensor *view = matTTensorView(t, &err);
+    if (view == NULL) return err;
+    *r = _matGatherInto(view, into, on, &err);
+    matFreeTensor(&view);
 
-    return MAT_NO_ERROR;
+    return err;
 }
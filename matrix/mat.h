@@ -1,6 +1,7 @@
 #ifndef MAT_H
 #define MAT_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -19,16 +20,75 @@
 #define printf_m(str, ...)
 #endif
 
+// Which copy of a device resident Tensor holds the latest data.
+typedef enum {
+    MAT_SYNCED=0,
+    // `data` was written on the host and the device copy is stale.
+    MAT_HOST_DIRTY,
+    // The device copy was written by a kernel and `data` is stale.
+    MAT_DEVICE_DIRTY
+} MatrixSync;
+
+// Bump allocator for Tensors, see `matMakeArena`.
+typedef struct _mat_arena MatrixArena;
+
+// Element type of a Tensor's data.
+typedef enum {
+    // `data`, the default.
+    MAT_FLOAT64=0,
+    // `data32`, half the memory and bandwidth, and much faster on most devices.
+    MAT_FLOAT32,
+    // `data16`, storage only: IEEE half precision, and bfloat16 (the top half of
+    // a float32). Copied, converted, and multiplied by `matProd` and `matDot` in
+    // float32, other operations return MAT_DTYPE_UNSUPPORTED.
+    MAT_FLOAT16,
+    MAT_BFLOAT16,
+    // `data8`, storage only: integers, converted by rounding to nearest and saturating.
+    // The quantized weights of `matQuantizedProd`, see `matQuantize`.
+    MAT_INT8
+} MatrixDtype;
+
+// Number of `MatrixDtype`s.
+#define MAT_DTYPES 5
+// Dtypes operations compute in, the first ones. The others are storage only.
+#define MAT_COMPUTE_DTYPES 2
+
 // Tensor accelerated
-// Guarenteed to be contigues
+// Contiguous, unless it is a strided view. See `matIsTensorContiguous`.
 // ndims = 0 => scalar.
-typedef struct {
+typedef struct _mat_tensor {
     unsigned *dimsz;
     unsigned ndims;
 
     size_t literal_size;
 
-    double *data;
+    // The data, read through the member of its dtype. Operands of an operation
+    // must share a dtype, which the result has as well. See `matTensorCast`.
+    union {
+        double *data;
+        float *data32;
+        uint16_t *data16;
+        int8_t *data8;
+    };
+    MatrixDtype dtype;
+
+    // Element stride of each dimension, or NULL if contiguous. Element `ind`
+    // is at data[offset + ind[0] * stride[0] + ind[1] * stride[1] + ...].
+    unsigned *stride;
+    size_t offset;
+    // The Tensor a view shares its data with, or NULL if it owns its data.
+    // A view must not outlive it.
+    struct _mat_tensor *_base;
+
+    // Persistent device copy of `data`, or NULL if the Tensor is
+    // host only. Managed by mat.h, see `matTensorToDevice`.
+    // Always NULL for views, which use the one of their base.
+    cl_mem _device_data;
+    MatrixSync _sync;
+
+    // Arena the Tensor and its fields were allocated from, or NULL if they
+    // were malloc'd. See `matSetArena`.
+    MatrixArena *_arena;
 } Tensor;
 
 typedef enum {
@@ -42,17 +102,88 @@ typedef enum {
     MAT_UNFIT_TENSORS,
     MAT_TENSOR_NO_DATA,
     MAT_TENSOR_NO_DIMS,
-    MAT_NULL_PTR
+    MAT_NULL_PTR,
+    MAT_DTYPE_MISMATCH,
+    MAT_DTYPE_UNSUPPORTED
 } MatrixErr;
 
+// Where mat.h operations run.
+typedef enum {
+    // Chosen per operation by operand size, see `MatrixCrossover`.
+    MAT_BACKEND_AUTO=0,
+    // The OpenCL device `oclapi` was initialized with.
+    MAT_BACKEND_DEVICE,
+    // The native CPU backend, see `matGetCpuIsa`.
+    MAT_BACKEND_CPU
+} MatrixBackend;
+
+// Element-wise activation functions, see `matActivation`.
+// NOTE: Must match the defines in mat.cl.
+typedef enum {
+    MAT_ACTIVATION_RELU=0,
+    MAT_ACTIVATION_SIGMOID,
+    MAT_ACTIVATION_TANH,
+    // The identity.
+    MAT_ACTIVATION_NONE
+} MatrixActivation;
+
+// Instruction set used by the CPU backend.
+typedef enum {
+    MAT_CPU_SCALAR=0,
+    MAT_CPU_AVX2,
+    MAT_CPU_AVX512
+} MatrixCpuIsa;
+
+// Sizes from which operations on host Tensors run on the device, see `matCalibrate`.
+typedef struct {
+    // Elements of the result of `matAdd`, `matSub` and `matMult`.
+    size_t elementwise;
+    // Multiply-adds of `matProd`, M * N * K for matrices.
+    size_t prod;
+    // Multiply-adds of `matDot` of nD Tensors.
+    size_t dot;
+    // Elements summed by `matSum`.
+    size_t sum;
+} MatrixCrossover;
+
 MatrixErr matInit();
+MatrixErr matSetProfile(const char *path);
+MatrixErr matCalibrate();
+MatrixCrossover matGetCrossover();
+void matSetCrossover(MatrixCrossover crossover);
+MatrixErr matSetBackend(MatrixBackend backend);
+MatrixBackend matGetBackend();
+MatrixCpuIsa matGetCpuIsa();
+MatrixErr matSetCpuIsa(MatrixCpuIsa isa);
+
+MatrixArena* matMakeArena(size_t size);
+void matFreeArena(MatrixArena **arena);
+void* matArenaAlloc(MatrixArena *arena, size_t size);
+void matArenaReset(MatrixArena *arena);
+MatrixArena* matSetArena(MatrixArena *arena);
+MatrixArena* matGetArena();
+
 Tensor* matMakeTensor(unsigned ndims, unsigned *dims, MatrixErr *e);
+void* matTensorAlloc(Tensor *t, size_t size);
 Tensor* matTensorDeepCopy(Tensor *t, MatrixErr *e);
+Tensor* matTensorCast(Tensor *t, MatrixDtype dtype, MatrixErr *e);
+MatrixErr matTensorSetDtype(Tensor *t, MatrixDtype dtype);
+double matTensorGetI(Tensor *t, unsigned *ind, MatrixErr *e);
 double* matTensorAtI(Tensor *t, unsigned *ind, MatrixErr *e);
 unsigned *matTensorIAt(Tensor *t, int literal, MatrixErr *e);
 MatrixErr matTensorFit(Tensor *t1, Tensor *t2, Tensor **t1r, Tensor **t2r);
 void matTensorPrint(Tensor *t);
 
+Tensor* matTTensorView(Tensor *t, MatrixErr *e);
+Tensor* matTensorReshape(Tensor *t, unsigned ndims, unsigned *dims, MatrixErr *e);
+Tensor* matTensorSlice(Tensor *t, unsigned dim, unsigned start, unsigned end, MatrixErr *e);
+Tensor* matTensorStack(Tensor *tensors, unsigned n, MatrixErr *e);
+MatrixErr matTensorUnstack(Tensor *t, Tensor **r);
+
+MatrixErr matTensorToDevice(Tensor *t);
+MatrixErr matTensorToHost(Tensor *t);
+MatrixErr matTensorReleaseDevice(Tensor *t);
+
 MatrixErr matProd(Tensor *t1, Tensor *t2, Tensor **r);
 MatrixErr matMult(Tensor *t1, Tensor *t2, Tensor **r);
 MatrixErr matDot(Tensor *t1, Tensor *t2, Tensor **r);
@@ -61,8 +192,55 @@ MatrixErr matSub(Tensor *t1, Tensor *t2, Tensor **r);
 
 MatrixErr matTTensor(Tensor *t, Tensor **r);
 
+// Same as the above, writing to an existing contiguous Tensor of the result's size.
+MatrixErr matProdInto(Tensor *t1, Tensor *t2, Tensor *r);
+MatrixErr matMultInto(Tensor *t1, Tensor *t2, Tensor *r);
+MatrixErr matDotInto(Tensor *t1, Tensor *t2, Tensor *r);
+MatrixErr matAddInto(Tensor *t1, Tensor *t2, Tensor *r);
+MatrixErr matSubInto(Tensor *t1, Tensor *t2, Tensor *r);
+MatrixErr matTTensorInto(Tensor *t, Tensor *r);
+
+// In place, on a contiguous Tensor.
+MatrixErr matSubInPlace(Tensor *t, Tensor *s);
+MatrixErr matAxpy(double alpha, Tensor *x, Tensor *y);
+
+// Activation functions, and the derivative `u` through them at their input `t`.
+MatrixErr matActivation(Tensor *t, MatrixActivation f, Tensor **r);
+MatrixErr matActivationInto(Tensor *t, MatrixActivation f, Tensor *r);
+MatrixErr matActivationDerive(Tensor *t, Tensor *u, MatrixActivation f, Tensor **r);
+
+// Fused dense layer f(w * [x; 1]), with the bias as the last column of `w`, and its derivatives.
+MatrixErr matDense(Tensor *w, Tensor *x, MatrixActivation f, Tensor **r);
+MatrixErr matDenseInto(Tensor *w, Tensor *x, MatrixActivation f, Tensor *r);
+MatrixErr matDenseDerive(Tensor *w, Tensor *x, Tensor *y, Tensor *u, MatrixActivation f, Tensor **dw, Tensor **dx);
+
+// int8 weights with a float32 scale per row, and their product with inputs quantized to int8.
+MatrixErr matQuantize(Tensor *w, Tensor **q, Tensor **scale);
+MatrixErr matQuantizedProd(Tensor *q, Tensor *scale, Tensor *x, double x_scale, Tensor **r);
+MatrixErr matQuantizedProdInto(Tensor *q, Tensor *scale, Tensor *x, double x_scale, Tensor *r);
+
+// Optimizer updates of the weights `w` by their gradient `g` and state, in place.
+MatrixErr matMomentumUpdate(Tensor *w, Tensor *g, Tensor *v, double learning_rate, double momentum);
+MatrixErr matRMSPropUpdate(Tensor *w, Tensor *g, Tensor *s, double learning_rate, double decay, double epsilon);
+MatrixErr matAdamUpdate(Tensor *w, Tensor *g, Tensor *m, Tensor *v, double learning_rate,
+                        double beta1, double beta2, double epsilon, int step);
+
 MatrixErr matSum(double *src, int size, double *res);
 
+// Reductions of one dimension of a Tensor, which is removed from the result.
+MatrixErr matSumAxis(Tensor *t, unsigned dim, Tensor **r);
+MatrixErr matMeanAxis(Tensor *t, unsigned dim, Tensor **r);
+MatrixErr matMaxAxis(Tensor *t, unsigned dim, Tensor **r);
+
+// Same as the above, on an explicit backend.
+MatrixErr matProdOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+MatrixErr matMultOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+MatrixErr matDotOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+MatrixErr matAddOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+MatrixErr matSubOn(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+MatrixErr matTTensorOn(Tensor *t, Tensor **r, MatrixBackend backend);
+MatrixErr matSumOn(double *src, int size, double *res, MatrixBackend backend);
+
 static const char* matGetErrorString(MatrixErr error) {
     switch (error) {
         case MAT_NO_ERROR: return "MAT_NO_ERROR";
@@ -76,6 +254,8 @@ static const char* matGetErrorString(MatrixErr error) {
         case MAT_TENSOR_NO_DATA: return "MAT_TENSOR_NO_DATA";
         case MAT_TENSOR_NO_DIMS: return "MAT_TENSOR_NO_DIMS";
         case MAT_NULL_PTR: return "MAT_NULL_PTR";
+        case MAT_DTYPE_MISMATCH: return "MAT_DTYPE_MISMATCH";
+        case MAT_DTYPE_UNSUPPORTED: return "MAT_DTYPE_UNSUPPORTED";
         default: return "Unknown Matrix error";
     }
 }
@@ -88,26 +268,45 @@ static inline cl_int matGetExtendedError(int perserve) {
     return claGetExtendedError(perserve);
 }
 
+// Free memory allocated with `matTensorAlloc`. Arena memory is left to `matArenaReset`.
+static inline void matTensorRelease(Tensor *t, void *p) {
+    if (t == NULL || t->_arena == NULL) free(p);
+}
+
+// Views only free their own fields, the data belongs to their base.
 static void matFreeTensor(Tensor **t) {
     if (t == NULL) return;
 
     Tensor *t_d = *t;
     if (t_d != NULL) {
-        free(t_d->data);
+        if (t_d->_base == NULL) {
+            claFreeBuffer(t_d->_device_data);
+            matTensorRelease(t_d, t_d->data);
+        }
+        t_d->_device_data = NULL;
         t_d->data = NULL;
-        free(t_d->dimsz);
+        matTensorRelease(t_d, t_d->dimsz);
         t_d->dimsz = NULL;
+        matTensorRelease(t_d, t_d->stride);
+        t_d->stride = NULL;
+
+        if (t_d->_arena == NULL) free(t_d);
     }
 
-    free(*t);
     *t = NULL;
 }
 
 static void matFreeTensorD(Tensor t) {
-    free(t.data);
+    if (t._base == NULL) {
+        claFreeBuffer(t._device_data);
+        matTensorRelease(&t, t.data);
+    }
+    t._device_data = NULL;
     t.data = NULL;
-    free(t.dimsz);
+    matTensorRelease(&t, t.dimsz);
     t.dimsz = NULL;
+    matTensorRelease(&t, t.stride);
+    t.stride = NULL;
 }
 
 static MatrixErr matCheckTensor(Tensor *t, MatrixErr *e) {
@@ -127,40 +326,90 @@ static inline int matIsTensorScalar(Tensor *t) {
     return t->literal_size == 1;
 }
 
+// The Tensor holding the data (and device copy) of a view, or the Tensor itself.
+static inline Tensor* matTensorStorage(Tensor *t) {
+    return (t != NULL && t->_base != NULL)? t->_base : t;
+}
+
+// Can `data` be indexed linearly.
+/*
+ * False for strided views, which must be read through `matTensorAtI`,
+ * or copied with `matTensorDeepCopy`.
+ * */
+static inline int matIsTensorContiguous(Tensor *t) {
+    if (t == NULL) return 0;
+    return t->stride == NULL && t->offset == 0;
+}
+
+// Is the Tensor backed by a persistent device buffer.
+static inline int matIsTensorResident(Tensor *t) {
+    t = matTensorStorage(t);
+    if (t == NULL) return 0;
+    return t->_device_data != NULL;
+}
+
+// Mark the host data of a resident Tensor as modified.
+/*
+ * Must be called after writing to `data` of a resident Tensor directly,
+ * so the next kernel using it will see the change.
+ * */
+static inline void matTensorMarkHostDirty(Tensor *t) {
+    t = matTensorStorage(t);
+    if (matIsTensorResident(t)) t->_sync = MAT_HOST_DIRTY;
+}
+
+// Size of an element of `dtype`, in bytes.
+static inline size_t matDtypeSize(MatrixDtype dtype) {
+    switch (dtype) {
+        case MAT_FLOAT32: return sizeof(float);
+        case MAT_FLOAT16:
+        case MAT_BFLOAT16: return sizeof(uint16_t);
+        case MAT_INT8: return sizeof(int8_t);
+        default: return sizeof(double);
+    }
+}
+
+// Is `dtype` storage only, see `MAT_FLOAT16`.
+static inline int matIsDtypeStorage(MatrixDtype dtype) {
+    return dtype >= MAT_COMPUTE_DTYPES;
+}
+
 static inline Tensor* matMakeScalar(double s, MatrixErr *e) {
     Tensor *t = matMakeTensor(0, NULL, e);
     // NOTE: Redundent if.
     if (t != NULL) {
-        t->data = (double *) malloc(sizeof(double));
+        t->data = (double *) matTensorAlloc(t, sizeof(double));
         t->data[0] = s;
     }
     
     return t;
 }
 
+// A one dimensional view of the Tensor, or a copy if it is strided.
 static inline Tensor* matTensorFlatten(Tensor *t, MatrixErr *e) {
     if (matCheckTensor(t, e) != MAT_NO_ERROR) return NULL;
  
-    unsigned *dimsz = (unsigned *) malloc(sizeof(unsigned));
-    dimsz[0] = t->literal_size;
-    Tensor *r = matMakeTensor(1, dimsz, NULL);
-    free(dimsz);
-    r->data = (double *) malloc(sizeof(double) * r->literal_size);
-    memcpy((void *) r->data, (void *) t->data, t->literal_size * sizeof(double));
-
-    return r;
+    unsigned size = t->literal_size;
+    return matTensorReshape(t, 1, &size, e);
 }
 
 static inline void matTensorReduce(Tensor *t) {
     unsigned new_ndims = 0;
     for (int i = 0; i < t->ndims; i++) if (t->dimsz[i] != 1) new_ndims++;
     
-    unsigned *new_dimsz = (unsigned *) malloc(sizeof(unsigned) * new_ndims);
+    unsigned *new_dimsz = (unsigned *) matTensorAlloc(t, sizeof(unsigned) * new_ndims);
+    unsigned *new_stride = (t->stride != NULL)? (unsigned *) matTensorAlloc(t, sizeof(unsigned) * (new_ndims? new_ndims : 1)) : NULL;
     unsigned ind = 0;
-    for (int i = 0; i < t->ndims; i++) if (t->dimsz[i] != 1) new_dimsz[ind++] = t->dimsz[i];
+    for (int i = 0; i < t->ndims; i++) {
+        if (t->dimsz[i] == 1) continue;
+        if (new_stride != NULL) new_stride[ind] = t->stride[i];
+        new_dimsz[ind++] = t->dimsz[i];
+    }
 
-    free(t->dimsz);
+    matTensorRelease(t, t->dimsz);
     t->dimsz = new_dimsz;
+    matTensorRelease(t, t->stride);
+    t->stride = new_stride;
     t->ndims = new_ndims;
 }
 
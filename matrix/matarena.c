@@ -0,0 +1,171 @@
+#include "mat.h"
+
+#include <stdint.h>
+
+// Alignment of every allocation, the widest vector loads of the CPU backend.
+#define ARENA_ALIGN 64
+// Default chunk size.
+#define ARENA_DEFAULT_SIZE (1 << 20)
+
+// A block of memory the arena bumps through. The memory follows the header.
+typedef struct _mat_arena_chunk {
+    struct _mat_arena_chunk *next;
+    size_t size;
+    size_t used;
+} _MatArenaChunk;
+
+struct _mat_arena {
+    // Newest chunk first, allocations are made from it.
+    _MatArenaChunk *chunks;
+    // Size of new chunks.
+    size_t size;
+    // Bytes allocated (with padding) since the last reset, over all chunks.
+    size_t used;
+};
+
+// Arena Tensors are made from, see `matSetArena`.
+static MatrixArena *matarena = NULL;
+
+static _MatArenaChunk* _matMakeChunk(size_t size) {
+    _MatArenaChunk *chunk = (_MatArenaChunk *) malloc(sizeof(_MatArenaChunk) + size);
+    if (chunk == NULL) return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+
+    return chunk;
+}
+
+static void _matFreeChunks(_MatArenaChunk *chunk) {
+    while (chunk != NULL) {
+        _MatArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+}
+
+// Make an arena, a bump allocator for Tensors that live until the same point.
+/*
+ * Allocations are taken from large chunks, and all released at once by
+ * `matArenaReset`. The arena grows by more chunks as needed, and a reset merges
+ * them, so a workload repeating between resets stops calling malloc.
+ * `size` - initial chunk size in bytes, or 0 for a default of 1MB.
+ * */
+MatrixArena* matMakeArena(size_t size) {
+    MatrixArena *arena = (MatrixArena *) malloc(sizeof(MatrixArena));
+    if (arena == NULL) return NULL;
+
+    arena->size = size? size : ARENA_DEFAULT_SIZE;
+    arena->used = 0;
+    arena->chunks = _matMakeChunk(arena->size);
+    if (arena->chunks == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    return arena;
+}
+
+// Free an arena and all of its memory. Unsets it, if it is the current arena.
+void matFreeArena(MatrixArena **arena) {
+    if (arena == NULL || *arena == NULL) return;
+
+    if (matarena == *arena) matarena = NULL;
+
+    _matFreeChunks((*arena)->chunks);
+    free(*arena);
+    *arena = NULL;
+}
+
+// Allocate `size` bytes from the arena, aligned to 64 bytes.
+/*
+ * The memory is valid until the next `matArenaReset`, and must not be freed.
+ * returns NULL if out of memory.
+ * */
+void* matArenaAlloc(MatrixArena *arena, size_t size) {
+    if (arena == NULL) return NULL;
+
+    _MatArenaChunk *chunk = arena->chunks;
+    uintptr_t base = (uintptr_t) (chunk + 1);
+    uintptr_t start = (base + chunk->used + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1);
+
+    if (start + size > base + chunk->size) {
+        // Room for the allocation at any alignment.
+        size_t chunk_size = (size + ARENA_ALIGN > arena->size)? size + ARENA_ALIGN : arena->size;
+        _MatArenaChunk *next = _matMakeChunk(chunk_size);
+        if (next == NULL) return NULL;
+
+        next->next = chunk;
+        arena->chunks = chunk = next;
+        base = (uintptr_t) (chunk + 1);
+        start = (base + ARENA_ALIGN - 1) & ~(uintptr_t) (ARENA_ALIGN - 1);
+    }
+
+    size_t used = start + size - base;
+    arena->used += used - chunk->used;
+    chunk->used = used;
+
+    return (void *) start;
+}
+
+// Release everything allocated from the arena at once.
+/*
+ * Tensors allocated from it must not be used afterwards. They only need
+ * `matFreeTensor` before the reset to release device buffers.
+ * If the arena had to grow, its chunks are merged into one large enough
+ * for everything allocated since the last reset.
+ * */
+void matArenaReset(MatrixArena *arena) {
+    if (arena == NULL) return;
+
+    if (arena->chunks->next != NULL) {
+        // Padding of every chunk's first allocation.
+        size_t size = arena->used + ARENA_ALIGN;
+        if (size < arena->size) size = arena->size;
+
+        _MatArenaChunk *merged = _matMakeChunk(size);
+        if (merged != NULL) {
+            _matFreeChunks(arena->chunks);
+            arena->chunks = merged;
+            arena->size = size;
+        } else {
+            // Keep the newest chunk.
+            _matFreeChunks(arena->chunks->next);
+            arena->chunks->next = NULL;
+        }
+    }
+
+    arena->chunks->used = 0;
+    arena->used = 0;
+}
+
+// Set the arena Tensors are made from.
+/*
+ * While set, mat.h makes the Tensors it returns (their struct, dimensions,
+ * strides and data) from the arena instead of the heap, and `matFreeTensor`
+ * only releases their device buffers. They live until `matArenaReset`.
+ * `arena` - the arena, or NULL to allocate from the heap again.
+ * returns the previously set arena, to restore it.
+ * */
+MatrixArena* matSetArena(MatrixArena *arena) {
+    MatrixArena *previous = matarena;
+    matarena = arena;
+
+    return previous;
+}
+
+MatrixArena* matGetArena() {
+    return matarena;
+}
+
+// Allocate memory owned by `t`, from its arena if it has one.
+/*
+ * Used for fields of a Tensor, such as its data, so `matFreeTensor`
+ * releases them the same way as the Tensor itself.
+ * */
+void* matTensorAlloc(Tensor *t, size_t size) {
+    if (t != NULL && t->_arena != NULL) return matArenaAlloc(t->_arena, size);
+
+    return malloc(size);
+}
@@ -0,0 +1,969 @@
+#include "matcpu.h"
+
+// Type generic, so the template below calls the math functions of its element type.
+#include <tgmath.h>
+#include <stdlib.h>
+#include <string.h>
+
+// SIMD versions are compiled with per function target attributes, so the library
+// itself doesn't require AVX, and picked at runtime in `_matCpuInit`.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAT_CPU_X86
+#include <immintrin.h>
+#endif
+
+#define MIN(a, b) (((a) < (b))? (a) : (b))
+
+// `_matCpuGemm` blocking, in elements. A KB x NB block of b (512KB) stays in L2
+// while it is swept by all rows of a.
+#define CPU_GEMM_KB 128
+#define CPU_GEMM_NB 512
+// Products with fewer columns (or, with columns of b contiguous, rows) than this are inner
+// products of the rows of a and the columns of b. An axpy along few columns is mostly tail,
+// and transposing b isn't paid back by few rows.
+#define CPU_GEMM_NARROW 64
+#define CPU_TRANSPOSE_BLOCK 32
+// `_matCpuGemmInt8` blocking, in bytes of int8 weights kept in L2 while every input sweeps them.
+#define CPU_GEMM8_BLOCK (256 * 1024)
+
+// ----- Scalar -----
+
+static void _matCpuAddScalar(const double *a, const double *b, double *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] + b[i];
+}
+
+static void _matCpuSubScalar(const double *a, const double *b, double *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] - b[i];
+}
+
+static void _matCpuMultScalar(const double *a, const double *b, double *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] * b[i];
+}
+
+static void _matCpuMaximumScalar(const double *a, const double *b, double *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = (a[i] > b[i])? a[i] : b[i];
+}
+
+static double _matCpuSumScalar(const double *src, size_t n) {
+    // Independent accumulators, so the adds don't wait on each other.
+    double acc[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += src[i];
+        acc[1] += src[i + 1];
+        acc[2] += src[i + 2];
+        acc[3] += src[i + 3];
+    }
+    for (; i < n; i++) acc[0] += src[i];
+
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+static double _matCpuMaxScalar(const double *src, size_t n) {
+    double acc[4] = { src[0], src[0], src[0], src[0] };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] = (src[i] > acc[0])? src[i] : acc[0];
+        acc[1] = (src[i + 1] > acc[1])? src[i + 1] : acc[1];
+        acc[2] = (src[i + 2] > acc[2])? src[i + 2] : acc[2];
+        acc[3] = (src[i + 3] > acc[3])? src[i + 3] : acc[3];
+    }
+    for (; i < n; i++) acc[0] = (src[i] > acc[0])? src[i] : acc[0];
+
+    acc[0] = (acc[1] > acc[0])? acc[1] : acc[0];
+    acc[2] = (acc[3] > acc[2])? acc[3] : acc[2];
+    return (acc[2] > acc[0])? acc[2] : acc[0];
+}
+
+// y += alpha * x
+static void _matCpuAxpyScalar(double alpha, const double *x, double *y, size_t n) {
+    for (size_t i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+
+static double _matCpuInnerScalar(const double *x, const double *y, size_t n) {
+    double acc[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += x[i] * y[i];
+        acc[1] += x[i + 1] * y[i + 1];
+        acc[2] += x[i + 2] * y[i + 2];
+        acc[3] += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++) acc[0] += x[i] * y[i];
+
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+static void _matCpuAdd32Scalar(const float *a, const float *b, float *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] + b[i];
+}
+
+static void _matCpuSub32Scalar(const float *a, const float *b, float *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] - b[i];
+}
+
+static void _matCpuMult32Scalar(const float *a, const float *b, float *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = a[i] * b[i];
+}
+
+static void _matCpuMaximum32Scalar(const float *a, const float *b, float *r, size_t n) {
+    for (size_t i = 0; i < n; i++) r[i] = (a[i] > b[i])? a[i] : b[i];
+}
+
+static void _matCpuAxpy32Scalar(float alpha, const float *x, float *y, size_t n) {
+    for (size_t i = 0; i < n; i++) y[i] += alpha * x[i];
+}
+
+static float _matCpuInner32Scalar(const float *x, const float *y, size_t n) {
+    float acc[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += x[i] * y[i];
+        acc[1] += x[i + 1] * y[i + 1];
+        acc[2] += x[i + 2] * y[i + 2];
+        acc[3] += x[i + 3] * y[i + 3];
+    }
+    for (; i < n; i++) acc[0] += x[i] * y[i];
+
+    return (acc[0] + acc[1]) + (acc[2] + acc[3]);
+}
+
+// Accumulates in double, single precision loses too much over long sums.
+static float _matCpuSum32Scalar(const float *src, size_t n) {
+    double acc[4] = { 0, 0, 0, 0 };
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        acc[0] += src[i];
+        acc[1] += src[i + 1];
+        acc[2] += src[i + 2];
+        acc[3] += src[i + 3];
+    }
+    for (; i < n; i++) acc[0] += src[i];
+
+    return (float) ((acc[0] + acc[1]) + (acc[2] + acc[3]));
+}
+
+static float _matCpuMax32Scalar(const float *src, size_t n) {
+    float acc = src[0];
+    for (size_t i = 1; i < n; i++) acc = (src[i] > acc)? src[i] : acc;
+
+    return acc;
+}
+
+static int32_t _matCpuDot8Scalar(const int8_t *x, const int8_t *w, size_t n) {
+    int32_t acc = 0;
+    for (size_t i = 0; i < n; i++) acc += (int32_t) x[i] * w[i];
+
+    return acc;
+}
+
+// r[j] = x . w[j], for the 4 rows of `w`, `n` apart.
+static void _matCpuDot8x4Scalar(const int8_t *x, const int8_t *w, size_t n, int32_t *r) {
+    for (int j = 0; j < 4; j++) r[j] = _matCpuDot8Scalar(x, w + j * n, n);
+}
+
+#ifdef MAT_CPU_X86
+
+// ----- AVX2 -----
+
+// `sop` - the scalar operation, for the tail.
+#define MAT_CPU_BINARY(name, type, isa, width, loadu, storeu, vop, sop) \
+    __attribute__((target(isa))) \
+    static void name(const type *a, const type *b, type *r, size_t n) { \
+        size_t i = 0; \
+        for (; i + (width) <= n; i += (width)) storeu(r + i, vop(loadu(a + i), loadu(b + i))); \
+        if (i < n) sop(a + i, b + i, r + i, n - i); \
+    }
+
+MAT_CPU_BINARY(_matCpuAddAVX2, double, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, _matCpuAddScalar)
+MAT_CPU_BINARY(_matCpuSubAVX2, double, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, _matCpuSubScalar)
+MAT_CPU_BINARY(_matCpuMultAVX2, double, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, _matCpuMultScalar)
+MAT_CPU_BINARY(_matCpuMaximumAVX2, double, "avx2", 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_max_pd, _matCpuMaximumScalar)
+
+__attribute__((target("avx2")))
+static double _matCpuSumAVX2(const double *src, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(src + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(src + i + 4));
+        acc2 = _mm256_add_pd(acc2, _mm256_loadu_pd(src + i + 8));
+        acc3 = _mm256_add_pd(acc3, _mm256_loadu_pd(src + i + 12));
+    }
+    for (; i + 4 <= n; i += 4) acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(src + i));
+
+    __m256d acc = _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double res = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+
+    for (; i < n; i++) res += src[i];
+
+    return res;
+}
+
+__attribute__((target("avx2")))
+static double _matCpuMaxAVX2(const double *src, size_t n) {
+    if (n < 8) return _matCpuMaxScalar(src, n);
+
+    __m256d acc0 = _mm256_loadu_pd(src);
+    __m256d acc1 = _mm256_loadu_pd(src + 4);
+
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_max_pd(acc0, _mm256_loadu_pd(src + i));
+        acc1 = _mm256_max_pd(acc1, _mm256_loadu_pd(src + i + 4));
+    }
+
+    __m256d acc = _mm256_max_pd(acc0, acc1);
+    __m128d half = _mm_max_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double res = _mm_cvtsd_f64(_mm_max_sd(half, _mm_unpackhi_pd(half, half)));
+
+    for (; i < n; i++) res = (src[i] > res)? src[i] : res;
+
+    return res;
+}
+
+__attribute__((target("avx2,fma")))
+static void _matCpuAxpyAVX2(double alpha, const double *x, double *y, size_t n) {
+    __m256d va = _mm256_set1_pd(alpha);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+        _mm256_storeu_pd(y + i + 4, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4)));
+    }
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx2,fma")))
+static double _matCpuInnerAVX2(const double *x, const double *y, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd();
+    __m256d acc3 = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc0);
+        acc1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4), _mm256_loadu_pd(y + i + 4), acc1);
+        acc2 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 8), _mm256_loadu_pd(y + i + 8), acc2);
+        acc3 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 12), _mm256_loadu_pd(y + i + 12), acc3);
+    }
+    for (; i + 4 <= n; i += 4) acc0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), acc0);
+
+    __m256d acc = _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double res = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+
+    for (; i < n; i++) res += x[i] * y[i];
+
+    return res;
+}
+
+MAT_CPU_BINARY(_matCpuAdd32AVX2, float, "avx2", 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_add_ps, _matCpuAdd32Scalar)
+MAT_CPU_BINARY(_matCpuSub32AVX2, float, "avx2", 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_sub_ps, _matCpuSub32Scalar)
+MAT_CPU_BINARY(_matCpuMult32AVX2, float, "avx2", 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_mul_ps, _matCpuMult32Scalar)
+MAT_CPU_BINARY(_matCpuMaximum32AVX2, float, "avx2", 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_max_ps, _matCpuMaximum32Scalar)
+
+__attribute__((target("avx2,fma")))
+static void _matCpuAxpy32AVX2(float alpha, const float *x, float *y, size_t n) {
+    __m256 va = _mm256_set1_ps(alpha);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+        _mm256_storeu_ps(y + i + 8, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8)));
+    }
+    for (; i + 8 <= n; i += 8)
+        _mm256_storeu_ps(y + i, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i)));
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx2")))
+static inline float _matCpuHsum32fAVX2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+
+    return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehdup_ps(s)));
+}
+
+__attribute__((target("avx2,fma")))
+static float _matCpuInner32AVX2(const float *x, const float *y, size_t n) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    __m256 acc2 = _mm256_setzero_ps();
+    __m256 acc3 = _mm256_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), acc1);
+        acc2 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 16), _mm256_loadu_ps(y + i + 16), acc2);
+        acc3 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 24), _mm256_loadu_ps(y + i + 24), acc3);
+    }
+    for (; i + 8 <= n; i += 8) acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), acc0);
+
+    float res = _matCpuHsum32fAVX2(_mm256_add_ps(_mm256_add_ps(acc0, acc1), _mm256_add_ps(acc2, acc3)));
+    for (; i < n; i++) res += x[i] * y[i];
+
+    return res;
+}
+
+// Widened to double, as `_matCpuSum32Scalar`.
+__attribute__((target("avx2")))
+static float _matCpuSum32AVX2(const float *src, size_t n) {
+    __m256d acc0 = _mm256_setzero_pd();
+    __m256d acc1 = _mm256_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_cvtps_pd(_mm_loadu_ps(src + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_cvtps_pd(_mm_loadu_ps(src + i + 4)));
+    }
+
+    __m256d acc = _mm256_add_pd(acc0, acc1);
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(acc), _mm256_extractf128_pd(acc, 1));
+    double res = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+
+    for (; i < n; i++) res += src[i];
+
+    return (float) res;
+}
+
+__attribute__((target("avx2")))
+static float _matCpuMax32AVX2(const float *src, size_t n) {
+    if (n < 8) return _matCpuMax32Scalar(src, n);
+
+    __m256 acc = _mm256_loadu_ps(src);
+
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) acc = _mm256_max_ps(acc, _mm256_loadu_ps(src + i));
+
+    __m128 s = _mm_max_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+    float res = _mm_cvtss_f32(_mm_max_ss(s, _mm_movehdup_ps(s)));
+
+    for (; i < n; i++) res = (src[i] > res)? src[i] : res;
+
+    return res;
+}
+
+__attribute__((target("avx2")))
+static inline int32_t _matCpuHsum32AVX2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+
+    return _mm_cvtsi128_si32(s);
+}
+
+// pmaddubsw multiplies unsigned by signed bytes, so it gets |x|, and the weights take the
+// sign of x. With both in [-127, 127], the sums of pairs fit int16 without saturating.
+__attribute__((target("avx2")))
+static void _matCpuDot8x4AVX2(const int8_t *x, const int8_t *w, size_t n, int32_t *r) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256();
+    __m256i acc3 = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i xv = _mm256_loadu_si256((const __m256i *) (x + i));
+        __m256i ax = _mm256_sign_epi8(xv, xv);
+#define MAT_CPU_DOT8_ROW(acc, j) \
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(ax, \
+              _mm256_sign_epi8(_mm256_loadu_si256((const __m256i *) (w + (j) * n + i)), xv)), ones));
+        MAT_CPU_DOT8_ROW(acc0, 0)
+        MAT_CPU_DOT8_ROW(acc1, 1)
+        MAT_CPU_DOT8_ROW(acc2, 2)
+        MAT_CPU_DOT8_ROW(acc3, 3)
+#undef MAT_CPU_DOT8_ROW
+    }
+
+    r[0] = _matCpuHsum32AVX2(acc0) + _matCpuDot8Scalar(x + i, w + i, n - i);
+    r[1] = _matCpuHsum32AVX2(acc1) + _matCpuDot8Scalar(x + i, w + n + i, n - i);
+    r[2] = _matCpuHsum32AVX2(acc2) + _matCpuDot8Scalar(x + i, w + 2 * n + i, n - i);
+    r[3] = _matCpuHsum32AVX2(acc3) + _matCpuDot8Scalar(x + i, w + 3 * n + i, n - i);
+}
+
+// ----- AVX-512 -----
+
+MAT_CPU_BINARY(_matCpuAddAVX512, double, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_add_pd, _matCpuAddScalar)
+MAT_CPU_BINARY(_matCpuSubAVX512, double, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_sub_pd, _matCpuSubScalar)
+MAT_CPU_BINARY(_matCpuMultAVX512, double, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_mul_pd, _matCpuMultScalar)
+MAT_CPU_BINARY(_matCpuMaximumAVX512, double, "avx512f", 8, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_max_pd, _matCpuMaximumScalar)
+
+__attribute__((target("avx512f")))
+static double _matCpuSumAVX512(const double *src, size_t n) {
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(src + i));
+        acc1 = _mm512_add_pd(acc1, _mm512_loadu_pd(src + i + 8));
+    }
+    for (; i + 8 <= n; i += 8) acc0 = _mm512_add_pd(acc0, _mm512_loadu_pd(src + i));
+
+    double res = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+    for (; i < n; i++) res += src[i];
+
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static double _matCpuMaxAVX512(const double *src, size_t n) {
+    if (n < 8) return _matCpuMaxScalar(src, n);
+
+    __m512d acc = _mm512_loadu_pd(src);
+
+    size_t i = 8;
+    for (; i + 8 <= n; i += 8) acc = _mm512_max_pd(acc, _mm512_loadu_pd(src + i));
+
+    double res = _mm512_reduce_max_pd(acc);
+    for (; i < n; i++) res = (src[i] > res)? src[i] : res;
+
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static void _matCpuAxpyAVX512(double alpha, const double *x, double *y, size_t n) {
+    __m512d va = _mm512_set1_pd(alpha);
+
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+        _mm512_storeu_pd(y + i, _mm512_fmadd_pd(va, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx512f")))
+static double _matCpuInnerAVX512(const double *x, const double *y, size_t n) {
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), acc0);
+        acc1 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i + 8), _mm512_loadu_pd(y + i + 8), acc1);
+    }
+    for (; i + 8 <= n; i += 8) acc0 = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), acc0);
+
+    double res = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+    for (; i < n; i++) res += x[i] * y[i];
+
+    return res;
+}
+
+MAT_CPU_BINARY(_matCpuAdd32AVX512, float, "avx512f", 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_add_ps, _matCpuAdd32Scalar)
+MAT_CPU_BINARY(_matCpuSub32AVX512, float, "avx512f", 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_sub_ps, _matCpuSub32Scalar)
+MAT_CPU_BINARY(_matCpuMult32AVX512, float, "avx512f", 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_mul_ps, _matCpuMult32Scalar)
+MAT_CPU_BINARY(_matCpuMaximum32AVX512, float, "avx512f", 16, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_max_ps, _matCpuMaximum32Scalar)
+
+__attribute__((target("avx512f")))
+static void _matCpuAxpy32AVX512(float alpha, const float *x, float *y, size_t n) {
+    __m512 va = _mm512_set1_ps(alpha);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        _mm512_storeu_ps(y + i, _mm512_fmadd_ps(va, _mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i)));
+    for (; i < n; i++) y[i] += alpha * x[i];
+}
+
+__attribute__((target("avx512f")))
+static float _matCpuInner32AVX512(const float *x, const float *y, size_t n) {
+    __m512 acc0 = _mm512_setzero_ps();
+    __m512 acc1 = _mm512_setzero_ps();
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+        acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i + 16), _mm512_loadu_ps(y + i + 16), acc1);
+    }
+    for (; i + 16 <= n; i += 16) acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + i), _mm512_loadu_ps(y + i), acc0);
+
+    float res = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+    for (; i < n; i++) res += x[i] * y[i];
+
+    return res;
+}
+
+__attribute__((target("avx512f")))
+static float _matCpuSum32AVX512(const float *src, size_t n) {
+    __m512d acc0 = _mm512_setzero_pd();
+    __m512d acc1 = _mm512_setzero_pd();
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm512_add_pd(acc0, _mm512_cvtps_pd(_mm256_loadu_ps(src + i)));
+        acc1 = _mm512_add_pd(acc1, _mm512_cvtps_pd(_mm256_loadu_ps(src + i + 8)));
+    }
+
+    double res = _mm512_reduce_add_pd(_mm512_add_pd(acc0, acc1));
+    for (; i < n; i++) res += src[i];
+
+    return (float) res;
+}
+
+__attribute__((target("avx512f")))
+static float _matCpuMax32AVX512(const float *src, size_t n) {
+    if (n < 16) return _matCpuMax32Scalar(src, n);
+
+    __m512 acc = _mm512_loadu_ps(src);
+
+    size_t i = 16;
+    for (; i + 16 <= n; i += 16) acc = _mm512_max_ps(acc, _mm512_loadu_ps(src + i));
+
+    float res = _mm512_reduce_max_ps(acc);
+    for (; i < n; i++) res = (src[i] > res)? src[i] : res;
+
+    return res;
+}
+
+// `_matCpuDot8x4AVX2` with vpdpbusd, which sums 4 products of bytes into int32 directly.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void _matCpuDot8x4VNNI(const int8_t *x, const int8_t *w, size_t n, int32_t *r) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i acc0 = zero;
+    __m512i acc1 = zero;
+    __m512i acc2 = zero;
+    __m512i acc3 = zero;
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m512i xv = _mm512_loadu_si512((const void *) (x + i));
+        __m512i ax = _mm512_abs_epi8(xv);
+        __mmask64 negative = _mm512_movepi8_mask(xv);
+#define MAT_CPU_DOT8_ROW(acc, j) \
+        { \
+            __m512i wv = _mm512_loadu_si512((const void *) (w + (j) * n + i)); \
+            acc = _mm512_dpbusd_epi32(acc, ax, _mm512_mask_sub_epi8(wv, negative, zero, wv)); \
+        }
+        MAT_CPU_DOT8_ROW(acc0, 0)
+        MAT_CPU_DOT8_ROW(acc1, 1)
+        MAT_CPU_DOT8_ROW(acc2, 2)
+        MAT_CPU_DOT8_ROW(acc3, 3)
+#undef MAT_CPU_DOT8_ROW
+    }
+
+    r[0] = _mm512_reduce_add_epi32(acc0) + _matCpuDot8Scalar(x + i, w + i, n - i);
+    r[1] = _mm512_reduce_add_epi32(acc1) + _matCpuDot8Scalar(x + i, w + n + i, n - i);
+    r[2] = _mm512_reduce_add_epi32(acc2) + _matCpuDot8Scalar(x + i, w + 2 * n + i, n - i);
+    r[3] = _mm512_reduce_add_epi32(acc3) + _matCpuDot8Scalar(x + i, w + 3 * n + i, n - i);
+}
+
+#endif
+
+// Implementations in use. Scalar until `_matCpuInit` is called.
+static struct {
+    MatrixCpuIsa isa;
+    _matCpuBinaryFn add;
+    _matCpuBinaryFn sub;
+    _matCpuBinaryFn mult;
+    _matCpuBinaryFn maximum;
+    double (*sum)(const double *src, size_t n);
+    double (*max)(const double *src, size_t n);
+    void (*axpy)(double alpha, const double *x, double *y, size_t n);
+    double (*inner)(const double *x, const double *y, size_t n);
+    _matCpuBinaryFn32 add32;
+    _matCpuBinaryFn32 sub32;
+    _matCpuBinaryFn32 mult32;
+    _matCpuBinaryFn32 maximum32;
+    float (*sum32)(const float *src, size_t n);
+    float (*max32)(const float *src, size_t n);
+    void (*axpy32)(float alpha, const float *x, float *y, size_t n);
+    float (*inner32)(const float *x, const float *y, size_t n);
+    void (*dot8x4)(const int8_t *x, const int8_t *w, size_t n, int32_t *r);
+} cpu = { MAT_CPU_SCALAR, _matCpuAddScalar, _matCpuSubScalar, _matCpuMultScalar, _matCpuMaximumScalar,
+          _matCpuSumScalar, _matCpuMaxScalar, _matCpuAxpyScalar, _matCpuInnerScalar,
+          _matCpuAdd32Scalar, _matCpuSub32Scalar, _matCpuMult32Scalar, _matCpuMaximum32Scalar,
+          _matCpuSum32Scalar, _matCpuMax32Scalar, _matCpuAxpy32Scalar, _matCpuInner32Scalar, _matCpuDot8x4Scalar };
+
+static int _matCpuSupports(MatrixCpuIsa isa) {
+    switch (isa) {
+        case MAT_CPU_SCALAR: return 1;
+#ifdef MAT_CPU_X86
+        // Also checks the OS saves the extended registers.
+        case MAT_CPU_AVX2: return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        case MAT_CPU_AVX512: return __builtin_cpu_supports("avx512f");
+#endif
+        default: return 0;
+    }
+}
+
+void _matCpuInit() {
+#ifdef MAT_CPU_X86
+    __builtin_cpu_init();
+#endif
+
+    if (!_matCpuSetIsa(MAT_CPU_AVX512)) return;
+    if (!_matCpuSetIsa(MAT_CPU_AVX2)) return;
+    _matCpuSetIsa(MAT_CPU_SCALAR);
+}
+
+MatrixCpuIsa _matCpuGetIsa() {
+    return cpu.isa;
+}
+
+int _matCpuSetIsa(MatrixCpuIsa isa) {
+    if (!_matCpuSupports(isa)) return 1;
+
+    switch (isa) {
+#ifdef MAT_CPU_X86
+        case MAT_CPU_AVX512:
+            cpu.add = _matCpuAddAVX512;
+            cpu.sub = _matCpuSubAVX512;
+            cpu.mult = _matCpuMultAVX512;
+            cpu.maximum = _matCpuMaximumAVX512;
+            cpu.sum = _matCpuSumAVX512;
+            cpu.max = _matCpuMaxAVX512;
+            cpu.axpy = _matCpuAxpyAVX512;
+            cpu.inner = _matCpuInnerAVX512;
+            cpu.add32 = _matCpuAdd32AVX512;
+            cpu.sub32 = _matCpuSub32AVX512;
+            cpu.mult32 = _matCpuMult32AVX512;
+            cpu.maximum32 = _matCpuMaximum32AVX512;
+            cpu.sum32 = _matCpuSum32AVX512;
+            cpu.max32 = _matCpuMax32AVX512;
+            cpu.axpy32 = _matCpuAxpy32AVX512;
+            cpu.inner32 = _matCpuInner32AVX512;
+            // VNNI came after AVX-512 itself.
+            cpu.dot8x4 = (__builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vnni"))?
+                         _matCpuDot8x4VNNI : _matCpuDot8x4AVX2;
+            break;
+        case MAT_CPU_AVX2:
+            cpu.add = _matCpuAddAVX2;
+            cpu.sub = _matCpuSubAVX2;
+            cpu.mult = _matCpuMultAVX2;
+            cpu.maximum = _matCpuMaximumAVX2;
+            cpu.sum = _matCpuSumAVX2;
+            cpu.max = _matCpuMaxAVX2;
+            cpu.axpy = _matCpuAxpyAVX2;
+            cpu.inner = _matCpuInnerAVX2;
+            cpu.add32 = _matCpuAdd32AVX2;
+            cpu.sub32 = _matCpuSub32AVX2;
+            cpu.mult32 = _matCpuMult32AVX2;
+            cpu.maximum32 = _matCpuMaximum32AVX2;
+            cpu.sum32 = _matCpuSum32AVX2;
+            cpu.max32 = _matCpuMax32AVX2;
+            cpu.axpy32 = _matCpuAxpy32AVX2;
+            cpu.inner32 = _matCpuInner32AVX2;
+            cpu.dot8x4 = _matCpuDot8x4AVX2;
+            break;
+#endif
+        default:
+            cpu.add = _matCpuAddScalar;
+            cpu.sub = _matCpuSubScalar;
+            cpu.mult = _matCpuMultScalar;
+            cpu.maximum = _matCpuMaximumScalar;
+            cpu.sum = _matCpuSumScalar;
+            cpu.max = _matCpuMaxScalar;
+            cpu.axpy = _matCpuAxpyScalar;
+            cpu.inner = _matCpuInnerScalar;
+            cpu.add32 = _matCpuAdd32Scalar;
+            cpu.sub32 = _matCpuSub32Scalar;
+            cpu.mult32 = _matCpuMult32Scalar;
+            cpu.maximum32 = _matCpuMaximum32Scalar;
+            cpu.sum32 = _matCpuSum32Scalar;
+            cpu.max32 = _matCpuMax32Scalar;
+            cpu.axpy32 = _matCpuAxpy32Scalar;
+            cpu.inner32 = _matCpuInner32Scalar;
+            cpu.dot8x4 = _matCpuDot8x4Scalar;
+            break;
+    }
+    cpu.isa = isa;
+
+    return 0;
+}
+
+void _matCpuAdd(const double *a, const double *b, double *r, size_t n) {
+    cpu.add(a, b, r, n);
+}
+
+void _matCpuSub(const double *a, const double *b, double *r, size_t n) {
+    cpu.sub(a, b, r, n);
+}
+
+void _matCpuMult(const double *a, const double *b, double *r, size_t n) {
+    cpu.mult(a, b, r, n);
+}
+
+void _matCpuMaximum(const double *a, const double *b, double *r, size_t n) {
+    cpu.maximum(a, b, r, n);
+}
+
+void _matCpuAxpy(double alpha, const double *x, double *y, size_t n) {
+    cpu.axpy(alpha, x, y, n);
+}
+
+double _matCpuInner(const double *x, const double *y, size_t n) {
+    return cpu.inner(x, y, n);
+}
+
+double _matCpuSum(const double *src, size_t n) {
+    return cpu.sum(src, n);
+}
+
+double _matCpuMax(const double *src, size_t n) {
+    return cpu.max(src, n);
+}
+
+// Runs the body for every row (dimension 0) of a shape, with `row` its index, and
+// `aoff` and `boff` the offset of its first element in each strided operand.
+// NOTE: Up to 32 dimensions.
+#define MAT_CPU_FOR_ROWS(ndims, dimsz, astride, bstride, ...) \
+    do { \
+        unsigned _ind[32] = { 0 }; \
+        size_t _rows = 1; \
+        for (unsigned _i = 1; _i < (ndims); _i++) _rows *= (dimsz)[_i]; \
+        size_t aoff = 0, boff = 0; \
+        for (size_t row = 0; row < _rows; row++) { \
+            __VA_ARGS__ \
+            for (unsigned _i = 1; _i < (ndims); _i++) { \
+                aoff += (astride)[_i]; \
+                boff += (bstride)[_i]; \
+                if (++_ind[_i] < (dimsz)[_i]) break; \
+                aoff -= (size_t) (astride)[_i] * (dimsz)[_i]; \
+                boff -= (size_t) (bstride)[_i] * (dimsz)[_i]; \
+                _ind[_i] = 0; \
+            } \
+        } \
+    } while (0)
+
+// Same as `remapLinearIndexSpace` in mat.cl.
+static unsigned _matCpuRemap(size_t literal, const unsigned *source_mapping, const unsigned *target_mapping, int mapping_size) {
+    unsigned sum = 0;
+    size_t source_stride = 1;
+    unsigned target_stride = 1;
+
+    for (int i = 0; i < mapping_size; i++) {
+        unsigned ind = (literal / source_stride) % source_mapping[i];
+        source_stride *= source_mapping[i];
+        if (target_mapping[i] > 1) sum += ind * target_stride;
+        target_stride *= target_mapping[i];
+    }
+
+    return sum;
+}
+
+// ----- float32 -----
+
+void _matCpuAdd32(const float *a, const float *b, float *r, size_t n) {
+    cpu.add32(a, b, r, n);
+}
+
+void _matCpuSub32(const float *a, const float *b, float *r, size_t n) {
+    cpu.sub32(a, b, r, n);
+}
+
+void _matCpuMult32(const float *a, const float *b, float *r, size_t n) {
+    cpu.mult32(a, b, r, n);
+}
+
+void _matCpuMaximum32(const float *a, const float *b, float *r, size_t n) {
+    cpu.maximum32(a, b, r, n);
+}
+
+void _matCpuAxpy32(float alpha, const float *x, float *y, size_t n) {
+    cpu.axpy32(alpha, x, y, n);
+}
+
+float _matCpuInner32(const float *x, const float *y, size_t n) {
+    return cpu.inner32(x, y, n);
+}
+
+float _matCpuSum32(const float *src, size_t n) {
+    return cpu.sum32(src, n);
+}
+
+float _matCpuMax32(const float *src, size_t n) {
+    return cpu.max32(src, n);
+}
+
+void _matCpuToFloat32(const double *src, float *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = (float) src[i];
+}
+
+void _matCpuToFloat64(const float *src, double *dst, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = src[i];
+}
+
+// ----- 16-bit storage -----
+// Converted in software, bit by bit, so results match on hosts without native half support.
+
+static inline float _matCpuBitsToFloat(uint32_t bits) {
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static inline uint32_t _matCpuFloatToBits(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+static inline float _matCpuFromHalf(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    // Infinities and NaNs.
+    if (exp == 0x1f) return _matCpuBitsToFloat(sign | 0x7f800000 | (mant << 13));
+    // Rebiased from 15 to 127.
+    if (exp != 0) return _matCpuBitsToFloat(sign | ((exp + 112) << 23) | (mant << 13));
+    if (mant == 0) return _matCpuBitsToFloat(sign);
+
+    // Subnormals, normalized.
+    exp = 113;
+    while (!(mant & 0x400)) {
+        mant <<= 1;
+        exp--;
+    }
+
+    return _matCpuBitsToFloat(sign | (exp << 23) | ((mant & 0x3ff) << 13));
+}
+
+// Rounds to the nearest half, ties to even.
+static inline uint16_t _matCpuToHalf(float f) {
+    uint32_t bits = _matCpuFloatToBits(f);
+    uint16_t sign = (bits >> 16) & 0x8000;
+    uint32_t abs = bits & 0x7fffffff;
+
+    if (abs > 0x7f800000) return sign | 0x7e00;
+    // 65520 and above round past the largest half, 65504.
+    if (abs >= 0x477ff000) return sign | 0x7c00;
+    // Below 2^-25, rounds to zero.
+    if (abs <= 0x33000000) return sign;
+
+    // Below 2^-14, a subnormal in units of 2^-24.
+    if (abs < 0x38800000) {
+        uint32_t mant = (abs & 0x7fffff) | 0x800000;
+        unsigned shift = 126 - (abs >> 23);
+        uint32_t r = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1);
+        uint32_t half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (r & 1))) r++;
+
+        return sign | r;
+    }
+
+    // Rebiased from 127 to 15. A carry out of the mantissa rounds up the exponent.
+    uint32_t r = (abs - 0x38000000) >> 13;
+    uint32_t rem = abs & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (r & 1))) r++;
+
+    return sign | r;
+}
+
+static inline float _matCpuFromBFloat16(uint16_t b) {
+    return _matCpuBitsToFloat((uint32_t) b << 16);
+}
+
+// Rounds to the nearest bfloat16, ties to even. NaNs stay quiet NaNs.
+static inline uint16_t _matCpuToBFloat16(float f) {
+    uint32_t bits = _matCpuFloatToBits(f);
+    if ((bits & 0x7fffffff) > 0x7f800000) return (bits >> 16) | 0x40;
+
+    return (bits + 0x7fff + ((bits >> 16) & 1)) >> 16;
+}
+
+// ----- int8 -----
+
+// Rounds to nearest, ties to even, saturating to [-127, 127] so the range is symmetric
+// (see `_matCpuDot8x4AVX2`). NaNs become 0.
+static inline int8_t _matCpuToInt8(float f) {
+    if (!(f == f)) return 0;
+    if (f >= 127) return 127;
+    if (f <= -127) return -127;
+
+    return (int8_t) rint(f);
+}
+
+void _matCpuGemmInt8(const int8_t *w, const int8_t *x, int32_t *r, size_t in, size_t out, size_t n) {
+    // Rows of w in a block, a multiple of 4.
+    size_t block = (CPU_GEMM8_BLOCK / in) & ~(size_t) 3;
+    if (block < 4) block = 4;
+
+    for (size_t o0 = 0; o0 < out; o0 += block) {
+        size_t oe = MIN(out, o0 + block);
+        for (size_t b = 0; b < n; b++) {
+            const int8_t *xb = x + b * in;
+            int32_t *rb = r + b * out;
+
+            size_t o = o0;
+            for (; o + 4 <= oe; o += 4) cpu.dot8x4(xb, w + o * in, in, rb + o);
+            for (; o < oe; o++) rb[o] = _matCpuDot8Scalar(xb, w + o * in, in);
+        }
+    }
+}
+
+// ----- Conversions -----
+
+// Elements are copied as is, whichever dtype they are.
+void _matCpuGatherBytes(const void *a, size_t size, const unsigned *astride, unsigned ndims, const unsigned *dimsz, void *r) {
+    const char *ab = (const char *) a;
+    char *rb = (char *) r;
+    if (ndims == 0) {
+        memcpy(rb, ab, size);
+        return;
+    }
+
+    const size_t n = dimsz[0];
+    MAT_CPU_FOR_ROWS(ndims, dimsz, astride, astride,
+        if (astride[0] == 1) memcpy(rb + row * n * size, ab + aoff * size, n * size);
+        else for (size_t i = 0; i < n; i++) memcpy(rb + (row * n + i) * size, ab + (aoff + i * astride[0]) * size, size);
+    );
+}
+
+void _matCpuWiden(const void *src, MatrixDtype from, float *dst, size_t n) {
+    switch (from) {
+        case MAT_FLOAT64: _matCpuToFloat32((const double *) src, dst, n); break;
+        case MAT_FLOAT32: memcpy(dst, src, sizeof(float) * n); break;
+        case MAT_FLOAT16:
+            for (size_t i = 0; i < n; i++) dst[i] = _matCpuFromHalf(((const uint16_t *) src)[i]);
+            break;
+        case MAT_BFLOAT16:
+            for (size_t i = 0; i < n; i++) dst[i] = _matCpuFromBFloat16(((const uint16_t *) src)[i]);
+            break;
+        case MAT_INT8:
+            for (size_t i = 0; i < n; i++) dst[i] = ((const int8_t *) src)[i];
+            break;
+    }
+}
+
+void _matCpuNarrow(const float *src, void *dst, MatrixDtype to, size_t n) {
+    switch (to) {
+        case MAT_FLOAT64: _matCpuToFloat64(src, (double *) dst, n); break;
+        case MAT_FLOAT32: memcpy(dst, src, sizeof(float) * n); break;
+        case MAT_FLOAT16:
+            for (size_t i = 0; i < n; i++) ((uint16_t *) dst)[i] = _matCpuToHalf(src[i]);
+            break;
+        case MAT_BFLOAT16:
+            for (size_t i = 0; i < n; i++) ((uint16_t *) dst)[i] = _matCpuToBFloat16(src[i]);
+            break;
+        case MAT_INT8:
+            for (size_t i = 0; i < n; i++) ((int8_t *) dst)[i] = _matCpuToInt8(src[i]);
+            break;
+    }
+}
+
+// ----- Generic -----
+
+#define REAL double
+#define CPU_NAME(name) name
+#include "matcpu_generic.h"
+#undef REAL
+#undef CPU_NAME
+
+#define REAL float
+#define CPU_NAME(name) name##32
+#include "matcpu_generic.h"
+#undef REAL
+#undef CPU_NAME
@@ -0,0 +1,135 @@
+#ifndef MATCPU_H
+#define MATCPU_H
+
+// Native CPU backend of mat.h.
+// Operates on plain host arrays, the callers in mat.c handle the Tensors.
+
+#include <stddef.h>
+
+#include "mat.h"
+
+typedef void (*_matCpuBinaryFn)(const double *a, const double *b, double *r, size_t n);
+typedef void (*_matCpuBinaryFn32)(const float *a, const float *b, float *r, size_t n);
+
+// Select the widest instruction set supported by the running CPU.
+void _matCpuInit();
+MatrixCpuIsa _matCpuGetIsa();
+// Returns 0 on success, 1 if the CPU doesn't support `isa`.
+int _matCpuSetIsa(MatrixCpuIsa isa);
+
+// r[i] = a[i] op b[i], for i < n.
+void _matCpuAdd(const double *a, const double *b, double *r, size_t n);
+void _matCpuSub(const double *a, const double *b, double *r, size_t n);
+void _matCpuMult(const double *a, const double *b, double *r, size_t n);
+void _matCpuMaximum(const double *a, const double *b, double *r, size_t n);
+// y[i] += alpha * x[i], for i < n.
+void _matCpuAxpy(double alpha, const double *x, double *y, size_t n);
+// Sum of x[i] * y[i], for i < n.
+double _matCpuInner(const double *x, const double *y, size_t n);
+
+// r = f(a), and r = u * f'(a), over n elements. `f` is a `MatrixActivation`.
+void _matCpuActivation(const double *a, int f, double *r, size_t n);
+void _matCpuActivationDerive(const double *a, const double *u, int f, double *r, size_t n);
+
+// Host versions of the `matdense` kernel, and of its derivatives by the weights and inputs
+// (`matdenseweights` and `matdenseinput`) at once.
+void _matCpuDense(const double *w, const double *x, double *r, size_t in, size_t out, size_t n, int f);
+void _matCpuDenseDerive(const double *w, const double *x, const double *y, const double *u,
+                        double *dw, double *dx, size_t in, size_t out, size_t n, int f);
+
+// Host versions of the optimizer update kernels, over n elements.
+void _matCpuMomentum(double learning_rate, double momentum, const double *g, double *v, double *w, size_t n);
+void _matCpuRMSProp(double learning_rate, double decay, double epsilon, const double *g, double *s, double *w, size_t n);
+void _matCpuAdam(double learning_rate, double beta1, double beta2, double epsilon, double c1, double c2,
+                 const double *g, double *m, double *v, double *w, size_t n);
+
+// r = a op b over the shape `dimsz`, reading the operands through strides.
+// Rows with a unit stride go to `fn` directly, others are gathered first.
+void _matCpuBinaryStrided(_matCpuBinaryFn fn, unsigned ndims, const unsigned *dimsz,
+                          const double *a, const unsigned *astride,
+                          const double *b, const unsigned *bstride, double *r);
+
+// Copy a strided Tensor of shape `dimsz` to the contiguous `r`.
+void _matCpuGather(const double *a, const unsigned *astride, unsigned ndims, const unsigned *dimsz, double *r);
+
+double _matCpuSum(const double *src, size_t n);
+// n > 0.
+double _matCpuMax(const double *src, size_t n);
+
+// Sum (or max) of a dimension of a strided Tensor, into the contiguous `r`.
+// `astride` are the strides of the other dimensions, shaped `rdimsz`, and the reduced
+// one is `n` elements `axis_stride` apart.
+void _matCpuReduce(const double *a, const unsigned *astride, unsigned rndims, const unsigned *rdimsz,
+                   size_t n, unsigned axis_stride, int max, double *r);
+
+// r = a * b, for a (M x K) and b (K x N). Element (row, k) of a is at a[row * ars + k * acs],
+// and (k, col) of b at b[k * brs + col * bcs]. For contiguous operands, ars = K, brs = N and
+// acs = bcs = 1. Returns 1 if out of memory.
+int _matCpuGemm(const double *a, size_t ars, size_t acs, const double *b, size_t brs, size_t bcs,
+                double *r, int M, int N, int K);
+
+// Host versions of the `matprod` and `matdot` kernels, computing all `rsize` outputs.
+void _matCpuProd(const double *a, const unsigned *adimsz, const double *b, const unsigned *bdimsz,
+                 double *r, const unsigned *rdimsz, int ndims, size_t rsize);
+void _matCpuDot(const double *a, unsigned andims, const unsigned *adimsz,
+                const double *b, unsigned bndims, const unsigned *bdimsz,
+                double *r, const unsigned *rdimsz, size_t rsize);
+
+// r[col + row * D] = a[row + col * P], transposing a (D x P) matrix.
+void _matCpuTranspose(const double *a, double *r, size_t P, size_t D);
+
+// r = (q * x') * scale * x_scale, for the int8 weights q (out x in) with a scale per row, and
+// the n inputs x (n x in), quantized to int8 by x_scale. See `_matCpuGemmInt8`.
+void _matCpuQuantizedProd(const int8_t *q, const float *scale, const double *x, double x_scale,
+                          double *r, size_t in, size_t out, size_t n);
+
+// float32 versions of the above, for `MAT_FLOAT32` Tensors. Sums accumulate in double.
+void _matCpuAdd32(const float *a, const float *b, float *r, size_t n);
+void _matCpuSub32(const float *a, const float *b, float *r, size_t n);
+void _matCpuMult32(const float *a, const float *b, float *r, size_t n);
+void _matCpuMaximum32(const float *a, const float *b, float *r, size_t n);
+void _matCpuAxpy32(float alpha, const float *x, float *y, size_t n);
+float _matCpuInner32(const float *x, const float *y, size_t n);
+void _matCpuActivation32(const float *a, int f, float *r, size_t n);
+void _matCpuActivationDerive32(const float *a, const float *u, int f, float *r, size_t n);
+void _matCpuDense32(const float *w, const float *x, float *r, size_t in, size_t out, size_t n, int f);
+void _matCpuDenseDerive32(const float *w, const float *x, const float *y, const float *u,
+                          float *dw, float *dx, size_t in, size_t out, size_t n, int f);
+void _matCpuMomentum32(double learning_rate, double momentum, const float *g, float *v, float *w, size_t n);
+void _matCpuRMSProp32(double learning_rate, double decay, double epsilon, const float *g, float *s, float *w, size_t n);
+void _matCpuAdam32(double learning_rate, double beta1, double beta2, double epsilon, double c1, double c2,
+                   const float *g, float *m, float *v, float *w, size_t n);
+void _matCpuBinaryStrided32(_matCpuBinaryFn32 fn, unsigned ndims, const unsigned *dimsz,
+                            const float *a, const unsigned *astride,
+                            const float *b, const unsigned *bstride, float *r);
+void _matCpuGather32(const float *a, const unsigned *astride, unsigned ndims, const unsigned *dimsz, float *r);
+float _matCpuSum32(const float *src, size_t n);
+float _matCpuMax32(const float *src, size_t n);
+void _matCpuReduce32(const float *a, const unsigned *astride, unsigned rndims, const unsigned *rdimsz,
+                     size_t n, unsigned axis_stride, int max, float *r);
+int _matCpuGemm32(const float *a, size_t ars, size_t acs, const float *b, size_t brs, size_t bcs,
+                  float *r, int M, int N, int K);
+void _matCpuProd32(const float *a, const unsigned *adimsz, const float *b, const unsigned *bdimsz,
+                   float *r, const unsigned *rdimsz, int ndims, size_t rsize);
+void _matCpuDot32(const float *a, unsigned andims, const unsigned *adimsz,
+                  const float *b, unsigned bndims, const unsigned *bdimsz,
+                  float *r, const unsigned *rdimsz, size_t rsize);
+void _matCpuTranspose32(const float *a, float *r, size_t P, size_t D);
+void _matCpuQuantizedProd32(const int8_t *q, const float *scale, const float *x, double x_scale,
+                            float *r, size_t in, size_t out, size_t n);
+
+// Convert `n` elements between the dtypes.
+void _matCpuToFloat32(const double *src, float *dst, size_t n);
+void _matCpuToFloat64(const float *src, double *dst, size_t n);
+// Convert `n` elements of any dtype to float32, and back. Rounds to nearest, ties to even.
+void _matCpuWiden(const void *src, MatrixDtype from, float *dst, size_t n);
+void _matCpuNarrow(const float *src, void *dst, MatrixDtype to, size_t n);
+
+// `_matCpuGather` of elements `size` bytes each, for the storage dtypes.
+void _matCpuGatherBytes(const void *a, size_t size, const unsigned *astride, unsigned ndims, const unsigned *dimsz, void *r);
+
+// r = w * x', int8 products summed in int32, for w (out x in) and x (n x in), both row major.
+// The values must be in [-127, 127].
+void _matCpuGemmInt8(const int8_t *w, const int8_t *x, int32_t *r, size_t in, size_t out, size_t n);
+
+#endif
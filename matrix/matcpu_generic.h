@@ -0,0 +1,346 @@
+// CPU backend functions generic over the element type, included by matcpu.c once
+// per `MatrixDtype`, with `REAL` the element type and `CPU_NAME` giving the name of
+// a function for it (e.g. `_matCpuAdd` or `_matCpuAdd32`).
+// NOTE: No include guard, on purpose.
+
+#if !defined(REAL) || !defined(CPU_NAME)
+#error "Define REAL and CPU_NAME before including matcpu_generic.h"
+#endif
+
+void CPU_NAME(_matCpuActivation)(const REAL *a, int f, REAL *r, size_t n) {
+    switch (f) {
+        case MAT_ACTIVATION_SIGMOID:
+            for (size_t i = 0; i < n; i++) r[i] = 1 / (1 + exp(-a[i]));
+            break;
+        case MAT_ACTIVATION_TANH:
+            for (size_t i = 0; i < n; i++) r[i] = tanh(a[i]);
+            break;
+        case MAT_ACTIVATION_NONE:
+            if (r != a) memcpy(r, a, sizeof(REAL) * n);
+            break;
+        default:
+            for (size_t i = 0; i < n; i++) r[i] = (a[i] > 0)? a[i] : 0;
+            break;
+    }
+}
+
+void CPU_NAME(_matCpuActivationDerive)(const REAL *a, const REAL *u, int f, REAL *r, size_t n) {
+    switch (f) {
+        case MAT_ACTIVATION_SIGMOID:
+            for (size_t i = 0; i < n; i++) {
+                REAL y = 1 / (1 + exp(-a[i]));
+                r[i] = u[i] * y * (1 - y);
+            }
+            break;
+        case MAT_ACTIVATION_TANH:
+            for (size_t i = 0; i < n; i++) {
+                REAL y = tanh(a[i]);
+                r[i] = u[i] * (1 - y * y);
+            }
+            break;
+        case MAT_ACTIVATION_NONE:
+            if (r != u) memcpy(r, u, sizeof(REAL) * n);
+            break;
+        default:
+            for (size_t i = 0; i < n; i++) r[i] = (a[i] > 0)? u[i] : 0;
+            break;
+    }
+}
+
+// Derivative of an activation, from its output `y`.
+static inline REAL CPU_NAME(_matCpuActivationDerivative)(REAL y, int f) {
+    switch (f) {
+        case MAT_ACTIVATION_SIGMOID: return y * (1 - y);
+        case MAT_ACTIVATION_TANH: return 1 - y * y;
+        case MAT_ACTIVATION_NONE: return 1;
+        default: return (y > 0)? 1 : 0;
+    }
+}
+
+void CPU_NAME(_matCpuDense)(const REAL *w, const REAL *x, REAL *r, size_t in, size_t out, size_t n, int f) {
+    for (size_t b = 0; b < n; b++) {
+        const REAL *xb = x + b * in;
+        for (size_t o = 0; o < out; o++) {
+            const REAL *wrow = w + o * (in + 1);
+            r[b * out + o] = wrow[in] + CPU_NAME(_matCpuInner)(wrow, xb, in);
+        }
+    }
+
+    if (f != MAT_ACTIVATION_NONE) CPU_NAME(_matCpuActivation)(r, f, r, out * n);
+}
+
+void CPU_NAME(_matCpuDenseDerive)(const REAL *w, const REAL *x, const REAL *y, const REAL *u,
+                                  REAL *dw, REAL *dx, size_t in, size_t out, size_t n, int f) {
+    memset(dw, 0, sizeof(REAL) * (in + 1) * out);
+    memset(dx, 0, sizeof(REAL) * in * n);
+
+    for (size_t b = 0; b < n; b++) {
+        const REAL *xb = x + b * in;
+        REAL *dxb = dx + b * in;
+        for (size_t o = 0; o < out; o++) {
+            REAL d = u[b * out + o] * CPU_NAME(_matCpuActivationDerivative)(y[b * out + o], f);
+            const REAL *wrow = w + o * (in + 1);
+            REAL *dwrow = dw + o * (in + 1);
+
+            for (size_t k = 0; k < in; k++) {
+                dwrow[k] += d * xb[k];
+                dxb[k] += d * wrow[k];
+            }
+            dwrow[in] += d;
+        }
+    }
+}
+
+void CPU_NAME(_matCpuMomentum)(double learning_rate, double momentum, const REAL *g, REAL *v, REAL *w, size_t n) {
+    const REAL lr = learning_rate, mu = momentum;
+
+    for (size_t i = 0; i < n; i++) {
+        v[i] = mu * v[i] + g[i];
+        w[i] -= lr * v[i];
+    }
+}
+
+void CPU_NAME(_matCpuRMSProp)(double learning_rate, double decay, double epsilon, const REAL *g, REAL *s, REAL *w, size_t n) {
+    const REAL lr = learning_rate, rho = decay, eps = epsilon;
+
+    for (size_t i = 0; i < n; i++) {
+        s[i] = rho * s[i] + (1 - rho) * g[i] * g[i];
+        w[i] -= lr * g[i] / (sqrt(s[i]) + eps);
+    }
+}
+
+void CPU_NAME(_matCpuAdam)(double learning_rate, double beta1, double beta2, double epsilon, double c1, double c2,
+                           const REAL *g, REAL *m, REAL *v, REAL *w, size_t n) {
+    const REAL lr = learning_rate, b1 = beta1, b2 = beta2, eps = epsilon, rc1 = c1, rc2 = c2;
+
+    for (size_t i = 0; i < n; i++) {
+        m[i] = b1 * m[i] + (1 - b1) * g[i];
+        v[i] = b2 * v[i] + (1 - b2) * g[i] * g[i];
+        w[i] -= lr * (m[i] * rc1) / (sqrt(v[i] * rc2) + eps);
+    }
+}
+
+// Gather `n` elements `stride` apart into `r`, or return `a` if already contiguous.
+static const REAL* CPU_NAME(_matCpuRow)(const REAL *a, unsigned stride, size_t n, REAL *r) {
+    if (stride == 1) return a;
+    for (size_t i = 0; i < n; i++) r[i] = a[i * stride];
+    return r;
+}
+
+void CPU_NAME(_matCpuBinaryStrided)(CPU_NAME(_matCpuBinaryFn) fn, unsigned ndims, const unsigned *dimsz,
+                                    const REAL *a, const unsigned *astride,
+                                    const REAL *b, const unsigned *bstride, REAL *r) {
+    if (ndims == 0) {
+        fn(a, b, r, 1);
+        return;
+    }
+
+    const size_t n = dimsz[0];
+    REAL *arow = (REAL *) malloc(sizeof(REAL) * n);
+    REAL *brow = (REAL *) malloc(sizeof(REAL) * n);
+
+    MAT_CPU_FOR_ROWS(ndims, dimsz, astride, bstride,
+        fn(CPU_NAME(_matCpuRow)(a + aoff, astride[0], n, arow), CPU_NAME(_matCpuRow)(b + boff, bstride[0], n, brow), r + row * n, n);
+    );
+
+    free(arow);
+    free(brow);
+}
+
+void CPU_NAME(_matCpuGather)(const REAL *a, const unsigned *astride, unsigned ndims, const unsigned *dimsz, REAL *r) {
+    if (ndims == 0) {
+        r[0] = a[0];
+        return;
+    }
+
+    const size_t n = dimsz[0];
+    MAT_CPU_FOR_ROWS(ndims, dimsz, astride, astride,
+        for (size_t i = 0; i < n; i++) r[row * n + i] = a[aoff + i * astride[0]];
+    );
+}
+
+// Reduce `n` elements `stride` apart.
+static REAL CPU_NAME(_matCpuReduceRun)(const REAL *a, size_t stride, size_t n, int max) {
+    if (stride == 1) return max? CPU_NAME(_matCpuMax)(a, n) : CPU_NAME(_matCpuSum)(a, n);
+
+    REAL acc = a[0];
+    for (size_t i = 1; i < n; i++) {
+        REAL v = a[i * stride];
+        acc = max? ((v > acc)? v : acc) : acc + v;
+    }
+
+    return acc;
+}
+
+void CPU_NAME(_matCpuReduce)(const REAL *a, const unsigned *astride, unsigned rndims, const unsigned *rdimsz,
+                             size_t n, unsigned axis_stride, int max, REAL *r) {
+    if (rndims == 0) {
+        r[0] = CPU_NAME(_matCpuReduceRun)(a, axis_stride, n, max);
+        return;
+    }
+
+    const size_t n0 = rdimsz[0];
+    if (astride[0] == 1 && axis_stride != 1) {
+        // Rows of the result are contiguous in the source, so whole rows are
+        // reduced into them at once.
+        MAT_CPU_FOR_ROWS(rndims, rdimsz, astride, astride,
+            REAL *rrow = r + row * n0;
+            memcpy(rrow, a + aoff, sizeof(REAL) * n0);
+            for (size_t k = 1; k < n; k++)
+                (max? CPU_NAME(_matCpuMaximum) : CPU_NAME(_matCpuAdd))(rrow, a + aoff + k * axis_stride, rrow, n0);
+        );
+        return;
+    }
+
+    MAT_CPU_FOR_ROWS(rndims, rdimsz, astride, astride,
+        for (size_t i = 0; i < n0; i++)
+            r[row * n0 + i] = CPU_NAME(_matCpuReduceRun)(a + aoff + i * astride[0], axis_stride, n, max);
+    );
+}
+
+// r = a * b, each element the inner product of a row of a and a column of b. Strided
+// rows of a are gathered, and so are the columns of b unless they are contiguous.
+// Returns 1 if out of memory.
+static int CPU_NAME(_matCpuGemmInner)(const REAL *a, size_t ars, size_t acs, const REAL *b, size_t brs, size_t bcs,
+                                      REAL *r, int M, int N, int K) {
+    REAL *bt = (brs == 1)? NULL : (REAL *) malloc(sizeof(REAL) * N * K);
+    REAL *arow = (acs == 1)? NULL : (REAL *) malloc(sizeof(REAL) * K);
+    if ((bt == NULL && brs != 1) || (arow == NULL && acs != 1)) {
+        free(bt);
+        free(arow);
+        return 1;
+    }
+
+    const REAL *bcols = b;
+    size_t bstep = bcs;
+    if (bt != NULL) {
+        for (int k = 0; k < K; k++)
+            for (int j = 0; j < N; j++) bt[(size_t) j * K + k] = b[(size_t) k * brs + (size_t) j * bcs];
+        bcols = bt;
+        bstep = K;
+    }
+
+    for (int i = 0; i < M; i++) {
+        const REAL *ai = (acs == 1)? a + (size_t) i * ars : CPU_NAME(_matCpuRow)(a + (size_t) i * ars, acs, K, arow);
+        for (int j = 0; j < N; j++) r[(size_t) i * N + j] = CPU_NAME(_matCpuInner)(ai, bcols + (size_t) j * bstep, K);
+    }
+
+    free(bt);
+    free(arow);
+
+    return 0;
+}
+
+int CPU_NAME(_matCpuGemm)(const REAL *a, size_t ars, size_t acs, const REAL *b, size_t brs, size_t bcs,
+                          REAL *r, int M, int N, int K) {
+    // Few columns, or columns of b already contiguous and read by few rows of a.
+    if (N < CPU_GEMM_NARROW || (brs == 1 && M < CPU_GEMM_NARROW))
+        return CPU_NAME(_matCpuGemmInner)(a, ars, acs, b, brs, bcs, r, M, N, K);
+
+    // Rows of b are read as vectors.
+    REAL *bc = NULL;
+    if (bcs != 1) {
+        if ((bc = (REAL *) malloc(sizeof(REAL) * K * N)) == NULL) return 1;
+        for (int k = 0; k < K; k++)
+            for (int j = 0; j < N; j++) bc[(size_t) k * N + j] = b[(size_t) k * brs + (size_t) j * bcs];
+        b = bc;
+        brs = N;
+    }
+
+    memset(r, 0, sizeof(REAL) * M * N);
+
+    // Row i of r accumulates a[i, k] * (row k of b), over all k. Both rows are
+    // contiguous, so the inner loop is a vectorized axpy.
+    for (int jb = 0; jb < N; jb += CPU_GEMM_NB) {
+        const int jn = MIN(CPU_GEMM_NB, N - jb);
+
+        for (int kb = 0; kb < K; kb += CPU_GEMM_KB) {
+            const int kend = MIN(kb + CPU_GEMM_KB, K);
+
+            for (int i = 0; i < M; i++) {
+                const REAL *arow = a + (size_t) i * ars;
+                REAL *rrow = r + (size_t) i * N + jb;
+
+                for (int k = kb; k < kend; k++)
+                    CPU_NAME(_matCpuAxpy)(arow[k * acs], b + (size_t) k * brs + jb, rrow, jn);
+            }
+        }
+    }
+
+    free(bc);
+
+    return 0;
+}
+
+void CPU_NAME(_matCpuProd)(const REAL *a, const unsigned *adimsz, const REAL *b, const unsigned *bdimsz,
+                           REAL *r, const unsigned *rdimsz, int ndims, size_t rsize) {
+    const unsigned b_stride = bdimsz[0];
+    const unsigned iter = adimsz[0];
+
+    for (size_t gi = 0; gi < rsize; gi++) {
+        size_t gi_dim0 = gi % rdimsz[0];
+        unsigned offseta = _matCpuRemap(gi - gi_dim0, rdimsz, adimsz, ndims);
+
+        size_t gi_dim1 = (gi - gi_dim0) / rdimsz[0];
+        if (ndims > 1) gi_dim1 %= rdimsz[1];
+        unsigned offsetb = _matCpuRemap(gi - gi_dim1 * rdimsz[0], rdimsz, bdimsz, ndims);
+
+        REAL acc = 0;
+        for (unsigned i = 0; i < iter; i++) acc += a[offseta + i] * b[offsetb + i * b_stride];
+        r[gi] = acc;
+    }
+}
+
+void CPU_NAME(_matCpuDot)(const REAL *a, unsigned andims, const unsigned *adimsz,
+                          const REAL *b, unsigned bndims, const unsigned *bdimsz,
+                          REAL *r, const unsigned *rdimsz, size_t rsize) {
+    const unsigned b_stride = (bndims > 1)? bdimsz[0] : 1;
+
+    unsigned a_mul_st = 1;
+    for (unsigned i = 1; i < andims; i++) a_mul_st *= adimsz[i];
+
+    for (size_t gi = 0; gi < rsize; gi++) {
+        unsigned a_ind = _matCpuRemap(gi, rdimsz, &adimsz[1], andims - 1) * adimsz[0];
+
+        unsigned dimba = (gi - a_ind / adimsz[0]) / a_mul_st;
+        unsigned fdimb = dimba % bdimsz[0];
+        unsigned b_ind = fdimb + (dimba - fdimb) * bdimsz[1];
+
+        REAL acc = 0;
+        for (unsigned i = 0; i < adimsz[0]; i++) acc += a[a_ind + i] * b[b_ind + b_stride * i];
+        r[gi] = acc;
+    }
+}
+
+void CPU_NAME(_matCpuTranspose)(const REAL *a, REAL *r, size_t P, size_t D) {
+    // Blocked, so both the reads and the writes of a block stay in cache.
+    for (size_t cb = 0; cb < D; cb += CPU_TRANSPOSE_BLOCK) {
+        const size_t cend = MIN(cb + CPU_TRANSPOSE_BLOCK, D);
+
+        for (size_t rb = 0; rb < P; rb += CPU_TRANSPOSE_BLOCK) {
+            const size_t rend = MIN(rb + CPU_TRANSPOSE_BLOCK, P);
+
+            for (size_t row = rb; row < rend; row++)
+                for (size_t col = cb; col < cend; col++)
+                    r[col + row * D] = a[row + col * P];
+        }
+    }
+}
+
+void CPU_NAME(_matCpuQuantizedProd)(const int8_t *q, const float *scale, const REAL *x, double x_scale,
+                                    REAL *r, size_t in, size_t out, size_t n) {
+    int8_t *xq = (int8_t *) malloc(in * n);
+    int32_t *acc = (int32_t *) malloc(sizeof(int32_t) * out * n);
+
+    const float inv = 1 / x_scale;
+    for (size_t i = 0; i < in * n; i++) xq[i] = _matCpuToInt8(x[i] * inv);
+
+    _matCpuGemmInt8(q, xq, acc, in, out, n);
+
+    const REAL xs = x_scale;
+    for (size_t b = 0; b < n; b++)
+        for (size_t o = 0; o < out; o++) r[b * out + o] = acc[b * out + o] * (scale[o] * xs);
+
+    free(xq);
+    free(acc);
+}
@@ -0,0 +1,31 @@
+#ifndef MATKERNELS_H
+#define MATKERNELS_H
+
+// Kernels of the mat.cl template, registered once per dtype by `matInit`.
+
+#include <stdlib.h>
+#include <string.h>
+
+// Names of the kernels of a dtype, the template names with its suffix.
+#define MAT_KERNEL_COUNT 24
+#define MAT_KERNEL_NAMES(suffix) \
+    "matmul" suffix, "matadd" suffix, "matsub" suffix, "matprod" suffix, "matdot" suffix, "matgemm" suffix, \
+    "matgather" suffix, "mataddv" suffix, "matsubv" suffix, "matmulv" suffix, "matreduce" suffix, "reduce" suffix, \
+    "mataxpy" suffix, "matmomentum" suffix, "matrmsprop" suffix, "matadam" suffix, "matactivation" suffix, \
+    "matactivationderive" suffix, "matdense" suffix, "matdenseweights" suffix, "matdenseinput" suffix, \
+    "matwiden" suffix, "matnarrow" suffix, "matqprod" suffix
+
+// Definitions the float32 instance of the mat.cl template is built with.
+// NOTE: Must match the defaults in mat.cl.
+#define MAT_FLOAT32_HEADER "#define REAL float\n#define REAL4 float4\n#define KERNEL(name) name##_f32\n"
+
+// The mat.cl template, with `header` defining its element type before it.
+static inline char* _matKernelSource(const char *header, const char *src) {
+    char *res = (char *) malloc(strlen(header) + strlen(src) + 1);
+    strcpy(res, header);
+    strcat(res, src);
+
+    return res;
+}
+
+#endif
@@ -0,0 +1,275 @@
+// NOTE: Must come before any header, for `clock_gettime`.
+#ifdef _WIN32
+#include <windows.h>
+#else
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <time.h>
+#endif
+
+#include "mat.h"
+#include "matprofile.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROFILE_MAGIC "MATPROF1"
+#define PROFILE_DEVICE_NAME_SIZE 256
+// Timed runs of every measurement, after a warm up run. The fastest one is kept.
+#define CALIBRATION_REPS 3
+
+typedef MatrixErr (*_matBinaryOp)(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend);
+
+// Profile file set with `matSetProfile`.
+static char *profile_path = NULL;
+
+static double _matNow() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+// `matSumOn` as a binary operation of the data of `t1`.
+static MatrixErr _matSumOp(Tensor *t1, Tensor *t2, Tensor **r, MatrixBackend backend) {
+    double res;
+    *r = NULL;
+    return matSumOn(t1->data, t1->literal_size, &res, backend);
+}
+
+// Fastest run of `op` in seconds, or a negative value if it failed.
+static double _matTimeOp(_matBinaryOp op, Tensor *t1, Tensor *t2, MatrixBackend backend) {
+    double best = -1;
+
+    for (int rep = 0; rep <= CALIBRATION_REPS; rep++) {
+        Tensor *r = NULL;
+
+        double start = _matNow();
+        MatrixErr err = op(t1, t2, &r, backend);
+        double elapsed = _matNow() - start;
+
+        matFreeTensor(&r);
+        if (err != MAT_NO_ERROR) return -1;
+
+        // The first run is a warm up.
+        if (rep > 0 && (best < 0 || elapsed < best)) best = elapsed;
+    }
+
+    return best;
+}
+
+static Tensor* _matRandomTensor(unsigned ndims, unsigned *dims) {
+    Tensor *t = matMakeTensor(ndims, dims, NULL);
+    t->data = (double *) malloc(sizeof(double) * t->literal_size);
+    for (size_t i = 0; i < t->literal_size; i++) t->data[i] = (double) rand() / RAND_MAX;
+
+    return t;
+}
+
+// Smallest size from which the device is faster at every larger measured size.
+/*
+ * SIZE_MAX if the device never catches up. A failed device run counts as slower.
+ * */
+static size_t _matCrossoverOf(const size_t *work, const double *cpu, const double *device, int n) {
+    size_t crossover = SIZE_MAX;
+
+    for (int i = n; i --> 0;) {
+        if (device[i] < 0 || (cpu[i] >= 0 && device[i] >= cpu[i])) break;
+        crossover = work[i];
+    }
+
+    return crossover;
+}
+
+// Measure one operation over a size sweep.
+/*
+ * `shape` - fills the operand dimensions of step `i`, and returns its work size.
+ * */
+static size_t _matCalibrateOp(_matBinaryOp op, int steps,
+                              size_t (*shape)(int i, unsigned *ndims1, unsigned *dims1, unsigned *ndims2, unsigned *dims2)) {
+    size_t work[32];
+    double cpu[32];
+    double device[32];
+
+    for (int i = 0; i < steps; i++) {
+        unsigned ndims1, ndims2;
+        unsigned dims1[3], dims2[3];
+        work[i] = shape(i, &ndims1, dims1, &ndims2, dims2);
+
+        Tensor *t1 = _matRandomTensor(ndims1, dims1);
+        Tensor *t2 = _matRandomTensor(ndims2, dims2);
+
+        cpu[i] = _matTimeOp(op, t1, t2, MAT_BACKEND_CPU);
+        device[i] = _matTimeOp(op, t1, t2, MAT_BACKEND_DEVICE);
+
+        matFreeTensor(&t1);
+        matFreeTensor(&t2);
+    }
+
+    return _matCrossoverOf(work, cpu, device, steps);
+}
+
+// Vectors of 64 to 4M elements.
+static size_t _matVectorShape(int i, unsigned *ndims1, unsigned *dims1, unsigned *ndims2, unsigned *dims2) {
+    unsigned n = 64u << (2 * i);
+    *ndims1 = *ndims2 = 1;
+    dims1[0] = dims2[0] = n;
+
+    return n;
+}
+
+// Square matrices of 8 to 512.
+static size_t _matProdShape(int i, unsigned *ndims1, unsigned *dims1, unsigned *ndims2, unsigned *dims2) {
+    unsigned n = 8u << i;
+    *ndims1 = *ndims2 = 2;
+    dims1[0] = dims1[1] = dims2[0] = dims2[1] = n;
+
+    return (size_t) n * n * n;
+}
+
+// A stack of two square matrices dotted with a square matrix, of 8 to 256.
+static size_t _matDotShape(int i, unsigned *ndims1, unsigned *dims1, unsigned *ndims2, unsigned *dims2) {
+    unsigned n = 8u << i;
+    *ndims1 = 3;
+    *ndims2 = 2;
+    dims1[0] = dims1[1] = dims2[0] = dims2[1] = n;
+    dims1[2] = 2;
+
+    return (size_t) 2 * n * n * n;
+}
+
+static int _matProfileKey(char *device_name, MatrixCpuIsa *isa) {
+    *isa = matGetCpuIsa();
+    return claGetDeviceName(device_name, PROFILE_DEVICE_NAME_SIZE) != OCL_NO_ERR;
+}
+
+// Returns 0 if the profile was loaded.
+static int _matLoadProfile(const char *path) {
+    char device_name[PROFILE_DEVICE_NAME_SIZE];
+    MatrixCpuIsa isa;
+    if (_matProfileKey(device_name, &isa)) return 1;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 1;
+
+    char line[PROFILE_DEVICE_NAME_SIZE + 2];
+    unsigned long long elementwise, prod, dot, sum;
+    int file_isa;
+    int ok = fgets(line, sizeof(line), f) != NULL && strncmp(line, PROFILE_MAGIC, strlen(PROFILE_MAGIC)) == 0;
+    // Made for other hardware.
+    ok = ok && fgets(line, sizeof(line), f) != NULL;
+    if (ok) {
+        line[strcspn(line, "\n")] = '\0';
+        ok = strcmp(line, device_name) == 0;
+    }
+    ok = ok && fscanf(f, "%d %llu %llu %llu %llu", &file_isa, &elementwise, &prod, &dot, &sum) == 5;
+    ok = ok && file_isa == (int) isa;
+    fclose(f);
+
+    if (!ok) return 1;
+
+    MatrixCrossover crossover = { elementwise, prod, dot, sum };
+    matSetCrossover(crossover);
+
+    return 0;
+}
+
+static void _matSaveProfile(const char *path) {
+    char device_name[PROFILE_DEVICE_NAME_SIZE];
+    MatrixCpuIsa isa;
+    if (_matProfileKey(device_name, &isa)) return;
+
+    // Written aside and renamed, so a concurrent run never reads half a profile.
+    char *tmp_path = (char *) malloc(strlen(path) + 5);
+    sprintf(tmp_path, "%s.tmp", path);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (f != NULL) {
+        MatrixCrossover c = matGetCrossover();
+        fprintf(f, "%s\n%s\n%d %llu %llu %llu %llu\n", PROFILE_MAGIC, device_name, (int) isa,
+                (unsigned long long) c.elementwise, (unsigned long long) c.prod,
+                (unsigned long long) c.dot, (unsigned long long) c.sum);
+        int ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+
+        // Renaming over an existing file fails on Windows, replace it there.
+        if (ok && rename(tmp_path, path)) {
+            remove(path);
+            ok = rename(tmp_path, path) == 0;
+        }
+        if (!ok) remove(tmp_path);
+    }
+
+    free(tmp_path);
+}
+
+static void _matLoadOrCalibrate() {
+    if (profile_path == NULL || !_matLoadProfile(profile_path)) return;
+    matCalibrate();
+}
+
+void _matProfileInit() {
+    if (profile_path == NULL && getenv("MAT_PROFILE") != NULL) {
+        // Sets the profile path, and loads it.
+        matSetProfile(getenv("MAT_PROFILE"));
+        return;
+    }
+
+    _matLoadOrCalibrate();
+}
+
+// Set the profile file of `matCalibrate`.
+/*
+ * A profile made on the same CPU and device is loaded instead of calibrating, otherwise
+ * `matCalibrate` runs and saves a new one. Once initialized, this happens right away.
+ * If unset, the `MAT_PROFILE` environment variable is used by `matInit`.
+ * `path` - profile file, or NULL to stop saving profiles.
+ * returns 0 on success
+ * */
+MatrixErr matSetProfile(const char *path) {
+    free(profile_path);
+    profile_path = NULL;
+
+    if (path == NULL) return MAT_NO_ERROR;
+
+    profile_path = (char *) malloc(strlen(path) + 1);
+    strcpy(profile_path, path);
+
+    if (_matHasDevice()) _matLoadOrCalibrate();
+
+    return MAT_NO_ERROR;
+}
+
+// Measure when operations are faster on the device than on the CPU.
+/*
+ * Times `matAdd`, `matProd`, `matDot` and `matSum` over a sweep of sizes on both
+ * backends, with host operands, and sets the crossover sizes (see `matSetCrossover`).
+ * Saves them to the profile file, if one is set.
+ * returns MAT_UNINITIALIZED if there is no device to calibrate.
+ * */
+MatrixErr matCalibrate() {
+    if (!_matHasDevice()) return MAT_UNINITIALIZED;
+
+    MatrixCrossover crossover;
+    crossover.elementwise = _matCalibrateOp(matAddOn, 9, _matVectorShape);
+    crossover.prod = _matCalibrateOp(matProdOn, 7, _matProdShape);
+    crossover.dot = _matCalibrateOp(matDotOn, 6, _matDotShape);
+    crossover.sum = _matCalibrateOp(_matSumOp, 9, _matVectorShape);
+    matSetCrossover(crossover);
+
+    fprintf(stderr, "Calibrated mat.h: device from %llu elements (element-wise), %llu (prod), %llu (dot), %llu (sum).\n",
+            (unsigned long long) crossover.elementwise, (unsigned long long) crossover.prod,
+            (unsigned long long) crossover.dot, (unsigned long long) crossover.sum);
+
+    if (profile_path != NULL) _matSaveProfile(profile_path);
+
+    return MAT_NO_ERROR;
+}
@@ -0,0 +1,13 @@
+#ifndef MATPROFILE_H
+#define MATPROFILE_H
+
+// CPU/device calibration of mat.h, see `matCalibrate`.
+
+// Load the profile set with `matSetProfile` (or `MAT_PROFILE`), calibrating and
+// saving it when missing or made on other hardware. Called by `matInit`.
+void _matProfileInit();
+
+// Is mat.h initialized, with a device backend. Defined in mat.c.
+int _matHasDevice();
+
+#endif
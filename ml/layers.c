@@ -3,13 +3,14 @@
 // NOTE: Random number generation uses time.
 #include <time.h>
 #include <math.h>
+#include <string.h>
 
 // TODO: Is this function usefull? Shouldn't each layer implement its weight initializer?
 // Or maybe this function is usefull to be used inside the implementation?
 // TODO: A function with the exact same functunality should be added to mat lib, and this one either acting as an API call to it or removing the function entirely.
 Tensor* mlWeightInitializer(MLWeightInitializerType initializer, unsigned ndims, unsigned *dims) {
     Tensor *res = matMakeTensor(ndims, dims, NULL);
-    res->data = (double *) malloc(sizeof(double) * res->literal_size);
+    res->data = (double *) matTensorAlloc(res, sizeof(double) * res->literal_size);
 
     switch (initializer) {
         case ML_WEIGHT_INITIALIZER_ZEROS: {
@@ -43,12 +44,85 @@ Tensor* mlWeightInitializer(MLWeightInitializerType initializer, unsigned ndims,
     return res;
 }
 
+/* Batches */
+
+// Is `t` a batch of samples of `size` elements, stacked as the rows of a matrix
+// (see `matTensorStack`). Anything else is a single sample.
+static int _mlIsBatch(Tensor *t, unsigned size) {
+    return t != NULL && t->ndims == 2 && t->dimsz[0] == size;
+}
+
+// Set the shape of an operation's result, which may have had its dimensions of 1 reduced.
+static void _mlSetShape(Tensor *t, unsigned ndims, unsigned *dims) {
+    matTensorRelease(t, t->dimsz);
+    t->dimsz = (unsigned *) matTensorAlloc(t, sizeof(unsigned) * ndims);
+    memcpy(t->dimsz, dims, sizeof(unsigned) * ndims);
+    t->ndims = ndims;
+}
+
+// Shape of a layer keeping the shape of its input.
+static MLErr _mlSameShape(Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (input == NULL) return ML_NULL_PTR;
+
+    *output = matMakeTensor(input->ndims, input->dimsz, NULL);
+
+    return (*output == NULL)? ML_LAYER_INVALID_INPUT_DIMS : ML_NO_ERR;
+}
+
+// Trainable weights of a layer without weights.
+static MLErr _mlNoWeights(Tensor **weights) {
+    if (weights == NULL) return ML_NULL_PTR;
+    *weights = NULL;
+
+    return ML_NO_ERR;
+}
+
+// Forward of an element-wise activation layer.
+static MLErr _mlActivationForward(Layer *self, MatrixActivation f, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    if (input == NULL) return ML_NULL_PTR;
+
+    MatrixErr error = (*output != NULL)? matActivationInto(input, f, *output) : matActivation(input, f, output);
+    if (error != MAT_NO_ERROR) {
+        self->error = error;
+
+        return ML_LAYER_INTERNAL_ERROR;
+    }
+
+    return ML_NO_ERR;
+}
+
+// Derive of an element-wise activation layer, recomputing f'(x) from its input in the
+// same kernel that applies it to the upstream derivative.
+static MLErr _mlActivationDerive(Layer *self, MatrixActivation f, Tensor *upstream_derivatives, Tensor *activation,
+                                 Tensor **downstream_derivative, Tensor **self_derivative) {
+    if (downstream_derivative == NULL || self_derivative == NULL) return ML_NULL_PTR;
+    *downstream_derivative = NULL;
+    // Activations have no weights.
+    *self_derivative = NULL;
+
+    MatrixErr error = matActivationDerive(activation, upstream_derivatives, f, downstream_derivative);
+    if (error != MAT_NO_ERROR) {
+        self->error = error;
+
+        return ML_LAYER_INTERNAL_ERROR;
+    }
+
+    return ML_NO_ERR;
+}
+
 /* Fully Connected Layer */
 
 MLErr mlFullyConnectedInitialize(Layer *self) {
     if (self->weights == NULL) return ML_LAYER_INVALID_WEIGHTS;
     if (((Tensor *) self->weights)->ndims != 2) return ML_LAYER_INVALID_WEIGHTS;
 
+    // Keep the weights on the device, so the forward chain doesn't copy them
+    // every pass. On failure the layer still works from host memory.
+    matTensorToDevice((Tensor *) self->weights);
+
     return ML_NO_ERR;
 }
 
@@ -64,23 +138,35 @@ MLErr mlFullyConnectedCleanup(Layer *self) {
 
 MLErr mlFullyConnectedForward(Layer *self, Tensor *input, Tensor **output) {
     Tensor *weights = (Tensor *) self->weights;
-    Tensor *inputf = matTensorFlatten(input, NULL);
-    Tensor *res;
+    // Planned output, or NULL.
+    Tensor *res = *output;
+    MatrixErr e;
+
+    if (_mlIsBatch(input, weights->dimsz[0])) {
+        // output = input * weights', a single product for the whole batch.
+        Tensor *weightsT = matTTensorView(weights, NULL);
+        if (res != NULL) e = matProdInto(input, weightsT, res);
+        else {
+            e = matProd(input, weightsT, &res);
+            if (e == MAT_NO_ERROR) _mlSetShape(res, 2, (unsigned []) { weights->dimsz[1], input->dimsz[1] });
+        }
+        matFreeTensor(&weightsT);
+    } else {
+        Tensor *inputf = matTensorFlatten(input, NULL);
+        e = (res != NULL)? matDotInto(weights, inputf, res) : matDot(weights, inputf, &res);
+        matFreeTensor(&inputf);
+    }
 
-    MatrixErr e = matDot(weights, inputf, &res);
+    if (e != MAT_NO_ERROR && res != *output) matFreeTensor(&res);
 
     switch (e) {
         case MAT_NO_ERROR: break;
         case MAT_DIMENSION_MISTMATCH:
-            matFreeTensor(&inputf);
-            matFreeTensor(&res);
             self->error = e;
 
             return ML_LAYER_INVALID_INPUT_DIMS;
 
         default:
-            matFreeTensor(&inputf);
-            matFreeTensor(&res);
             self->error = e;
 
             return ML_LAYER_INTERNAL_ERROR;
@@ -88,8 +174,6 @@ MLErr mlFullyConnectedForward(Layer *self, Tensor *input, Tensor **output) {
 
     *output = res;
 
-    matFreeTensor(&inputf);
-
     return ML_NO_ERR;
 }
 
@@ -99,66 +183,95 @@ MLErr mlFullyConnectedDerive(Layer *self, Tensor *upstream_derivatives, Tensor *
     if (self_derivative == NULL) return ML_NULL_PTR;
     *self_derivative = NULL;
 
-    // self_derivative = activations * upstream_derivatives
-    Tensor *activationf = matTensorFlatten(activation, NULL);
-    // HACK: Is this correct? In GD it certainly is, but does it apply to any context?
-    Tensor *upstream_derivativesf = matTensorFlatten(upstream_derivatives, NULL);
-    Tensor *res;
+    Tensor *weights = (Tensor *) self->weights;
+    unsigned in = weights->dimsz[0];
+    unsigned out = weights->dimsz[1];
+
+    // A single sample is derived as a batch of one.
+    int batch = _mlIsBatch(activation, in);
+    unsigned batch_size = batch? activation->dimsz[1] : 1;
+    Tensor *activations = batch? activation : matTensorReshape(activation, 2, (unsigned []) { in, 1 }, NULL);
+    Tensor *upstream = batch? upstream_derivatives : matTensorReshape(upstream_derivatives, 2, (unsigned []) { out, 1 }, NULL);
+    if (activations == NULL || upstream == NULL) {
+        if (!batch) {
+            matFreeTensor(&activations);
+            matFreeTensor(&upstream);
+        }
+        self->error = MAT_DIMENSION_MISTMATCH;
+
+        return ML_LAYER_INVALID_INPUT_DIMS;
+    }
+
+    // self_derivative = upstream_derivatives' * activations, summing the outer
+    // products of every sample.
+    Tensor *upstreamT = matTTensorView(upstream, NULL);
+    Tensor *res = NULL;
+    MatrixErr e = matProd(upstreamT, activations, &res);
+    matFreeTensor(&upstreamT);
+
+    // downstream_derivative = upstream_derivatives * self->weights
+    Tensor *downstream = NULL;
+    if (e == MAT_NO_ERROR) e = matProd(upstream, weights, &downstream);
 
-    MatrixErr e = matDot(activationf, upstream_derivativesf, &res);
+    if (!batch) {
+        matFreeTensor(&activations);
+        matFreeTensor(&upstream);
+    }
 
     switch (e) {
         case MAT_NO_ERROR: break;
         default:
-            matFreeTensor(&activationf);
-            matFreeTensor(&upstream_derivativesf);
+            matFreeTensor(&res);
+            matFreeTensor(&downstream);
             printf_m("%s\n", matGetErrorString(e));
 
             self->error = e;
 
             return ML_LAYER_INTERNAL_ERROR;
     }
-    
-    *self_derivative = res;
-
-    matFreeTensor(&activationf);
-    matFreeTensor(&upstream_derivativesf);
 
-    // downstream_derivative = self->weights' * upstream_derivatives
-    Tensor *weightsnT;
-    matTTensor((Tensor *) self->weights, &weightsnT);
+    _mlSetShape(res, 2, (unsigned []) { in, out });
+    if (batch) _mlSetShape(downstream, 2, (unsigned []) { in, batch_size });
+    else _mlSetShape(downstream, 1, &in);
 
-    Tensor *downstream;
-    
-    e = matDot(weightsnT, upstream_derivatives, &downstream);
+    *self_derivative = res;
+    *downstream_derivative = downstream;
 
-    switch (e) {
-        case MAT_NO_ERROR: break;
-        default:
-            matTensorPrint(weightsnT);
-            matFreeTensor(&weightsnT);
+    return ML_NO_ERR;
+}
 
-            self->error = e;
+MLErr mlFullyConnectedUpdate(Layer *self, Tensor *self_derivative) {
+    // self->weights -= self_derivative, in place.
+    MatrixErr error = matSubInPlace((Tensor *) self->weights, self_derivative);
+    if (error != MAT_NO_ERROR) {
+        self->error = error;
 
-            return ML_LAYER_INTERNAL_ERROR;
+        return ML_LAYER_INTERNAL_ERROR;
     }
-    
-    *downstream_derivative = downstream;
 
-    matFreeTensor(&weightsnT);
+    return ML_NO_ERR;
+}
+
+MLErr mlFullyConnectedTrainable(Layer *self, Tensor **weights) {
+    if (weights == NULL) return ML_NULL_PTR;
+    *weights = (Tensor *) self->weights;
 
     return ML_NO_ERR;
 }
 
-MLErr mlFullyConnectedUpdate(Layer *self, Tensor *self_derivative) {
-    // self->weights -= self_derivative
-    
-    Tensor *new_weights;
+MLErr mlFullyConnectedShape(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (input == NULL) return ML_NULL_PTR;
+
     Tensor *weights = (Tensor *) self->weights;
-    
-    matSub(weights, self_derivative, &new_weights);
-    
-    self->weights = (void *) new_weights;
+
+    if (_mlIsBatch(input, weights->dimsz[0]))
+        *output = matMakeTensor(2, (unsigned []) { weights->dimsz[1], input->dimsz[1] }, NULL);
+    else if (input->literal_size == weights->dimsz[0])
+        *output = matMakeTensor(1, &weights->dimsz[1], NULL);
+    else
+        return ML_LAYER_INVALID_INPUT_DIMS;
 
     return ML_NO_ERR;
 }
@@ -171,6 +284,8 @@ const char* mlFullyConnectedErrorString(int error) {
 
 MLErr mlBiasInitialize(Layer *self) {
     if (self->weights == NULL) return ML_LAYER_INVALID_PARAMETERS;
+    matTensorToDevice((Tensor *) self->weights);
+
     return ML_NO_ERR;
 }
 
@@ -180,10 +295,18 @@ MLErr mlBiasCleanup(Layer *self) {
 
 MLErr mlBiasForward(Layer *self, Tensor *input, Tensor **output) {
     Tensor *w = (Tensor *) self->weights;
-    Tensor *it = matTensorFlatten(input, NULL);
+    MatrixErr error;
+
+    // Written to the planned output, if given.
+    if (_mlIsBatch(input, w->literal_size)) {
+        // The bias is broadcast over the rows of the batch.
+        error = (*output != NULL)? matAddInto(w, input, *output) : matAdd(w, input, output);
+    } else {
+        Tensor *it = matTensorFlatten(input, NULL);
+        error = (*output != NULL)? matAddInto(w, it, *output) : matAdd(w, it, output);
+        matFreeTensor(&it);
+    }
 
-    MatrixErr error = matAdd(w, it, output);
-    matFreeTensor(&it);
     if (error != MAT_NO_ERROR) {
         self->error = error;
 
@@ -194,19 +317,21 @@ MLErr mlBiasForward(Layer *self, Tensor *input, Tensor **output) {
 }
 
 MLErr mlBiasDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
-    // self_derivative = sum(upstream_derivatives)
+    // self_derivative = upstream_derivatives, summed over a batch
     // downstream_derivative = upstream_derivatives
     
     *downstream_derivative = matTensorDeepCopy(upstream_derivatives, NULL);
 
     Tensor *w = (Tensor *) self->weights;
-    Tensor *ones = mlWeightInitializer(ML_WEIGHT_INITIALIZER_ONES, w->ndims, w->dimsz);
+    MatrixErr error;
     
-    MatrixErr error = matDot(ones, upstream_derivatives, self_derivative);
-
-    matFreeTensor(&ones);
+    if (_mlIsBatch(upstream_derivatives, w->literal_size))
+        error = matSumAxis(upstream_derivatives, 1, self_derivative);
+    else
+        *self_derivative = matTensorDeepCopy(upstream_derivatives, &error);
     
     if (error != MAT_NO_ERROR) {
+        matFreeTensor(downstream_derivative);
         self->error = error;
 
         return ML_LAYER_INTERNAL_ERROR;
@@ -216,20 +341,35 @@ MLErr mlBiasDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation
 }
 
 MLErr mlBiasUpdate(Layer *self, Tensor *self_derivative) {
-    // self->weights -= self_derivative
-    Tensor *new_weights;
-    Tensor *weightsn = (Tensor *) self->weights;
-
-    MatrixErr error = matSub(weightsn, self_derivative, &new_weights);
+    // self->weights -= self_derivative, in place.
+    MatrixErr error = matSubInPlace((Tensor *) self->weights, self_derivative);
     if (error != MAT_NO_ERROR) {
         self->error = error;
 
         return ML_LAYER_INTERNAL_ERROR;
     }
-    
-    self->weights = (void *) new_weights;
 
-    matFreeTensor(&weightsn);
+    return ML_NO_ERR;
+}
+
+MLErr mlBiasTrainable(Layer *self, Tensor **weights) {
+    if (weights == NULL) return ML_NULL_PTR;
+    *weights = (Tensor *) self->weights;
+
+    return ML_NO_ERR;
+}
+
+MLErr mlBiasShape(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (input == NULL) return ML_NULL_PTR;
+
+    Tensor *w = (Tensor *) self->weights;
+
+    if (_mlIsBatch(input, w->literal_size)) return _mlSameShape(input, output);
+    if (input->literal_size != w->literal_size) return ML_LAYER_INVALID_INPUT_DIMS;
+
+    *output = matMakeTensor(1, (unsigned []) { w->literal_size }, NULL);
 
     return ML_NO_ERR;
 }
@@ -238,6 +378,248 @@ const char* mlBiasErrorString(int error) {
     return "ML_LAYER_BIAS_UNKNOWN_ERROR";
 }
 
+/* Dense */
+
+typedef struct {
+    // The layer's copy of its parameters, which `parameters` points to.
+    MLDenseParameters parameters;
+    // Output of the last forward, owned by the caller. Training derives a layer
+    // right after its forward, while its output is still alive.
+    Tensor *output;
+} _MLDenseCache;
+
+MLErr mlDenseInitialize(Layer *self) {
+    Tensor *weights = (Tensor *) self->weights;
+    // {in + 1, out}, the bias is the last column.
+    if (weights == NULL) return ML_LAYER_INVALID_WEIGHTS;
+    if (weights->ndims != 2 || weights->dimsz[0] < 2 || !matIsTensorContiguous(weights)) return ML_LAYER_INVALID_WEIGHTS;
+
+    _MLDenseCache *cache = (_MLDenseCache *) malloc(sizeof(_MLDenseCache));
+    if (cache == NULL) return ML_LAYER_INTERNAL_ERROR;
+
+    MLDenseParameters *parameters = (MLDenseParameters *) self->parameters;
+    cache->parameters.activation = (parameters != NULL)? parameters->activation : MAT_ACTIVATION_NONE;
+    cache->output = NULL;
+    self->_cache = cache;
+    self->parameters = &cache->parameters;
+
+    matTensorToDevice(weights);
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseCleanup(Layer *self) {
+    self->parameters = NULL;
+
+    matFreeTensor((Tensor **) &self->weights);
+    free(self->_cache);
+    self->_cache = NULL;
+    self->error = 0;
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseForward(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    if (input == NULL) return ML_NULL_PTR;
+
+    _MLDenseCache *cache = (_MLDenseCache *) self->_cache;
+    Tensor *weights = (Tensor *) self->weights;
+
+    // A single pass for the product, bias and activation.
+    MatrixErr e = (*output != NULL)? matDenseInto(weights, input, cache->parameters.activation, *output)
+                                   : matDense(weights, input, cache->parameters.activation, output);
+
+    switch (e) {
+        case MAT_NO_ERROR: break;
+        case MAT_DIMENSION_MISTMATCH:
+            self->error = e;
+
+            return ML_LAYER_INVALID_INPUT_DIMS;
+
+        default:
+            self->error = e;
+
+            return ML_LAYER_INTERNAL_ERROR;
+    }
+
+    cache->output = *output;
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
+    if (downstream_derivative == NULL || self_derivative == NULL) return ML_NULL_PTR;
+    *downstream_derivative = NULL;
+    *self_derivative = NULL;
+
+    _MLDenseCache *cache = (_MLDenseCache *) self->_cache;
+    // The activation's derivative is taken from the output, so it needs the forward of `activation`.
+    if (cache->output == NULL || upstream_derivatives == NULL) return ML_NULL_PTR;
+
+    MatrixErr e = matDenseDerive((Tensor *) self->weights, activation, cache->output, upstream_derivatives,
+                                 cache->parameters.activation, self_derivative, downstream_derivative);
+    if (e != MAT_NO_ERROR) {
+        self->error = e;
+
+        return (e == MAT_DIMENSION_MISTMATCH)? ML_LAYER_INVALID_INPUT_DIMS : ML_LAYER_INTERNAL_ERROR;
+    }
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseUpdate(Layer *self, Tensor *self_derivative) {
+    // self->weights -= self_derivative, in place.
+    MatrixErr error = matSubInPlace((Tensor *) self->weights, self_derivative);
+    if (error != MAT_NO_ERROR) {
+        self->error = error;
+
+        return ML_LAYER_INTERNAL_ERROR;
+    }
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseTrainable(Layer *self, Tensor **weights) {
+    if (weights == NULL) return ML_NULL_PTR;
+    // The weights and bias, updated together.
+    *weights = (Tensor *) self->weights;
+
+    return ML_NO_ERR;
+}
+
+MLErr mlDenseShape(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (input == NULL) return ML_NULL_PTR;
+
+    Tensor *weights = (Tensor *) self->weights;
+    unsigned in = weights->dimsz[0] - 1;
+
+    if (_mlIsBatch(input, in))
+        *output = matMakeTensor(2, (unsigned []) { weights->dimsz[1], input->dimsz[1] }, NULL);
+    else if (input->literal_size == in)
+        *output = matMakeTensor(1, &weights->dimsz[1], NULL);
+    else
+        return ML_LAYER_INVALID_INPUT_DIMS;
+
+    return ML_NO_ERR;
+}
+
+const char* mlDenseErrorString(int error) {
+    return "ML_LAYER_DENSE_UNKNOWN_ERROR";
+}
+
+/* Quantized Fully Connected */
+
+// The layer's copy of its parameters, which `parameters` points to.
+typedef MLQuantizedParameters _MLQuantizedCache;
+
+MLErr mlQuantizedFullyConnectedInitialize(Layer *self) {
+    MLQuantizedParameters *parameters = (MLQuantizedParameters *) self->parameters;
+    if (parameters == NULL || parameters->scale == NULL) return ML_LAYER_INVALID_PARAMETERS;
+
+    // Takes the scales first, so cleanup frees them even if the weights are invalid.
+    _MLQuantizedCache *cache = (_MLQuantizedCache *) malloc(sizeof(_MLQuantizedCache));
+    if (cache == NULL) return ML_LAYER_INTERNAL_ERROR;
+    cache->scale = parameters->scale;
+    cache->input_scale = parameters->input_scale;
+    self->_cache = cache;
+    self->parameters = cache;
+
+    Tensor *weights = (Tensor *) self->weights;
+    // int8 {in, out}.
+    if (weights == NULL) return ML_LAYER_INVALID_WEIGHTS;
+    if (weights->ndims != 2 || weights->dtype != MAT_INT8 || !matIsTensorContiguous(weights)) return ML_LAYER_INVALID_WEIGHTS;
+    if (cache->scale->dtype != MAT_FLOAT32 || cache->scale->literal_size != weights->dimsz[1]) return ML_LAYER_INVALID_PARAMETERS;
+
+    matTensorToDevice(weights);
+    matTensorToDevice(cache->scale);
+
+    return ML_NO_ERR;
+}
+
+MLErr mlQuantizedFullyConnectedCleanup(Layer *self) {
+    self->parameters = NULL;
+
+    matFreeTensor((Tensor **) &self->weights);
+    if (self->_cache != NULL) matFreeTensor(&((_MLQuantizedCache *) self->_cache)->scale);
+    free(self->_cache);
+    self->_cache = NULL;
+    self->error = 0;
+
+    return ML_NO_ERR;
+}
+
+MLErr mlQuantizedFullyConnectedForward(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    if (input == NULL) return ML_NULL_PTR;
+
+    _MLQuantizedCache *cache = (_MLQuantizedCache *) self->_cache;
+    Tensor *weights = (Tensor *) self->weights;
+
+    // A single input or a batch, in the dtype of the input.
+    MatrixErr e = (*output != NULL)? matQuantizedProdInto(weights, cache->scale, input, cache->input_scale, *output)
+                                   : matQuantizedProd(weights, cache->scale, input, cache->input_scale, output);
+
+    switch (e) {
+        case MAT_NO_ERROR: break;
+        case MAT_DIMENSION_MISTMATCH:
+            self->error = e;
+
+            return ML_LAYER_INVALID_INPUT_DIMS;
+
+        default:
+            self->error = e;
+
+            return ML_LAYER_INTERNAL_ERROR;
+    }
+
+    return ML_NO_ERR;
+}
+
+MLErr mlQuantizedFullyConnectedDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
+    if (downstream_derivative == NULL || self_derivative == NULL) return ML_NULL_PTR;
+    *downstream_derivative = NULL;
+    *self_derivative = NULL;
+
+    // Inference only.
+    self->error = MAT_DTYPE_UNSUPPORTED;
+
+    return ML_LAYER_INTERNAL_ERROR;
+}
+
+MLErr mlQuantizedFullyConnectedUpdate(Layer *self, Tensor *self_derivative) {
+    self->error = MAT_DTYPE_UNSUPPORTED;
+
+    return ML_LAYER_INTERNAL_ERROR;
+}
+
+MLErr mlQuantizedFullyConnectedTrainable(Layer *self, Tensor **weights) {
+    return _mlNoWeights(weights);
+}
+
+MLErr mlQuantizedFullyConnectedShape(Layer *self, Tensor *input, Tensor **output) {
+    if (output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (input == NULL) return ML_NULL_PTR;
+
+    Tensor *weights = (Tensor *) self->weights;
+
+    if (_mlIsBatch(input, weights->dimsz[0]))
+        *output = matMakeTensor(2, (unsigned []) { weights->dimsz[1], input->dimsz[1] }, NULL);
+    else if (input->literal_size == weights->dimsz[0])
+        *output = matMakeTensor(1, &weights->dimsz[1], NULL);
+    else
+        return ML_LAYER_INVALID_INPUT_DIMS;
+
+    return ML_NO_ERR;
+}
+
+const char* mlQuantizedFullyConnectedErrorString(int error) {
+    return "ML_LAYER_QUANTIZED_FULLY_CONNECTED_UNKNOWN_ERROR";
+}
+
 /* ReLu */
 
 MLErr mlReLuInitialize(Layer *self) {
@@ -249,31 +631,118 @@ MLErr mlReLuCleanup(Layer *self) {
 }
 
 MLErr mlReLuForward(Layer *self, Tensor *input, Tensor **output) {
-    return ML_NO_ERR;
+    return _mlActivationForward(self, MAT_ACTIVATION_RELU, input, output);
 }
 
 MLErr mlReLuDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
-    return ML_NO_ERR;
+    return _mlActivationDerive(self, MAT_ACTIVATION_RELU, upstream_derivatives, activation, downstream_derivative, self_derivative);
 }
 
 MLErr mlReLuUpdate(Layer *self, Tensor *self_derivative) {
     return ML_NO_ERR;
 }
 
+MLErr mlReLuShape(Layer *self, Tensor *input, Tensor **output) {
+    return _mlSameShape(input, output);
+}
+
+MLErr mlReLuTrainable(Layer *self, Tensor **weights) {
+    return _mlNoWeights(weights);
+}
+
 const char* mlReLuErrorString(int error) {
     return "ML_LAYER_RELU_UNKNOWN_ERROR";
 }
 
+/* Sigmoid */
+
+MLErr mlSigmoidInitialize(Layer *self) {
+    return ML_NO_ERR;
+}
+
+MLErr mlSigmoidCleanup(Layer *self) {
+    return ML_NO_ERR;
+}
+
+MLErr mlSigmoidForward(Layer *self, Tensor *input, Tensor **output) {
+    return _mlActivationForward(self, MAT_ACTIVATION_SIGMOID, input, output);
+}
+
+MLErr mlSigmoidDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
+    return _mlActivationDerive(self, MAT_ACTIVATION_SIGMOID, upstream_derivatives, activation, downstream_derivative, self_derivative);
+}
+
+MLErr mlSigmoidUpdate(Layer *self, Tensor *self_derivative) {
+    return ML_NO_ERR;
+}
+
+MLErr mlSigmoidShape(Layer *self, Tensor *input, Tensor **output) {
+    return _mlSameShape(input, output);
+}
+
+MLErr mlSigmoidTrainable(Layer *self, Tensor **weights) {
+    return _mlNoWeights(weights);
+}
+
+const char* mlSigmoidErrorString(int error) {
+    return "ML_LAYER_SIGMOID_UNKNOWN_ERROR";
+}
+
+/* Tanh */
+
+MLErr mlTanhInitialize(Layer *self) {
+    return ML_NO_ERR;
+}
+
+MLErr mlTanhCleanup(Layer *self) {
+    return ML_NO_ERR;
+}
+
+MLErr mlTanhForward(Layer *self, Tensor *input, Tensor **output) {
+    return _mlActivationForward(self, MAT_ACTIVATION_TANH, input, output);
+}
+
+MLErr mlTanhDerive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative) {
+    return _mlActivationDerive(self, MAT_ACTIVATION_TANH, upstream_derivatives, activation, downstream_derivative, self_derivative);
+}
+
+MLErr mlTanhUpdate(Layer *self, Tensor *self_derivative) {
+    return ML_NO_ERR;
+}
+
+MLErr mlTanhShape(Layer *self, Tensor *input, Tensor **output) {
+    return _mlSameShape(input, output);
+}
+
+MLErr mlTanhTrainable(Layer *self, Tensor **weights) {
+    return _mlNoWeights(weights);
+}
+
+const char* mlTanhErrorString(int error) {
+    return "ML_LAYER_TANH_UNKNOWN_ERROR";
+}
+
 /* MeanSquaredError */
 
+// The cache is the size of one sample, 0 until it is set.
 MLErr mlMeanSquaredErrorInitialize(Layer *self) {
-    return ML_NO_ERR;
+    self->_cache = calloc(1, sizeof(unsigned));
+
+    return (self->_cache != NULL)? ML_NO_ERR : ML_LAYER_INTERNAL_ERROR;
 }
 
 MLErr mlMeanSquaredErrorCleanup(Layer *self) {
+    free(self->_cache);
+    self->_cache = NULL;
+
     return ML_NO_ERR;
 }
 
+void _mlSetLossSampleSize(Layer *self, unsigned size) {
+    if (self != NULL && self->derive == mlMeanSquaredErrorDerive && self->_cache != NULL)
+        *(unsigned *) self->_cache = size;
+}
+
 MLErr mlMeanSquaredErrorForward(Layer *self, Tensor *input, Tensor **output) {
     *output = matTensorDeepCopy(input, NULL);
 
@@ -286,6 +755,20 @@ MLErr mlMeanSquaredErrorDerive(Layer *self, Tensor *upstream_derivatives, Tensor
     // downstream_derivative = error_function_DERIVATIVE(actual output, desired output)
 
     MatrixErr error = matSub(activation, upstream_derivatives, downstream_derivative);
+
+    // The mean over a batch (see `matTensorStack`), so the derivatives summed
+    // by the layers below don't grow with the batch size. Without a sample size
+    // the activation is a single sample.
+    unsigned size = (self->_cache != NULL && *(unsigned *) self->_cache)? *(unsigned *) self->_cache : activation->literal_size;
+    if (error == MAT_NO_ERROR && _mlIsBatch(activation, size) && activation->dimsz[1] > 1) {
+        Tensor *scale = matMakeScalar(1.0 / activation->dimsz[1], NULL);
+        Tensor *sum = *downstream_derivative;
+
+        error = matMult(sum, scale, downstream_derivative);
+        matFreeTensor(&scale);
+        matFreeTensor(&sum);
+    }
+
     if (error != MAT_NO_ERROR) {
         self->error = error;
 
@@ -302,6 +785,14 @@ MLErr mlMeanSquaredErrorUpdate(Layer *self, Tensor *self_derivative) {
     return ML_NO_ERR;
 }
 
+MLErr mlMeanSquaredErrorShape(Layer *self, Tensor *input, Tensor **output) {
+    return _mlSameShape(input, output);
+}
+
+MLErr mlMeanSquaredErrorTrainable(Layer *self, Tensor **weights) {
+    return _mlNoWeights(weights);
+}
+
 const char* mlMeanSquaredErrorErrorString(int error) {
     return "ML_LAYER_MEAN_SQUARED_ERROR_UNKNOWN_ERROR";
 }
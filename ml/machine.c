@@ -1,7 +1,33 @@
+// NOTE: Must come before any header, for `clock_gettime`.
+#ifdef _WIN32
+#include <windows.h>
+#else
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 199309L
+#endif
+#include <time.h>
+#endif
+
 #include "ml.h"
 #include "../matrix/mat.h"
 
+#include <math.h>
 #include <stdlib.h>
+#include <string.h>
+
+// Wall clock time in seconds, from an arbitrary starting point.
+static double _mlNow() {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
 
 MLErr mlMachineFeedForward(Machine machine, Tensor *input, Tensor **output) {
     if (matCheckTensor(input, NULL)) return ML_MAT_ERROR;
@@ -9,10 +35,15 @@ MLErr mlMachineFeedForward(Machine machine, Tensor *input, Tensor **output) {
     if (output == NULL) return ML_NULL_PTR;
     *output = NULL;
 
+    // Runs in the dtype of the machine, the output is converted back to the input's.
     Tensor *current_inp = input;
     Tensor *current_output = NULL;
+    MatrixDtype dtype = mlMachineDtype(machine);
+    if (input->dtype != dtype && (current_inp = matTensorCast(input, dtype, NULL)) == NULL) return ML_MAT_ERROR;
 
     for (int layeri = 0; layeri < machine.layer_count; layeri++) {
+        // Each layer makes its own output.
+        current_output = NULL;
         MLErr error = machine.layers[layeri]->forward(machine.layers[layeri], current_inp, &current_output);
         if (current_inp != input) matFreeTensor(&current_inp);
         if (error != ML_NO_ERR) {
@@ -24,8 +55,596 @@ MLErr mlMachineFeedForward(Machine machine, Tensor *input, Tensor **output) {
         current_inp = current_output;
     }
 
+    // Intermediate results may have stayed on the device, but the caller
+    // expects the host data to be valid.
+    if (matTensorToHost(current_output)) {
+        matFreeTensor(&current_output);
+        return ML_MAT_ERROR;
+    }
+
+    if (current_output != NULL && current_output->dtype != input->dtype) {
+        Tensor *cast = matTensorCast(current_output, input->dtype, NULL);
+        matFreeTensor(&current_output);
+        if (cast == NULL) return ML_MAT_ERROR;
+        current_output = cast;
+    }
+
     *output = current_output;
 
     return ML_NO_ERR;
 }
 
+// Feed forward `input_n` inputs at once.
+/*
+ * The inputs are stacked into one batch (see `matTensorStack`), so every layer
+ * runs once for all of them. A batch already stacked that way can be passed to
+ * `mlMachineFeedForward` directly, and gives a stacked output.
+ * `inputs` - an array of `input_n` inputs of the same size.
+ * `outputs` - an array with room for `input_n` outputs, which the caller frees.
+ * */
+MLErr mlMachineFeedForwardBatch(Machine machine, int input_n, Tensor *inputs, Tensor **outputs) {
+    if (inputs == NULL || outputs == NULL) return ML_NULL_PTR;
+    for (int i = 0; i < input_n; i++) outputs[i] = NULL;
+
+    Tensor *batch = matTensorStack(inputs, input_n, NULL);
+    if (batch == NULL) return ML_MAT_ERROR;
+
+    Tensor *output = NULL;
+    MLErr error = mlMachineFeedForward(machine, batch, &output);
+    matFreeTensor(&batch);
+    if (error != ML_NO_ERR) return error;
+
+    // Layers keep the batch shape, one output per row.
+    if (output->ndims != 2 || output->dimsz[1] != input_n) error = ML_LAYER_INVALID_INPUT_DIMS;
+    else if (matTensorUnstack(output, outputs) != MAT_NO_ERROR) error = ML_MAT_ERROR;
+    matFreeTensor(&output);
+
+    return error;
+}
+
+// Make a batcher, queueing single inputs and feeding them forward as batches.
+/*
+ * Inputs are submitted with `mlBatcherSubmit`, and a batch runs once `max_batch`
+ * inputs are queued, or when `mlBatcherPoll` finds the first one has waited
+ * `max_latency` seconds. A serving loop submits requests as they arrive, and
+ * polls between them.
+ * The `Machine` is not owned by the batcher.
+ * */
+MLBatcher* mlMakeBatcher(Machine machine, int max_batch, double max_latency) {
+    if (max_batch <= 0) return NULL;
+
+    MLBatcher *batcher = (MLBatcher *) malloc(sizeof(MLBatcher));
+    if (batcher == NULL) return NULL;
+    batcher->machine = machine;
+    batcher->max_batch = max_batch;
+    batcher->max_latency = max_latency;
+    batcher->n = 0;
+    batcher->_inputs = NULL;
+    batcher->_outputs = (Tensor ***) malloc(sizeof(Tensor **) * max_batch);
+    batcher->_first_submit = 0;
+    if (batcher->_outputs == NULL) {
+        free(batcher);
+        return NULL;
+    }
+
+    return batcher;
+}
+
+// Free a batcher, dropping any queued inputs. Their outputs stay NULL.
+void mlFreeBatcher(MLBatcher **batcher) {
+    if (batcher == NULL || *batcher == NULL) return;
+
+    matFreeTensor(&(*batcher)->_inputs);
+    free((*batcher)->_outputs);
+    free(*batcher);
+    *batcher = NULL;
+}
+
+// Queue an input.
+/*
+ * The input is copied, and may be freed once this returns. `*output` is set to
+ * NULL, and to the output of the input when its batch runs (possibly during this
+ * call), which the caller then frees. All inputs must have the same size.
+ * */
+MLErr mlBatcherSubmit(MLBatcher *batcher, Tensor *input, Tensor **output) {
+    if (batcher == NULL || output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (matCheckTensor(input, NULL)) return ML_MAT_ERROR;
+
+    if (batcher->_inputs == NULL) {
+        // In the dtype of the first input, later ones are converted to it.
+        unsigned dims[] = { input->literal_size, batcher->max_batch };
+        batcher->_inputs = matMakeTensor(2, dims, NULL);
+        if (batcher->_inputs == NULL) return ML_MAT_ERROR;
+        batcher->_inputs->dtype = input->dtype;
+        batcher->_inputs->data = (double *) matTensorAlloc(batcher->_inputs,
+                                                           matDtypeSize(input->dtype) * batcher->_inputs->literal_size);
+        if (batcher->_inputs->data == NULL) {
+            matFreeTensor(&batcher->_inputs);
+            return ML_MAT_ERROR;
+        }
+    }
+    if (input->literal_size != batcher->_inputs->dimsz[0]) return ML_LAYER_INVALID_INPUT_DIMS;
+
+    Tensor *src = input;
+    if (input->dtype != batcher->_inputs->dtype) src = matTensorCast(input, batcher->_inputs->dtype, NULL);
+    else if (!matIsTensorContiguous(input)) src = matTensorDeepCopy(input, NULL);
+    if (src == NULL || matTensorToHost(src)) {
+        if (src != input) matFreeTensor(&src);
+        return ML_MAT_ERROR;
+    }
+    size_t size = matDtypeSize(src->dtype);
+    memcpy((char *) batcher->_inputs->data + (size_t) batcher->n * input->literal_size * size,
+           (char *) src->data + src->offset * size, size * input->literal_size);
+    if (src != input) matFreeTensor(&src);
+
+    if (batcher->n == 0) batcher->_first_submit = _mlNow();
+    batcher->_outputs[batcher->n++] = output;
+
+    if (batcher->n == batcher->max_batch) return mlBatcherFlush(batcher);
+
+    return ML_NO_ERR;
+}
+
+// Run the queued inputs if the first one has waited `max_latency` seconds.
+MLErr mlBatcherPoll(MLBatcher *batcher) {
+    if (batcher == NULL) return ML_NULL_PTR;
+    if (batcher->n == 0 || _mlNow() - batcher->_first_submit < batcher->max_latency) return ML_NO_ERR;
+
+    return mlBatcherFlush(batcher);
+}
+
+// Run the queued inputs now, as a single batch.
+/*
+ * On failure the queued inputs are dropped, and their outputs stay NULL.
+ * */
+MLErr mlBatcherFlush(MLBatcher *batcher) {
+    if (batcher == NULL) return ML_NULL_PTR;
+    if (batcher->n == 0) return ML_NO_ERR;
+
+    int n = batcher->n;
+    batcher->n = 0;
+
+    // The queued rows, without copying them.
+    Tensor *batch = matTensorSlice(batcher->_inputs, 1, 0, n, NULL);
+    Tensor *output = NULL;
+    MLErr error = mlMachineFeedForward(batcher->machine, batch, &output);
+    matFreeTensor(&batch);
+    if (error != ML_NO_ERR) return error;
+
+    Tensor **outputs = (Tensor **) malloc(sizeof(Tensor *) * n);
+    if (output->ndims != 2 || output->dimsz[1] != n) error = ML_LAYER_INVALID_INPUT_DIMS;
+    else if (matTensorUnstack(output, outputs) != MAT_NO_ERROR) error = ML_MAT_ERROR;
+    matFreeTensor(&output);
+
+    if (error == ML_NO_ERR)
+        for (int i = 0; i < n; i++) *batcher->_outputs[i] = outputs[i];
+    free(outputs);
+
+    return error;
+}
+
+// Number of layers from `i` that fuse into a `Dense` layer, 0 if none: a FullyConnected,
+// a Bias of its outputs, then optionally an activation, which is set in `f`.
+static int _mlFusedLength(Layer **layers, int layer_count, int i, MatrixActivation *f) {
+    if (i + 1 >= layer_count) return 0;
+    if (layers[i]->forward != mlFullyConnectedForward || layers[i + 1]->forward != mlBiasForward) return 0;
+
+    Tensor *w = (Tensor *) layers[i]->weights;
+    Tensor *b = (Tensor *) layers[i + 1]->weights;
+    if (!matIsTensorContiguous(w) || !matIsTensorContiguous(b) || b->literal_size != w->dimsz[1]) return 0;
+    if (w->dtype != b->dtype) return 0;
+
+    *f = MAT_ACTIVATION_NONE;
+    if (i + 2 < layer_count) {
+        Layer *next = layers[i + 2];
+        if (next->forward == mlReLuForward) *f = MAT_ACTIVATION_RELU;
+        else if (next->forward == mlSigmoidForward) *f = MAT_ACTIVATION_SIGMOID;
+        else if (next->forward == mlTanhForward) *f = MAT_ACTIVATION_TANH;
+    }
+
+    return (*f == MAT_ACTIVATION_NONE)? 2 : 3;
+}
+
+// Weights of a `Dense` layer, {in + 1, out}, from the weights {in, out} and bias {out}.
+static Tensor* _mlPackDense(Tensor *w, Tensor *b) {
+    if (matTensorToHost(w) || matTensorToHost(b)) return NULL;
+
+    if (w->dtype != b->dtype) return NULL;
+
+    unsigned in = w->dimsz[0];
+    unsigned out = w->dimsz[1];
+    // Copied bytewise, in the dtype of the weights.
+    size_t size = matDtypeSize(w->dtype);
+
+    Tensor *packed = matMakeTensor(2, (unsigned []) { in + 1, out }, NULL);
+    if (packed == NULL) return NULL;
+    packed->dtype = w->dtype;
+    packed->data = (double *) matTensorAlloc(packed, size * packed->literal_size);
+    if (packed->data == NULL) {
+        matFreeTensor(&packed);
+        return NULL;
+    }
+
+    char *dst = (char *) packed->data;
+    for (unsigned o = 0; o < out; o++) {
+        memcpy(dst + (size_t) o * (in + 1) * size, (char *) w->data + (size_t) o * in * size, size * in);
+        memcpy(dst + ((size_t) o * (in + 1) + in) * size, (char *) b->data + o * size, size);
+    }
+
+    return packed;
+}
+
+// Fuse runs of FullyConnected, Bias and activation layers into `Dense` layers.
+/*
+ * Each run then takes a single kernel forward, instead of one per layer with an
+ * activation written and read back between them, and two backward.
+ * The fused layers are freed, and `machine->layers` is compacted in place, so
+ * `layer_count` may shrink. Layers the optimizer keeps state for (see `Adam`)
+ * change, so fuse before making a `LearningInstance` or plan of the machine.
+ * On error, the machine is left with the runs fused so far.
+ * */
+MLErr mlMachineFuse(Machine *machine) {
+    if (machine == NULL) return ML_NULL_PTR;
+    if (!machine->_all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+
+    // The layers outlive any arena.
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    Layer **layers = machine->layers;
+    MLErr error = ML_NO_ERR;
+    int n = 0;
+    int i = 0;
+    while (i < machine->layer_count) {
+        MatrixActivation f;
+        int length = (error == ML_NO_ERR)? _mlFusedLength(layers, machine->layer_count, i, &f) : 0;
+        if (length == 0) {
+            layers[n++] = layers[i++];
+            continue;
+        }
+
+        Tensor *packed = _mlPackDense((Tensor *) layers[i]->weights, (Tensor *) layers[i + 1]->weights);
+        if (packed == NULL) {
+            error = ML_MAT_ERROR;
+            continue;
+        }
+
+        // The activation is copied by the layer.
+        MLDenseParameters parameters = { f };
+        Layer *dense = mlMakeLayer(Dense, &parameters, packed);
+        if (dense->_initialization_error != ML_NO_ERR) {
+            error = dense->_initialization_error;
+            mlFreeLayer(&dense);
+            continue;
+        }
+
+        for (int j = i; j < i + length; j++) mlFreeLayer(&layers[j]);
+        layers[n++] = dense;
+        i += length;
+    }
+
+    for (int j = n; j < machine->layer_count; j++) layers[j] = NULL;
+    machine->layer_count = n;
+    matSetArena(previous_arena);
+
+    return error;
+}
+
+// The dtype a `Machine` runs in, that of its weights. MAT_FLOAT64 without any.
+MatrixDtype mlMachineDtype(Machine machine) {
+    for (int i = 0; i < machine.layer_count; i++) {
+        Layer *layer = machine.layers[i];
+        Tensor *weights = NULL;
+        if (layer == NULL || layer->trainable == NULL || layer->trainable(layer, &weights) != ML_NO_ERR) continue;
+        // Storage only weights are multiplied in float32.
+        if (weights != NULL) return matIsDtypeStorage(weights->dtype)? MAT_FLOAT32 : weights->dtype;
+    }
+
+    return MAT_FLOAT64;
+}
+
+// Convert the weights of every layer of a `Machine` to `dtype`, in place.
+/*
+ * `mlMachineFeedForward` and training then run in `dtype`, converting inputs and
+ * targets to it. MAT_FLOAT32 halves the memory and bandwidth of the weights and
+ * activations, for a precision of about 7 digits.
+ * Cast before making a `LearningInstance` or plan of the machine, their state is
+ * made in the dtype of the weights. Layers only updated through `update` aren't
+ * converted.
+ * A storage only dtype (MAT_FLOAT16, MAT_BFLOAT16) only applies to the weights of
+ * `FullyConnected` layers, the others and the activations become MAT_FLOAT32. This
+ * is for inference: the products accumulate in float32, but the optimizers can't
+ * update 16-bit weights. MAT_INT8 needs scales, see `mlMachineQuantize`.
+ * */
+MLErr mlMachineCast(Machine machine, MatrixDtype dtype) {
+    if (!machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+    if (dtype == MAT_INT8) return ML_MAT_ERROR;
+
+    // Reallocated weights outlive any arena.
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    MLErr error = ML_NO_ERR;
+    for (int i = 0; i < machine.layer_count && error == ML_NO_ERR; i++) {
+        Layer *layer = machine.layers[i];
+        Tensor *weights = NULL;
+        if (layer->trainable != NULL && (error = layer->trainable(layer, &weights)) != ML_NO_ERR) break;
+        MatrixDtype to = (matIsDtypeStorage(dtype) && layer->forward != mlFullyConnectedForward)? MAT_FLOAT32 : dtype;
+        if (weights != NULL && matTensorSetDtype(weights, to) != MAT_NO_ERROR) error = ML_MAT_ERROR;
+    }
+
+    matSetArena(previous_arena);
+
+    return error;
+}
+
+// max |t|, or -1 on failure.
+static double _mlAbsMax(Tensor *t) {
+    Tensor *t64 = matTensorCast(t, MAT_FLOAT64, NULL);
+    if (t64 == NULL || matTensorToHost(t64)) {
+        matFreeTensor(&t64);
+        return -1;
+    }
+
+    double max = 0;
+    for (size_t i = 0; i < t64->literal_size; i++) max = (fabs(t64->data[i]) > max)? fabs(t64->data[i]) : max;
+    matFreeTensor(&t64);
+
+    return max;
+}
+
+// Replace the `FullyConnected` layers of a `Machine` by `QuantizedFullyConnected` ones, in place.
+/*
+ * The weights are quantized to int8 with a scale per output (see `matQuantize`), and
+ * the inputs of each layer with a single step, calibrated as the largest |input| it gets
+ * over `inputs` / 127. Each input is run through the layers before it with
+ * `mlMachineFeedForward`, before any is replaced.
+ * Quantize before fusing, `mlMachineFuse` only fuses `FullyConnected` layers. The
+ * quantized layers are for inference, training the machine fails afterwards.
+ * `inputs` - `input_n` inputs or batches, representative of those the machine runs on.
+ * With none, each layer quantizes every input by its own range instead.
+ * */
+MLErr mlMachineQuantize(Machine machine, int input_n, Tensor *inputs) {
+    if (!machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+    if (input_n > 0 && inputs == NULL) return ML_NULL_PTR;
+
+    double *input_scale = (double *) calloc(machine.layer_count, sizeof(double));
+    if (input_scale == NULL) return ML_LAYER_INTERNAL_ERROR;
+
+    MLErr error = ML_NO_ERR;
+    for (int i = 0; i < machine.layer_count && error == ML_NO_ERR; i++) {
+        if (machine.layers[i]->forward != mlFullyConnectedForward) continue;
+
+        // The first i layers.
+        Machine head = mlMakeMachine(i, machine.layers);
+        double max = 0;
+        for (int j = 0; j < input_n && error == ML_NO_ERR; j++) {
+            Tensor *activation = &inputs[j];
+            if (i > 0 && (error = mlMachineFeedForward(head, &inputs[j], &activation)) != ML_NO_ERR) break;
+
+            double m = _mlAbsMax(activation);
+            if (m < 0) error = ML_MAT_ERROR;
+            else max = (m > max)? m : max;
+            if (activation != &inputs[j]) matFreeTensor(&activation);
+        }
+        // 0 quantizes dynamically.
+        input_scale[i] = max / 127;
+    }
+
+    // Quantized weights outlive any arena.
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    for (int i = 0; i < machine.layer_count && error == ML_NO_ERR; i++) {
+        if (machine.layers[i]->forward != mlFullyConnectedForward) continue;
+
+        Tensor *q, *scale;
+        if (matQuantize((Tensor *) machine.layers[i]->weights, &q, &scale) != MAT_NO_ERROR) {
+            error = ML_MAT_ERROR;
+            break;
+        }
+
+        // The layer takes the scales and the weights.
+        MLQuantizedParameters parameters = { scale, input_scale[i] };
+        Layer *quantized = mlMakeLayer(QuantizedFullyConnected, &parameters, q);
+        if (quantized->_initialization_error != ML_NO_ERR) {
+            error = quantized->_initialization_error;
+            mlFreeLayer(&quantized);
+            break;
+        }
+
+        mlFreeLayer(&machine.layers[i]);
+        machine.layers[i] = quantized;
+    }
+
+    matSetArena(previous_arena);
+    free(input_scale);
+
+    return error;
+}
+
+// Free a plan, and the buffers of its activations. The `Machine` is not freed.
+void mlFreePlan(MLPlan **plan) {
+    if (plan == NULL || *plan == NULL) return;
+
+    MLPlan *p = *plan;
+    for (int i = 0; i < p->machine.layer_count; i++) {
+        if (p->_outputs != NULL) matFreeTensor(&p->_outputs[i]);
+        if (p->_made != NULL) matFreeTensor(&p->_made[i]);
+    }
+    for (int i = 0; i < p->buffer_n; i++) matFreeTensor(&p->_buffers[i]);
+
+    free(p->_outputs);
+    free(p->_made);
+    free(p->_buffers);
+    free(p->dimsz);
+    free(p);
+    *plan = NULL;
+}
+
+// Preallocate the activations of a `Machine` for inputs shaped `dims`.
+/*
+ * The output shape of every layer is inferred with its `shape`, and the activations
+ * are assigned to as few buffers as their lifetimes allow: an activation is live from
+ * the layer writing it until the next layer read it, so the activations of a chain
+ * of layers share two buffers. Buffers are made resident when there is a device
+ * (see `matTensorToDevice`), so activations never leave it between layers.
+ * `mlPlanFeedForward` then has the layers write to the planned activations, instead
+ * of allocating new ones every pass.
+ * A plan is only valid for the `Machine` it was made for, which must outlive it.
+ * */
+MLErr mlMachinePlan(Machine machine, unsigned ndims, unsigned *dims, MLPlan **plan) {
+    if (plan == NULL) return ML_NULL_PTR;
+    *plan = NULL;
+    if (!machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+
+    int n = machine.layer_count;
+
+    // The plan outlives any arena.
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    MLPlan *p = (MLPlan *) malloc(sizeof(MLPlan));
+    if (p == NULL) {
+        matSetArena(previous_arena);
+        return ML_MAT_ERROR;
+    }
+    p->machine = machine;
+    p->dtype = mlMachineDtype(machine);
+    p->ndims = ndims;
+    p->dimsz = (unsigned *) malloc(sizeof(unsigned) * (ndims? ndims : 1));
+    p->buffer_n = 0;
+    p->_buffers = (Tensor **) calloc(n? n : 1, sizeof(Tensor *));
+    p->_outputs = (Tensor **) calloc(n? n : 1, sizeof(Tensor *));
+    p->_made = (Tensor **) calloc(n? n : 1, sizeof(Tensor *));
+
+    // Size of each buffer, and the last step its latest activation is read at.
+    size_t *buffer_size = (size_t *) malloc(sizeof(size_t) * (n? n : 1));
+    int *buffer_end = (int *) malloc(sizeof(int) * (n? n : 1));
+    int *assigned = (int *) malloc(sizeof(int) * (n? n : 1));
+
+    MLErr error = ML_NO_ERR;
+    Tensor *input_shape = NULL;
+    if (p->dimsz == NULL || p->_buffers == NULL || p->_outputs == NULL || p->_made == NULL ||
+        buffer_size == NULL || buffer_end == NULL || assigned == NULL) {
+        error = ML_MAT_ERROR;
+    } else {
+        memcpy(p->dimsz, dims, sizeof(unsigned) * ndims);
+        if ((input_shape = matMakeTensor(ndims, dims, NULL)) == NULL) error = ML_LAYER_INVALID_INPUT_DIMS;
+    }
+
+    for (int i = 0; i < n && error == ML_NO_ERR; i++) {
+        Layer *layer = machine.layers[i];
+        Tensor *shape = (i == 0)? input_shape : p->_outputs[i - 1];
+        Tensor *next = NULL;
+        error = (layer->shape != NULL)? layer->shape(layer, shape, &next) : ML_LAYER_INVALID_PARAMETERS;
+        if (error != ML_NO_ERR) break;
+        // Holds the shape until the buffers are sized, and the planned output is made.
+        p->_outputs[i] = next;
+
+        // Written at step i, read at step i + 1. The caller reads the last one.
+        int start = i, end = i + 1;
+
+        // Reuse a free buffer, the smallest fitting one, or else the largest to grow.
+        int best = -1;
+        for (int b = 0; b < p->buffer_n; b++) {
+            if (buffer_end[b] >= start) continue;
+            if (best < 0) {
+                best = b;
+                continue;
+            }
+
+            int fits = buffer_size[b] >= next->literal_size;
+            int best_fits = buffer_size[best] >= next->literal_size;
+            if (fits != best_fits) {
+                if (fits) best = b;
+            } else if (fits? buffer_size[b] < buffer_size[best] : buffer_size[b] > buffer_size[best]) best = b;
+        }
+        if (best < 0) {
+            best = p->buffer_n++;
+            buffer_size[best] = 0;
+        }
+
+        if (buffer_size[best] < next->literal_size) buffer_size[best] = next->literal_size;
+        buffer_end[best] = end;
+        assigned[i] = best;
+    }
+    matFreeTensor(&input_shape);
+
+    for (int b = 0; b < p->buffer_n && error == ML_NO_ERR; b++) {
+        unsigned size = buffer_size[b];
+        if ((p->_buffers[b] = matMakeTensor(1, &size, NULL)) == NULL) {
+            error = ML_MAT_ERROR;
+            break;
+        }
+        p->_buffers[b]->dtype = p->dtype;
+        p->_buffers[b]->data = (double *) matTensorAlloc(p->_buffers[b], matDtypeSize(p->dtype) * size);
+        if (p->_buffers[b]->data == NULL || matTensorToDevice(p->_buffers[b]) != MAT_NO_ERROR) error = ML_MAT_ERROR;
+    }
+
+    // Each output views the start of its buffer, in its own shape.
+    for (int i = 0; i < n && error == ML_NO_ERR; i++) {
+        Tensor *out_shape = p->_outputs[i];
+        Tensor *head = matTensorSlice(p->_buffers[assigned[i]], 0, 0, out_shape->literal_size, NULL);
+        p->_outputs[i] = (head != NULL)? matTensorReshape(head, out_shape->ndims, out_shape->dimsz, NULL) : NULL;
+        matFreeTensor(&head);
+        matFreeTensor(&out_shape);
+
+        if (p->_outputs[i] == NULL) error = ML_MAT_ERROR;
+    }
+
+    free(buffer_size);
+    free(buffer_end);
+    free(assigned);
+    matSetArena(previous_arena);
+
+    if (error != ML_NO_ERR) {
+        mlFreePlan(&p);
+        return error;
+    }
+
+    *plan = p;
+
+    return ML_NO_ERR;
+}
+
+// Feed forward an input through a planned `Machine`, see `mlMachinePlan`.
+/*
+ * `input` must have the shape the plan was made for, and is converted to the dtype
+ * of the machine if needed.
+ * `output` - set to the output of the last layer, which belongs to the plan, in the
+ * dtype of the machine. It is valid until the next pass, and must not be freed.
+ * */
+MLErr mlPlanFeedForward(MLPlan *plan, Tensor *input, Tensor **output) {
+    if (plan == NULL || output == NULL) return ML_NULL_PTR;
+    *output = NULL;
+    if (matCheckTensor(input, NULL)) return ML_MAT_ERROR;
+
+    if (input->ndims != plan->ndims) return ML_LAYER_INVALID_INPUT_DIMS;
+    for (int i = 0; i < input->ndims; i++)
+        if (input->dimsz[i] != plan->dimsz[i]) return ML_LAYER_INVALID_INPUT_DIMS;
+
+    Machine machine = plan->machine;
+    Tensor *current_inp = input;
+    if (input->dtype != plan->dtype && (current_inp = matTensorCast(input, plan->dtype, NULL)) == NULL) return ML_MAT_ERROR;
+
+    for (int layeri = 0; layeri < machine.layer_count; layeri++) {
+        matFreeTensor(&plan->_made[layeri]);
+
+        Tensor *current_output = plan->_outputs[layeri];
+        MLErr error = machine.layers[layeri]->forward(machine.layers[layeri], current_inp, &current_output);
+        if (current_inp != input && layeri == 0) matFreeTensor(&current_inp);
+
+        // The layer made its own output.
+        if (current_output != plan->_outputs[layeri]) {
+            if (error != ML_NO_ERR) matFreeTensor(&current_output);
+            plan->_made[layeri] = current_output;
+        }
+        if (error != ML_NO_ERR) return error;
+
+        current_inp = current_output;
+    }
+
+    if (matTensorToHost(current_inp)) return ML_MAT_ERROR;
+
+    *output = current_inp;
+
+    return ML_NO_ERR;
+}
@@ -16,7 +16,8 @@ typedef enum {
     ML_OPTIMIZER_UNEXPECTED_DIMS,
     ML_OPTIMIZER_INTERNAL_ERORR,
     ML_MAT_ERROR,
-    ML_NULL_PTR
+    ML_NULL_PTR,
+    ML_FILE_ERROR
 } MLErr;
 
 static const char* mlGetErrorString(MLErr error) {
@@ -30,6 +31,7 @@ static const char* mlGetErrorString(MLErr error) {
         case ML_OPTIMIZER_UNEXPECTED_DIMS: return "ML_OPTIMIZER_UNEXPECTED_DIMS";
         case ML_OPTIMIZER_INTERNAL_ERORR: return "ML_OPTIMIZER_INTERNAL_ERORR";
         case ML_NULL_PTR: return "ML_NULL_PTR";
+        case ML_FILE_ERROR: return "ML_FILE_ERROR";
         default: return "Unknown ML Error";
     }
 }
@@ -47,9 +49,19 @@ typedef struct layer {
     // freeing it.
     void *weights;
     
+    // `*output` is either NULL, for the layer to make its output, or an existing
+    // Tensor shaped as `shape` returns, for the layer to write to (see `mlMachinePlan`).
+    // A layer that can't write to it replaces it with a new Tensor.
     MLErr (*forward)(struct layer *self, Tensor *input, Tensor **output);
     MLErr (*derive)(struct layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative);
     MLErr (*update)(struct layer *self, Tensor *self_derivative);
+    // Shape of the output for an input shaped as `input`, as a new Tensor
+    // without data. `input` may have no data either.
+    MLErr (*shape)(struct layer *self, Tensor *input, Tensor **output);
+    // The weights Tensor `self_derivative` is the derivative of, for optimizers
+    // to update in place. NULL if the layer has none, or is only updated through
+    // `update`.
+    MLErr (*trainable)(struct layer *self, Tensor **weights);
 
     // Cache for the implemntation to use and refrance as needed.
     // Handled by the implementation only, and is considered opaque
@@ -85,14 +97,18 @@ MLErr ml##name##Cleanup(Layer *self); \
 MLErr ml##name##Forward(Layer *self, Tensor *input, Tensor **output); \
 MLErr ml##name##Derive(Layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative); \
 MLErr ml##name##Update(Layer *self, Tensor *self_derivative); \
+MLErr ml##name##Shape(Layer *self, Tensor *input, Tensor **output); \
+MLErr ml##name##Trainable(Layer *self, Tensor **weights); \
 const char* ml##name##ErrorString(int error);
 
 // Make layer by name.
-#define mlMakeLayer(name, parameters, initial_weights) mlMakeLayerExplicit(ml##name##Forward, ml##name##Derive, ml##name##Update, ml##name##Initialize, ml##name##Cleanup, ml##name##ErrorString, parameters, initial_weights)
+#define mlMakeLayer(name, parameters, initial_weights) mlMakeLayerExplicit(ml##name##Forward, ml##name##Derive, ml##name##Update, ml##name##Shape, ml##name##Trainable, ml##name##Initialize, ml##name##Cleanup, ml##name##ErrorString, parameters, initial_weights)
 // Make layer by explicit function pointers.
 static Layer* mlMakeLayerExplicit(MLErr (*forward)(struct layer *self, Tensor *input, Tensor **output), 
                  MLErr (*derive)(struct layer *self, Tensor *upstream_derivatives, Tensor *activation, Tensor **downstream_derivative, Tensor **self_derivative),
                  MLErr (*update)(struct layer *self, Tensor *self_derivative),
+                 MLErr (*shape)(struct layer *self, Tensor *input, Tensor **output),
+                 MLErr (*trainable)(struct layer *self, Tensor **weights),
                  MLErr (*initialize)(struct layer *self),
                  MLErr (*cleanup)(struct layer *self),
                  const char* (*errorString)(int error),
@@ -101,6 +117,8 @@ static Layer* mlMakeLayerExplicit(MLErr (*forward)(struct layer *self, Tensor *i
     l->forward = forward;
     l->derive = derive;
     l->update = update;
+    l->shape = shape;
+    l->trainable = trainable;
     l->_cache = NULL;
     l->initialize = initialize;
     l->cleanup = cleanup;
@@ -137,11 +155,18 @@ Tensor* mlWeightInitializer(MLWeightInitializerType initializer, unsigned ndims,
 
 /* Machine */
 
+// What the weights of a loaded machine live in, see `mlLoadMachine`.
+struct _ml_storage;
+void _mlFreeStorage(struct _ml_storage *storage);
+
 typedef struct {
     int layer_count;
     Layer **layers;
 
     int _all_layers_initialized;
+
+    // The file a machine was loaded from, and the layers, or NULL. Released with the machine.
+    struct _ml_storage *_storage;
 } Machine;
 
 static Machine mlMakeMachine(int layer_count, Layer **layers) {
@@ -149,6 +174,7 @@ static Machine mlMakeMachine(int layer_count, Layer **layers) {
 
     m.layer_count = layer_count;
     m.layers = layers;
+    m._storage = NULL;
 
     m._all_layers_initialized = 1;
     for (int i = 0; i < m.layer_count; i++) {
@@ -165,9 +191,11 @@ static void mlFreeMachine(Machine **m) {
     if (m == NULL) return;
 
     Machine *m_p = *m;
-    if (m_p != NULL)
+    if (m_p != NULL) {
         for (int i = 0; i < m_p->layer_count; i++)
             mlFreeLayer(&m_p->layers[i]);
+        _mlFreeStorage(m_p->_storage);
+    }
 
     free(*m);
     *m = NULL;
@@ -176,12 +204,92 @@ static void mlFreeMachine(Machine **m) {
 static inline void mlFreeMachineD(Machine m) {
     for (int i = 0; i < m.layer_count; i++)
         mlFreeLayer(&m.layers[i]);
+    _mlFreeStorage(m._storage);
 }
 
 MLErr mlMachineFeedForward(Machine machine, Tensor *input, Tensor **output);
+MLErr mlMachineFeedForwardBatch(Machine machine, int input_n, Tensor *inputs, Tensor **outputs);
+
+// Dynamic batching of single inputs, see `mlMakeBatcher`.
+typedef struct {
+    Machine machine;
+
+    // A batch runs once this many inputs are queued.
+    int max_batch;
+    // Or once the first queued input has waited this long, in seconds,
+    // checked by `mlBatcherPoll`.
+    double max_latency;
+
+    // Number of queued inputs.
+    int n;
+
+    // Queued inputs, stacked as the rows of a `{input size, max_batch}` matrix.
+    Tensor *_inputs;
+    // Where to put the output of each queued input.
+    Tensor ***_outputs;
+    // When the first queued input was submitted.
+    double _first_submit;
+} MLBatcher;
+
+MLBatcher* mlMakeBatcher(Machine machine, int max_batch, double max_latency);
+void mlFreeBatcher(MLBatcher **batcher);
+MLErr mlBatcherSubmit(MLBatcher *batcher, Tensor *input, Tensor **output);
+MLErr mlBatcherPoll(MLBatcher *batcher);
+MLErr mlBatcherFlush(MLBatcher *batcher);
+
+// Preallocated activations of a `Machine`, for inputs of one shape. See `mlMachinePlan`.
+typedef struct {
+    Machine machine;
+
+    // Dtype of the machine when planned, which the activations have.
+    MatrixDtype dtype;
+
+    // Shape of the inputs the plan is for.
+    unsigned ndims;
+    unsigned *dimsz;
+
+    // Number of buffers the activations share.
+    int buffer_n;
+    // Each large enough for every activation assigned to it.
+    Tensor **_buffers;
+    // Output of each layer, viewing its assigned buffer.
+    Tensor **_outputs;
+    // Outputs a layer made instead of writing to the planned one, freed on the next pass.
+    Tensor **_made;
+} MLPlan;
+
+MLErr mlMachineFuse(Machine *machine);
+
+MatrixDtype mlMachineDtype(Machine machine);
+MLErr mlMachineCast(Machine machine, MatrixDtype dtype);
+
+MLErr mlMachineQuantize(Machine machine, int input_n, Tensor *inputs);
+
+MLErr mlSaveMachine(Machine machine, const char *path);
+MLErr mlLoadMachine(const char *path, Machine *machine);
+
+MLErr mlMachinePlan(Machine machine, unsigned ndims, unsigned *dims, MLPlan **plan);
+void mlFreePlan(MLPlan **plan);
+MLErr mlPlanFeedForward(MLPlan *plan, Tensor *input, Tensor **output);
 
 /* LearningInstance*/
 
+// What an optimizer keeps between steps, for checkpoints (see `mlCheckpointInstance`).
+// Points into the optimizer, so a checkpoint can be restored into it.
+typedef struct {
+    // Steps taken, or NULL if not counted.
+    int *step;
+    // The `hyper_parameters`, as `hyper_parameters_size` bytes.
+    void *hyper_parameters;
+    size_t hyper_parameters_size;
+    // `tensor_n` slots of Tensors, any of which may be NULL until the optimizer makes it.
+    int tensor_n;
+    Tensor **tensors;
+} MLOptimizerState;
+
+// A checkpoint being written, see `mlCheckpointInstance`.
+struct _ml_checkpoint;
+
 // NOTE: Implemented functions must be named according to the doc.
 typedef struct learninginstance {
     Machine src_machine;
@@ -201,6 +309,28 @@ typedef struct learninginstance {
     // NOTE: `target_outputs` indecies must be aligned with `inputs`
     // Meaning the target output of input 1 is `target_outputs[1]`
     Tensor *target_outputs;
+    // Number of inputs trained on at once, 1 by default. Larger batches are
+    // stacked into one Tensor (see `matTensorStack`), so each layer runs once
+    // per batch, and the optimizer is given the derivatives of the whole batch.
+    int batch_size;
+
+    // Arena the Tensors of a training step are made from, reset after each
+    // step. Made by `mlTrainInstance`, see `matSetArena`.
+    MatrixArena *_arena;
+
+    // Passes over the inputs completed by `mlTrainInstance`.
+    int epoch;
+    // Input the current pass continues from, see `mlTrainInstance`.
+    int _position;
+
+    // Write a checkpoint to `checkpoint_path` every `checkpoint_interval` training
+    // steps, or none if 0 (the default). See `mlCheckpointInstance`.
+    int checkpoint_interval;
+    const char *checkpoint_path;
+    // Steps since the last of these checkpoints.
+    int _checkpoint_steps;
+    // The checkpoint being written, or NULL.
+    struct _ml_checkpoint *_checkpoint;
 
     // Optimier is handled by the implementation. 
     MLErr (*optimizer)(struct learninginstance *self, Tensor **activations, Tensor **derivatives);
@@ -217,6 +347,8 @@ typedef struct learninginstance {
     // Cleanup function to free all reasources used by the instnace,
     // and set them to NULL. 
     MLErr (*cleanup)(struct learninginstance *self);
+    // The state the optimizer keeps between steps, once initialized.
+    MLErr (*state)(struct learninginstance *self, MLOptimizerState *state);
 } LearningInstance;
 
 // Prototype optimizer by name.
@@ -224,16 +356,18 @@ typedef struct learninginstance {
 MLErr ml##name(LearningInstance *self, Tensor **activations, Tensor **derivatives); \
 MLErr ml##name##Propagate(LearningInstance *self, Tensor *upstream_derivative, Tensor **downstream_derivative); \
 MLErr ml##name##Initialize(LearningInstance *self); \
-MLErr ml##name##Cleanup(LearningInstance *self);
+MLErr ml##name##Cleanup(LearningInstance *self); \
+MLErr ml##name##State(LearningInstance *self, MLOptimizerState *state);
 
 // Make instance by name
-#define mlMakeLearningInstance(machine, hyper_parameters, input_n, inputs, target_outputs, optimizer_name) mlMakeLearningInstanceExplicit(machine, hyper_parameters, input_n, inputs, target_outputs, ml##optimizer_name, ml##optimizer_name##Propagate, ml##optimizer_name##Initialize, ml##optimizer_name##Cleanup)
+#define mlMakeLearningInstance(machine, hyper_parameters, input_n, inputs, target_outputs, optimizer_name) mlMakeLearningInstanceExplicit(machine, hyper_parameters, input_n, inputs, target_outputs, ml##optimizer_name, ml##optimizer_name##Propagate, ml##optimizer_name##Initialize, ml##optimizer_name##Cleanup, ml##optimizer_name##State)
 // Make instnace by explicit function pointers.
 static LearningInstance* mlMakeLearningInstanceExplicit(Machine machine, void *hyper_parameters, int input_n, Tensor *inputs, Tensor *target_outputs, 
     MLErr (*optimizer)(struct learninginstance *self, Tensor **activations, Tensor **derivatives),
     MLErr (*propagate)(struct learninginstance *self, Tensor *upstream_derivative, Tensor **downstream_derivative),
     MLErr (*initialize)(struct learninginstance *self),
-    MLErr (*cleanup)(struct learninginstance *self)) {
+    MLErr (*cleanup)(struct learninginstance *self),
+    MLErr (*state)(struct learninginstance *self, MLOptimizerState *state)) {
     LearningInstance *instance = (LearningInstance *) malloc(sizeof(LearningInstance));
 
     instance->optimizer = optimizer;
@@ -242,6 +376,7 @@ static LearningInstance* mlMakeLearningInstanceExplicit(Machine machine, void *h
     instance->_cache = NULL;
     instance->initialize = initialize;
     instance->cleanup = cleanup;
+    instance->state = state;
 
     instance->src_machine = machine;
 
@@ -250,25 +385,104 @@ static LearningInstance* mlMakeLearningInstanceExplicit(Machine machine, void *h
     instance->input_n = input_n;
     instance->inputs = inputs;
     instance->target_outputs = target_outputs;
+    instance->batch_size = 1;
+    instance->_arena = NULL;
+
+    instance->epoch = 0;
+    instance->_position = 0;
+    instance->checkpoint_interval = 0;
+    instance->checkpoint_path = NULL;
+    instance->_checkpoint_steps = 0;
+    instance->_checkpoint = NULL;
 
     instance->initialize(instance);
     
     return instance;
 }
 
+MLErr mlWaitCheckpoint(LearningInstance *instance);
+
+static void mlFreeLearningInstance(LearningInstance **instance) {
+    if (instance == NULL) return;
+
+    LearningInstance *i_p = *instance;
+    if (i_p != NULL) {
+        // A checkpoint being written reads nothing of the instance, but is freed with it.
+        mlWaitCheckpoint(i_p);
+        i_p->cleanup(i_p);
+        matFreeArena(&i_p->_arena);
+    }
+
+    free(*instance);
+    *instance = NULL;
+}
+
 MLErr mlTrainInstance(LearningInstance *instnace);
 
+MLErr mlCheckpointInstance(LearningInstance *instance, const char *path);
+MLErr mlResumeInstance(LearningInstance *instance, const char *path);
+
+// Hyper parameters of the `Momentum` optimizer. `SGD` takes the learning rate alone, as a double.
+typedef struct {
+    double learning_rate;
+    // Fraction of the previous step kept, e.g. 0.9.
+    double momentum;
+} MLMomentumParameters;
+
+// Hyper parameters of the `RMSProp` optimizer.
+typedef struct {
+    double learning_rate;
+    // Decay of the average of squared derivatives, e.g. 0.9.
+    double decay;
+    // Keeps the step finite, e.g. 1e-8.
+    double epsilon;
+} MLRMSPropParameters;
+
+// Hyper parameters of the `Adam` optimizer.
+typedef struct {
+    double learning_rate;
+    // Decay of the averages of the derivatives and their squares, e.g. 0.9 and 0.999.
+    double beta1;
+    double beta2;
+    // Keeps the step finite, e.g. 1e-8.
+    double epsilon;
+} MLAdamParameters;
+
+// Parameters of the `Dense` layer, which may be NULL for no activation.
+typedef struct {
+    MatrixActivation activation;
+} MLDenseParameters;
+
+// Parameters of the `QuantizedFullyConnected` layer, whose weights are int8 {in, out}.
+// The layer takes the `scale` Tensor. See `mlMachineQuantize`.
+typedef struct {
+    // float32 {out}, the scale of each row of the weights, see `matQuantize`.
+    Tensor *scale;
+    // Step of the int8 inputs, or 0 to take it from each input, see `matQuantizedProd`.
+    double input_scale;
+} MLQuantizedParameters;
+
 /* Prototype */
 
 ML_PROTOTYPE_LAYER(FullyConnected);
 ML_PROTOTYPE_LAYER(Bias);
+// FullyConnected, Bias and an activation in one layer, see `mlMachineFuse`.
+ML_PROTOTYPE_LAYER(Dense);
+// FullyConnected with int8 weights, for inference, see `mlMachineQuantize`.
+ML_PROTOTYPE_LAYER(QuantizedFullyConnected);
 
 ML_PROTOTYPE_LAYER(ReLu);
 ML_PROTOTYPE_LAYER(Sigmoid);
 ML_PROTOTYPE_LAYER(Tanh);
 
 ML_PROTOTYPE_LAYER(MeanSquaredError);
+// Set the size of one sample a loss layer derives, telling a batch from a single
+// 2-D sample. Set by `mlTrainInstance`, other layers are left alone.
+void _mlSetLossSampleSize(Layer *self, unsigned size);
 
 ML_PROTOTYPE_OPTIMIZER(SGD);
+ML_PROTOTYPE_OPTIMIZER(Momentum);
+ML_PROTOTYPE_OPTIMIZER(RMSProp);
+ML_PROTOTYPE_OPTIMIZER(Adam);
 
 #endif
@@ -3,157 +3,240 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-MLErr mlTrainInstance(LearningInstance *instance) {
-    if (!instance->src_machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
-
+// Forward and backward pass of one input (or batch), then the optimizer.
+static MLErr _mlTrainStep(LearningInstance *instance, Tensor *input, Tensor *target) {
     // Convinience
     Machine src_machine = instance->src_machine;
 
+    // Everything made during the step comes from the instance's arena, and is
+    // released at once by resetting it. The optimizer runs outside of it, since
+    // the weights it makes outlive the step.
+    MatrixArena *previous_arena = matSetArena(instance->_arena);
+
     // First, collect the activations.
-    // activations is an `input_n x layer_count` array of activations.
+    // activations is a `layer_count` array of activations.
     // NOTE: `activations[0] = input`
-    Tensor ***activations = (Tensor ***) malloc(sizeof(Tensor **) * instance->input_n);
-    Tensor ***derivatives = (Tensor ***) malloc(sizeof(Tensor **) * instance->input_n);
-    for (int i = 0; i < instance->input_n; i++) {
-        activations[i] = (Tensor **) malloc(sizeof(Tensor *) * src_machine.layer_count);
-        derivatives[i] = (Tensor **) malloc(sizeof(Tensor *) * src_machine.layer_count);
-    }
+    Tensor **activations = (Tensor **) matArenaAlloc(instance->_arena, sizeof(Tensor *) * src_machine.layer_count);
+    Tensor **derivatives = (Tensor **) matArenaAlloc(instance->_arena, sizeof(Tensor *) * src_machine.layer_count);
     
     // Make sure that when data is freed on panic, itll free NULL instead of junk.
-    for (int i = 0; i < instance->input_n; i++) 
-        for (int j = 0; j < src_machine.layer_count; j++) {
-            activations[i][j] = NULL;
-            derivatives[i][j] = NULL;
-        }
+    for (int j = 0; j < src_machine.layer_count; j++) {
+        activations[j] = NULL;
+        derivatives[j] = NULL;
+    }
 
-    // Clearer free of activations and derivatives. 
+    // Clearer free of activations and derivatives. Freeing them releases their
+    // device buffers, the arena reset releases the rest, so any other tensor of
+    // the step must be freed before.
 #define freeActivationsDerivatives \
-    for (int i = 0; i < instance->input_n; i++) { \
-        for (int j = 0; j < src_machine.layer_count; j++) { \
-            if (j != 0) matFreeTensor(&activations[i][j]); \
-            matFreeTensor(&derivatives[i][j]); \
-        } \
-        free(activations[i]); \
-        activations[i] = NULL; \
-        free(derivatives[i]); \
-        derivatives[i] = NULL; \
+    for (int j = 0; j < src_machine.layer_count; j++) { \
+        if (j != 0) matFreeTensor(&activations[j]); \
+        matFreeTensor(&derivatives[j]); \
     } \
-    free(activations); \
     activations = NULL; \
-    free(derivatives); \
-    derivatives = NULL;
+    derivatives = NULL; \
+    matSetArena(previous_arena); \
+    matArenaReset(instance->_arena);
+
+    Tensor *current_inp = input;
+    Tensor *current_output = NULL;
+
+    for (int layeri = 0; layeri < src_machine.layer_count; layeri++) {
+        // Each layer makes its own output.
+        current_output = NULL;
+        MLErr error = src_machine.layers[layeri]->forward(src_machine.layers[layeri], current_inp, &current_output);
+        if (error != ML_NO_ERR) {
+            matFreeTensor(&current_output);
 
-    for (int inp_num = 0; inp_num < instance->input_n; inp_num++) {
-        Tensor *current_inp = &instance->inputs[inp_num];
-        Tensor *current_output = NULL;
+            freeActivationsDerivatives;
 
-        for (int layeri = 0; layeri < src_machine.layer_count; layeri++) {
-            MLErr error = src_machine.layers[layeri]->forward(src_machine.layers[layeri], current_inp, &current_output);
-            if (error != ML_NO_ERR) {
+            return error;
+        }
 
-                freeActivationsDerivatives;
-                
-                matFreeTensor(&current_output);
-                return error;
-            }
+        activations[layeri] = current_inp;
+        current_inp = current_output;
+    }
+    
+    // Check if the output is the same shape as the expected output
+    if (current_output->ndims != target->ndims) {
+        matFreeTensor(&current_output);
 
-            activations[inp_num][layeri] = current_inp;
-            current_inp = current_output;
-        }
+        freeActivationsDerivatives;
         
-        // Check if the output is the same shape as the expected output
-        if (current_output->ndims != instance->target_outputs[inp_num].ndims) {
-
-            freeActivationsDerivatives;
+        return ML_OPTIMIZER_UNEXPECTED_DIMS;
+    }
 
+    for (int dim = 0; dim < current_output->ndims; dim++)
+        if (current_output->dimsz[dim] != target->dimsz[dim]) {
             matFreeTensor(&current_output);
             
+            freeActivationsDerivatives;
+            
             return ML_OPTIMIZER_UNEXPECTED_DIMS;
         }
 
-        for (int dim = 0; dim < current_output->ndims; dim++)
-            if (current_output->dimsz[dim] != instance->target_outputs[inp_num].dimsz[dim]) {
-                
-                freeActivationsDerivatives;
+    matFreeTensor(&current_output);
 
-                matFreeTensor(&current_output);
-                
-                return ML_OPTIMIZER_UNEXPECTED_DIMS;
-            }
+    // The value in current_output is the final output of the machine.
+    // If the final value is needed outside of this context, the last activation should also be the last value, since:
+    // The final layer is the error calculation.
+    // Its syntax is described in the docs.
 
-        matFreeTensor(&current_output);
+    // Calculate derivatives.
+    Tensor *err_deriv = target;
+    Tensor *curr_deriv = err_deriv;
+    Tensor *next_deriv = NULL;
+    Tensor *self_deriv = NULL;
 
-        // The value in current_output is the final output of the machine.
-        // If the final value is needed outside of this context, the last activation should also be the last value, since:
-        // The final layer is the error calculation.
-        // Its syntax is described in the docs.
+    for (int layeri = src_machine.layer_count - 1; layeri >= 0; layeri--) {
+        MLErr derror = src_machine.layers[layeri]->derive(src_machine.layers[layeri], curr_deriv, activations[layeri], &next_deriv, &self_deriv);
+        if (curr_deriv != err_deriv) matFreeTensor(&curr_deriv);
+        
+        if (derror != ML_NO_ERR) {
+            // curr_deriv is freed, or the target.
+            matFreeTensor(&next_deriv);
+            matFreeTensor(&self_deriv);
+
+            freeActivationsDerivatives;
 
-        // Calculate derivatives.
-        Tensor *err_deriv = &instance->target_outputs[inp_num];
-        Tensor *curr_deriv = err_deriv;
-        Tensor *next_deriv = NULL;
-        Tensor *self_deriv = NULL;
+            return derror;
+        }
 
-        for (int layeri = src_machine.layer_count - 1; layeri >= 0; layeri--) {
-            MLErr derror = src_machine.layers[layeri]->derive(src_machine.layers[layeri], curr_deriv, activations[inp_num][layeri], &next_deriv, &self_deriv);
+        derivatives[layeri] = self_deriv;
+        
+        MLErr oerror = instance->propagate(instance, next_deriv, &curr_deriv);
+        matFreeTensor(&next_deriv);
+        
+        if (oerror != ML_NO_ERR) {
+            // self_deriv is freed with the derivatives.
             if (curr_deriv != err_deriv) matFreeTensor(&curr_deriv);
-            
-            if (derror != ML_NO_ERR) {
 
-                freeActivationsDerivatives;
-                
-                matFreeTensor(&curr_deriv);
-                matFreeTensor(&next_deriv);
-                matFreeTensor(&self_deriv);
+            freeActivationsDerivatives;
 
-                return derror;
-            }
+            return oerror;
+        }
+    } 
+    // The final derivative is not needed, its the derivative
+    // of the previous layer, but this is the last layer.
+    if (curr_deriv != err_deriv) matFreeTensor(&curr_deriv);
 
-            derivatives[inp_num][layeri] = self_deriv;
-            
-            MLErr oerror = instance->propagate(instance, next_deriv, &curr_deriv);
-            matFreeTensor(&next_deriv);
-            
-            if (oerror != ML_NO_ERR) {
-
-                freeActivationsDerivatives;
-                
-                matFreeTensor(&curr_deriv);
-                matFreeTensor(&next_deriv);
-                matFreeTensor(&self_deriv);
-
-                return oerror;
-            }
-        } 
-        // The final derivative is not needed, its the derivative
-        // of the previous layer, but this is the last layer.
-        matFreeTensor(&next_deriv);
+    // Run the optimizer. It is responsible for updating the weights.
+    matSetArena(previous_arena);
+    MLErr error = instance->optimizer(instance, activations, derivatives);
+
+    freeActivationsDerivatives;
+#undef freeActivationsDerivatives
 
-        // Run the optimizer. It is responsible for updating the weights.
-        instance->optimizer(instance, activations[inp_num], derivatives[inp_num]);
+    return error;
+}
+
+// Note a step done, up to input `position`, and write a checkpoint if one is due.
+static MLErr _mlStepDone(LearningInstance *instance, int position) {
+    // The last step completes the pass, before it is checkpointed.
+    if (position >= instance->input_n) {
+        instance->_position = 0;
+        instance->epoch++;
+    } else {
+        instance->_position = position;
     }
+    if (instance->checkpoint_interval <= 0 || ++instance->_checkpoint_steps < instance->checkpoint_interval) return ML_NO_ERR;
 
-    freeActivationsDerivatives;
+    instance->_checkpoint_steps = 0;
+    return mlCheckpointInstance(instance, instance->checkpoint_path);
+}
+
+// Train on every input once, in batches of `batch_size`.
+/*
+ * A pass continues from where the last one stopped, on error or in the middle of a
+ * resumed checkpoint, and completes `epoch`. Writes the checkpoints set with
+ * `checkpoint_interval`, and fails if one can't be, after the step it follows.
+ * */
+MLErr mlTrainInstance(LearningInstance *instance) {
+    if (!instance->src_machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+
+    if (instance->_arena == NULL && (instance->_arena = matMakeArena(0)) == NULL) return ML_MAT_ERROR;
+
+    // Inputs and targets are converted to the dtype of the machine.
+    MatrixDtype dtype = mlMachineDtype(instance->src_machine);
+    if (instance->_position < 0 || instance->_position >= instance->input_n) instance->_position = 0;
+
+    // The loss is told the size of a sample, to tell the batches below from 2-D samples.
+    Machine machine = instance->src_machine;
+    if (instance->input_n > 0 && machine.layer_count > 0) _mlSetLossSampleSize(machine.layers[machine.layer_count - 1], instance->target_outputs[0].literal_size);
+
+    if (instance->batch_size <= 1) {
+        for (int inp_num = instance->_position; inp_num < instance->input_n; inp_num++) {
+            Tensor *input = &instance->inputs[inp_num];
+            Tensor *target = &instance->target_outputs[inp_num];
+            if (input->dtype != dtype) input = matTensorCast(input, dtype, NULL);
+            if (target->dtype != dtype) target = matTensorCast(target, dtype, NULL);
+
+            MLErr error = (input == NULL || target == NULL)? ML_MAT_ERROR : _mlTrainStep(instance, input, target);
+            if (input != &instance->inputs[inp_num]) matFreeTensor(&input);
+            if (target != &instance->target_outputs[inp_num]) matFreeTensor(&target);
+            if (error == ML_NO_ERR) error = _mlStepDone(instance, inp_num + 1);
+            if (error != ML_NO_ERR) return error;
+        }
+
+        return ML_NO_ERR;
+    }
+
+    // Consecutive inputs are stacked into batches, and every layer runs once per
+    // batch. The last batch may be smaller.
+    for (int inp_num = instance->_position; inp_num < instance->input_n; inp_num += instance->batch_size) {
+        int n = instance->input_n - inp_num;
+        if (n > instance->batch_size) n = instance->batch_size;
+
+        Tensor *inputs = matTensorStack(&instance->inputs[inp_num], n, NULL);
+        Tensor *targets = matTensorStack(&instance->target_outputs[inp_num], n, NULL);
+
+        MLErr error = (inputs == NULL || targets == NULL)? ML_MAT_ERROR : ML_NO_ERR;
+        if (error == ML_NO_ERR && (matTensorSetDtype(inputs, dtype) != MAT_NO_ERROR ||
+                                   matTensorSetDtype(targets, dtype) != MAT_NO_ERROR))
+            error = ML_MAT_ERROR;
+        if (error == ML_NO_ERR) error = _mlTrainStep(instance, inputs, targets);
+        matFreeTensor(&inputs);
+        matFreeTensor(&targets);
+        if (error == ML_NO_ERR) error = _mlStepDone(instance, inp_num + n);
+        if (error != ML_NO_ERR) return error;
+    }
 
     return ML_NO_ERR;
 }
 
 MLErr mlSGD(LearningInstance *self, Tensor **activations, Tensor **derivatives) {
-    Tensor *learning_rate = matMakeScalar(*(double *) self->hyper_parameters, NULL);
+    double learning_rate = *(double *) self->hyper_parameters;
+    // Only made for layers updated through `update`.
+    Tensor *learning_rate_scalar = NULL;
     int error = ML_NO_ERR;
     
     // Update each layer with its derivative
-    for (int i = 0; i < self->src_machine.layer_count; i++)  {
-        // Multiply each derivative by the learning rate
-        Tensor *new_deriv = NULL;
-        error = matDot(learning_rate, derivatives[i], &new_deriv);
-        if (error != MAT_NO_ERROR) return ML_OPTIMIZER_INTERNAL_ERORR;
-
-        error = self->src_machine.layers[i]->update(self->src_machine.layers[i], new_deriv);
-        matFreeTensor(&new_deriv);
-        if (error != ML_NO_ERR) return error;
+    for (int i = 0; i < self->src_machine.layer_count && error == ML_NO_ERR; i++)  {
+        Layer *layer = self->src_machine.layers[i];
+        // Layers without weights have no derivative.
+        if (derivatives[i] == NULL) continue;
+
+        Tensor *weights;
+        if ((error = layer->trainable(layer, &weights)) != ML_NO_ERR) break;
+
+        // weights -= learning_rate * derivative, in one pass.
+        if (weights != NULL) {
+            if (matAxpy(-learning_rate, derivatives[i], weights) != MAT_NO_ERROR) error = ML_OPTIMIZER_INTERNAL_ERORR;
+            continue;
+        }
+
+        // Multiply the derivative by the learning rate, in place since it is discarded after.
+        if (learning_rate_scalar == NULL) learning_rate_scalar = matMakeScalar(learning_rate, NULL);
+        if (matMultInto(derivatives[i], learning_rate_scalar, derivatives[i]) != MAT_NO_ERROR) {
+            error = ML_OPTIMIZER_INTERNAL_ERORR;
+            break;
+        }
+
+        error = layer->update(layer, derivatives[i]);
     }
 
+    matFreeTensor(&learning_rate_scalar);
+
     return error;
 }
 
@@ -173,3 +256,211 @@ MLErr mlSGDInitialize(LearningInstance *self) {
 MLErr mlSGDCleanup(LearningInstance *self) {
     return ML_NO_ERR;
 }
+
+MLErr mlSGDState(LearningInstance *self, MLOptimizerState *state) {
+    if (state == NULL) return ML_NULL_PTR;
+
+    state->step = NULL;
+    state->hyper_parameters = self->hyper_parameters;
+    state->hyper_parameters_size = sizeof(double);
+    state->tensor_n = 0;
+    state->tensors = NULL;
+
+    return ML_NO_ERR;
+}
+
+// State of the optimizers keeping moments of the derivatives, in `_cache`.
+typedef struct {
+    // Updates done, for the bias corrections of `Adam`.
+    int step;
+    // Per layer, shaped as its weights. Made on the layer's first update.
+    // NOTE: `second` follows `first` in one array, the state of checkpoints.
+    Tensor **first;
+    Tensor **second;
+} _MLMoments;
+
+typedef MatrixErr (*_mlMomentsUpdateFn)(LearningInstance *self, Tensor *weights, Tensor *derivative,
+                                        Tensor *first, Tensor *second, int step);
+
+static MLErr _mlMakeMoments(LearningInstance *self) {
+    self->_cache = NULL;
+    if (self->hyper_parameters == NULL) return ML_NULL_PTR;
+
+    _MLMoments *moments = (_MLMoments *) malloc(sizeof(_MLMoments));
+    if (moments == NULL) return ML_MAT_ERROR;
+
+    moments->step = 0;
+    moments->first = (Tensor **) calloc(2 * self->src_machine.layer_count + 1, sizeof(Tensor *));
+    if (moments->first == NULL) {
+        free(moments);
+        return ML_MAT_ERROR;
+    }
+    moments->second = moments->first + self->src_machine.layer_count;
+    self->_cache = moments;
+
+    return ML_NO_ERR;
+}
+
+static void _mlFreeMoments(LearningInstance *self) {
+    _MLMoments *moments = (_MLMoments *) self->_cache;
+    if (moments == NULL) return;
+
+    for (int i = 0; i < self->src_machine.layer_count; i++) {
+        matFreeTensor(&moments->first[i]);
+        matFreeTensor(&moments->second[i]);
+    }
+    free(moments->first);
+    free(moments);
+    self->_cache = NULL;
+}
+
+static MLErr _mlMomentsState(LearningInstance *self, MLOptimizerState *state, size_t hyper_parameters_size) {
+    _MLMoments *moments = (_MLMoments *) self->_cache;
+    if (state == NULL || moments == NULL) return ML_NULL_PTR;
+
+    state->step = &moments->step;
+    state->hyper_parameters = self->hyper_parameters;
+    state->hyper_parameters_size = hyper_parameters_size;
+    state->tensor_n = 2 * self->src_machine.layer_count;
+    state->tensors = moments->first;
+
+    return ML_NO_ERR;
+}
+
+// A moment of `weights`, zeros on its first use. Kept on the device, if there is one.
+static Tensor* _mlMoment(Tensor **moment, Tensor *weights) {
+    if (*moment != NULL) return *moment;
+
+    // Lives as long as the instance, not the training step.
+    MatrixArena *arena = matSetArena(NULL);
+    *moment = mlWeightInitializer(ML_WEIGHT_INITIALIZER_ZEROS, weights->ndims, weights->dimsz);
+    if (*moment != NULL && matTensorSetDtype(*moment, weights->dtype) != MAT_NO_ERROR) matFreeTensor(moment);
+    matSetArena(arena);
+
+    if (*moment != NULL && matTensorToDevice(*moment) != MAT_NO_ERROR) matFreeTensor(moment);
+
+    return *moment;
+}
+
+// Update the weights of every layer with its derivative and moments, one fused update each.
+/*
+ * `second` - whether the update uses a second moment.
+ * */
+static MLErr _mlMomentsOptimizer(LearningInstance *self, Tensor **derivatives, int second, _mlMomentsUpdateFn update) {
+    _MLMoments *moments = (_MLMoments *) self->_cache;
+    if (moments == NULL) return ML_NULL_PTR;
+
+    moments->step++;
+
+    for (int i = 0; i < self->src_machine.layer_count; i++) {
+        Layer *layer = self->src_machine.layers[i];
+        // Layers without weights have no derivative.
+        if (derivatives[i] == NULL) continue;
+
+        Tensor *weights;
+        MLErr error = layer->trainable(layer, &weights);
+        if (error != ML_NO_ERR) return error;
+        // The moments are only kept for weights updated in place.
+        if (weights == NULL) return ML_OPTIMIZER_INTERNAL_ERORR;
+
+        Tensor *first = _mlMoment(&moments->first[i], weights);
+        Tensor *second_moment = second? _mlMoment(&moments->second[i], weights) : NULL;
+        if (first == NULL || (second && second_moment == NULL)) return ML_MAT_ERROR;
+
+        MatrixErr e = update(self, weights, derivatives[i], first, second_moment, moments->step);
+        if (e == MAT_DIMENSION_MISTMATCH) return ML_OPTIMIZER_UNEXPECTED_DIMS;
+        if (e != MAT_NO_ERROR) return ML_OPTIMIZER_INTERNAL_ERORR;
+    }
+
+    return ML_NO_ERR;
+}
+
+/* Momentum */
+
+static MatrixErr _mlMomentumUpdate(LearningInstance *self, Tensor *weights, Tensor *derivative,
+                                   Tensor *first, Tensor *second, int step) {
+    MLMomentumParameters *p = (MLMomentumParameters *) self->hyper_parameters;
+    return matMomentumUpdate(weights, derivative, first, p->learning_rate, p->momentum);
+}
+
+MLErr mlMomentum(LearningInstance *self, Tensor **activations, Tensor **derivatives) {
+    return _mlMomentsOptimizer(self, derivatives, 0, _mlMomentumUpdate);
+}
+
+MLErr mlMomentumPropagate(LearningInstance *self, Tensor *upstream_derivative, Tensor **downstream_derivative) {
+    return mlSGDPropagate(self, upstream_derivative, downstream_derivative);
+}
+
+MLErr mlMomentumInitialize(LearningInstance *self) {
+    return _mlMakeMoments(self);
+}
+
+MLErr mlMomentumCleanup(LearningInstance *self) {
+    _mlFreeMoments(self);
+
+    return ML_NO_ERR;
+}
+
+MLErr mlMomentumState(LearningInstance *self, MLOptimizerState *state) {
+    return _mlMomentsState(self, state, sizeof(MLMomentumParameters));
+}
+
+/* RMSProp */
+
+static MatrixErr _mlRMSPropUpdate(LearningInstance *self, Tensor *weights, Tensor *derivative,
+                                  Tensor *first, Tensor *second, int step) {
+    MLRMSPropParameters *p = (MLRMSPropParameters *) self->hyper_parameters;
+    return matRMSPropUpdate(weights, derivative, first, p->learning_rate, p->decay, p->epsilon);
+}
+
+MLErr mlRMSProp(LearningInstance *self, Tensor **activations, Tensor **derivatives) {
+    return _mlMomentsOptimizer(self, derivatives, 0, _mlRMSPropUpdate);
+}
+
+MLErr mlRMSPropPropagate(LearningInstance *self, Tensor *upstream_derivative, Tensor **downstream_derivative) {
+    return mlSGDPropagate(self, upstream_derivative, downstream_derivative);
+}
+
+MLErr mlRMSPropInitialize(LearningInstance *self) {
+    return _mlMakeMoments(self);
+}
+
+MLErr mlRMSPropCleanup(LearningInstance *self) {
+    _mlFreeMoments(self);
+
+    return ML_NO_ERR;
+}
+
+MLErr mlRMSPropState(LearningInstance *self, MLOptimizerState *state) {
+    return _mlMomentsState(self, state, sizeof(MLRMSPropParameters));
+}
+
+/* Adam */
+
+static MatrixErr _mlAdamUpdate(LearningInstance *self, Tensor *weights, Tensor *derivative,
+                               Tensor *first, Tensor *second, int step) {
+    MLAdamParameters *p = (MLAdamParameters *) self->hyper_parameters;
+    return matAdamUpdate(weights, derivative, first, second, p->learning_rate, p->beta1, p->beta2, p->epsilon, step);
+}
+
+MLErr mlAdam(LearningInstance *self, Tensor **activations, Tensor **derivatives) {
+    return _mlMomentsOptimizer(self, derivatives, 1, _mlAdamUpdate);
+}
+
+MLErr mlAdamPropagate(LearningInstance *self, Tensor *upstream_derivative, Tensor **downstream_derivative) {
+    return mlSGDPropagate(self, upstream_derivative, downstream_derivative);
+}
+
+MLErr mlAdamInitialize(LearningInstance *self) {
+    return _mlMakeMoments(self);
+}
+
+MLErr mlAdamCleanup(LearningInstance *self) {
+    _mlFreeMoments(self);
+
+    return ML_NO_ERR;
+}
+
+MLErr mlAdamState(LearningInstance *self, MLOptimizerState *state) {
+    return _mlMomentsState(self, state, sizeof(MLAdamParameters));
+}
@@ -0,0 +1,822 @@
+// NOTE: Must come before any header, for `mmap` and threads.
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ml.h"
+#include "../matrix/mat.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * File layout, in the byte order of the machine that saved it:
+ * a `_MLFileHeader`, a `_MLFileLayer` per layer, a `_MLFileTensor` per Tensor of
+ * the layers in order, then the data of each Tensor, at offsets aligned to
+ * ML_FILE_ALIGN.
+ * */
+
+// Bumped when the layout changes, files of other versions are rejected.
+#define ML_FILE_VERSION 1
+// Written as is, to reject files saved with another byte order.
+#define ML_FILE_BYTE_ORDER 0x01020304u
+// Alignment of the data of each Tensor, the widest vector loads of the CPU backend.
+#define ML_FILE_ALIGN 64
+#define ML_FILE_MAX_DIMS 8
+
+#define ML_FILE_ALIGN_UP(n) (((n) + ML_FILE_ALIGN - 1) / ML_FILE_ALIGN * ML_FILE_ALIGN)
+
+// Layers a file can hold, told apart by their `forward`.
+// NOTE: The values are stored, only append.
+typedef enum {
+    _ML_FILE_UNKNOWN=0,
+    _ML_FILE_FULLY_CONNECTED,
+    _ML_FILE_BIAS,
+    _ML_FILE_DENSE,
+    _ML_FILE_QUANTIZED_FULLY_CONNECTED,
+    _ML_FILE_RELU,
+    _ML_FILE_SIGMOID,
+    _ML_FILE_TANH,
+    _ML_FILE_MEAN_SQUARED_ERROR
+} _MLFileLayerKind;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t layer_count;
+    uint32_t tensor_count;
+    uint32_t reserved;
+} _MLFileHeader;
+
+typedef struct {
+    uint32_t kind;
+    // Of `Dense`.
+    int32_t activation;
+    // Of `QuantizedFullyConnected`.
+    double input_scale;
+    // Tensors of the layer, its weights and then those of its parameters.
+    uint32_t tensor_count;
+    uint32_t reserved;
+} _MLFileLayer;
+
+typedef struct {
+    uint32_t dtype;
+    uint32_t ndims;
+    uint32_t dimsz[ML_FILE_MAX_DIMS];
+    // Of the data from the start of the file, and its size, in bytes.
+    uint64_t offset;
+    uint64_t size;
+} _MLFileTensor;
+
+struct _ml_storage {
+    // The file, mapped copy on write.
+    void *mapping;
+    size_t size;
+    // The Tensors viewing the mapping, allocated with their dims from here, so
+    // the layers freeing them leaves the mapping alone.
+    MatrixArena *arena;
+    Layer **layers;
+};
+
+static _MLFileLayerKind _mlLayerKind(Layer *layer) {
+    if (layer->forward == mlFullyConnectedForward) return _ML_FILE_FULLY_CONNECTED;
+    if (layer->forward == mlBiasForward) return _ML_FILE_BIAS;
+    if (layer->forward == mlDenseForward) return _ML_FILE_DENSE;
+    if (layer->forward == mlQuantizedFullyConnectedForward) return _ML_FILE_QUANTIZED_FULLY_CONNECTED;
+    if (layer->forward == mlReLuForward) return _ML_FILE_RELU;
+    if (layer->forward == mlSigmoidForward) return _ML_FILE_SIGMOID;
+    if (layer->forward == mlTanhForward) return _ML_FILE_TANH;
+    if (layer->forward == mlMeanSquaredErrorForward) return _ML_FILE_MEAN_SQUARED_ERROR;
+
+    return _ML_FILE_UNKNOWN;
+}
+
+// Number of Tensors a layer of `kind` has.
+static unsigned _mlKindTensors(_MLFileLayerKind kind) {
+    switch (kind) {
+        case _ML_FILE_FULLY_CONNECTED:
+        case _ML_FILE_BIAS:
+        case _ML_FILE_DENSE:
+            return 1;
+        case _ML_FILE_QUANTIZED_FULLY_CONNECTED: return 2;
+        default: return 0;
+    }
+}
+
+// The Tensors of a layer, as many as `_mlKindTensors`.
+static void _mlLayerTensors(Layer *layer, _MLFileLayerKind kind, Tensor **tensors) {
+    if (_mlKindTensors(kind) > 0) tensors[0] = (Tensor *) layer->weights;
+    if (kind == _ML_FILE_QUANTIZED_FULLY_CONNECTED) tensors[1] = ((MLQuantizedParameters *) layer->parameters)->scale;
+}
+
+static int _mlWritePadding(FILE *file, size_t n) {
+    static const char zeros[ML_FILE_ALIGN] = { 0 };
+    return n > 0 && fwrite(zeros, 1, n, file) != n;
+}
+
+// Save a `Machine`, its layers and their weights, to a file `mlLoadMachine` maps back.
+/*
+ * Takes the layers provided by ml.h, in any dtype, fused or quantized. Device
+ * resident weights are synchronized first. Fails with ML_FILE_ERROR for layers
+ * of other implementations, or if the file can't be written.
+ * */
+MLErr mlSaveMachine(Machine machine, const char *path) {
+    if (path == NULL) return ML_NULL_PTR;
+    if (!machine._all_layers_initialized) return ML_MACHINE_UNINITIALIZED_LAYER;
+
+    unsigned tensor_count = 0;
+    for (int i = 0; i < machine.layer_count; i++) {
+        _MLFileLayerKind kind = _mlLayerKind(machine.layers[i]);
+        if (kind == _ML_FILE_UNKNOWN) return ML_FILE_ERROR;
+        tensor_count += _mlKindTensors(kind);
+    }
+
+    MLErr error = ML_NO_ERR;
+    FILE *file = NULL;
+    // Contiguous host copies of the Tensors that aren't.
+    MatrixArena *previous_arena = matSetArena(NULL);
+    _MLFileLayer *file_layers = (_MLFileLayer *) calloc(machine.layer_count + 1, sizeof(_MLFileLayer));
+    _MLFileTensor *file_tensors = (_MLFileTensor *) calloc(tensor_count + 1, sizeof(_MLFileTensor));
+    Tensor **tensors = (Tensor **) calloc(tensor_count + 1, sizeof(Tensor *));
+    Tensor **copies = (Tensor **) calloc(tensor_count + 1, sizeof(Tensor *));
+    if (file_layers == NULL || file_tensors == NULL || tensors == NULL || copies == NULL) {
+        error = ML_MAT_ERROR;
+        goto Cleanup;
+    }
+
+    size_t offset = ML_FILE_ALIGN_UP(sizeof(_MLFileHeader) + sizeof(_MLFileLayer) * machine.layer_count +
+                                     sizeof(_MLFileTensor) * tensor_count);
+    unsigned n = 0;
+    for (int i = 0; i < machine.layer_count; i++) {
+        Layer *layer = machine.layers[i];
+        _MLFileLayerKind kind = _mlLayerKind(layer);
+
+        file_layers[i].kind = kind;
+        file_layers[i].activation = (kind == _ML_FILE_DENSE)? ((MLDenseParameters *) layer->parameters)->activation : 0;
+        file_layers[i].input_scale = (kind == _ML_FILE_QUANTIZED_FULLY_CONNECTED)?
+                                     ((MLQuantizedParameters *) layer->parameters)->input_scale : 0;
+        file_layers[i].tensor_count = _mlKindTensors(kind);
+        _mlLayerTensors(layer, kind, tensors + n);
+
+        for (unsigned j = 0; j < file_layers[i].tensor_count; j++, n++) {
+            Tensor *t = tensors[n];
+            if (t == NULL || t->ndims > ML_FILE_MAX_DIMS) {
+                error = ML_FILE_ERROR;
+                goto Cleanup;
+            }
+            if (!matIsTensorContiguous(t)) {
+                copies[n] = matTensorDeepCopy(t, NULL);
+                if (copies[n] == NULL) {
+                    error = ML_MAT_ERROR;
+                    goto Cleanup;
+                }
+                tensors[n] = t = copies[n];
+            }
+            if (matTensorToHost(t) != MAT_NO_ERROR) {
+                error = ML_MAT_ERROR;
+                goto Cleanup;
+            }
+
+            file_tensors[n].dtype = t->dtype;
+            file_tensors[n].ndims = t->ndims;
+            for (unsigned d = 0; d < t->ndims; d++) file_tensors[n].dimsz[d] = t->dimsz[d];
+            file_tensors[n].offset = offset;
+            file_tensors[n].size = matDtypeSize(t->dtype) * t->literal_size;
+            offset = ML_FILE_ALIGN_UP(offset + file_tensors[n].size);
+        }
+    }
+
+    file = fopen(path, "wb");
+    if (file == NULL) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+
+    _MLFileHeader header = { { 'A', 'M', 'L', 'M' }, ML_FILE_VERSION, ML_FILE_BYTE_ORDER, machine.layer_count, tensor_count, 0 };
+    size_t position = sizeof(_MLFileHeader) + sizeof(_MLFileLayer) * machine.layer_count + sizeof(_MLFileTensor) * tensor_count;
+    if (fwrite(&header, sizeof(_MLFileHeader), 1, file) != 1 ||
+        fwrite(file_layers, sizeof(_MLFileLayer), machine.layer_count, file) != machine.layer_count ||
+        fwrite(file_tensors, sizeof(_MLFileTensor), tensor_count, file) != tensor_count) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+
+    for (unsigned i = 0; i < tensor_count; i++) {
+        if (_mlWritePadding(file, file_tensors[i].offset - position) ||
+            fwrite(tensors[i]->data, 1, file_tensors[i].size, file) != file_tensors[i].size) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+        position = file_tensors[i].offset + file_tensors[i].size;
+    }
+
+Cleanup:
+    if (file != NULL && fclose(file) != 0 && error == ML_NO_ERR) error = ML_FILE_ERROR;
+    for (unsigned i = 0; copies != NULL && i < tensor_count; i++) matFreeTensor(&copies[i]);
+    free(copies);
+    free(tensors);
+    free(file_tensors);
+    free(file_layers);
+    matSetArena(previous_arena);
+
+    return error;
+}
+
+// Map a whole file, copy on write. Returns 0 on success.
+static int _mlMapFile(const char *path, struct _ml_storage *storage) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return 1;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return 1;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return 1;
+
+    // The view keeps the mapping open.
+    storage->mapping = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (storage->mapping == NULL) return 1;
+    storage->size = (size_t) size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return 1;
+    }
+
+    // Private, so the weights can still be updated or cast in place.
+    void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return 1;
+    storage->mapping = mapping;
+    storage->size = (size_t) st.st_size;
+#endif
+
+    return 0;
+}
+
+void _mlFreeStorage(struct _ml_storage *storage) {
+    if (storage == NULL) return;
+
+    free(storage->layers);
+    matFreeArena(&storage->arena);
+    if (storage->mapping != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(storage->mapping);
+#else
+        munmap(storage->mapping, storage->size);
+#endif
+    }
+
+    free(storage);
+}
+
+// A Tensor viewing the data of `file_tensor` in the mapping, or NULL if it is out of range.
+static Tensor* _mlMapTensor(struct _ml_storage *storage, _MLFileTensor *file_tensor) {
+    if (file_tensor->dtype >= MAT_DTYPES || file_tensor->ndims > ML_FILE_MAX_DIMS) return NULL;
+    if (file_tensor->offset % ML_FILE_ALIGN != 0 || file_tensor->offset > storage->size ||
+        file_tensor->size > storage->size - file_tensor->offset) return NULL;
+
+    Tensor *t = matMakeTensor(file_tensor->ndims, file_tensor->dimsz, NULL);
+    if (t == NULL) return NULL;
+    if (matDtypeSize(file_tensor->dtype) * t->literal_size != file_tensor->size) return NULL;
+
+    t->dtype = file_tensor->dtype;
+    t->data = (double *) ((char *) storage->mapping + file_tensor->offset);
+
+    return t;
+}
+
+// Load a `Machine` saved with `mlSaveMachine`, mapping the file into memory.
+/*
+ * The weights aren't copied: they are Tensors viewing the mapped file, which is
+ * paged in as they are first read, and only copied (by the OS) for pages written to.
+ * The layers may keep device copies as usual. The mapping, and `machine->layers`,
+ * are released with the machine by `mlFreeMachineD` or `mlFreeMachine`, so the
+ * layers must stay in it. The file must not change while it is loaded.
+ * Fails with ML_FILE_ERROR if the file can't be mapped, or isn't a machine of
+ * this version and byte order.
+ * */
+MLErr mlLoadMachine(const char *path, Machine *machine) {
+    if (path == NULL || machine == NULL) return ML_NULL_PTR;
+
+    struct _ml_storage *storage = (struct _ml_storage *) calloc(1, sizeof(struct _ml_storage));
+    if (storage == NULL) return ML_MAT_ERROR;
+    if (_mlMapFile(path, storage)) {
+        free(storage);
+        return ML_FILE_ERROR;
+    }
+
+    MLErr error = ML_NO_ERR;
+    MatrixArena *previous_arena = matGetArena();
+    Tensor **tensors = NULL;
+
+    _MLFileHeader *header = (_MLFileHeader *) storage->mapping;
+    if (storage->size < sizeof(_MLFileHeader) || memcmp(header->magic, "AMLM", 4) != 0 ||
+        header->version != ML_FILE_VERSION || header->byte_order != ML_FILE_BYTE_ORDER ||
+        header->layer_count > (storage->size - sizeof(_MLFileHeader)) / sizeof(_MLFileLayer) ||
+        header->tensor_count > (storage->size - sizeof(_MLFileHeader) - sizeof(_MLFileLayer) * header->layer_count) / sizeof(_MLFileTensor)) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+    _MLFileLayer *file_layers = (_MLFileLayer *) (header + 1);
+    _MLFileTensor *file_tensors = (_MLFileTensor *) (file_layers + header->layer_count);
+
+    storage->layers = (Layer **) calloc(header->layer_count + 1, sizeof(Layer *));
+    tensors = (Tensor **) calloc(header->tensor_count + 1, sizeof(Tensor *));
+    storage->arena = matMakeArena(1024 * (header->tensor_count + 1));
+    if (storage->layers == NULL || tensors == NULL || storage->arena == NULL) {
+        error = ML_MAT_ERROR;
+        goto Cleanup;
+    }
+
+    matSetArena(storage->arena);
+    for (unsigned i = 0; i < header->tensor_count; i++) {
+        tensors[i] = _mlMapTensor(storage, &file_tensors[i]);
+        if (tensors[i] == NULL) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+    }
+    // The layers are malloc'd as usual.
+    matSetArena(NULL);
+
+    unsigned n = 0;
+    for (unsigned i = 0; i < header->layer_count; i++) {
+        _MLFileLayerKind kind = (_MLFileLayerKind) file_layers[i].kind;
+        if (kind == _ML_FILE_UNKNOWN || file_layers[i].tensor_count != _mlKindTensors(kind) ||
+            file_layers[i].tensor_count > header->tensor_count - n) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+        Tensor **t = tensors + n;
+        n += file_layers[i].tensor_count;
+
+        Layer *layer = NULL;
+        switch (kind) {
+            case _ML_FILE_FULLY_CONNECTED: layer = mlMakeLayer(FullyConnected, NULL, t[0]); break;
+            case _ML_FILE_BIAS: layer = mlMakeLayer(Bias, NULL, t[0]); break;
+            case _ML_FILE_DENSE: {
+                // Copied by the layer.
+                MLDenseParameters parameters = { (MatrixActivation) file_layers[i].activation };
+                layer = mlMakeLayer(Dense, &parameters, t[0]);
+                break;
+            }
+            case _ML_FILE_QUANTIZED_FULLY_CONNECTED: {
+                MLQuantizedParameters parameters = { t[1], file_layers[i].input_scale };
+                layer = mlMakeLayer(QuantizedFullyConnected, &parameters, t[0]);
+                break;
+            }
+            case _ML_FILE_RELU: layer = mlMakeLayer(ReLu, NULL, NULL); break;
+            case _ML_FILE_SIGMOID: layer = mlMakeLayer(Sigmoid, NULL, NULL); break;
+            case _ML_FILE_TANH: layer = mlMakeLayer(Tanh, NULL, NULL); break;
+            case _ML_FILE_MEAN_SQUARED_ERROR: layer = mlMakeLayer(MeanSquaredError, NULL, NULL); break;
+            default:
+                error = ML_FILE_ERROR;
+                goto Cleanup;
+        }
+
+        storage->layers[i] = layer;
+        if (layer->_initialization_error != ML_NO_ERR) {
+            error = layer->_initialization_error;
+            goto Cleanup;
+        }
+    }
+
+    *machine = mlMakeMachine(header->layer_count, storage->layers);
+    machine->_storage = storage;
+
+Cleanup:
+    matSetArena(previous_arena);
+    free(tensors);
+    if (error != ML_NO_ERR) {
+        // The layers free their Tensors, which the arena keeps.
+        for (unsigned i = 0; storage->layers != NULL && i < header->layer_count; i++) mlFreeLayer(&storage->layers[i]);
+        _mlFreeStorage(storage);
+    }
+
+    return error;
+}
+
+/* Checkpoints */
+
+/*
+ * File layout, in the byte order of the machine that saved it:
+ * a `_MLCheckpointHeader`, a `_MLCheckpointTensor` per Tensor, the hyper parameters,
+ * then the data of each Tensor, at offsets aligned to ML_FILE_ALIGN.
+ * */
+
+#define ML_CHECKPOINT_VERSION 1
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t layer_count;
+    // Slots of the optimizer state, see `MLOptimizerState`.
+    uint32_t state_count;
+    uint32_t tensor_count;
+    int32_t epoch;
+    int32_t position;
+    int32_t step;
+    uint32_t reserved;
+    uint64_t hyper_parameters_size;
+} _MLCheckpointHeader;
+
+typedef struct {
+    // The layer of the weights, or `layer_count` + the slot of the optimizer state.
+    uint32_t slot;
+    uint32_t reserved;
+    _MLFileTensor tensor;
+} _MLCheckpointTensor;
+
+// A snapshot of a `LearningInstance`, written by a thread of its own.
+struct _ml_checkpoint {
+    // Written to `<path>.tmp` first, and renamed over it once complete.
+    char *path;
+    _MLCheckpointHeader header;
+    _MLCheckpointTensor *tensors;
+    void *hyper_parameters;
+    // Host copy of the data of each Tensor.
+    void **data;
+
+    // Of the write, set by the thread.
+    MLErr error;
+    // Whether the write runs on `thread`, or was done in place.
+    int threaded;
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+static void _mlFreeCheckpoint(struct _ml_checkpoint *checkpoint) {
+    if (checkpoint == NULL) return;
+
+    for (unsigned i = 0; checkpoint->data != NULL && i < checkpoint->header.tensor_count; i++) free(checkpoint->data[i]);
+    free(checkpoint->data);
+    free(checkpoint->tensors);
+    free(checkpoint->hyper_parameters);
+    free(checkpoint->path);
+    free(checkpoint);
+}
+
+// Copy a Tensor to `*data`, described by `record`. Returns 0 on success.
+static int _mlSnapshotTensor(Tensor *t, uint32_t slot, _MLCheckpointTensor *record, void **data) {
+    if (t->ndims > ML_FILE_MAX_DIMS) return 1;
+
+    Tensor *c = matIsTensorContiguous(t)? t : matTensorDeepCopy(t, NULL);
+    if (c == NULL || matTensorToHost(c) != MAT_NO_ERROR) {
+        if (c != t) matFreeTensor(&c);
+        return 1;
+    }
+
+    size_t size = matDtypeSize(c->dtype) * c->literal_size;
+    *data = malloc(size);
+    if (*data != NULL) memcpy(*data, c->data, size);
+
+    record->slot = slot;
+    record->tensor.dtype = c->dtype;
+    record->tensor.ndims = c->ndims;
+    for (unsigned d = 0; d < c->ndims; d++) record->tensor.dimsz[d] = c->dimsz[d];
+    record->tensor.size = size;
+
+    if (c != t) matFreeTensor(&c);
+
+    return *data == NULL;
+}
+
+static MLErr _mlWriteCheckpoint(struct _ml_checkpoint *checkpoint) {
+    size_t length = strlen(checkpoint->path);
+    char *temporary = (char *) malloc(length + 5);
+    if (temporary == NULL) return ML_MAT_ERROR;
+    memcpy(temporary, checkpoint->path, length);
+    memcpy(temporary + length, ".tmp", 5);
+
+    MLErr error = ML_NO_ERR;
+    _MLCheckpointHeader *header = &checkpoint->header;
+    FILE *file = fopen(temporary, "wb");
+    if (file == NULL) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+
+    size_t position = sizeof(_MLCheckpointHeader) + sizeof(_MLCheckpointTensor) * header->tensor_count + header->hyper_parameters_size;
+    if (fwrite(header, sizeof(_MLCheckpointHeader), 1, file) != 1 ||
+        fwrite(checkpoint->tensors, sizeof(_MLCheckpointTensor), header->tensor_count, file) != header->tensor_count ||
+        fwrite(checkpoint->hyper_parameters, 1, header->hyper_parameters_size, file) != header->hyper_parameters_size) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+
+    for (unsigned i = 0; i < header->tensor_count; i++) {
+        _MLFileTensor *t = &checkpoint->tensors[i].tensor;
+        if (_mlWritePadding(file, t->offset - position) || fwrite(checkpoint->data[i], 1, t->size, file) != t->size) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+        position = t->offset + t->size;
+    }
+
+    // On disk before it replaces the last checkpoint, so a crash leaves one of them whole.
+#ifdef _WIN32
+    if (fflush(file) != 0 || _commit(_fileno(file)) != 0) error = ML_FILE_ERROR;
+#else
+    if (fflush(file) != 0 || fsync(fileno(file)) != 0) error = ML_FILE_ERROR;
+#endif
+
+Cleanup:
+    if (file != NULL && fclose(file) != 0) error = ML_FILE_ERROR;
+    if (error == ML_NO_ERR) {
+#ifdef _WIN32
+        if (!MoveFileExA(temporary, checkpoint->path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) error = ML_FILE_ERROR;
+#else
+        if (rename(temporary, checkpoint->path) != 0) error = ML_FILE_ERROR;
+#endif
+    }
+    if (error != ML_NO_ERR) remove(temporary);
+    free(temporary);
+
+    return error;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI _mlCheckpointThread(LPVOID checkpoint) {
+    ((struct _ml_checkpoint *) checkpoint)->error = _mlWriteCheckpoint((struct _ml_checkpoint *) checkpoint);
+    return 0;
+}
+#else
+static void* _mlCheckpointThread(void *checkpoint) {
+    ((struct _ml_checkpoint *) checkpoint)->error = _mlWriteCheckpoint((struct _ml_checkpoint *) checkpoint);
+    return NULL;
+}
+#endif
+
+// Wait for the checkpoint of an instance being written, if any.
+/*
+ * Returns the error of its write, ML_FILE_ERROR if the file couldn't be written.
+ * */
+MLErr mlWaitCheckpoint(LearningInstance *instance) {
+    if (instance == NULL) return ML_NULL_PTR;
+
+    struct _ml_checkpoint *checkpoint = instance->_checkpoint;
+    if (checkpoint == NULL) return ML_NO_ERR;
+
+    if (checkpoint->threaded) {
+#ifdef _WIN32
+        WaitForSingleObject(checkpoint->thread, INFINITE);
+        CloseHandle(checkpoint->thread);
+#else
+        pthread_join(checkpoint->thread, NULL);
+#endif
+    }
+
+    MLErr error = checkpoint->error;
+    _mlFreeCheckpoint(checkpoint);
+    instance->_checkpoint = NULL;
+
+    return error;
+}
+
+// Checkpoint the training of an instance to a file, written in the background.
+/*
+ * Saves the weights of the machine's layers (those `trainable` gives), the state and
+ * hyper parameters of the optimizer (see `MLOptimizerState`), and how far training is,
+ * so `mlResumeInstance` continues from here. Call it between training steps, such as
+ * between `mlTrainInstance` passes, or set `checkpoint_interval` for `mlTrainInstance`
+ * to call it every so many steps.
+ * The instance is copied to host memory before returning, and the copy written by a
+ * thread, while training goes on. The file is written to `<path>.tmp` and renamed over
+ * `path` once complete, so a crash while writing leaves the previous checkpoint.
+ * One checkpoint is written at a time: this waits for the last, and returns its error
+ * (see `mlWaitCheckpoint`), though the new one is still taken.
+ * */
+MLErr mlCheckpointInstance(LearningInstance *instance, const char *path) {
+    if (instance == NULL || path == NULL) return ML_NULL_PTR;
+
+    MLErr last_error = mlWaitCheckpoint(instance);
+
+    MLOptimizerState state;
+    MLErr error = instance->state(instance, &state);
+    if (error != ML_NO_ERR) return error;
+
+    Machine machine = instance->src_machine;
+    struct _ml_checkpoint *checkpoint = (struct _ml_checkpoint *) calloc(1, sizeof(struct _ml_checkpoint));
+    if (checkpoint == NULL) return ML_MAT_ERROR;
+
+    // Host copies outlive any arena.
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    unsigned slots = machine.layer_count + state.tensor_n;
+    checkpoint->path = (char *) malloc(strlen(path) + 1);
+    checkpoint->tensors = (_MLCheckpointTensor *) calloc(slots + 1, sizeof(_MLCheckpointTensor));
+    checkpoint->data = (void **) calloc(slots + 1, sizeof(void *));
+    checkpoint->hyper_parameters = malloc(state.hyper_parameters_size + 1);
+    if (checkpoint->path == NULL || checkpoint->tensors == NULL || checkpoint->data == NULL || checkpoint->hyper_parameters == NULL) {
+        error = ML_MAT_ERROR;
+        goto Cleanup;
+    }
+    strcpy(checkpoint->path, path);
+    if (state.hyper_parameters_size > 0) memcpy(checkpoint->hyper_parameters, state.hyper_parameters, state.hyper_parameters_size);
+
+    _MLCheckpointHeader *header = &checkpoint->header;
+    memcpy(header->magic, "AMLC", 4);
+    header->version = ML_CHECKPOINT_VERSION;
+    header->byte_order = ML_FILE_BYTE_ORDER;
+    header->layer_count = machine.layer_count;
+    header->state_count = state.tensor_n;
+    header->epoch = instance->epoch;
+    header->position = instance->_position;
+    header->step = (state.step != NULL)? *state.step : 0;
+    header->hyper_parameters_size = state.hyper_parameters_size;
+
+    for (unsigned slot = 0; slot < slots; slot++) {
+        Tensor *t = NULL;
+        if (slot < machine.layer_count) {
+            Layer *layer = machine.layers[slot];
+            if ((error = layer->trainable(layer, &t)) != ML_NO_ERR) goto Cleanup;
+        } else {
+            t = state.tensors[slot - machine.layer_count];
+        }
+        if (t == NULL) continue;
+
+        unsigned n = header->tensor_count++;
+        if (_mlSnapshotTensor(t, slot, &checkpoint->tensors[n], &checkpoint->data[n])) {
+            error = ML_MAT_ERROR;
+            goto Cleanup;
+        }
+    }
+
+    size_t offset = ML_FILE_ALIGN_UP(sizeof(_MLCheckpointHeader) + sizeof(_MLCheckpointTensor) * header->tensor_count +
+                                     header->hyper_parameters_size);
+    for (unsigned i = 0; i < header->tensor_count; i++) {
+        checkpoint->tensors[i].tensor.offset = offset;
+        offset = ML_FILE_ALIGN_UP(offset + checkpoint->tensors[i].tensor.size);
+    }
+
+    // Written in place if no thread can be made.
+#ifdef _WIN32
+    checkpoint->thread = CreateThread(NULL, 0, _mlCheckpointThread, checkpoint, 0, NULL);
+    checkpoint->threaded = checkpoint->thread != NULL;
+#else
+    checkpoint->threaded = pthread_create(&checkpoint->thread, NULL, _mlCheckpointThread, checkpoint) == 0;
+#endif
+    if (!checkpoint->threaded) checkpoint->error = _mlWriteCheckpoint(checkpoint);
+    instance->_checkpoint = checkpoint;
+    checkpoint = NULL;
+
+Cleanup:
+    _mlFreeCheckpoint(checkpoint);
+    matSetArena(previous_arena);
+
+    return (error != ML_NO_ERR)? error : last_error;
+}
+
+// Check a Tensor of a checkpoint fits in the file. Returns 0 if it does.
+static int _mlCheckRecord(struct _ml_storage *file, _MLFileTensor *t) {
+    if (t->dtype >= MAT_DTYPES || t->ndims > ML_FILE_MAX_DIMS) return 1;
+    if (t->offset % ML_FILE_ALIGN != 0 || t->offset > file->size || t->size > file->size - t->offset) return 1;
+
+    uint64_t size = matDtypeSize((MatrixDtype) t->dtype);
+    for (unsigned d = 0; d < t->ndims; d++) {
+        if (t->dimsz[d] == 0) return 1;
+        size *= t->dimsz[d];
+    }
+
+    return size != t->size;
+}
+
+// Does `w` have the shape and dtype of `t`.
+static int _mlRecordMatches(Tensor *w, _MLFileTensor *t) {
+    if (w == NULL || !matIsTensorContiguous(w) || w->dtype != t->dtype || w->ndims != t->ndims) return 0;
+    for (unsigned d = 0; d < w->ndims; d++)
+        if (w->dimsz[d] != t->dimsz[d]) return 0;
+
+    return 1;
+}
+
+// Restore an instance from a checkpoint of `mlCheckpointInstance`.
+/*
+ * The instance must have the same optimizer, and its machine the same layers, as
+ * the one checkpointed, such as a machine remade or loaded the same way. Its weights
+ * and the optimizer state are replaced, the hyper parameters are copied to
+ * `hyper_parameters`, and `mlTrainInstance` continues the pass that was checkpointed.
+ * Fails with ML_FILE_ERROR, leaving the instance as it was, if the file can't be read
+ * or is of another version, byte order, machine or optimizer.
+ * */
+MLErr mlResumeInstance(LearningInstance *instance, const char *path) {
+    if (instance == NULL || path == NULL) return ML_NULL_PTR;
+
+    // Not while a checkpoint is written, possibly to the same file.
+    mlWaitCheckpoint(instance);
+
+    MLOptimizerState state;
+    MLErr error = instance->state(instance, &state);
+    if (error != ML_NO_ERR) return error;
+
+    struct _ml_storage *file = (struct _ml_storage *) calloc(1, sizeof(struct _ml_storage));
+    if (file == NULL) return ML_MAT_ERROR;
+    if (_mlMapFile(path, file)) {
+        free(file);
+        return ML_FILE_ERROR;
+    }
+
+    Machine machine = instance->src_machine;
+    MatrixArena *previous_arena = matSetArena(NULL);
+
+    _MLCheckpointHeader *header = (_MLCheckpointHeader *) file->mapping;
+    if (file->size < sizeof(_MLCheckpointHeader) || memcmp(header->magic, "AMLC", 4) != 0 ||
+        header->version != ML_CHECKPOINT_VERSION || header->byte_order != ML_FILE_BYTE_ORDER ||
+        header->layer_count != machine.layer_count || header->state_count != state.tensor_n ||
+        header->hyper_parameters_size != state.hyper_parameters_size ||
+        header->tensor_count > header->layer_count + header->state_count ||
+        sizeof(_MLCheckpointTensor) * header->tensor_count + header->hyper_parameters_size > file->size - sizeof(_MLCheckpointHeader)) {
+        error = ML_FILE_ERROR;
+        goto Cleanup;
+    }
+    _MLCheckpointTensor *records = (_MLCheckpointTensor *) (header + 1);
+    char *hyper_parameters = (char *) (records + header->tensor_count);
+
+    // Checked whole first, so a bad file changes nothing.
+    for (unsigned i = 0; i < header->tensor_count; i++) {
+        if (records[i].slot >= header->layer_count + header->state_count || _mlCheckRecord(file, &records[i].tensor)) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+        if (records[i].slot >= header->layer_count) continue;
+
+        Layer *layer = machine.layers[records[i].slot];
+        Tensor *weights = NULL;
+        if ((error = layer->trainable(layer, &weights)) != ML_NO_ERR) goto Cleanup;
+        if (!_mlRecordMatches(weights, &records[i].tensor)) {
+            error = ML_FILE_ERROR;
+            goto Cleanup;
+        }
+    }
+
+    // The state the optimizer has made is replaced, and made again by it where the checkpoint has none.
+    for (int i = 0; i < state.tensor_n; i++) matFreeTensor(&state.tensors[i]);
+
+    for (unsigned i = 0; i < header->tensor_count; i++) {
+        _MLFileTensor *t = &records[i].tensor;
+        const char *data = (const char *) file->mapping + t->offset;
+
+        if (records[i].slot < header->layer_count) {
+            Layer *layer = machine.layers[records[i].slot];
+            Tensor *weights = NULL;
+            layer->trainable(layer, &weights);
+
+            // Fully overwritten, the device copy is updated from it.
+            memcpy(weights->data, data, t->size);
+            matTensorMarkHostDirty(weights);
+            continue;
+        }
+
+        Tensor **slot = &state.tensors[records[i].slot - header->layer_count];
+        *slot = matMakeTensor(t->ndims, t->dimsz, NULL);
+        if (*slot == NULL || ((*slot)->data = (double *) matTensorAlloc(*slot, t->size)) == NULL) {
+            matFreeTensor(slot);
+            error = ML_MAT_ERROR;
+            goto Cleanup;
+        }
+        (*slot)->dtype = (MatrixDtype) t->dtype;
+        memcpy((*slot)->data, data, t->size);
+        // Kept on the device as the optimizer does, or on the host if that fails.
+        matTensorToDevice(*slot);
+    }
+
+    if (state.step != NULL) *state.step = header->step;
+    if (header->hyper_parameters_size > 0) memcpy(state.hyper_parameters, hyper_parameters, header->hyper_parameters_size);
+    instance->epoch = header->epoch;
+    instance->_position = header->position;
+    instance->_checkpoint_steps = 0;
+
+Cleanup:
+    matSetArena(previous_arena);
+    _mlFreeStorage(file);
+
+    return error;
+}